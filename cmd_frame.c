@@ -0,0 +1,152 @@
+/**
+ * @file cmd_frame.c
+ * @name Encoder and batch decoder of the binary command stream (format in cmd_frame.h).
+ *
+ * parse() walks a contiguous buffer and takes every whole frame it finds,
+ * stopping in front of a frame that is not complete yet. frame_decode runs
+ * it straight on the caller's data; only the unfinished tail is copied to
+ * the decoder, and on the next call the first frame is completed in the
+ * decoder's buffer before parsing continues in the new data.
+*/
+
+#include <cmd_frame.h>
+#include <string.h>
+
+/** @name crc8
+ * @brief CRC-8, polynomial 0x07, initial value 0
+*/
+static uint8_t crc8(const uint8_t* data, uint32_t len){
+    uint8_t crc = 0;
+    for(uint32_t i = 0; i < len; i++){
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/** @name frame_size
+ * @brief size of the frame announced by a flags byte
+ * @return FRAME_MIN_SIZE / FRAME_MAX_SIZE, 0 if the flags are not valid
+*/
+static uint32_t frame_size(uint8_t flags){
+    if(flags & ~FRAME_FLAGS_VALID){
+        return 0;
+    }
+    return (flags & CMD_TIMESTAMP) ? FRAME_MAX_SIZE : FRAME_MIN_SIZE;
+}
+
+/** @name parse
+ * @brief Takes all whole frames in data and pushes them into queue
+ * @return bytes consumed; the rest (less than one frame) starts with a sync byte
+*/
+static uint32_t parse(frame_decoder_t* decoder, const uint8_t* data, uint32_t len, cmd_queue_t* queue){
+    uint32_t i = 0;
+    while(i < len){
+        if(data[i] != FRAME_SYNC){
+            decoder->stats.skipped++;
+            i++;
+            continue;
+        }
+        if(len - i < 2){
+            break;
+        }
+        uint32_t size = frame_size(data[i + 1]);
+        if(size != 0 && len - i < size){
+            break;
+        }
+        const uint8_t* f = &data[i];
+        if(size == 0 || crc8(&f[1], size - 2) != f[size - 1]){
+            // not a frame after all: resynchronise on the next sync byte
+            decoder->stats.errors++;
+            decoder->stats.skipped++;
+            i++;
+            continue;
+        }
+        mouse_cmd_t cmd;
+        cmd.flags = f[1];
+        cmd.dx = (int16_t)(f[2] | (f[3] << 8));
+        cmd.dy = (int16_t)(f[4] | (f[5] << 8));
+        cmd.wheel = (int8_t)f[6];
+        cmd.buttons = f[7];
+        cmd.time_us = 0;
+        if(cmd.flags & CMD_TIMESTAMP){
+            cmd.time_us = f[8] | (f[9] << 8) | (f[10] << 16) | ((uint32_t)f[11] << 24);
+        }
+        cmd_queue_push(queue, &cmd); // counted as dropped if the queue is full
+        decoder->stats.frames++;
+        i += size;
+    }
+    return i;
+}
+
+/** @name frame_decoder_init
+ * @brief Empties the decoder and clears its counters
+*/
+void frame_decoder_init(frame_decoder_t* decoder){
+    decoder->len = 0;
+    decoder->stats.frames = 0;
+    decoder->stats.errors = 0;
+    decoder->stats.skipped = 0;
+}
+
+/** @name frame_decode
+ * @brief Decodes the bytes of one read and queues every complete frame
+ * @note  The queue should have room for FRAME_MAX_PER_READ(len) commands,
+ *        otherwise the commands that do not fit are counted as dropped.
+ * @return number of frames decoded
+*/
+uint32_t frame_decode(frame_decoder_t* decoder, const uint8_t* data, uint32_t len, cmd_queue_t* queue){
+    uint32_t frames = decoder->stats.frames;
+    if(decoder->len > 0){
+        // finish the frame cut off by the last read
+        uint32_t carried = decoder->len;
+        uint32_t take = sizeof(decoder->buf) - carried;
+        if(take > len){
+            take = len;
+        }
+        memcpy(&decoder->buf[carried], data, take);
+        uint32_t used = parse(decoder, decoder->buf, carried + take, queue);
+        if(used < carried){
+            // still no whole frame, which means all of data is in the buffer now
+            memmove(decoder->buf, &decoder->buf[used], carried + take - used);
+            decoder->len = carried + take - used;
+            return decoder->stats.frames - frames;
+        }
+        // the buffer held more than one frame, so parsing got past the carried bytes: go on in data
+        decoder->len = 0;
+        data += used - carried;
+        len -= used - carried;
+    }
+    uint32_t used = parse(decoder, data, len, queue);
+    memcpy(decoder->buf, &data[used], len - used);
+    decoder->len = len - used;
+    return decoder->stats.frames - frames;
+}
+
+/** @name frame_encode
+ * @brief Builds the frame of a command
+ * @param  out  FRAME_MAX_SIZE bytes
+ * @return frame size (FRAME_MIN_SIZE, or FRAME_MAX_SIZE with CMD_TIMESTAMP)
+*/
+uint32_t frame_encode(const mouse_cmd_t* cmd, uint8_t* out){
+    uint8_t flags = cmd->flags & FRAME_FLAGS_VALID;
+    uint32_t size = frame_size(flags);
+    out[0] = FRAME_SYNC;
+    out[1] = flags;
+    out[2] = (uint8_t)cmd->dx;
+    out[3] = (uint8_t)((uint16_t)cmd->dx >> 8);
+    out[4] = (uint8_t)cmd->dy;
+    out[5] = (uint8_t)((uint16_t)cmd->dy >> 8);
+    out[6] = (uint8_t)cmd->wheel;
+    out[7] = cmd->buttons;
+    if(flags & CMD_TIMESTAMP){
+        out[8] = (uint8_t)cmd->time_us;
+        out[9] = (uint8_t)(cmd->time_us >> 8);
+        out[10] = (uint8_t)(cmd->time_us >> 16);
+        out[11] = (uint8_t)(cmd->time_us >> 24);
+    }
+    out[size - 1] = crc8(&out[1], size - 2);
+    return size;
+}
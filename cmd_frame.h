@@ -0,0 +1,62 @@
+/** @file   cmd_frame.h
+ *  @brief  binary framed command stream on stdin
+ *
+ *  One frame carries one mouse_cmd_t, little endian:
+ *    uint8_t  FRAME_SYNC
+ *    uint8_t  flags        CMD_* (other bits must be 0)
+ *    int16_t  dx
+ *    int16_t  dy
+ *    int8_t   wheel
+ *    uint8_t  buttons      CMD_BUTTON_* held
+ *    uint32_t time_us      only if flags has CMD_TIMESTAMP
+ *    uint8_t  crc          CRC-8 (poly 0x07) of everything after the sync byte
+ *  There is no escaping: FRAME_SYNC may appear inside a frame. A frame
+ *  with unknown flags or a bad CRC is not taken; the decoder drops its
+ *  sync byte and looks for the next one, so it resynchronises after lost
+ *  or corrupted bytes within a frame or two.
+ *
+ *  frame_decode parses everything a read() returned in one call. Whole
+ *  frames are parsed in place; only a frame cut off at the end of the read
+ *  is copied, and completed by the next call.
+**/
+
+#include <unistd.h>
+#include <cmd_queue.h>
+
+#ifndef _CMD_FRAME_H_
+#define _CMD_FRAME_H_
+
+#define FRAME_SYNC 0xA5
+/** @brief frame sizes without and with the timestamp */
+#define FRAME_MIN_SIZE 9
+#define FRAME_MAX_SIZE 13
+/** @brief flag bits a frame may carry */
+#define FRAME_FLAGS_VALID (CMD_TIMESTAMP | CMD_ACCEL | CMD_NEXT_CURVE | CMD_PRINT_STATS)
+
+/** @brief most frames one frame_decode call over len bytes can produce */
+#define FRAME_MAX_PER_READ(len) ((len) / FRAME_MIN_SIZE + 1)
+
+/** @brief decoder counters */
+typedef struct{
+    uint32_t frames;    // frames taken
+    uint32_t errors;    // frames rejected (bad flags or CRC)
+    uint32_t skipped;   // bytes thrown away while looking for a frame
+}frame_stats_t;
+
+/** @brief decoder state */
+typedef struct{
+    uint8_t buf[2 * FRAME_MAX_SIZE];    // start of a frame cut off by the end of the last read
+    uint32_t len;
+    frame_stats_t stats;
+}frame_decoder_t;
+
+/** @brief empty the decoder and clear its counters */
+void frame_decoder_init(frame_decoder_t* decoder);
+
+/** @brief decode len bytes and push every frame into queue; returns the number of frames */
+uint32_t frame_decode(frame_decoder_t* decoder, const uint8_t* data, uint32_t len, cmd_queue_t* queue);
+
+/** @brief encode a command (for test rigs); out needs FRAME_MAX_SIZE bytes, returns the frame size */
+uint32_t frame_encode(const mouse_cmd_t* cmd, uint8_t* out);
+
+#endif /* _CMD_FRAME_H_ */
@@ -0,0 +1,74 @@
+/**
+ * @file cmd_queue.c
+ * @name Lock-free SPSC command queue.
+ *
+ * head and tail are free-running counters; head - tail is the number of
+ * queued commands and the slot is the counter modulo CMD_QUEUE_SIZE. The
+ * acquire load of the other side's counter pairs with its release store,
+ * so a slot is never read before it is written or overwritten before it
+ * is read.
+*/
+
+#include <cmd_queue.h>
+
+_Static_assert((CMD_QUEUE_SIZE & (CMD_QUEUE_SIZE - 1)) == 0, "CMD_QUEUE_SIZE must be a power of 2");
+
+/** @name cmd_queue_init
+ * @brief Empties the queue and clears the counters
+ * @note  Call it before the producer and the consumer start
+*/
+void cmd_queue_init(cmd_queue_t* queue){
+    queue->head = 0;
+    queue->tail = 0;
+    queue->stats.pushed = 0;
+    queue->stats.popped = 0;
+    queue->stats.dropped = 0;
+    queue->stats.max_depth = 0;
+}
+
+/** @name cmd_queue_push
+ * @brief Adds a command (producer only)
+ * @return 0 on success, -1 if the queue is full (the command is counted as dropped)
+*/
+int cmd_queue_push(cmd_queue_t* queue, const mouse_cmd_t* cmd){
+    uint32_t head = queue->head;
+    uint32_t depth = head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if(depth >= CMD_QUEUE_SIZE){
+        __atomic_store_n(&queue->stats.dropped, queue->stats.dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    queue->ring[head & (CMD_QUEUE_SIZE - 1)] = *cmd;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&queue->stats.pushed, queue->stats.pushed + 1, __ATOMIC_RELAXED);
+    if(depth + 1 > queue->stats.max_depth){
+        __atomic_store_n(&queue->stats.max_depth, depth + 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/** @name cmd_queue_pop
+ * @brief Takes the oldest command (consumer only)
+ * @return 0 on success, -1 if the queue is empty
+*/
+int cmd_queue_pop(cmd_queue_t* queue, mouse_cmd_t* cmd){
+    uint32_t tail = queue->tail;
+    if(__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail){
+        return -1;
+    }
+    *cmd = queue->ring[tail & (CMD_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->stats.popped, queue->stats.popped + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/** @name cmd_queue_stats
+ * @brief Copies the counters
+ * @note  Any thread; the counters are read one by one, so they may be a few commands apart
+*/
+void cmd_queue_stats(const cmd_queue_t* queue, cmd_queue_stats_t* stats){
+    stats->pushed = __atomic_load_n(&queue->stats.pushed, __ATOMIC_RELAXED);
+    stats->popped = __atomic_load_n(&queue->stats.popped, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&queue->stats.dropped, __ATOMIC_RELAXED);
+    stats->max_depth = __atomic_load_n(&queue->stats.max_depth, __ATOMIC_RELAXED);
+}
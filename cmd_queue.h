@@ -0,0 +1,67 @@
+/** @file   cmd_queue.h
+ *  @brief  lock-free single-producer / single-consumer queue of mouse commands
+ *
+ *  One thread pushes (the input thread), one thread pops (the mouse
+ *  thread); neither needs a mutex. The producer only writes the head, the
+ *  consumer only writes the tail, and a command is published by the
+ *  release store of the head after it has been written.
+**/
+
+#include <unistd.h>
+
+#ifndef _CMD_QUEUE_H_
+#define _CMD_QUEUE_H_
+
+/** @brief number of commands the queue holds (must be a power of 2) */
+#define CMD_QUEUE_SIZE 128
+
+/** @brief command flags (the flags byte of a frame, see cmd_frame.h) */
+#define CMD_TIMESTAMP (0x1 << 0)    // time_us is valid
+#define CMD_ACCEL (0x1 << 1)        // scale dx / dy by the acceleration curve instead of moving exactly
+#define CMD_NEXT_CURVE (0x1 << 2)   // select the next acceleration curve
+#define CMD_PRINT_STATS (0x1 << 3)  // print the command queue counters
+
+/** @brief buttons of mouse_cmd_t (bit 0 left, bit 1 right, bit 2 middle) */
+#define CMD_BUTTON_LEFT (0x1 << 0)
+#define CMD_BUTTON_RIGHT (0x1 << 1)
+#define CMD_BUTTON_MIDDLE (0x1 << 2)
+
+/** @brief one decoded command: relative motion and the buttons held from now on */
+typedef struct{
+    int16_t dx;
+    int16_t dy;
+    int8_t wheel;       // detents, +ve up
+    uint8_t buttons;    // CMD_BUTTON_* held
+    uint8_t flags;      // CMD_*
+    uint32_t time_us;   // sender's clock, if flags has CMD_TIMESTAMP
+}mouse_cmd_t;
+
+/** @brief queue counters */
+typedef struct{
+    uint32_t pushed;    // commands accepted
+    uint32_t popped;    // commands handed to the consumer
+    uint32_t dropped;   // commands lost because the queue was full
+    uint32_t max_depth; // highest number of queued commands seen by the producer
+}cmd_queue_stats_t;
+
+/** @brief the queue (all fields are owned by cmd_queue.c) */
+typedef struct{
+    mouse_cmd_t ring[CMD_QUEUE_SIZE];
+    volatile uint32_t head;     // next slot to write, only written by the producer
+    volatile uint32_t tail;     // next slot to read, only written by the consumer
+    cmd_queue_stats_t stats;    // pushed, dropped, max_depth: producer; popped: consumer
+}cmd_queue_t;
+
+/** @brief empty the queue and clear the counters (before both threads start) */
+void cmd_queue_init(cmd_queue_t* queue);
+
+/** @brief producer: add a command, returns 0 or -1 if the queue is full (counted as dropped) */
+int cmd_queue_push(cmd_queue_t* queue, const mouse_cmd_t* cmd);
+
+/** @brief consumer: take the oldest command, returns 0 or -1 if the queue is empty */
+int cmd_queue_pop(cmd_queue_t* queue, mouse_cmd_t* cmd);
+
+/** @brief copy of the counters (any thread; each counter is read atomically) */
+void cmd_queue_stats(const cmd_queue_t* queue, cmd_queue_stats_t* stats);
+
+#endif /* _CMD_QUEUE_H_ */
@@ -0,0 +1,47 @@
+/**
+ * @file event.c
+ * @name Wake-up event.
+ *
+ * pending is cleared right before each run, so a signal that arrives while
+ * the handler runs causes one more run. running is checked again after it
+ * is released, which closes the window where a signal sees running == 1
+ * just before the owner leaves.
+*/
+
+#include <event.h>
+
+/** @name event_init
+ * @brief Sets the handler and clears the counters
+ * @note  Call it before any thread signals the event
+*/
+void event_init(event_t* event, void (*handler)()){
+    event->handler = handler;
+    event->pending = 0;
+    event->running = 0;
+    event->signals = 0;
+    event->runs = 0;
+    event->deferred = 0;
+}
+
+/** @name event_signal
+ * @brief Marks the event and runs the handler until no signal is left
+ *
+ * Returns right away if another thread is running the handler (it will
+ * pick the signal up). Safe from any thread, not from interrupts.
+*/
+void event_signal(event_t* event){
+    __atomic_fetch_add(&event->signals, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->pending, 1, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&event->pending, __ATOMIC_ACQUIRE)){
+        uint32_t idle = 0;
+        if(!__atomic_compare_exchange_n(&event->running, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            __atomic_fetch_add(&event->deferred, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        while(__atomic_exchange_n(&event->pending, 0, __ATOMIC_ACQ_REL)){
+            __atomic_fetch_add(&event->runs, 1, __ATOMIC_RELAXED);
+            event->handler();
+        }
+        __atomic_store_n(&event->running, 0, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,34 @@
+/** @file   event.h
+ *  @brief  wake-up event: runs a handler as soon as work is signalled
+ *
+ *  The kernel only offers periodic threads (wait_until_next_period), so a
+ *  thread cannot block on an event. Instead, event_signal() runs the
+ *  handler right away in the signalling thread, unless another thread is
+ *  already running it; that thread then runs it again before it returns,
+ *  so no signal is lost. The handler therefore never runs twice at the
+ *  same time and needs no lock. A periodic thread calls event_signal() as
+ *  well, as a fallback and for per-period work.
+**/
+
+#include <unistd.h>
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+/** @brief an event and its handler */
+typedef struct{
+    void (*handler)();
+    volatile uint32_t pending;  // signalled, handler not started yet
+    volatile uint32_t running;  // a thread is inside the handler loop
+    volatile uint32_t signals;  // number of event_signal calls
+    volatile uint32_t runs;     // number of handler runs
+    volatile uint32_t deferred; // signals handed over to the thread already running the handler
+}event_t;
+
+/** @brief set the handler and clear the counters (before any thread signals) */
+void event_init(event_t* event, void (*handler)());
+
+/** @brief mark the event and run the handler unless another thread already runs it */
+void event_signal(event_t* event);
+
+#endif /* _EVENT_H_ */
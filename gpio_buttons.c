@@ -0,0 +1,192 @@
+/**
+ * @file gpio_buttons.c
+ * @name Physical buttons: GPIOTE edges, PPI timestamps and eager debouncing (see gpio_buttons.h).
+ *
+ * TIMER3 counts microseconds. Button n uses GPIOTE IN[n], PPI channel
+ * BUTTON_PPI_CHANNEL + n (EVENTS_IN[n] -> TASKS_CAPTURE[n]), CC[n] for the
+ * timestamp of its first edge and CC[BUTTON_COUNT + n] for the end of its
+ * lockout. While a button is locked out its GPIOTE interrupt and its PPI
+ * channel are disabled, so a bouncing contact costs no interrupts and does
+ * not overwrite the timestamp.
+ *
+ * GPIOTE_IRQHandler and TIMER3_IRQHandler run at the same priority and
+ * never interrupt each other, so together they are the single producer
+ * of the physical button lane of usbd.c.
+*/
+
+#include <usbd.h>
+#include <gpio_buttons.h>
+#include <usbd_trace.h>
+
+#ifndef NVIC_BASE
+#define NVIC_BASE 0xE000E000
+#endif
+
+/** @brief GPIOTE (IRQ 6) and TIMER3 (IRQ 26) */
+#define NVIC_ISER0 (volatile uint32_t*) (NVIC_BASE + 0x100)
+#define GPIOTE_IRQ_BIT (1 << 6)
+#define TIMER3_IRQ_BIT (1 << 26)
+
+/** @brief PIN_CNF: input, input buffer connected, pull-up */
+#define PIN_CNF_INPUT_PULLUP (0x3 << 2)
+/** @brief GPIOTE CONFIG: event mode on pin PSEL, both edges */
+#define GPIOTE_CONFIG_EVENT 0x1
+#define GPIOTE_CONFIG_PSEL(pin) ((uint32_t)(pin) << 8)
+#define GPIOTE_CONFIG_TOGGLE (0x3 << 16)
+/** @brief TIMER: timer mode, 32 bit, 16 MHz / 2^4 = 1 MHz */
+#define TIMER_MODE_TIMER 0
+#define TIMER_BITMODE_32 3
+#define TIMER_PRESCALER_1MHZ 4
+#define TIMER_INT_COMPARE(n) (0x1 << (16 + (n)))
+
+/** @brief CC register of a button's lockout */
+#define LOCKOUT_CC(n) (BUTTON_COUNT + (n))
+
+_Static_assert(LOCKOUT_CC(BUTTON_COUNT - 1) < 6, "TIMER3 has 6 CC registers: one timestamp and one lockout per button");
+_Static_assert(BUTTON_PPI_CHANNEL + BUTTON_COUNT <= 20, "not enough PPI channels");
+
+static const uint8_t button_pins[BUTTON_COUNT] = BUTTON_PINS;
+/** @brief bit n: button n reported pressed / in its lockout */
+static uint32_t button_state = 0;
+static uint32_t button_locked = 0;
+/** @brief counters (see buttons_stats_t) */
+static volatile uint32_t button_edges = 0;
+static volatile uint32_t button_settled = 0;
+static volatile uint32_t button_dropped = 0;
+static volatile uint32_t button_max_irq_us = 0;
+
+/** @name button_pressed
+ * @brief Level of a button's pin (active low)
+*/
+static uint32_t button_pressed(uint32_t n){
+    return (REG_READ(NRF_P0->IN) & (0x1u << button_pins[n])) == 0;
+}
+
+/** @name button_report
+ * @brief Hands the new button state to the EP1 report path
+ * @param cycles  cycle counter at the change (see usbd_trace.h)
+*/
+static void button_report(uint32_t cycles){
+    if(usbd_queue_buttons((uint8_t)button_state, cycles) != 0){
+        button_dropped++;
+    }
+}
+
+/** @name button_lock
+ * @brief Ignores the button's pin until deadline
+ * @param now  TIMER3 now; a deadline already passed is moved just ahead of it
+*/
+static void button_lock(uint32_t n, uint32_t deadline, uint32_t now){
+    if((int32_t)(deadline - now) < 2){
+        // COMPARE only fires when the counter reaches CC, so stay a whole tick ahead
+        deadline = now + 2;
+    }
+    REG_WRITE(NRF_TIMER3->CC[LOCKOUT_CC(n)], deadline);
+    REG_CLEAR(NRF_TIMER3->EVENTS_COMPARE[LOCKOUT_CC(n)]);
+    if((button_locked & (0x1u << n)) == 0){
+        REG_WRITE(NRF_GPIOTE->INTENCLR, 0x1u << n);
+        REG_WRITE(NRF_TIMER3->INTENSET, TIMER_INT_COMPARE(LOCKOUT_CC(n)));
+        button_locked |= (0x1u << n);
+    }
+}
+
+/** @name buttons_init
+ * @brief Configures the pins, GPIOTE, PPI and TIMER3 and enables the button interrupts
+ * @note  A button already held is reported right away.
+*/
+void buttons_init(){
+    REG_WRITE(NRF_TIMER3->MODE, TIMER_MODE_TIMER);
+    REG_WRITE(NRF_TIMER3->BITMODE, TIMER_BITMODE_32);
+    REG_WRITE(NRF_TIMER3->PRESCALER, TIMER_PRESCALER_1MHZ);
+    REG_TRIGGER(NRF_TIMER3->TASKS_CLEAR);
+    REG_TRIGGER(NRF_TIMER3->TASKS_START);
+    uint32_t mask = 0;
+    for(uint32_t n = 0; n < BUTTON_COUNT; n++){
+        REG_WRITE(NRF_P0->PIN_CNF[button_pins[n]], PIN_CNF_INPUT_PULLUP);
+        REG_WRITE(NRF_GPIOTE->CONFIG[n], GPIOTE_CONFIG_EVENT | GPIOTE_CONFIG_PSEL(button_pins[n]) | GPIOTE_CONFIG_TOGGLE);
+        REG_CLEAR(NRF_GPIOTE->EVENTS_IN[n]);
+        REG_WRITE(NRF_PPI->CH[BUTTON_PPI_CHANNEL + n].EEP, PPI_ADDR(NRF_GPIOTE->EVENTS_IN[n]));
+        REG_WRITE(NRF_PPI->CH[BUTTON_PPI_CHANNEL + n].TEP, PPI_ADDR(NRF_TIMER3->TASKS_CAPTURE[n]));
+        mask |= (0x1u << n);
+    }
+    REG_WRITE(NRF_PPI->CHENSET, mask << BUTTON_PPI_CHANNEL);
+    button_state = 0;
+    button_locked = 0;
+    for(uint32_t n = 0; n < BUTTON_COUNT; n++){
+        if(button_pressed(n)){
+            button_state |= (0x1u << n);
+        }
+    }
+    if(button_state != 0){
+        button_report(trace_now());
+    }
+    REG_WRITE(NRF_GPIOTE->INTENSET, mask);
+    REG_WRITE(*NVIC_ISER0, GPIOTE_IRQ_BIT | TIMER3_IRQ_BIT);
+}
+
+/** @name GPIOTE_IRQHandler
+ * @brief First edge of a stable button: report the other state now and start its lockout
+ * @note  The pin is not read: after an edge of a stable button its level
+ *        can only be the other one, whatever it bounced to since.
+*/
+void GPIOTE_IRQHandler(){
+    for(uint32_t n = 0; n < BUTTON_COUNT; n++){
+        if((button_locked & (0x1u << n)) != 0 || REG_READ(NRF_GPIOTE->EVENTS_IN[n]) == 0){
+            continue;
+        }
+        // stop the bounces from capturing over the first edge's timestamp
+        REG_WRITE(NRF_PPI->CHENCLR, 0x1u << (BUTTON_PPI_CHANNEL + n));
+        REG_CLEAR(NRF_GPIOTE->EVENTS_IN[n]);
+        uint32_t edge = REG_READ(NRF_TIMER3->CC[n]);
+        // the lockout CC is free while the button is stable: borrow it to read the timer
+        REG_TRIGGER(NRF_TIMER3->TASKS_CAPTURE[LOCKOUT_CC(n)]);
+        uint32_t now = REG_READ(NRF_TIMER3->CC[LOCKOUT_CC(n)]);
+        uint32_t age = now - edge;
+        if(age > button_max_irq_us){
+            button_max_irq_us = age;
+        }
+        button_state ^= (0x1u << n);
+        button_edges++;
+        button_report(trace_now() - age * (TRACE_CPU_HZ / 1000000));
+        button_lock(n, edge + BUTTON_DEBOUNCE_US, now);
+    }
+}
+
+/** @name TIMER3_IRQHandler
+ * @brief End of a lockout: report the level the pin settled at if it differs, otherwise watch for edges again
+*/
+void TIMER3_IRQHandler(){
+    for(uint32_t n = 0; n < BUTTON_COUNT; n++){
+        if((button_locked & (0x1u << n)) == 0 || REG_READ(NRF_TIMER3->EVENTS_COMPARE[LOCKOUT_CC(n)]) == 0){
+            continue;
+        }
+        REG_CLEAR(NRF_TIMER3->EVENTS_COMPARE[LOCKOUT_CC(n)]);
+        // forget the bounces; an edge from here on raises a new event and captures its timestamp
+        REG_WRITE(NRF_PPI->CHENSET, 0x1u << (BUTTON_PPI_CHANNEL + n));
+        REG_CLEAR(NRF_GPIOTE->EVENTS_IN[n]);
+        if(button_pressed(n) != ((button_state >> n) & 0x1)){
+            REG_WRITE(NRF_PPI->CHENCLR, 0x1u << (BUTTON_PPI_CHANNEL + n));
+            button_state ^= (0x1u << n);
+            button_settled++;
+            button_report(trace_now());
+            REG_TRIGGER(NRF_TIMER3->TASKS_CAPTURE[LOCKOUT_CC(n)]);
+            uint32_t now = REG_READ(NRF_TIMER3->CC[LOCKOUT_CC(n)]);
+            button_lock(n, now + BUTTON_DEBOUNCE_US, now);
+            continue;
+        }
+        button_locked &= ~(0x1u << n);
+        REG_WRITE(NRF_TIMER3->INTENCLR, TIMER_INT_COMPARE(LOCKOUT_CC(n)));
+        REG_WRITE(NRF_GPIOTE->INTENSET, 0x1u << n);
+    }
+}
+
+/** @name buttons_get_stats
+ * @brief Reads the button counters
+*/
+void buttons_get_stats(buttons_stats_t* stats){
+    stats->buttons = button_state;
+    stats->edges = button_edges;
+    stats->settled = button_settled;
+    stats->dropped = button_dropped;
+    stats->max_irq_us = button_max_irq_us;
+}
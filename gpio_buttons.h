@@ -0,0 +1,79 @@
+/** @file   gpio_buttons.h
+ *  @brief  physical mouse buttons on GPIO pins, read through GPIOTE interrupts
+ *
+ *  Each button is an active-low switch on a P0 pin with the internal
+ *  pull-up. A GPIOTE IN channel raises an event on every edge, and a PPI
+ *  channel captures TIMER3 into CC[n] on that event, so the edge gets a
+ *  hardware timestamp however late its interrupt runs. The interrupt
+ *  disables the PPI channel until the lockout ends, so the bounces that
+ *  follow do not overwrite it.
+ *
+ *  Debouncing is eager: the first edge of a stable button is reported at
+ *  once, straight into the EP1 report path (usbd_queue_buttons), and the
+ *  button then ignores its pin for BUTTON_DEBOUNCE_US from that edge. When
+ *  the lockout ends the pin is sampled again; if it settled at the other
+ *  level (a tap shorter than the lockout, or a glitch), that change is
+ *  reported too and a new lockout starts. A press therefore costs one
+ *  interrupt and no settle delay, and no thread ever polls the pins.
+ *
+ *  TIMER3 keeps running while the bus is suspended, so a press there takes
+ *  the same path and the report path signals a remote wakeup.
+**/
+
+#include <unistd.h>
+
+#ifndef _GPIO_BUTTONS_H_
+#define _GPIO_BUTTONS_H_
+
+/** @brief peripheral base addresses */
+#ifndef P0_BASE
+#define P0_BASE 0x50000000
+#endif
+#ifndef GPIOTE_BASE
+#define GPIOTE_BASE 0x40006000
+#endif
+#ifndef TIMER3_BASE
+#define TIMER3_BASE 0x4001A000
+#endif
+#ifndef PPI_BASE
+#define PPI_BASE 0x4001F000
+#endif
+
+/** @brief number of buttons; button n is HID button n + 1 (left, right, middle) */
+#define BUTTON_COUNT 3
+
+/** @brief P0 pins of the buttons (Button 1-3 of the nRF52840 DK) */
+#ifndef BUTTON_PINS
+#define BUTTON_PINS {11, 12, 24}
+#endif
+
+/** @brief time a button ignores its pin after a reported change (longest bounce of the switches) */
+#ifndef BUTTON_DEBOUNCE_US
+#define BUTTON_DEBOUNCE_US 5000
+#endif
+
+/** @brief first of the BUTTON_COUNT PPI channels used for the edge timestamps */
+#ifndef BUTTON_PPI_CHANNEL
+#define BUTTON_PPI_CHANNEL 0
+#endif
+
+/** @brief button counters (latency measured from the captured edge) */
+typedef struct{
+    uint32_t buttons;       // bit n set while button n is reported pressed
+    uint32_t edges;         // changes reported on their first edge
+    uint32_t settled;       // changes found when a lockout ended
+    uint32_t dropped;       // changes the report path had no room for
+    uint32_t max_irq_us;    // longest time from an edge to its interrupt
+}buttons_stats_t;
+
+/** @brief configure the pins, GPIOTE, PPI and TIMER3 and enable the button interrupts (called by usbd_init) */
+void buttons_init();
+
+/** @brief read the button counters */
+void buttons_get_stats(buttons_stats_t* stats);
+
+/** @brief interrupt handlers: edges (GPIOTE) and ends of lockouts (TIMER3) */
+void GPIOTE_IRQHandler();
+void TIMER3_IRQHandler();
+
+#endif /* _GPIO_BUTTONS_H_ */
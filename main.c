@@ -3,6 +3,10 @@
 **/
 
 #include <lib642.h>
+#include <mouse_accel.h>
+#include <cmd_queue.h>
+#include <cmd_frame.h>
+#include <event.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,8 +14,11 @@
 
 #define UNUSED __attribute__((unused))
 
-/** @brief size of the user input buffer */
-#define USER_BUF_MAX 2
+/** @brief bytes taken from stdin per read(), and reads per period while more input is waiting */
+#define INPUT_BATCH 1024
+#define INPUT_READS 4
+
+_Static_assert(FRAME_MAX_PER_READ(INPUT_BATCH) <= CMD_QUEUE_SIZE, "the frames of one read must fit into the command queue");
 
 /** @brief thread user space stack size - 4KB */
 #define USR_STACK_WORDS 512
@@ -19,113 +26,198 @@
 #define NUM_MUTEXES 0
 #define CLOCK_FREQUENCY 600
 
-/** @brief mouse actions impelemented:
- * 'a': move mouse pointer left
- * 'd': move mouse pointer right
- * 'w': move mouse pointer up
- * 's': move mouse pointer down
- * 't': scroll mouse wheel up
- * 'g': scroll mouse wheel down
- * 'q': click left mouse button
- * 'e': click right mouse button
- */
-char mouse_actions[][10] = {
-    "a", "d", "w", "s", "t", "g", "q", "e"
-};
+/** @brief largest movement / scroll of one mouse_move / mouse_scroll call */
+#define MOUSE_MOVE_MAX 127
+/** @brief frames with timestamps are only merged into one movement within this window (one 1 kHz report) */
+#define MERGE_WINDOW_US 1000
 
-enum ENUM_MOUSE_ACTIONS{LEFT = 0, RIGHT, UP, DOWN, SUP, SDOWN, LCLICK, RCLICK};
+/** @brief decoded commands from thread_0_keypress to thread_1_mouse_evt */
+cmd_queue_t mouse_cmds;
+/** @brief frame decoder of stdin (only used by thread_0_keypress) */
+frame_decoder_t input_frames;
+/** @brief read buffer of thread_0_keypress (too large for its stack) */
+unsigned char input[INPUT_BATCH];
 
-/** @brief buffer to hold user input */
-char user_cmd_buffer[USER_BUF_MAX] = "z";
-/** @brief current index in user buffer */
-int user_cmd_i = 0;
+/** @brief signalled when commands are queued or a period starts; runs process_commands */
+event_t mouse_wakeup;
+/** @brief set by thread_1_mouse_evt once per period, consumed by process_commands */
+volatile uint32_t mouse_tick = 0;
 
-/**
- * @name clear_user_buffer
- * @brief empty the user buffer 
- */
-void clear_user_buffer(){
-    for(int i = 0; i < USER_BUF_MAX; i++){
-        user_cmd_buffer[i] = '\0';
-    }
-    user_cmd_i = 0;
-}
+/** @brief pointer acceleration (only used by process_commands) */
+accel_state_t mouse_accel;
+/** @brief buttons currently held (only used by process_commands) */
+uint8_t mouse_buttons = 0;
+
+/** @brief motion summed over queued commands until it is sent (only used by process_commands) */
+typedef struct{
+    int32_t dx;         // exact movement
+    int32_t dy;
+    int32_t accel_dx;   // movement to be scaled by the acceleration curve
+    int32_t accel_dy;
+    int32_t wheel;
+}pending_motion_t;
 
 /** @name thread_0_keypress
- * @brief thread which reads user input  
+ * @brief thread which reads the framed command stream and queues the decoded commands
+ *
+ * Each frame on stdin (see cmd_frame.h) carries relative motion, wheel,
+ * the buttons held and optionally a timestamp. Its flags select the next
+ * acceleration curve (CMD_NEXT_CURVE) or print the counters
+ * (CMD_PRINT_STATS). Motion is sent exactly as given unless the frame asks
+ * for acceleration (CMD_ACCEL).
  * @note T0:(10, 65)
  */
 void thread_0_keypress() {
     while(1){
-        if(user_cmd_i == USER_BUF_MAX){
-            clear_user_buffer();   
+        // everything sent since the last period, as long as the queue keeps up
+        for(int i = 0; i < INPUT_READS; i++){
+            int status = read(STDIN_FILENO, input, INPUT_BATCH);
+            if(status <= 0){
+                break;
+            }
+            if(frame_decode(&input_frames, input, status, &mouse_cmds) > 0){
+                // handle the commands now instead of in thread_1_mouse_evt's next period
+                event_signal(&mouse_wakeup);
+            }
+            if(status < INPUT_BATCH){
+                break;
+            }
         }
-        unsigned char input = 0;
-        int status = read(STDIN_FILENO, &input, 1);
-        if(input == '\n'){
-            clear_user_buffer();
+        wait_until_next_period();
+    }
+}
+
+/** @name print_queue_stats
+ * @brief prints the command queue counters
+ */
+void print_queue_stats(){
+    cmd_queue_stats_t stats;
+    cmd_queue_stats(&mouse_cmds, &stats);
+    printf("commands: %lu queued, %lu handled, %lu dropped, max depth %lu/%d\n",
+           (unsigned long) stats.pushed, (unsigned long) stats.popped, (unsigned long) stats.dropped,
+           (unsigned long) stats.max_depth, CMD_QUEUE_SIZE);
+    printf("frames: %lu decoded, %lu rejected, %lu bytes skipped\n", (unsigned long) input_frames.stats.frames,
+           (unsigned long) input_frames.stats.errors, (unsigned long) input_frames.stats.skipped);
+    printf("wakeups: %lu signals, %lu runs, %lu handed over\n",
+           (unsigned long) mouse_wakeup.signals, (unsigned long) mouse_wakeup.runs, (unsigned long) mouse_wakeup.deferred);
+}
+
+/** @name clamp_step
+ * @brief the part of a movement one mouse_move / mouse_scroll call can carry
+ */
+int32_t clamp_step(int32_t value){
+    return value > MOUSE_MOVE_MAX ? MOUSE_MOVE_MAX : value < -MOUSE_MOVE_MAX ? -MOUSE_MOVE_MAX : value;
+}
+
+/** @name send_movement
+ * @brief scales the raw movement and sends it in steps of at most MOUSE_MOVE_MAX
+ */
+void send_movement(int32_t dx, int32_t dy){
+    int32_t x, y;
+    accel_apply(&mouse_accel, dx, dy, &x, &y);
+    while(x != 0 || y != 0){
+        int32_t step_x = clamp_step(x);
+        int32_t step_y = clamp_step(y);
+        mouse_move((int8_t) step_x, (int8_t) step_y);
+        x -= step_x;
+        y -= step_y;
+    }
+}
+
+/** @name send_pending
+ * @brief sends the summed motion (exact, accelerated, then scrolling) in steps of at most MOUSE_MOVE_MAX
+ */
+void send_pending(pending_motion_t* motion){
+    while(motion->dx != 0 || motion->dy != 0){
+        int32_t x = clamp_step(motion->dx);
+        int32_t y = clamp_step(motion->dy);
+        mouse_move((int8_t) x, (int8_t) y);
+        motion->dx -= x;
+        motion->dy -= y;
+    }
+    if(motion->accel_dx != 0 || motion->accel_dy != 0){
+        send_movement(motion->accel_dx, motion->accel_dy);
+        motion->accel_dx = 0;
+        motion->accel_dy = 0;
+    }
+    while(motion->wheel != 0){
+        int32_t wheel = clamp_step(motion->wheel);
+        mouse_scroll((int8_t) wheel);
+        motion->wheel -= wheel;
+    }
+}
+
+/** @name process_commands
+ * @brief performs every queued command (mouse_wakeup handler)
+ * @note  runs in whichever thread signalled mouse_wakeup, never in two at once
+ */
+void process_commands(){
+    // motion summed over the queued commands, sent when the buttons change, a
+    // timestamped command leaves the merge window, or the queue is empty
+    pending_motion_t motion = {0, 0, 0, 0, 0};
+    uint32_t window = 0;
+    int have_window = 0;
+    mouse_cmd_t cmd;
+    while(cmd_queue_pop(&mouse_cmds, &cmd) == 0){
+        if(cmd.flags & CMD_TIMESTAMP){
+            uint32_t cmd_window = cmd.time_us / MERGE_WINDOW_US;
+            if(have_window && cmd_window != window){
+                send_pending(&motion);
+            }
+            window = cmd_window;
+            have_window = 1;
         }
-        if(status > 0 && (char) input >= 'a' && (char) input <= 'z'){
-            user_cmd_buffer[user_cmd_i] = (char) input;
-            user_cmd_i++;
-            user_cmd_buffer[user_cmd_i] = '\0';
+        if(cmd.flags & CMD_ACCEL){
+            motion.accel_dx += cmd.dx;
+            motion.accel_dy += cmd.dy;
+        }else{
+            motion.dx += cmd.dx;
+            motion.dy += cmd.dy;
+        }
+        motion.wheel += cmd.wheel;
+        if(cmd.buttons != mouse_buttons){
+            // keep the order: the pointer reaches its target before the buttons change
+            send_pending(&motion);
+            mouse_click(cmd.buttons); // held (moves carry them) until a command changes them
+            mouse_buttons = cmd.buttons;
+        }
+        if(cmd.flags & CMD_NEXT_CURVE){
+            accel_set_curve(&mouse_accel, (mouse_accel.curve + 1) % NUM_ACCEL_CURVES);
+            printf("acceleration: %s\n", accel_curve_name(mouse_accel.curve));
+        }
+        if(cmd.flags & CMD_PRINT_STATS){
+            print_queue_stats();
         }
-        wait_until_next_period();
+    }
+    send_pending(&motion);
+    if(__atomic_exchange_n(&mouse_tick, 0, __ATOMIC_ACQ_REL)){
+        // once per period, however many reads the period's movement came in
+        accel_tick(&mouse_accel);
     }
 }
 
 /** @name thread_1_mouse_evt
- * @brief thread which performs mouse action based on user input  
+ * @brief periodic fallback: picks up commands nobody has handled yet and ticks the acceleration
  * @note T1:(40, 65)
  */
 void thread_1_mouse_evt() {
     while(1){
-        for(int i = 0; i < 8; i++){
-            if(user_cmd_buffer[0] != mouse_actions[i][0]){
-                continue;
-            }
-            switch(i){
-                case LEFT:
-                    mouse_move(-10, 0);
-                    break;
-                case RIGHT:
-                    mouse_move(10, 0);
-                    break;
-                case UP:
-                    mouse_move(0, -10);
-                    break;
-                case DOWN:
-                    mouse_move(0, 10);
-                    break;
-                case SUP:
-                    mouse_scroll(3);
-                    break;
-                case SDOWN:
-                    mouse_scroll(-3);
-                    break;
-                case LCLICK:
-                    mouse_click(1); // mouse button pressed
-                    mouse_click(0); // mouse button unpressed (pressing and unpressing emulates a "click")
-                    break;
-                case RCLICK:
-                    mouse_click(2);
-                    mouse_click(0);
-                    break;
-                default:
-                    break;
-            }
-            clear_user_buffer();
-            break;
-        }
+        __atomic_store_n(&mouse_tick, 1, __ATOMIC_RELEASE);
+        event_signal(&mouse_wakeup);
         wait_until_next_period();
     }
 }
 
+
 /**
  * @name main
  * @brief runs the mouse application control logic 
  */
 int main(UNUSED int argc, UNUSED const char* argv[]) {
+    accel_init(&mouse_accel);
+    cmd_queue_init(&mouse_cmds);
+    frame_decoder_init(&input_frames);
+    event_init(&mouse_wakeup, process_commands);
     ABORT_ON_ERROR(thread_init(NUM_THREADS, USR_STACK_WORDS, NULL, KERNEL_ONLY, NUM_MUTEXES));
 
     ABORT_ON_ERROR(thread_create(&thread_0_keypress, 0, 10, 65, NULL));
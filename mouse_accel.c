@@ -0,0 +1,137 @@
+/**
+ * @file mouse_accel.c
+ * @name Fixed-point pointer acceleration.
+ *
+ * The gain tables were generated offline for speeds of 0 to 15 counts per
+ * period as gain = 0.25 + 11.75 * f(x), with x = (speed - 2) / 8 clamped to
+ * [0, 1] and f(x) = x (linear), x * x (quadratic) or x * x * (3 - 2 * x)
+ * (smooth). A frame of 10 counts after an idle period moves about 2.5
+ * counts (the fraction is carried), while frames adding up to 10 counts in
+ * every period move 120 counts per period once the speed has settled.
+*/
+
+#include <mouse_accel.h>
+
+/** @brief gain per speed (counts per period), Q8 */
+static const uint16_t accel_curves[NUM_ACCEL_CURVES][ACCEL_SPEED_STEPS] = {
+    [ACCEL_FLAT] = {
+         256,  256,  256,  256,  256,  256,  256,  256,
+         256,  256,  256,  256,  256,  256,  256,  256,
+    },
+    [ACCEL_LINEAR] = {
+          64,   64,   64,  440,  816, 1192, 1568, 1944,
+        2320, 2696, 3072, 3072, 3072, 3072, 3072, 3072,
+    },
+    [ACCEL_QUADRATIC] = {
+          64,   64,   64,  111,  252,  487,  816, 1239,
+        1756, 2367, 3072, 3072, 3072, 3072, 3072, 3072,
+    },
+    [ACCEL_SMOOTH] = {
+          64,   64,   64,  193,  534, 1016, 1568, 2120,
+        2602, 2943, 3072, 3072, 3072, 3072, 3072, 3072,
+    },
+};
+
+static const char* const accel_names[NUM_ACCEL_CURVES] = {"flat", "linear", "quadratic", "smooth"};
+
+/** @brief raw movement per axis and period is clamped so delta * gain fits into 32 bits */
+#define ACCEL_IN_MAX 0x7FFF
+
+_Static_assert((int64_t)ACCEL_IN_MAX * 0xFFFF + (1 << ACCEL_FRAC_BITS) <= 0x7FFFFFFF, "delta * gain overflows");
+
+/** @name accel_init
+ * @brief Resets the state and selects MOUSE_ACCEL_CURVE
+*/
+void accel_init(accel_state_t* state){
+    state->curve = MOUSE_ACCEL_CURVE;
+    state->speed = 0;
+    state->period_x = 0;
+    state->period_y = 0;
+    state->carry_x = 0;
+    state->carry_y = 0;
+}
+
+/** @name accel_set_curve
+ * @brief Selects a curve; the speed and the carried fractions are kept
+ * @param curve    ACCEL_* (ignored if out of range)
+*/
+void accel_set_curve(accel_state_t* state, uint32_t curve){
+    if(curve < NUM_ACCEL_CURVES){
+        state->curve = curve;
+    }
+}
+
+/** @name accel_curve_name
+ * @brief Name of a curve, for messages
+*/
+const char* accel_curve_name(uint32_t curve){
+    if(curve >= NUM_ACCEL_CURVES){
+        return "?";
+    }
+    return accel_names[curve];
+}
+
+/** @name accel_clamp_in
+ * @brief Clamps raw movement to what accel_axis and the speed can take
+*/
+static int32_t accel_clamp_in(int32_t delta){
+    if(delta > ACCEL_IN_MAX){
+        return ACCEL_IN_MAX;
+    }else if(delta < -ACCEL_IN_MAX){
+        return -ACCEL_IN_MAX;
+    }
+    return delta;
+}
+
+/** @name accel_axis
+ * @brief Scales one axis and keeps the fraction that was not sent
+*/
+static int32_t accel_axis(int32_t delta, uint32_t gain, int32_t* carry){
+    delta = accel_clamp_in(delta);
+    int32_t total = delta * (int32_t)gain + *carry;
+    // truncates toward zero, so the carry has the sign of the movement
+    int32_t out = total / (1 << ACCEL_FRAC_BITS);
+    *carry = total - out * (1 << ACCEL_FRAC_BITS);
+    return out;
+}
+
+/** @name accel_apply
+ * @brief Scales raw movement with the gain of the current speed
+ *
+ * May be called any number of times per period: the movement is added to
+ * the period's total, and the speed only changes in accel_tick. The output
+ * is not clamped; the caller sends it in as many steps as it needs, so
+ * fast movement is not cut off.
+ * @param dx, dy          raw movement (counts)
+ * @param out_x, out_y    movement to send
+*/
+void accel_apply(accel_state_t* state, int32_t dx, int32_t dy, int32_t* out_x, int32_t* out_y){
+    state->period_x = accel_clamp_in(state->period_x + accel_clamp_in(dx));
+    state->period_y = accel_clamp_in(state->period_y + accel_clamp_in(dy));
+    uint32_t step = state->speed >> ACCEL_FRAC_BITS;
+    if(step >= ACCEL_SPEED_STEPS){
+        step = ACCEL_SPEED_STEPS - 1;
+    }
+    uint32_t gain = accel_curves[state->curve][step];
+    *out_x = accel_axis(dx, gain, &state->carry_x);
+    *out_y = accel_axis(dy, gain, &state->carry_y);
+}
+
+/** @name accel_tick
+ * @brief Ends a period: moves the speed average towards the period's raw movement
+ * @note  Call it once per period, also when nothing moved, so the speed decays.
+*/
+void accel_tick(accel_state_t* state){
+    uint32_t ax = (state->period_x < 0) ? -(uint32_t)state->period_x : (uint32_t)state->period_x;
+    uint32_t ay = (state->period_y < 0) ? -(uint32_t)state->period_y : (uint32_t)state->period_y;
+    state->period_x = 0;
+    state->period_y = 0;
+    // |(dx, dy)| ~ max + min / 2 (octagonal approximation, within 12%)
+    uint32_t raw_speed = (ax > ay) ? ax + ay / 2 : ay + ax / 2;
+    if(raw_speed > ACCEL_IN_MAX){
+        raw_speed = ACCEL_IN_MAX;
+    }
+    // moving average in Q8: speed += (raw - speed) / 2^ACCEL_SMOOTH_SHIFT
+    int32_t diff = (int32_t)(raw_speed << ACCEL_FRAC_BITS) - (int32_t)state->speed;
+    state->speed = (uint32_t)((int32_t)state->speed + diff / (1 << ACCEL_SMOOTH_SHIFT));
+}
@@ -0,0 +1,65 @@
+/** @file   mouse_accel.h
+ *  @brief  fixed-point pointer acceleration between the command source and mouse_move
+ *
+ *  Raw movement (counts) is scaled by a gain looked up from the pointer
+ *  speed as soon as it arrives. The speed is a moving average of the raw
+ *  movement per period, updated once at the end of each period
+ *  (accel_tick), so it does not depend on how the movement of a period was
+ *  split into frames. Slow motion stays precise, sustained fast motion
+ *  speeds up. Gains come from precomputed Q8.8 tables (no floating
+ *  point), and the fraction of a count that could not be sent is carried
+ *  into the next frame's movement.
+**/
+
+#include <unistd.h>
+
+#ifndef _MOUSE_ACCEL_H_
+#define _MOUSE_ACCEL_H_
+
+/** @brief acceleration curves (gain over speed) */
+enum ACCEL_CURVE{
+    ACCEL_FLAT = 0,     // gain 1: raw counts, as without acceleration
+    ACCEL_LINEAR,       // gain rises linearly with speed
+    ACCEL_QUADRATIC,    // slow start, more room for precise movement
+    ACCEL_SMOOTH,       // S-curve: eases in and out of the fast range
+    NUM_ACCEL_CURVES
+};
+
+/** @brief curve used until accel_set_curve is called */
+#ifndef MOUSE_ACCEL_CURVE
+#define MOUSE_ACCEL_CURVE ACCEL_LINEAR
+#endif
+
+/** @brief number of table entries; speed is in counts per period, faster uses the last entry */
+#define ACCEL_SPEED_STEPS 16
+/** @brief fixed-point format of the gains and the carried fraction (Q8: 256 = 1.0) */
+#define ACCEL_FRAC_BITS 8
+/** @brief moving average weight of the newest period: 1 / (1 << ACCEL_SMOOTH_SHIFT) */
+#define ACCEL_SMOOTH_SHIFT 2
+
+/** @brief state of one pointer */
+typedef struct{
+    uint32_t curve;     // ACCEL_*
+    uint32_t speed;     // moving average of the raw speed, Q8 counts per period
+    int32_t period_x;   // raw movement of the current period
+    int32_t period_y;
+    int32_t carry_x;    // fraction of a count not sent yet, Q8
+    int32_t carry_y;
+}accel_state_t;
+
+/** @brief reset the state and select MOUSE_ACCEL_CURVE */
+void accel_init(accel_state_t* state);
+
+/** @brief select a curve (ignored if out of range) */
+void accel_set_curve(accel_state_t* state, uint32_t curve);
+
+/** @brief name of a curve, for messages */
+const char* accel_curve_name(uint32_t curve);
+
+/** @brief scale raw movement at the current speed; any number of calls per period (output may exceed int8_t) */
+void accel_apply(accel_state_t* state, int32_t dx, int32_t dy, int32_t* out_x, int32_t* out_y);
+
+/** @brief end of a period: update the speed from the movement of the period (call it every period, idle or not) */
+void accel_tick(accel_state_t* state);
+
+#endif /* _MOUSE_ACCEL_H_ */
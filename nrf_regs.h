@@ -0,0 +1,298 @@
+/** @file   nrf_regs.h
+ *  @brief  typed register blocks of the nRF52840 USBD, POWER, CLOCK, GPIO, GPIOTE, TIMER and PPI peripherals
+ *
+ *  Each peripheral is a struct laid over its base address; the offsets are
+ *  checked against the product specification at compile time. All
+ *  accesses go through REG_READ / REG_WRITE, so a host build can swap in a
+ *  backend that counts or checks every access (see sim/usbd_sim.h). Tasks
+ *  and events are written with a single store: REG_TRIGGER starts a task,
+ *  REG_CLEAR clears an event. INTENSET / INTENCLR are write-1-to-set /
+ *  clear and are never read back.
+**/
+
+#include <unistd.h>
+#include <stddef.h>
+
+#ifndef _NRF_REGS_H_
+#define _NRF_REGS_H_
+
+/** @brief register access backend: plain volatile accesses unless the build provides its own */
+#ifndef REG_READ
+#define REG_READ(reg) (reg)
+#define REG_WRITE(reg, value) ((reg) = (value))
+#endif
+
+/** @brief start a task / clear an event (one store, no read) */
+#define REG_TRIGGER(task) REG_WRITE(task, 0x1)
+#define REG_CLEAR(event) REG_WRITE(event, 0x0)
+
+/** @brief EasyDMA channel of one endpoint */
+typedef struct{
+    volatile uint32_t PTR;
+    volatile uint32_t MAXCNT;
+    volatile uint32_t AMOUNT;
+    volatile uint32_t RESERVED[2];
+}usbd_dma_regs_t;
+
+/** @brief USBD */
+typedef struct{
+    volatile uint32_t RESERVED0;
+    volatile uint32_t TASKS_STARTEPIN[8];       // 0x004
+    volatile uint32_t TASKS_STARTISOIN;         // 0x024
+    volatile uint32_t TASKS_STARTEPOUT[8];      // 0x028
+    volatile uint32_t TASKS_STARTISOOUT;        // 0x048
+    volatile uint32_t TASKS_EP0RCVOUT;          // 0x04C
+    volatile uint32_t TASKS_EP0STATUS;          // 0x050
+    volatile uint32_t TASKS_EP0STALL;           // 0x054
+    volatile uint32_t TASKS_DPDMDRIVE;          // 0x058
+    volatile uint32_t TASKS_DPDMNODRIVE;        // 0x05C
+    volatile uint32_t RESERVED1[40];
+    volatile uint32_t EVENTS_USBRESET;          // 0x100
+    volatile uint32_t EVENTS_STARTED;           // 0x104
+    volatile uint32_t EVENTS_ENDEPIN[8];        // 0x108
+    volatile uint32_t EVENTS_EP0DATADONE;       // 0x128
+    volatile uint32_t EVENTS_ENDISOIN;          // 0x12C
+    volatile uint32_t EVENTS_ENDEPOUT[8];       // 0x130
+    volatile uint32_t EVENTS_ENDISOOUT;         // 0x150
+    volatile uint32_t EVENTS_SOF;               // 0x154
+    volatile uint32_t EVENTS_USBEVENT;          // 0x158
+    volatile uint32_t EVENTS_EP0SETUP;          // 0x15C
+    volatile uint32_t EVENTS_EPDATA;            // 0x160
+    volatile uint32_t RESERVED2[39];
+    volatile uint32_t SHORTS;                   // 0x200
+    volatile uint32_t RESERVED3[63];
+    volatile uint32_t INTEN;                    // 0x300
+    volatile uint32_t INTENSET;                 // 0x304
+    volatile uint32_t INTENCLR;                 // 0x308
+    volatile uint32_t RESERVED4[61];
+    volatile uint32_t EVENTCAUSE;               // 0x400 (write 1 to clear)
+    volatile uint32_t RESERVED5[7];
+    volatile uint32_t HALTED_EPIN[8];           // 0x420
+    volatile uint32_t RESERVED6;
+    volatile uint32_t HALTED_EPOUT[8];          // 0x444
+    volatile uint32_t RESERVED7;
+    volatile uint32_t EPSTATUS;                 // 0x468
+    volatile uint32_t EPDATASTATUS;             // 0x46C (write 1 to clear)
+    volatile uint32_t USBADDR;                  // 0x470
+    volatile uint32_t RESERVED8[3];
+    volatile uint32_t BMREQUESTTYPE;            // 0x480
+    volatile uint32_t BREQUEST;                 // 0x484
+    volatile uint32_t WVALUEL;                  // 0x488
+    volatile uint32_t WVALUEH;                  // 0x48C
+    volatile uint32_t WINDEXL;                  // 0x490
+    volatile uint32_t WINDEXH;                  // 0x494
+    volatile uint32_t WLENGTHL;                 // 0x498
+    volatile uint32_t WLENGTHH;                 // 0x49C
+    volatile uint32_t SIZE_EPOUT[8];            // 0x4A0
+    volatile uint32_t SIZE_ISOOUT;              // 0x4C0
+    volatile uint32_t RESERVED9[15];
+    volatile uint32_t ENABLE;                   // 0x500
+    volatile uint32_t USBPULLUP;                // 0x504
+    volatile uint32_t DPDMVALUE;                // 0x508
+    volatile uint32_t DTOGGLE;                  // 0x50C
+    volatile uint32_t EPINEN;                   // 0x510
+    volatile uint32_t EPOUTEN;                  // 0x514
+    volatile uint32_t EPSTALL;                  // 0x518
+    volatile uint32_t ISOSPLIT;                 // 0x51C
+    volatile uint32_t FRAMECNTR;                // 0x520
+    volatile uint32_t RESERVED10[2];
+    volatile uint32_t LOWPOWER;                 // 0x52C
+    volatile uint32_t ISOINCONFIG;              // 0x530
+    volatile uint32_t RESERVED11[51];
+    usbd_dma_regs_t EPIN[8];                    // 0x600
+    usbd_dma_regs_t ISOIN;                      // 0x6A0 (PTR, MAXCNT, AMOUNT only)
+    volatile uint32_t RESERVED12[19];
+    usbd_dma_regs_t EPOUT[8];                   // 0x700
+    usbd_dma_regs_t ISOOUT;                     // 0x7A0 (PTR, MAXCNT, AMOUNT only)
+    volatile uint32_t RESERVED13[282];
+    volatile uint32_t ERRATA_199;               // 0xC1C, undocumented (Errata #199)
+}usbd_regs_t;
+
+_Static_assert(offsetof(usbd_regs_t, TASKS_STARTEPIN[1]) == 0x008, "USBD TASKS_STARTEPIN");
+_Static_assert(offsetof(usbd_regs_t, TASKS_STARTEPOUT[0]) == 0x028, "USBD TASKS_STARTEPOUT");
+_Static_assert(offsetof(usbd_regs_t, TASKS_DPDMNODRIVE) == 0x05C, "USBD TASKS_DPDMNODRIVE");
+_Static_assert(offsetof(usbd_regs_t, EVENTS_USBRESET) == 0x100, "USBD EVENTS_USBRESET");
+_Static_assert(offsetof(usbd_regs_t, EVENTS_ENDEPOUT[0]) == 0x130, "USBD EVENTS_ENDEPOUT");
+_Static_assert(offsetof(usbd_regs_t, EVENTS_EPDATA) == 0x160, "USBD EVENTS_EPDATA");
+_Static_assert(offsetof(usbd_regs_t, SHORTS) == 0x200, "USBD SHORTS");
+_Static_assert(offsetof(usbd_regs_t, INTENSET) == 0x304, "USBD INTENSET");
+_Static_assert(offsetof(usbd_regs_t, EVENTCAUSE) == 0x400, "USBD EVENTCAUSE");
+_Static_assert(offsetof(usbd_regs_t, HALTED_EPOUT[0]) == 0x444, "USBD HALTED.EPOUT");
+_Static_assert(offsetof(usbd_regs_t, EPDATASTATUS) == 0x46C, "USBD EPDATASTATUS");
+_Static_assert(offsetof(usbd_regs_t, BMREQUESTTYPE) == 0x480, "USBD BMREQUESTTYPE");
+_Static_assert(offsetof(usbd_regs_t, WLENGTHH) == 0x49C, "USBD WLENGTHH");
+_Static_assert(offsetof(usbd_regs_t, SIZE_EPOUT[0]) == 0x4A0, "USBD SIZE.EPOUT");
+_Static_assert(offsetof(usbd_regs_t, ENABLE) == 0x500, "USBD ENABLE");
+_Static_assert(offsetof(usbd_regs_t, DPDMVALUE) == 0x508, "USBD DPDMVALUE");
+_Static_assert(offsetof(usbd_regs_t, EPSTALL) == 0x518, "USBD EPSTALL");
+_Static_assert(offsetof(usbd_regs_t, LOWPOWER) == 0x52C, "USBD LOWPOWER");
+_Static_assert(offsetof(usbd_regs_t, EPIN[1].AMOUNT) == 0x61C, "USBD EPIN[1].AMOUNT");
+_Static_assert(offsetof(usbd_regs_t, ISOIN) == 0x6A0, "USBD ISOIN");
+_Static_assert(offsetof(usbd_regs_t, EPOUT[0]) == 0x700, "USBD EPOUT");
+_Static_assert(offsetof(usbd_regs_t, ISOOUT) == 0x7A0, "USBD ISOOUT");
+_Static_assert(offsetof(usbd_regs_t, ERRATA_199) == 0xC1C, "USBD Errata #199 register");
+
+/** @brief POWER (shares its base address with CLOCK) */
+typedef struct{
+    volatile uint32_t RESERVED0[30];
+    volatile uint32_t TASKS_CONSTLAT;           // 0x078
+    volatile uint32_t TASKS_LOWPWR;             // 0x07C
+    volatile uint32_t RESERVED1[34];
+    volatile uint32_t EVENTS_POFWARN;           // 0x108
+    volatile uint32_t RESERVED2[2];
+    volatile uint32_t EVENTS_SLEEPENTER;        // 0x114
+    volatile uint32_t EVENTS_SLEEPEXIT;         // 0x118
+    volatile uint32_t EVENTS_USBDETECTED;       // 0x11C
+    volatile uint32_t EVENTS_USBREMOVED;        // 0x120
+    volatile uint32_t EVENTS_USBPWRRDY;         // 0x124
+    volatile uint32_t RESERVED3[119];
+    volatile uint32_t INTENSET;                 // 0x304
+    volatile uint32_t INTENCLR;                 // 0x308
+    volatile uint32_t RESERVED4[61];
+    volatile uint32_t RESETREAS;                // 0x400
+    volatile uint32_t RESERVED5[13];
+    volatile uint32_t USBREGSTATUS;             // 0x438
+}power_regs_t;
+
+_Static_assert(offsetof(power_regs_t, TASKS_CONSTLAT) == 0x078, "POWER TASKS_CONSTLAT");
+_Static_assert(offsetof(power_regs_t, EVENTS_POFWARN) == 0x108, "POWER EVENTS_POFWARN");
+_Static_assert(offsetof(power_regs_t, EVENTS_USBDETECTED) == 0x11C, "POWER EVENTS_USBDETECTED");
+_Static_assert(offsetof(power_regs_t, EVENTS_USBPWRRDY) == 0x124, "POWER EVENTS_USBPWRRDY");
+_Static_assert(offsetof(power_regs_t, INTENSET) == 0x304, "POWER INTENSET");
+_Static_assert(offsetof(power_regs_t, RESETREAS) == 0x400, "POWER RESETREAS");
+_Static_assert(offsetof(power_regs_t, USBREGSTATUS) == 0x438, "POWER USBREGSTATUS");
+
+/** @brief CLOCK (HFCLK part) */
+typedef struct{
+    volatile uint32_t TASKS_HFCLKSTART;         // 0x000
+    volatile uint32_t TASKS_HFCLKSTOP;          // 0x004
+    volatile uint32_t RESERVED0[62];
+    volatile uint32_t EVENTS_HFCLKSTARTED;      // 0x100
+    volatile uint32_t RESERVED1[128];
+    volatile uint32_t INTENSET;                 // 0x304
+    volatile uint32_t INTENCLR;                 // 0x308
+    volatile uint32_t RESERVED2[63];
+    volatile uint32_t HFCLKRUN;                 // 0x408
+    volatile uint32_t HFCLKSTAT;                // 0x40C
+}clock_regs_t;
+
+_Static_assert(offsetof(clock_regs_t, EVENTS_HFCLKSTARTED) == 0x100, "CLOCK EVENTS_HFCLKSTARTED");
+_Static_assert(offsetof(clock_regs_t, INTENSET) == 0x304, "CLOCK INTENSET");
+_Static_assert(offsetof(clock_regs_t, HFCLKSTAT) == 0x40C, "CLOCK HFCLKSTAT");
+
+/** @brief GPIO port (P0) */
+typedef struct{
+    volatile uint32_t RESERVED0[321];
+    volatile uint32_t OUT;                      // 0x504
+    volatile uint32_t OUTSET;                   // 0x508
+    volatile uint32_t OUTCLR;                   // 0x50C
+    volatile uint32_t IN;                       // 0x510
+    volatile uint32_t DIR;                      // 0x514
+    volatile uint32_t DIRSET;                   // 0x518
+    volatile uint32_t DIRCLR;                   // 0x51C
+    volatile uint32_t LATCH;                    // 0x520
+    volatile uint32_t DETECTMODE;               // 0x524
+    volatile uint32_t RESERVED1[118];
+    volatile uint32_t PIN_CNF[32];              // 0x700
+}gpio_regs_t;
+
+_Static_assert(offsetof(gpio_regs_t, OUT) == 0x504, "GPIO OUT");
+_Static_assert(offsetof(gpio_regs_t, IN) == 0x510, "GPIO IN");
+_Static_assert(offsetof(gpio_regs_t, DETECTMODE) == 0x524, "GPIO DETECTMODE");
+_Static_assert(offsetof(gpio_regs_t, PIN_CNF[31]) == 0x77C, "GPIO PIN_CNF");
+
+/** @brief GPIOTE */
+typedef struct{
+    volatile uint32_t TASKS_OUT[8];             // 0x000
+    volatile uint32_t RESERVED0[4];
+    volatile uint32_t TASKS_SET[8];             // 0x030
+    volatile uint32_t RESERVED1[4];
+    volatile uint32_t TASKS_CLR[8];             // 0x060
+    volatile uint32_t RESERVED2[32];
+    volatile uint32_t EVENTS_IN[8];             // 0x100
+    volatile uint32_t RESERVED3[23];
+    volatile uint32_t EVENTS_PORT;              // 0x17C
+    volatile uint32_t RESERVED4[97];
+    volatile uint32_t INTENSET;                 // 0x304
+    volatile uint32_t INTENCLR;                 // 0x308
+    volatile uint32_t RESERVED5[129];
+    volatile uint32_t CONFIG[8];                // 0x510
+}gpiote_regs_t;
+
+_Static_assert(offsetof(gpiote_regs_t, TASKS_SET[0]) == 0x030, "GPIOTE TASKS_SET");
+_Static_assert(offsetof(gpiote_regs_t, TASKS_CLR[0]) == 0x060, "GPIOTE TASKS_CLR");
+_Static_assert(offsetof(gpiote_regs_t, EVENTS_IN[0]) == 0x100, "GPIOTE EVENTS_IN");
+_Static_assert(offsetof(gpiote_regs_t, EVENTS_PORT) == 0x17C, "GPIOTE EVENTS_PORT");
+_Static_assert(offsetof(gpiote_regs_t, INTENSET) == 0x304, "GPIOTE INTENSET");
+_Static_assert(offsetof(gpiote_regs_t, CONFIG[0]) == 0x510, "GPIOTE CONFIG");
+
+/** @brief TIMER (TIMER3 and TIMER4 have 6 capture / compare registers, the others 4) */
+typedef struct{
+    volatile uint32_t TASKS_START;              // 0x000
+    volatile uint32_t TASKS_STOP;               // 0x004
+    volatile uint32_t TASKS_COUNT;              // 0x008
+    volatile uint32_t TASKS_CLEAR;              // 0x00C
+    volatile uint32_t TASKS_SHUTDOWN;           // 0x010
+    volatile uint32_t RESERVED0[11];
+    volatile uint32_t TASKS_CAPTURE[6];         // 0x040
+    volatile uint32_t RESERVED1[58];
+    volatile uint32_t EVENTS_COMPARE[6];        // 0x140
+    volatile uint32_t RESERVED2[42];
+    volatile uint32_t SHORTS;                   // 0x200
+    volatile uint32_t RESERVED3[64];
+    volatile uint32_t INTENSET;                 // 0x304
+    volatile uint32_t INTENCLR;                 // 0x308
+    volatile uint32_t RESERVED4[126];
+    volatile uint32_t MODE;                     // 0x504
+    volatile uint32_t BITMODE;                  // 0x508
+    volatile uint32_t RESERVED5;
+    volatile uint32_t PRESCALER;                // 0x510
+    volatile uint32_t RESERVED6[11];
+    volatile uint32_t CC[6];                    // 0x540
+}timer_regs_t;
+
+_Static_assert(offsetof(timer_regs_t, TASKS_SHUTDOWN) == 0x010, "TIMER TASKS_SHUTDOWN");
+_Static_assert(offsetof(timer_regs_t, TASKS_CAPTURE[0]) == 0x040, "TIMER TASKS_CAPTURE");
+_Static_assert(offsetof(timer_regs_t, EVENTS_COMPARE[0]) == 0x140, "TIMER EVENTS_COMPARE");
+_Static_assert(offsetof(timer_regs_t, SHORTS) == 0x200, "TIMER SHORTS");
+_Static_assert(offsetof(timer_regs_t, INTENSET) == 0x304, "TIMER INTENSET");
+_Static_assert(offsetof(timer_regs_t, MODE) == 0x504, "TIMER MODE");
+_Static_assert(offsetof(timer_regs_t, PRESCALER) == 0x510, "TIMER PRESCALER");
+_Static_assert(offsetof(timer_regs_t, CC[0]) == 0x540, "TIMER CC");
+
+/** @brief PPI channel: the task started whenever the event is raised */
+typedef struct{
+    volatile uint32_t EEP;
+    volatile uint32_t TEP;
+}ppi_ch_regs_t;
+
+/** @brief PPI */
+typedef struct{
+    volatile uint32_t TASKS_CHG[12];            // 0x000 (EN, DIS of the six channel groups)
+    volatile uint32_t RESERVED0[308];
+    volatile uint32_t CHEN;                     // 0x500
+    volatile uint32_t CHENSET;                  // 0x504
+    volatile uint32_t CHENCLR;                  // 0x508
+    volatile uint32_t RESERVED1;
+    ppi_ch_regs_t CH[20];                       // 0x510
+}ppi_regs_t;
+
+_Static_assert(offsetof(ppi_regs_t, CHEN) == 0x500, "PPI CHEN");
+_Static_assert(offsetof(ppi_regs_t, CH[0].EEP) == 0x510, "PPI CH[0].EEP");
+_Static_assert(offsetof(ppi_regs_t, CH[19].TEP) == 0x5AC, "PPI CH[19].TEP");
+
+/** @brief address of a register as an event / task end point of a PPI channel */
+#ifndef PPI_ADDR
+#define PPI_ADDR(reg) ((uint32_t)(uintptr_t)&(reg))
+#endif
+
+/** @brief the register blocks (the base addresses come from the drivers' headers, or from the simulator) */
+#define NRF_USBD ((usbd_regs_t*) USBD_BASE)
+#define NRF_POWER ((power_regs_t*) POWER_BASE)
+#define NRF_CLOCK ((clock_regs_t*) CLOCK_BASE)
+#define NRF_P0 ((gpio_regs_t*) P0_BASE)
+#define NRF_GPIOTE ((gpiote_regs_t*) GPIOTE_BASE)
+#define NRF_TIMER3 ((timer_regs_t*) TIMER3_BASE)
+#define NRF_PPI ((ppi_regs_t*) PPI_BASE)
+
+#endif /* _NRF_REGS_H_ */
@@ -0,0 +1,240 @@
+/**
+ * @file report_rec.c
+ * @name Delta-encoded capture of input reports (see report_rec.h for the format).
+ *
+ * Records are encoded into a small stack buffer and handed to the write
+ * callback in one piece. The reader keeps at least one whole record in
+ * its buffer before decoding, so a record never straddles a refill.
+*/
+
+#include <report_rec.h>
+#include <string.h>
+
+/** @name put_varint
+ * @brief LEB128-encodes value at out
+ * @return number of bytes written
+*/
+static uint32_t put_varint(uint8_t* out, uint64_t value){
+    uint32_t n = 0;
+    while(value >= 0x80){
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+/** @name zigzag
+ * @brief maps a signed value to an unsigned one with small magnitudes first
+*/
+static uint32_t zigzag(int32_t value){
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/** @name unzigzag
+ * @brief inverse of zigzag
+*/
+static int32_t unzigzag(uint32_t value){
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/** @name rec_writer_init
+ * @brief Starts a capture and writes its header
+ * @return REC_OK or REC_ERR_IO
+*/
+int rec_writer_init(rec_writer_t* writer, rec_write_fn write, void* ctx){
+    uint8_t header[REC_HEADER_SIZE] = {0};
+    memcpy(header, REC_MAGIC, 4);
+    header[4] = REC_VERSION;
+    header[5] = sizeof(mouse_delta_t);
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->last_us = 0;
+    writer->buttons = 0;
+    writer->records = 0;
+    writer->bytes = 0;
+    writer->error = 0;
+    if(write(header, sizeof(header), ctx) != 0){
+        writer->error = REC_ERR_IO;
+        return REC_ERR_IO;
+    }
+    writer->bytes = sizeof(header);
+    return REC_OK;
+}
+
+/** @name rec_write
+ * @brief Appends one report
+ * @param  time_us  microseconds since the start of the capture (not going backwards)
+ * @return REC_OK, or the first error of the write callback (later reports are not recorded)
+*/
+int rec_write(rec_writer_t* writer, uint64_t time_us, const input_report_t* report){
+    if(writer->error != 0){
+        return writer->error;
+    }
+    uint8_t record[REC_MAX_RECORD];
+    // a clock going backwards is recorded as no time passing
+    uint32_t n = put_varint(record, time_us > writer->last_us ? time_us - writer->last_us : 0);
+    uint32_t mask_at = n++;
+    uint8_t mask = 0;
+    if(report->buttons != writer->buttons){
+        mask |= REC_HAS_BUTTONS;
+        record[n++] = report->buttons;
+    }
+    if(report->X != 0){
+        mask |= REC_HAS_X;
+        n += put_varint(&record[n], zigzag(report->X));
+    }
+    if(report->Y != 0){
+        mask |= REC_HAS_Y;
+        n += put_varint(&record[n], zigzag(report->Y));
+    }
+    if(report->Wheel != 0){
+        mask |= REC_HAS_WHEEL;
+        n += put_varint(&record[n], zigzag(report->Wheel));
+    }
+    record[mask_at] = mask;
+    if(writer->write(record, n, writer->ctx) != 0){
+        writer->error = REC_ERR_IO;
+        return REC_ERR_IO;
+    }
+    if(time_us > writer->last_us){
+        writer->last_us = time_us;
+    }
+    writer->buttons = report->buttons;
+    writer->records++;
+    writer->bytes += n;
+    return REC_OK;
+}
+
+/** @name fill
+ * @brief Tops up the read buffer so that it holds at least one whole record (unless the capture ends)
+ * @return REC_OK or REC_ERR_IO
+*/
+static int fill(rec_reader_t* reader){
+    if(reader->len - reader->pos >= REC_MAX_RECORD || reader->eof){
+        return REC_OK;
+    }
+    memmove(reader->buf, &reader->buf[reader->pos], reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    while(reader->len < REC_READ_CHUNK){
+        int32_t got = reader->read(&reader->buf[reader->len], REC_READ_CHUNK - reader->len, reader->ctx);
+        if(got < 0){
+            return REC_ERR_IO;
+        }
+        if(got == 0){
+            reader->eof = 1;
+            break;
+        }
+        reader->len += got;
+    }
+    return REC_OK;
+}
+
+/** @name get_varint
+ * @brief Decodes a LEB128 value of at most max_bytes bytes from the buffer
+ * @return REC_OK or REC_ERR_FORMAT
+*/
+static int get_varint(rec_reader_t* reader, uint64_t* value, uint32_t max_bytes){
+    *value = 0;
+    for(uint32_t i = 0; i < max_bytes; i++){
+        if(reader->pos >= reader->len){
+            return REC_ERR_FORMAT;
+        }
+        uint8_t byte = reader->buf[reader->pos++];
+        *value |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if((byte & 0x80) == 0){
+            return REC_OK;
+        }
+    }
+    return REC_ERR_FORMAT;
+}
+
+/** @name get_delta
+ * @brief Decodes a zigzag axis value and checks it fits into this build's mouse_delta_t
+ * @return REC_OK, REC_ERR_FORMAT or REC_ERR_RANGE
+*/
+static int get_delta(rec_reader_t* reader, int32_t* delta){
+    uint64_t raw;
+    int status = get_varint(reader, &raw, 5);
+    if(status != REC_OK){
+        return status;
+    }
+    int32_t value = unzigzag((uint32_t)raw);
+    // 16-bit captures replayed by an 8-bit build
+    if(value > MOUSE_DELTA_MAX || value < -MOUSE_DELTA_MAX){
+        return REC_ERR_RANGE;
+    }
+    *delta = value;
+    return REC_OK;
+}
+
+/** @name rec_reader_init
+ * @brief Opens a capture and checks its header
+ * @return REC_OK, REC_ERR_IO or REC_ERR_FORMAT
+*/
+int rec_reader_init(rec_reader_t* reader, rec_read_fn read, void* ctx){
+    reader->read = read;
+    reader->ctx = ctx;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->eof = 0;
+    reader->time_us = 0;
+    reader->buttons = 0;
+    reader->records = 0;
+    if(fill(reader) != REC_OK){
+        return REC_ERR_IO;
+    }
+    if(reader->len < REC_HEADER_SIZE || memcmp(reader->buf, REC_MAGIC, 4) != 0 || reader->buf[4] != REC_VERSION ||
+       (reader->buf[5] != 1 && reader->buf[5] != 2)){
+        return REC_ERR_FORMAT;
+    }
+    reader->delta_size = reader->buf[5];
+    reader->pos = REC_HEADER_SIZE;
+    return REC_OK;
+}
+
+/** @name rec_read
+ * @brief Reads the next report
+ * @param  time_us  set to the report's timestamp (us since the start of the capture)
+ * @return REC_OK, REC_END after the last report, or an error
+*/
+int rec_read(rec_reader_t* reader, uint64_t* time_us, input_report_t* report){
+    if(fill(reader) != REC_OK){
+        return REC_ERR_IO;
+    }
+    if(reader->pos == reader->len){
+        return REC_END;
+    }
+    uint64_t delta_us;
+    int status = get_varint(reader, &delta_us, 10);
+    if(status != REC_OK){
+        return status;
+    }
+    if(reader->pos >= reader->len){
+        return REC_ERR_FORMAT;
+    }
+    uint8_t mask = reader->buf[reader->pos++];
+    report->buttons = reader->buttons;
+    if(mask & REC_HAS_BUTTONS){
+        if(reader->pos >= reader->len){
+            return REC_ERR_FORMAT;
+        }
+        report->buttons = reader->buf[reader->pos++];
+    }
+    // decoded into locals: the report is packed
+    int32_t axis[3] = {0, 0, 0};
+    for(uint32_t i = 0; i < 3; i++){
+        if((mask & (REC_HAS_X << i)) && (status = get_delta(reader, &axis[i])) != REC_OK){
+            return status;
+        }
+    }
+    report->X = (mouse_delta_t)axis[0];
+    report->Y = (mouse_delta_t)axis[1];
+    report->Wheel = (mouse_delta_t)axis[2];
+    reader->time_us += delta_us;
+    reader->buttons = report->buttons;
+    reader->records++;
+    *time_us = reader->time_us;
+    return REC_OK;
+}
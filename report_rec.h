@@ -0,0 +1,93 @@
+/** @file   report_rec.h
+ *  @brief  compact capture format for input reports, for recording and replaying sessions
+ *
+ *  A capture is an 8-byte header followed by one record per report:
+ *    varint   time since the previous record (us, the first one since the start)
+ *    uint8_t  REC_HAS_* mask of the fields that follow
+ *    uint8_t  buttons                  (only if REC_HAS_BUTTONS)
+ *    varint   zigzag X, Y, Wheel       (each only if its bit is set)
+ *  Varints are LEB128 (7 bits per byte, least significant first), zigzag
+ *  maps 0, -1, 1, -2, ... to 0, 1, 2, 3, ... so small moves in either
+ *  direction take one byte. Buttons are only stored when they change; a
+ *  typical move report takes 4 bytes.
+ *
+ *  Writer and reader both work on a byte stream through a callback, so
+ *  neither needs the whole capture in RAM: the reader refills a
+ *  REC_READ_CHUNK buffer as it goes.
+**/
+
+#include <unistd.h>
+#include <usbd.h>
+
+#ifndef _REPORT_REC_H_
+#define _REPORT_REC_H_
+
+/** @brief header: magic, format version, sizeof(mouse_delta_t) of the recording build, reserved */
+#define REC_MAGIC "MREC"
+#define REC_VERSION 1
+#define REC_HEADER_SIZE 8
+
+/** @brief field mask of a record */
+#define REC_HAS_BUTTONS (0x1 << 0)
+#define REC_HAS_X (0x1 << 1)
+#define REC_HAS_Y (0x1 << 2)
+#define REC_HAS_WHEEL (0x1 << 3)
+
+/** @brief longest record: varint64 time, mask, buttons, three 32-bit varints */
+#define REC_MAX_RECORD (10 + 1 + 1 + 3 * 5)
+
+/** @brief bytes the reader fetches at once (at least REC_MAX_RECORD) */
+#define REC_READ_CHUNK 256
+
+_Static_assert(REC_READ_CHUNK >= REC_MAX_RECORD, "a record must fit into the read buffer");
+
+/** @brief errors returned by the rec_* functions */
+#define REC_OK 0
+#define REC_END 1           // rec_read: no more records
+#define REC_ERR_IO -1       // the callback failed
+#define REC_ERR_FORMAT -2   // bad header or truncated record
+#define REC_ERR_RANGE -3    // a value does not fit into this build's mouse_delta_t
+
+/** @brief stores len bytes, returns 0 on success */
+typedef int (*rec_write_fn)(const uint8_t* data, uint32_t len, void* ctx);
+/** @brief fetches up to len bytes, returns the number read (0 at the end) or a negative error */
+typedef int32_t (*rec_read_fn)(uint8_t* data, uint32_t len, void* ctx);
+
+/** @brief recording state */
+typedef struct{
+    rec_write_fn write;
+    void* ctx;
+    uint64_t last_us;       // timestamp of the previous record
+    uint8_t buttons;        // buttons of the previous record
+    uint32_t records;
+    uint64_t bytes;         // including the header
+    int error;              // first error of the callback, recording stops there
+}rec_writer_t;
+
+/** @brief replay state */
+typedef struct{
+    rec_read_fn read;
+    void* ctx;
+    uint8_t buf[REC_READ_CHUNK];
+    uint32_t pos;           // next byte in buf
+    uint32_t len;           // valid bytes in buf
+    int eof;                // the callback has returned 0
+    uint8_t delta_size;     // sizeof(mouse_delta_t) of the recording build
+    uint64_t time_us;       // timestamp of the last record read
+    uint8_t buttons;        // buttons of the last record read
+    uint32_t records;
+}rec_reader_t;
+
+/** @brief start a capture (writes the header) */
+int rec_writer_init(rec_writer_t* writer, rec_write_fn write, void* ctx);
+
+/** @brief append one report; time_us must not go backwards */
+int rec_write(rec_writer_t* writer, uint64_t time_us, const input_report_t* report);
+
+/** @brief open a capture (reads and checks the header) */
+int rec_reader_init(rec_reader_t* reader, rec_read_fn read, void* ctx);
+
+/** @brief read the next report and its timestamp; REC_END after the last one */
+int rec_read(rec_reader_t* reader, uint64_t* time_us, input_report_t* report);
+
+#endif /* _REPORT_REC_H_ */
@@ -0,0 +1,11 @@
+/** @file   arm.h
+ *  @brief  ARM helpers the firmware uses, stubbed for the host simulator
+**/
+
+#ifndef _ARM_H_
+#define _ARM_H_
+
+/** @brief the firmware hit a breakpoint; the simulator counts it as an error */
+void breakpoint();
+
+#endif /* _ARM_H_ */
@@ -0,0 +1,237 @@
+/**
+ * @file cmd_test.c
+ * @name Host test of the user-space command path: cmd_frame, cmd_queue and mouse_accel.
+ *
+ * Builds frames with frame_encode and feeds them to frame_decode the way
+ * thread_0_keypress does, checking what comes out of the command queue:
+ *   roundtrip  every field of frames with and without a timestamp
+ *   resync     junk, stray sync bytes, bad flags and a cut-off frame between frames
+ *   crc        a frame with a flipped bit is rejected, the next one is taken
+ *   split      a stream cut into two reads at every byte, and one byte per read
+ *   full       a queue that is not drained drops the rest and counts them
+ *   accel      the speed does not depend on how a period's movement was split,
+ *              and fast movement is not cut off
+ * Prints one line per check and fails if any of them does.
+ *
+ * usage: cmd_test
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <cmd_queue.h>
+#include <cmd_frame.h>
+#include <mouse_accel.h>
+
+/** @brief commands of the test stream */
+#define TEST_CMDS 6
+/** @brief largest test stream (frames plus junk) */
+#define STREAM_MAX 512
+
+static const mouse_cmd_t test_cmds[TEST_CMDS] = {
+    {10, -3, 0, CMD_BUTTON_LEFT, 0, 0},
+    {-32768, 32767, -1, 0, CMD_TIMESTAMP, 0xA5A5A5A5},
+    {0, 0, 2, CMD_BUTTON_RIGHT | CMD_BUTTON_MIDDLE, CMD_ACCEL, 0},
+    {FRAME_SYNC, FRAME_SYNC, (int8_t)FRAME_SYNC, FRAME_SYNC, CMD_TIMESTAMP | CMD_ACCEL, 123456},
+    {1, 1, 0, 0, CMD_NEXT_CURVE | CMD_PRINT_STATS, 0},
+    {-1, 0, 0, CMD_BUTTON_LEFT, CMD_TIMESTAMP, 0},
+};
+
+static cmd_queue_t queue;
+static frame_decoder_t decoder;
+
+/** @name encode_all
+ * @brief Encodes the test commands back to back
+ * @return stream length
+*/
+static uint32_t encode_all(uint8_t* out){
+    uint32_t len = 0;
+    for(uint32_t i = 0; i < TEST_CMDS; i++){
+        len += frame_encode(&test_cmds[i], &out[len]);
+    }
+    return len;
+}
+
+/** @name same_cmd
+ * @brief 1 if two commands carry the same fields (time_us only with CMD_TIMESTAMP)
+*/
+static int same_cmd(const mouse_cmd_t* a, const mouse_cmd_t* b){
+    return a->dx == b->dx && a->dy == b->dy && a->wheel == b->wheel && a->buttons == b->buttons &&
+           a->flags == b->flags && ((a->flags & CMD_TIMESTAMP) == 0 || a->time_us == b->time_us);
+}
+
+/** @name expect_cmds
+ * @brief Pops the queue and compares it with count test commands, starting at first
+ * @return 0 if exactly those came out, in order
+*/
+static int expect_cmds(uint32_t first, uint32_t count){
+    mouse_cmd_t cmd;
+    for(uint32_t i = first; i < first + count; i++){
+        if(cmd_queue_pop(&queue, &cmd) != 0 || !same_cmd(&cmd, &test_cmds[i])){
+            return -1;
+        }
+    }
+    return cmd_queue_pop(&queue, &cmd) == 0 ? -1 : 0;
+}
+
+/** @name reset
+ * @brief Empties the queue and the decoder
+*/
+static void reset(){
+    cmd_queue_init(&queue);
+    frame_decoder_init(&decoder);
+}
+
+/** @name check
+ * @brief Prints the result of one check
+ * @return 1 if it failed
+*/
+static int check(const char* name, int ok, const char* what){
+    printf("%-10s %s%s\n", name, ok ? "ok" : "FAIL: ", ok ? "" : what);
+    return !ok;
+}
+
+static int test_roundtrip(){
+    uint8_t stream[STREAM_MAX];
+    reset();
+    uint32_t len = encode_all(stream);
+    uint32_t frames = frame_decode(&decoder, stream, len, &queue);
+    int ok = (frames == TEST_CMDS && expect_cmds(0, TEST_CMDS) == 0 && decoder.stats.errors == 0 &&
+              decoder.stats.skipped == 0 && decoder.len == 0);
+    return check("roundtrip", ok, "decoded commands differ from the encoded ones");
+}
+
+static int test_resync(){
+    uint8_t stream[STREAM_MAX];
+    uint8_t frame[FRAME_MAX_SIZE];
+    uint32_t len = 0;
+    reset();
+    // junk, a sync byte with invalid flags, a frame cut off by the next one
+    static const uint8_t junk[] = {0x00, 0x11, FRAME_SYNC, 0xF0, 0x42};
+    memcpy(&stream[len], junk, sizeof(junk));
+    len += sizeof(junk);
+    len += frame_encode(&test_cmds[0], &stream[len]);
+    uint32_t size = frame_encode(&test_cmds[1], frame);
+    memcpy(&stream[len], frame, size / 2);
+    len += size / 2;
+    for(uint32_t i = 2; i < TEST_CMDS; i++){
+        len += frame_encode(&test_cmds[i], &stream[len]);
+    }
+    uint32_t frames = frame_decode(&decoder, stream, len, &queue);
+    mouse_cmd_t cmd;
+    int ok = (frames == TEST_CMDS - 1 && cmd_queue_pop(&queue, &cmd) == 0 && same_cmd(&cmd, &test_cmds[0]) &&
+              expect_cmds(2, TEST_CMDS - 2) == 0 && decoder.stats.errors >= 2 &&
+              decoder.stats.skipped >= sizeof(junk) + size / 2 && decoder.len == 0);
+    return check("resync", ok, "frames around junk and a cut-off frame were not all taken");
+}
+
+static int test_crc(){
+    uint8_t stream[STREAM_MAX];
+    reset();
+    uint32_t len = encode_all(stream);
+    // flip a bit of the first frame's dx
+    stream[2] ^= 0x4;
+    uint32_t frames = frame_decode(&decoder, stream, len, &queue);
+    int ok = (frames == TEST_CMDS - 1 && expect_cmds(1, TEST_CMDS - 1) == 0 && decoder.stats.errors == 1);
+    return check("crc", ok, "a corrupted frame was taken or the frames after it were lost");
+}
+
+static int test_split(){
+    uint8_t stream[STREAM_MAX];
+    uint32_t len = encode_all(stream);
+    int ok = 1;
+    for(uint32_t cut = 1; cut < len && ok; cut++){
+        reset();
+        uint32_t frames = frame_decode(&decoder, stream, cut, &queue);
+        frames += frame_decode(&decoder, &stream[cut], len - cut, &queue);
+        ok = (frames == TEST_CMDS && expect_cmds(0, TEST_CMDS) == 0 && decoder.stats.errors == 0 && decoder.len == 0);
+    }
+    reset();
+    uint32_t frames = 0;
+    for(uint32_t i = 0; i < len && ok; i++){
+        frames += frame_decode(&decoder, &stream[i], 1, &queue);
+    }
+    ok = ok && (frames == TEST_CMDS && expect_cmds(0, TEST_CMDS) == 0 && decoder.stats.errors == 0);
+    return check("split", ok, "a stream split across reads decoded differently");
+}
+
+static int test_full(){
+    uint8_t frame[FRAME_MAX_SIZE];
+    reset();
+    uint32_t size = frame_encode(&test_cmds[0], frame);
+    for(uint32_t i = 0; i < CMD_QUEUE_SIZE + 5; i++){
+        frame_decode(&decoder, frame, size, &queue);
+    }
+    cmd_queue_stats_t stats;
+    cmd_queue_stats(&queue, &stats);
+    int ok = (decoder.stats.frames == CMD_QUEUE_SIZE + 5 && stats.pushed == CMD_QUEUE_SIZE && stats.dropped == 5 &&
+              stats.max_depth == CMD_QUEUE_SIZE);
+    mouse_cmd_t cmd;
+    uint32_t popped = 0;
+    while(cmd_queue_pop(&queue, &cmd) == 0){
+        ok = ok && same_cmd(&cmd, &test_cmds[0]);
+        popped++;
+    }
+    // the queue takes commands again once it has been drained
+    frame_decode(&decoder, frame, size, &queue);
+    cmd_queue_stats(&queue, &stats);
+    ok = ok && (popped == CMD_QUEUE_SIZE && stats.popped == CMD_QUEUE_SIZE && stats.pushed == CMD_QUEUE_SIZE + 1 &&
+                stats.dropped == 5 && expect_cmds(0, 1) == 0);
+    return check("full", ok, "commands beyond a full queue were not counted as dropped");
+}
+
+static int test_accel(){
+    accel_state_t whole;
+    accel_state_t split;
+    accel_init(&whole);
+    accel_init(&split);
+    int32_t sent_whole = 0;
+    int32_t sent_split = 0;
+    int32_t x, y;
+    // a frame after an idle period stays precise: 10 counts at a gain of 0.25
+    accel_apply(&whole, 10, 0, &x, &y);
+    int ok = (x == 2 && y == 0);
+    sent_whole += x;
+    accel_apply(&split, 4, 0, &x, &y);
+    sent_split += x;
+    accel_apply(&split, 6, 0, &x, &y);
+    sent_split += x;
+    accel_tick(&whole);
+    accel_tick(&split);
+    // steady motion: the same movement per period, in one frame or in three
+    for(uint32_t period = 1; period < 20; period++){
+        accel_apply(&whole, 10, 0, &x, &y);
+        sent_whole += x;
+        for(uint32_t i = 0; i < 3; i++){
+            accel_apply(&split, i == 0 ? 4 : 3, 0, &x, &y);
+            sent_split += x;
+        }
+        accel_tick(&whole);
+        accel_tick(&split);
+        ok = ok && whole.speed == split.speed;
+    }
+    ok = ok && sent_whole == sent_split && whole.speed > 8 << ACCEL_FRAC_BITS;
+    // at full speed the output is not cut off at one report's range: 20 counts at a gain of 12
+    accel_state_t fast;
+    accel_init(&fast);
+    fast.speed = (ACCEL_SPEED_STEPS - 1) << ACCEL_FRAC_BITS;
+    accel_apply(&fast, 20, -20, &x, &y);
+    ok = ok && x == 240 && y == -240;
+    // idle periods let the speed decay
+    for(uint32_t period = 0; period < 40; period++){
+        accel_tick(&whole);
+    }
+    ok = ok && whole.speed < 1 << ACCEL_FRAC_BITS;
+    return check("accel", ok, "the speed or the movement depends on how a period's movement was split");
+}
+
+int main(){
+    int failed = 0;
+    failed |= test_roundtrip();
+    failed |= test_resync();
+    failed |= test_crc();
+    failed |= test_split();
+    failed |= test_full();
+    failed |= test_accel();
+    return failed;
+}
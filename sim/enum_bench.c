@@ -0,0 +1,301 @@
+/**
+ * @file enum_bench.c
+ * @name Enumeration-time benchmark: USBDETECTED / host reboot -> MOUSE_READY.
+ *
+ * Enumerates the device repeatedly against the scripted host. Even runs
+ * unplug and re-plug the cable (USBREMOVED, USBDETECTED, power-up), odd
+ * runs are a host reboot (bus reset on a device that stays attached).
+ * The host's transaction time and the position of the plug within a
+ * frame are varied with a seeded generator, so the runs are repeatable
+ * but do not all hit the same frame alignment.
+ *
+ * Every enumeration step gets a distribution (min, avg, p50, p90, max).
+ * With -c the p90 of each step is compared against a stored baseline and
+ * the program fails if a step got slower than the baseline allows. After
+ * the last run the host reads the trace summary (the heaviest vendor
+ * request), and no SETUP handler may have overrun its cycle budget.
+ *
+ * usage: usbd_enum_bench [-n runs] [-s seed] [-c baseline] [-w baseline] [-t tolerance_pct]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usbd.h>
+#include <nrf_model.h>
+#include <usb_host.h>
+#include <usbd_trace.h>
+
+#define MAX_RUNS 10000
+/** @brief time between unplug and re-plug */
+#define UNPLUG_NS 50000000ull
+/** @brief range of the host's transaction / NAK retry time */
+#define XACT_MIN_NS 5000ull
+#define XACT_MAX_NS 20000ull
+/** @brief a step may exceed its baseline p90 by tolerance_pct percent plus this much */
+#define SLACK_US 10.0
+
+/**
+ * @brief measured steps
+ * Slot 0 is the firmware power-up (USBDETECTED -> pull-up, plug runs only),
+ * slots 1 .. HOST_NUM_PHASES - 1 are the host steps (enum HOST_ENUM_PHASE),
+ * the last one is the whole enumeration.
+*/
+enum BENCH_PHASE{
+    BENCH_POWERUP = 0,
+    BENCH_TOTAL = HOST_NUM_PHASES,
+    NUM_BENCH_PHASES
+};
+
+/** @brief names used in the report and in the baseline file */
+static const char* phase_names[NUM_BENCH_PHASES] = {
+    "powerup", "attach", "reset", "device64", "address", "descriptors", "configured", "report", "total"
+};
+
+/** @brief samples of one step (ns) */
+typedef struct{
+    uint64_t* ns;
+    uint32_t count;
+}samples_t;
+
+/** @brief p50 / p90 of a step in the baseline file (us), negative if the step is not listed */
+typedef struct{
+    double p50;
+    double p90;
+}baseline_t;
+
+/** @name next_random
+ * @brief xorshift64, seeded from -s
+*/
+static uint64_t next_random(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/** @name compare_ns
+ * @brief qsort callback
+*/
+static int compare_ns(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/** @name percentile
+ * @brief nearest-rank percentile of sorted samples (ns)
+*/
+static uint64_t percentile(const samples_t* samples, uint32_t pct){
+    uint32_t rank = (samples->count * pct + 99) / 100;
+    return samples->ns[rank > 0 ? rank - 1 : 0];
+}
+
+/** @name enumerate_once
+ * @brief Plugs the cable or reboots the host, enumerates and records each step
+ * @return 0 on success
+*/
+static int enumerate_once(usb_host_t* host, uint32_t run, uint64_t* rnd, samples_t* samples){
+    int plug = (run % 2) == 0;
+    if(plug){
+        sim_vbus_remove();
+        sim_run_irqs();
+        sim_advance(UNPLUG_NS);
+    }
+    // land somewhere inside a frame
+    sim_advance(next_random(rnd) % HOST_FRAME_NS);
+    host_init(host);
+    host->timing.xact_ns = XACT_MIN_NS + next_random(rnd) % (XACT_MAX_NS - XACT_MIN_NS + 1);
+    if(plug){
+        sim_vbus_detect();
+        sim_run_irqs();
+    }
+    uint32_t errors = sim_stats.errors;
+    if(host_enumerate(host) != HOST_OK || MOUSE_READY != 1 || sim_stats.errors != errors){
+        fprintf(stderr, "run %u (%s): enumeration failed\n", run, plug ? "plug" : "reboot");
+        return -1;
+    }
+    for(uint32_t phase = HOST_PHASE_ATTACH; phase < HOST_NUM_PHASES; phase++){
+        samples_t* s = &samples[phase];
+        s->ns[s->count++] = host->phase_ns[phase] - host->phase_ns[phase - 1];
+    }
+    samples[BENCH_TOTAL].ns[samples[BENCH_TOTAL].count++] = host->phase_ns[HOST_PHASE_REPORT] - host->phase_ns[HOST_PHASE_START];
+    if(plug){
+        usbd_bringup_stats_t bringup;
+        usbd_get_bringup_stats(&bringup);
+        if((bringup.reached & (1 << BRINGUP_PULLUP)) == 0){
+            fprintf(stderr, "run %u: no power-up timestamps\n", run);
+            return -1;
+        }
+        samples[BENCH_POWERUP].ns[samples[BENCH_POWERUP].count++] = SIM_CYCLES_TO_NS(bringup.cycles[BRINGUP_PULLUP]);
+    }
+    return 0;
+}
+
+/** @name read_baseline
+ * @brief Reads "phase p50_us p90_us" lines ('#' starts a comment)
+ * @return 0 on success
+*/
+static int read_baseline(const char* path, baseline_t* baseline){
+    FILE* file = fopen(path, "r");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+        baseline[phase].p50 = -1;
+        baseline[phase].p90 = -1;
+    }
+    char line[256];
+    while(fgets(line, sizeof(line), file) != 0){
+        char name[64];
+        double p50, p90;
+        if(line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &p50, &p90) != 3){
+            continue;
+        }
+        for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+            if(strcmp(name, phase_names[phase]) == 0){
+                baseline[phase].p50 = p50;
+                baseline[phase].p90 = p90;
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+/** @name write_baseline
+ * @brief Stores the p50 / p90 of every step
+ * @return 0 on success
+*/
+static int write_baseline(const char* path, samples_t* samples, uint32_t runs, uint64_t seed){
+    FILE* file = fopen(path, "w");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "# usbd_enum_bench baseline (%u runs, seed %llu): phase p50_us p90_us\n", runs, (unsigned long long)seed);
+    for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+        fprintf(file, "%s %.3f %.3f\n", phase_names[phase], percentile(&samples[phase], 50) / 1e3,
+                percentile(&samples[phase], 90) / 1e3);
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    uint32_t runs = 100;
+    uint64_t seed = 642;
+    const char* check = 0;
+    const char* write = 0;
+    double tolerance = 5.0;
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:c:w:t:")) != -1){
+        switch(opt){
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, 0, 0);
+                break;
+            case 'c':
+                check = optarg;
+                break;
+            case 'w':
+                write = optarg;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n runs] [-s seed] [-c baseline] [-w baseline] [-t tolerance_pct]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(runs < 2 || runs > MAX_RUNS || seed == 0){
+        fprintf(stderr, "runs must be 2..%u and the seed non-zero\n", MAX_RUNS);
+        return 2;
+    }
+
+    samples_t samples[NUM_BENCH_PHASES];
+    for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+        samples[phase].ns = calloc(runs, sizeof(uint64_t));
+        samples[phase].count = 0;
+    }
+
+    sim_reset();
+    usbd_init();
+    usb_host_t host;
+    uint64_t rnd = seed;
+    int failed = 0;
+    for(uint32_t run = 0; run < runs && !failed; run++){
+        failed = enumerate_once(&host, run, &rnd, samples);
+    }
+    if(failed){
+        return 1;
+    }
+    // the heaviest SETUP handler last: the trace summary a host tool reads after enumeration
+    trace_stage_stats_t trace[NUM_TRACE_STAGES];
+    host_setup_t get_trace = {USB_REQ_VENDOR_DEVICE_IN, TRACE_REQ_GET_STATS, 0, 0, sizeof(trace)};
+    if(host_control(&host, &get_trace, (uint8_t*)trace) != sizeof(trace)){
+        printf("FAIL: vendor request TRACE_REQ_GET_STATS failed\n");
+        failed = 1;
+    }
+    usbd_setup_stats_t setup_stats;
+    usbd_get_setup_stats(&setup_stats);
+
+    printf("enumeration:     %u runs (%u plug, %u host reboot), seed %llu\n", runs, (runs + 1) / 2, runs / 2,
+           (unsigned long long)seed);
+    printf("step (ms):       %-11s    min      avg      p50      p90      max\n", "");
+    for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+        samples_t* s = &samples[phase];
+        qsort(s->ns, s->count, sizeof(uint64_t), compare_ns);
+        uint64_t sum = 0;
+        for(uint32_t i = 0; i < s->count; i++){
+            sum += s->ns[i];
+        }
+        printf("                 %-11s %8.3f %8.3f %8.3f %8.3f %8.3f\n", phase_names[phase], s->ns[0] / 1e6,
+               sum / 1e6 / s->count, percentile(s, 50) / 1e6, percentile(s, 90) / 1e6, s->ns[s->count - 1] / 1e6);
+    }
+
+    printf("SETUP requests:  %u, %u over budget, max %u cycles\n", setup_stats.requests, setup_stats.overruns,
+           setup_stats.max_cycles);
+
+    if(write != 0 && write_baseline(write, samples, runs, seed) != 0){
+        failed = 1;
+    }
+    baseline_t baseline[NUM_BENCH_PHASES];
+    if(check != 0){
+        if(read_baseline(check, baseline) != 0){
+            failed = 1;
+        }else{
+            for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+                double p90 = percentile(&samples[phase], 90) / 1e3;
+                if(baseline[phase].p90 < 0){
+                    printf("warning: %s is not in %s\n", phase_names[phase], check);
+                }else if(p90 > baseline[phase].p90 * (1 + tolerance / 100) + SLACK_US){
+                    printf("FAIL: %s p90 %.3f us, baseline %.3f us (+%.1f%%)\n", phase_names[phase], p90,
+                           baseline[phase].p90, tolerance);
+                    failed = 1;
+                }else if(p90 < baseline[phase].p90 / (1 + tolerance / 100) - SLACK_US){
+                    printf("note: %s p90 %.3f us is faster than the baseline %.3f us, consider updating it (-w)\n",
+                           phase_names[phase], p90, baseline[phase].p90);
+                }
+            }
+        }
+    }
+    if(setup_stats.overruns != 0){
+        printf("FAIL: %u of %u SETUP handlers over their cycle budget, max %u cycles (request 0x%04x)\n",
+               setup_stats.overruns, setup_stats.requests, setup_stats.max_cycles, setup_stats.max_request);
+        failed = 1;
+    }
+    if(sim_stats.errors != 0){
+        printf("FAIL: %u simulator errors\n", sim_stats.errors);
+        failed = 1;
+    }
+    for(uint32_t phase = 0; phase < NUM_BENCH_PHASES; phase++){
+        free(samples[phase].ns);
+    }
+    return failed;
+}
@@ -0,0 +1,613 @@
+/**
+ * @file load_bench.c
+ * @name Report-throughput benchmark: offered syscall load -> reports on EP1.
+ *
+ * Drives sys_mouse_move / sys_mouse_scroll / sys_mouse_click at a list of
+ * offered rates against the scripted host polling EP1 at the bInterval of
+ * a polling profile. Events arrive as a seeded Poisson process; each one
+ * is a move, a scroll step or a click, picked by the -x weights. A click
+ * presses a button, or releases it if one is held, so the moves and
+ * scroll steps in between carry it (a drag).
+ *
+ * For every rate the program prints the reports the host received per
+ * second, the latency from the syscall to the host receiving the report
+ * that carries it, the reports the firmware coalesced or dropped, and the
+ * cost of send_data on the syscall path. Button transitions may overtake
+ * motion (the priority lane, see ep1_stage), so moves and scroll steps are
+ * matched by the running sums of X / Y / Wheel as in replay.c, and each
+ * change of the buttons the host sees by the next transition offered,
+ * with its own syscall time. send_data is wrapped at link time (-Wl,--wrap=send_data):
+ * host CPU time is printed but depends on the machine, the register
+ * accesses per call are exact and are what the baseline checks.
+ *
+ * A transition cannot reach the host before the one ahead of it, but it
+ * must not wait behind motion: counted from its syscall, or from the host
+ * receiving the transition ahead of it if that came later, every click
+ * has to arrive within one poll interval (EP1 is armed at the SOF of the
+ * poll frame, see ep1_arm), or the program fails.
+ *
+ * With -c each rate is compared against a stored baseline and the program
+ * fails if the report rate fell, the p99 latency of motion or clicks rose,
+ * more reports were dropped or send_data got more expensive than the
+ * baseline allows.
+ *
+ * usage: usbd_load_bench [-r rate,rate,...] [-d duration_ms] [-x move:scroll:click] [-p poll_profile] [-s seed]
+ *                        [-c baseline] [-w baseline] [-t tolerance_pct]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <usbd.h>
+#include <syscall_mouse.h>
+#include <nrf_model.h>
+#include <usb_host.h>
+
+/** @brief rates of one run (events per second) */
+#define MAX_RATES 16
+/** @brief latency histogram: 1 us bins up to 1 s, the last one collects everything above */
+#define LATENCY_BINS 1000000
+/** @brief events sent but not yet seen by the host */
+#define PENDING_SIZE 65536
+/** @brief longest wait for the host to fetch the last reports of a rate */
+#define DRAIN_FRAMES 5000
+/** @brief largest move of one event */
+#define MOVE_MAX 8
+/** @brief p99 latency may exceed its baseline by tolerance_pct percent plus this much */
+#define SLACK_US 10.0
+/** @brief ... and the register accesses per send_data call by this much */
+#define SLACK_REGS 0.01
+
+/** @brief an event waiting for the host */
+typedef struct{
+    uint64_t time_ns;       // syscall time
+    int64_t x;              // running sums after this event
+    int64_t y;
+    int64_t wheel;
+    uint8_t buttons;        // buttons from this event on
+}pending_t;
+
+/** @brief events of one kind waiting for the host, and the latency of those delivered */
+typedef struct{
+    pending_t pending[PENDING_SIZE];
+    uint32_t head;          // oldest pending event
+    uint32_t tail;
+    uint32_t* bins;         // 1 us bins
+    uint64_t delivered;
+    uint64_t max_ns;
+}lane_t;
+
+/** @brief load state shared with the host callback */
+typedef struct{
+    lane_t motion;          // moves and scroll steps
+    lane_t clicks;          // button transitions
+    // what the host has received so far
+    int64_t x;
+    int64_t y;
+    int64_t wheel;
+    uint8_t buttons;
+    uint32_t mismatched;    // button changes the host saw that were not the next transition offered
+    uint64_t click_ns;      // time the host received the last transition
+    uint64_t click_own_max_ns;  // longest latency of a transition counted from click_ns when that was later than its syscall
+    uint8_t held;           // buttons of the last sys_mouse_click (moves and scroll steps carry them)
+    uint8_t sent_buttons;   // buttons of the last report the firmware accepted
+}load_t;
+
+/** @brief result of one rate */
+typedef struct{
+    uint32_t rate;
+    uint64_t events;
+    double reports_per_s;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double max_us;
+    double click_p99_us;
+    double click_max_us;
+    double click_own_us;    // longest click latency not spent behind an earlier transition
+    uint32_t coalesced;
+    uint32_t dropped;
+    double send_ns;         // host CPU time per send_data call
+    double regs_per_call;   // register accesses per send_data call
+}result_t;
+
+/** @brief baseline of one rate, rate 0 if the line is unused */
+typedef struct{
+    uint32_t rate;
+    double reports_per_s;
+    double p99_us;
+    double click_p99_us;
+    uint32_t dropped;
+    double regs_per_call;
+}baseline_t;
+
+/** @brief send_data on the syscall path (filled in by the wrapper) */
+static uint64_t send_calls = 0;
+static uint64_t send_host_ns = 0;
+static uint64_t send_regs = 0;
+
+void __real_send_data(uint8_t endpoint, const uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size);
+
+/** @name host_ns
+ * @brief monotonic host time
+*/
+static uint64_t host_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** @name __wrap_send_data
+ * @brief send_data as called from syscall_mouse.c: timed and its register accesses counted
+*/
+void __wrap_send_data(uint8_t endpoint, const uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size){
+    uint64_t regs = sim_stats.reg_reads + sim_stats.reg_writes;
+    uint64_t start = host_ns();
+    __real_send_data(endpoint, buffer_ptr, total_size, data_size);
+    send_host_ns += host_ns() - start;
+    send_regs += sim_stats.reg_reads + sim_stats.reg_writes - regs;
+    send_calls++;
+}
+
+/** @name next_random
+ * @brief xorshift64, seeded from -s
+*/
+static uint64_t next_random(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/** @name next_gap_ns
+ * @brief exponentially distributed time to the next event of a Poisson process
+*/
+static uint64_t next_gap_ns(uint64_t* rnd, uint32_t rate){
+    double u = ((next_random(rnd) >> 11) + 1) / 9007199254740993.0;    // (0, 1]
+    return (uint64_t)(-log(u) * 1e9 / rate);
+}
+
+/** @name offered
+ * @brief Adds the report of one syscall to the offered running sums and queues it in its lane, unless the firmware dropped it
+ * @param before  queue statistics before the syscall
+ * @note  A full priority lane drops the incoming report, a full motion
+ *        queue only its motion (see usbd_queue_report). What was dropped
+ *        is left out, so the host's sums can still catch up with the rest.
+ * @return 0 on success, -1 if a lane overflowed
+*/
+static int offered(load_t* load, pending_t* sums, const report_queue_stats_t* before, int32_t x, int32_t y, int32_t wheel,
+                   uint8_t buttons){
+    int motion = (x != 0 || y != 0 || wheel != 0);
+    report_queue_stats_t after;
+    usbd_get_queue_stats(&after);
+    if(after.dropped != before->dropped){
+        if(buttons == load->sent_buttons || before->transitions >= BUTTON_LANE_SIZE){
+            return 0;
+        }
+        motion = 0;
+    }
+    sums->time_ns = sim_time_ns;
+    if(motion){
+        sums->x += x;
+        sums->y += y;
+        sums->wheel += wheel;
+        if(load->motion.tail - load->motion.head >= PENDING_SIZE){
+            return -1;
+        }
+        load->motion.pending[load->motion.tail++ % PENDING_SIZE] = *sums;
+    }
+    if(buttons != load->sent_buttons){
+        sums->buttons = buttons;
+        load->sent_buttons = buttons;
+        if(load->clicks.tail - load->clicks.head >= PENDING_SIZE){
+            return -1;
+        }
+        load->clicks.pending[load->clicks.tail++ % PENDING_SIZE] = *sums;
+    }
+    return 0;
+}
+
+/** @name deliver
+ * @brief The host has received the events of a lane up to (not including) index end
+*/
+static void deliver(lane_t* lane, uint32_t end, uint64_t time_ns){
+    for(; lane->head != end; lane->head++){
+        uint64_t latency_ns = time_ns - lane->pending[lane->head % PENDING_SIZE].time_ns;
+        uint64_t bin = latency_ns / 1000;
+        lane->bins[bin < LATENCY_BINS ? bin : LATENCY_BINS - 1]++;
+        lane->delivered++;
+        if(latency_ns > lane->max_ns){
+            lane->max_ns = latency_ns;
+        }
+    }
+}
+
+/** @name on_report
+ * @brief EP1 report callback: delivers the newest pending move the host's running sums match and all before it,
+ *        and on a change of the buttons the next pending transition
+*/
+static void on_report(const uint8_t* report, uint32_t len, uint64_t time_ns, void* ctx){
+    load_t* load = ctx;
+    input_report_t r = {0, 0, 0, 0};
+    memcpy(&r, report, len < sizeof(r) ? len : sizeof(r));
+    load->x += r.X;
+    load->y += r.Y;
+    load->wheel += r.Wheel;
+    lane_t* motion = &load->motion;
+    uint32_t match = motion->head;
+    for(uint32_t i = motion->tail; i != motion->head; i--){
+        pending_t* p = &motion->pending[(i - 1) % PENDING_SIZE];
+        if(p->x == load->x && p->y == load->y && p->wheel == load->wheel){
+            match = i;
+            break;
+        }
+    }
+    // no match: part of the motion is still carried over in the firmware
+    deliver(motion, match, time_ns);
+    if(r.buttons == load->buttons){
+        return;
+    }
+    load->buttons = r.buttons;
+    // every report carries at most one transition, in the order they were offered
+    lane_t* clicks = &load->clicks;
+    if(clicks->head == clicks->tail || clicks->pending[clicks->head % PENDING_SIZE].buttons != r.buttons){
+        load->mismatched++;
+        return;
+    }
+    // a transition cannot reach the host before the one ahead of it
+    uint64_t start = clicks->pending[clicks->head % PENDING_SIZE].time_ns;
+    if(load->click_ns > start){
+        start = load->click_ns;
+    }
+    if(time_ns - start > load->click_own_max_ns){
+        load->click_own_max_ns = time_ns - start;
+    }
+    load->click_ns = time_ns;
+    deliver(clicks, clicks->head + 1, time_ns);
+}
+
+/** @name latency_percentile
+ * @brief nearest-rank percentile of a lane's latency (us, rounded down)
+*/
+static double latency_percentile(const lane_t* lane, uint32_t pct){
+    if(lane->delivered == 0){
+        return 0;
+    }
+    uint64_t rank = (lane->delivered * pct + 99) / 100;
+    uint64_t seen = 0;
+    for(uint32_t bin = 0; bin < LATENCY_BINS; bin++){
+        seen += lane->bins[bin];
+        if(seen >= rank && seen > 0){
+            return bin;
+        }
+    }
+    return LATENCY_BINS;
+}
+
+/** @name run_rate
+ * @brief Offers events at one rate for duration_ns and collects the result
+ * @return 0 on success
+*/
+static int run_rate(usb_host_t* host, load_t* load, uint32_t rate, uint64_t duration_ns, const uint32_t* mix,
+                    uint64_t* rnd, result_t* result){
+    lane_t* lanes[2] = {&load->motion, &load->clicks};
+    for(uint32_t i = 0; i < 2; i++){
+        memset(lanes[i]->bins, 0, LATENCY_BINS * sizeof(uint32_t));
+        lanes[i]->delivered = 0;
+        lanes[i]->max_ns = 0;
+    }
+    load->click_own_max_ns = 0;
+    send_calls = 0;
+    send_host_ns = 0;
+    send_regs = 0;
+    report_queue_stats_t before;
+    usbd_get_queue_stats(&before);
+    uint64_t reports = host->reports;
+
+    // running sums of what was offered, continued from the previous rate
+    pending_t sums = {0, load->x, load->y, load->wheel, load->sent_buttons};
+    uint32_t weights = mix[0] + mix[1] + mix[2];
+    uint64_t start = sim_time_ns;
+    uint64_t end = start + duration_ns;
+    uint64_t next = start + next_gap_ns(rnd, rate);
+    uint64_t events = 0;
+    while(next < end){
+        host_run_until(host, next);
+        uint32_t pick = next_random(rnd) % weights;
+        report_queue_stats_t stats;
+        usbd_get_queue_stats(&stats);
+        int status;
+        if(pick < mix[0]){
+            mouse_delta_t dx = (mouse_delta_t)(next_random(rnd) % (2 * MOVE_MAX + 1)) - MOVE_MAX;
+            mouse_delta_t dy = (mouse_delta_t)(next_random(rnd) % (2 * MOVE_MAX + 1)) - MOVE_MAX;
+            if(dx == 0 && dy == 0){
+                dx = 1;
+            }
+            sys_mouse_move(dx, dy);
+            status = offered(load, &sums, &stats, dx, dy, 0, load->held);
+        }else if(pick < mix[0] + mix[1]){
+            int8_t direction = next_random(rnd) % 2 ? 1 : -1;
+            sys_mouse_scroll(direction);
+            status = offered(load, &sums, &stats, 0, 0, direction * (int32_t)usbd_wheel_resolution(),
+                             load->held);
+        }else{
+            // press the left or right button, or release the one held
+            load->held = (load->held != 0) ? 0 : 1 + next_random(rnd) % 2;
+            sys_mouse_click(load->held);
+            status = offered(load, &sums, &stats, 0, 0, 0, load->held);
+        }
+        sim_run_irqs();
+        if(status != 0){
+            sim_error("more than %u events waiting for the host", PENDING_SIZE);
+            return -1;
+        }
+        events++;
+        next += next_gap_ns(rnd, rate);
+    }
+    host_run_until(host, end);
+    // let the last reports out, including motion carried over because it did not fit into one report
+    for(uint32_t frame = 0; frame < DRAIN_FRAMES && (load->motion.head != load->motion.tail ||
+                                                     load->clicks.head != load->clicks.tail); frame++){
+        host_advance(host, HOST_FRAME_NS);
+    }
+    if(load->motion.head != load->motion.tail || load->clicks.head != load->clicks.tail || load->x != sums.x || load->y != sums.y || load->wheel != sums.wheel ||
+       load->buttons != load->sent_buttons || load->mismatched != 0){
+        printf("FAIL: %u events/s: the host did not receive all motion, scrolling and clicks\n", rate);
+        return -1;
+    }
+
+    report_queue_stats_t after;
+    usbd_get_queue_stats(&after);
+    result->rate = rate;
+    result->events = events;
+    result->reports_per_s = (host->reports - reports) / (duration_ns / 1e9);
+    result->p50_us = latency_percentile(&load->motion, 50);
+    result->p90_us = latency_percentile(&load->motion, 90);
+    result->p99_us = latency_percentile(&load->motion, 99);
+    result->max_us = load->motion.max_ns / 1e3;
+    result->click_p99_us = load->clicks.delivered ? latency_percentile(&load->clicks, 99) : 0;
+    result->click_max_us = load->clicks.max_ns / 1e3;
+    result->click_own_us = load->click_own_max_ns / 1e3;
+    result->coalesced = after.coalesced - before.coalesced;
+    result->dropped = after.dropped - before.dropped;
+    result->send_ns = send_calls ? (double)send_host_ns / send_calls : 0;
+    result->regs_per_call = send_calls ? (double)send_regs / send_calls : 0;
+    return 0;
+}
+
+/** @name read_baseline
+ * @brief Reads "rate reports_per_s p99_us click_p99_us dropped regs_per_call" lines ('#' starts a comment)
+ * @return number of rates read, -1 if the file cannot be opened
+*/
+static int read_baseline(const char* path, baseline_t* baseline){
+    FILE* file = fopen(path, "r");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    int count = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), file) != 0 && count < MAX_RATES){
+        baseline_t* b = &baseline[count];
+        if(line[0] == '#' || sscanf(line, "%u %lf %lf %lf %u %lf", &b->rate, &b->reports_per_s, &b->p99_us,
+                                    &b->click_p99_us, &b->dropped, &b->regs_per_call) != 6){
+            continue;
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+/** @name write_baseline
+ * @brief Stores the checked metrics of every rate
+ * @return 0 on success
+*/
+static int write_baseline(const char* path, const result_t* results, uint32_t rates, uint64_t duration_ms,
+                          const uint32_t* mix, uint32_t profile, uint64_t seed){
+    FILE* file = fopen(path, "w");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "# usbd_load_bench baseline (%llu ms per rate, mix %u:%u:%u, poll profile %u, seed %llu)\n",
+            (unsigned long long)duration_ms, mix[0], mix[1], mix[2], profile, (unsigned long long)seed);
+    fprintf(file, "# rate reports_per_s p99_us click_p99_us dropped regs_per_call\n");
+    for(uint32_t i = 0; i < rates; i++){
+        fprintf(file, "%u %.3f %.3f %.3f %u %.3f\n", results[i].rate, results[i].reports_per_s, results[i].p99_us,
+                results[i].click_p99_us, results[i].dropped, results[i].regs_per_call);
+    }
+    fclose(file);
+    return 0;
+}
+
+/** @name check_baseline
+ * @brief Compares every rate with its baseline line
+ * @return 0 if nothing got worse than the tolerance allows
+*/
+static int check_baseline(const char* path, const result_t* results, uint32_t rates, double tolerance){
+    baseline_t baseline[MAX_RATES];
+    int count = read_baseline(path, baseline);
+    if(count < 0){
+        return -1;
+    }
+    int failed = 0;
+    double factor = 1 + tolerance / 100;
+    for(uint32_t i = 0; i < rates; i++){
+        const result_t* r = &results[i];
+        const baseline_t* b = 0;
+        for(int j = 0; j < count; j++){
+            if(baseline[j].rate == r->rate){
+                b = &baseline[j];
+            }
+        }
+        if(b == 0){
+            printf("warning: %u events/s is not in %s\n", r->rate, path);
+            continue;
+        }
+        if(r->reports_per_s < b->reports_per_s / factor){
+            printf("FAIL: %u events/s: %.1f reports/s, baseline %.1f (-%.1f%%)\n", r->rate, r->reports_per_s,
+                   b->reports_per_s, tolerance);
+            failed = 1;
+        }
+        if(r->p99_us > b->p99_us * factor + SLACK_US){
+            printf("FAIL: %u events/s: p99 latency %.0f us, baseline %.0f us (+%.1f%%)\n", r->rate, r->p99_us, b->p99_us,
+                   tolerance);
+            failed = 1;
+        }else if(r->p99_us < b->p99_us / factor - SLACK_US){
+            printf("note: %u events/s: p99 latency %.0f us is lower than the baseline %.0f us, consider updating it (-w)\n",
+                   r->rate, r->p99_us, b->p99_us);
+        }
+        if(r->click_p99_us > b->click_p99_us * factor + SLACK_US){
+            printf("FAIL: %u events/s: p99 click latency %.0f us, baseline %.0f us (+%.1f%%)\n", r->rate, r->click_p99_us,
+                   b->click_p99_us, tolerance);
+            failed = 1;
+        }
+        if(r->dropped > b->dropped * factor){
+            printf("FAIL: %u events/s: %u reports dropped, baseline %u (+%.1f%%)\n", r->rate, r->dropped, b->dropped, tolerance);
+            failed = 1;
+        }
+        if(r->regs_per_call > b->regs_per_call * factor + SLACK_REGS){
+            printf("FAIL: %u events/s: send_data makes %.2f register accesses per call, baseline %.2f\n", r->rate,
+                   r->regs_per_call, b->regs_per_call);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/** @name parse_list
+ * @brief Reads up to max numbers separated by sep
+ * @return number of values, -1 on a malformed list
+*/
+static int parse_list(const char* text, char sep, uint32_t* values, uint32_t max){
+    uint32_t count = 0;
+    while(*text != '\0'){
+        char* end;
+        unsigned long value = strtoul(text, &end, 10);
+        if(end == text || count == max || (*end != sep && *end != '\0')){
+            return -1;
+        }
+        values[count++] = value;
+        text = (*end == sep) ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]){
+    uint32_t rate_list[MAX_RATES] = {125, 500, 1000, 4000, 16000};
+    int rates = 5;
+    uint64_t duration_ms = 5000;
+    uint32_t mix[3] = {90, 8, 2};
+    uint32_t profile = POLL_1MS;
+    uint64_t seed = 642;
+    const char* check = 0;
+    const char* write = 0;
+    double tolerance = 5.0;
+    int opt;
+    int usage = 0;
+    while((opt = getopt(argc, argv, "r:d:x:p:s:c:w:t:")) != -1){
+        switch(opt){
+            case 'r':
+                rates = parse_list(optarg, ',', rate_list, MAX_RATES);
+                usage |= rates <= 0;
+                break;
+            case 'd':
+                duration_ms = strtoull(optarg, 0, 0);
+                break;
+            case 'x':
+                usage |= parse_list(optarg, ':', mix, 3) != 3;
+                break;
+            case 'p':
+                profile = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, 0, 0);
+                break;
+            case 'c':
+                check = optarg;
+                break;
+            case 'w':
+                write = optarg;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            default:
+                usage = 1;
+                break;
+        }
+    }
+    for(int i = 0; i < rates && !usage; i++){
+        usage |= rate_list[i] == 0;
+    }
+    if(usage || optind != argc || duration_ms == 0 || seed == 0 || mix[0] + mix[1] + mix[2] == 0){
+        fprintf(stderr, "usage: %s [-r rate,rate,...] [-d duration_ms] [-x move:scroll:click] [-p poll_profile] [-s seed]\n"
+                        "       %*s [-c baseline] [-w baseline] [-t tolerance_pct]\n", argv[0], (int)strlen(argv[0]), "");
+        return 2;
+    }
+
+    sim_reset();
+    usbd_init();
+    if(usbd_set_poll_profile(profile) != 0){
+        fprintf(stderr, "unknown poll profile %u\n", profile);
+        return 2;
+    }
+    load_t* load = calloc(1, sizeof(load_t));
+    load->motion.bins = calloc(LATENCY_BINS, sizeof(uint32_t));
+    load->clicks.bins = calloc(LATENCY_BINS, sizeof(uint32_t));
+    usb_host_t host;
+    host_init(&host);
+    host.on_report = on_report;
+    host.ctx = load;
+    sim_vbus_detect();
+    sim_run_irqs();
+    if(host_enumerate(&host) != HOST_OK || MOUSE_READY != 1){
+        fprintf(stderr, "enumeration failed\n");
+        return 1;
+    }
+
+    result_t results[MAX_RATES];
+    uint64_t rnd = seed;
+    int failed = 0;
+    for(int i = 0; i < rates && !failed; i++){
+        failed = run_rate(&host, load, rate_list[i], duration_ms * 1000000ull, mix, &rnd, &results[i]);
+    }
+    if(!failed){
+        printf("load:            %llu ms per rate, mix %u:%u:%u (move:scroll:click), poll %u ms, seed %llu\n",
+               (unsigned long long)duration_ms, mix[0], mix[1], mix[2], host.ep1_interval, (unsigned long long)seed);
+        printf("%-12s %9s %10s %9s %9s %9s %9s %9s %9s %9s %10s %8s %10s %8s\n", "events/s", "offered", "reports/s",
+               "p50 ms", "p90 ms", "p99 ms", "max ms", "click p99", "click max", "click own", "coalesced", "dropped", "send ns", "regs");
+        for(int i = 0; i < rates; i++){
+            const result_t* r = &results[i];
+            printf("%-12u %9llu %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %10u %8u %10.0f %8.2f\n", r->rate,
+                   (unsigned long long)r->events, r->reports_per_s, r->p50_us / 1e3, r->p90_us / 1e3, r->p99_us / 1e3,
+                   r->max_us / 1e3, r->click_p99_us / 1e3, r->click_max_us / 1e3, r->click_own_us / 1e3, r->coalesced, r->dropped, r->send_ns,
+                   r->regs_per_call);
+        }
+        for(int i = 0; i < rates; i++){
+            if(results[i].click_own_us > host.ep1_interval * 1000.0){
+                printf("FAIL: %u events/s: a click took %.3f ms after the transition ahead of it, more than one poll\n",
+                       results[i].rate, results[i].click_own_us / 1e3);
+                failed = 1;
+            }
+        }
+        if(write != 0 && write_baseline(write, results, rates, duration_ms, mix, profile, seed) != 0){
+            failed = 1;
+        }
+        if(check != 0 && check_baseline(check, results, rates, tolerance) != 0){
+            failed = 1;
+        }
+    }
+    if(sim_stats.errors != 0){
+        printf("FAIL: %u simulator errors\n", sim_stats.errors);
+        failed = 1;
+    }
+    free(load->motion.bins);
+    free(load->clicks.bins);
+    free(load);
+    return failed;
+}
@@ -0,0 +1,903 @@
+/**
+ * @file nrf_model.c
+ * @name Register-level model of the nRF52840 USBD, POWER, CLOCK, GPIO, GPIOTE, TIMER3, PPI and NVIC blocks.
+ *
+ * The firmware reads and writes the register pages below as plain memory.
+ * sim_step() runs between firmware calls (and inside firmware busy-wait
+ * loops) and reacts to what was written: TASKS_* registers start DMA or
+ * control stages, INTENSET/INTENCLR update the interrupt mask, and
+ * NVIC set-pending writes are latched. Interrupts are level triggered:
+ * an enabled EVENTS_* register that is still set keeps the IRQ pending.
+ *
+ * The button peripherals act on the write itself (sim_reg_write): TIMER3
+ * tasks, PPI CHENSET / CHENCLR and every INTENSET / INTENCLR. A pin driven
+ * with sim_gpio_set raises the GPIOTE events configured for it, and PPI
+ * starts the TIMER3 task connected to such an event right away.
+ *
+ * Write-1-to-clear registers (EVENTCAUSE, EPDATASTATUS) cannot be observed
+ * as plain memory. The model treats their bits as consumed once the
+ * firmware has cleared the event that reported them (USBEVENT, EPDATA).
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <nrf_model.h>
+
+/** @brief register pages */
+volatile uint32_t sim_usbd_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_power_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_nvic_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_errata_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_dwt_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_p0_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_gpiote_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_timer3_regs[SIM_PAGE_WORDS];
+volatile uint32_t sim_ppi_regs[SIM_PAGE_WORDS];
+
+uint64_t sim_time_ns = 0;
+int sim_verbose = 0;
+sim_stats_t sim_stats;
+
+sim_ep_buf_t sim_ep_in[SIM_NUM_EP];
+sim_ep_buf_t sim_ep_out[SIM_NUM_EP];
+int sim_ep0_status = 0;
+int sim_ep0_rcvout = 0;
+int sim_ep0_stall = 0;
+int sim_remote_wakeup = 0;
+
+/** @brief register offsets the model reacts to, taken from the firmware's register blocks */
+#define USBD_TASKS_STARTEPIN(n) (offsetof(usbd_regs_t, TASKS_STARTEPIN) + (n) * 4)
+#define USBD_TASKS_STARTEPOUT(n) (offsetof(usbd_regs_t, TASKS_STARTEPOUT) + (n) * 4)
+#define USBD_TASKS_EP0RCVOUT offsetof(usbd_regs_t, TASKS_EP0RCVOUT)
+#define USBD_TASKS_EP0STATUS offsetof(usbd_regs_t, TASKS_EP0STATUS)
+#define USBD_TASKS_EP0STALL offsetof(usbd_regs_t, TASKS_EP0STALL)
+#define USBD_TASKS_DPDMDRIVE offsetof(usbd_regs_t, TASKS_DPDMDRIVE)
+#define USBD_EV_ENDEPIN(n) (offsetof(usbd_regs_t, EVENTS_ENDEPIN) + (n) * 4)
+#define USBD_EV_ENDEPOUT(n) (offsetof(usbd_regs_t, EVENTS_ENDEPOUT) + (n) * 4)
+#define USBD_EV_USBEVENT offsetof(usbd_regs_t, EVENTS_USBEVENT)
+#define USBD_EV_EPDATA offsetof(usbd_regs_t, EVENTS_EPDATA)
+#define USBD_INTEN offsetof(usbd_regs_t, INTEN)
+#define USBD_INTENSET offsetof(usbd_regs_t, INTENSET)
+#define USBD_INTENCLR offsetof(usbd_regs_t, INTENCLR)
+#define USBD_EVENTCAUSE offsetof(usbd_regs_t, EVENTCAUSE)
+#define USBD_EPDATASTATUS offsetof(usbd_regs_t, EPDATASTATUS)
+#define USBD_ENABLE offsetof(usbd_regs_t, ENABLE)
+#define USBD_USBPULLUP offsetof(usbd_regs_t, USBPULLUP)
+#define USBD_EPINEN offsetof(usbd_regs_t, EPINEN)
+#define USBD_DPDMVALUE offsetof(usbd_regs_t, DPDMVALUE)
+#define USBD_LOWPOWER offsetof(usbd_regs_t, LOWPOWER)
+#define USBD_EPIN_PTR(n) (offsetof(usbd_regs_t, EPIN) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, PTR))
+#define USBD_EPIN_MAXCNT(n) (offsetof(usbd_regs_t, EPIN) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, MAXCNT))
+#define USBD_EPIN_AMOUNT(n) (offsetof(usbd_regs_t, EPIN) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, AMOUNT))
+#define USBD_EPOUT_PTR(n) (offsetof(usbd_regs_t, EPOUT) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, PTR))
+#define USBD_EPOUT_MAXCNT(n) (offsetof(usbd_regs_t, EPOUT) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, MAXCNT))
+#define USBD_EPOUT_AMOUNT(n) (offsetof(usbd_regs_t, EPOUT) + (n) * sizeof(usbd_dma_regs_t) + offsetof(usbd_dma_regs_t, AMOUNT))
+#define CLOCK_TASKS_HFCLKSTART offsetof(clock_regs_t, TASKS_HFCLKSTART)
+#define CLOCK_TASKS_HFCLKSTOP offsetof(clock_regs_t, TASKS_HFCLKSTOP)
+#define CLOCK_EV_HFCLKSTARTED offsetof(clock_regs_t, EVENTS_HFCLKSTARTED)
+#define CLOCK_HFCLKSTAT offsetof(clock_regs_t, HFCLKSTAT)
+#define POWER_EV_USBDETECTED offsetof(power_regs_t, EVENTS_USBDETECTED)
+#define POWER_EV_USBREMOVED offsetof(power_regs_t, EVENTS_USBREMOVED)
+#define POWER_EV_USBPWRRDY offsetof(power_regs_t, EVENTS_USBPWRRDY)
+#define POWER_INTENSET offsetof(power_regs_t, INTENSET)
+#define POWER_INTENCLR offsetof(power_regs_t, INTENCLR)
+#define POWER_USBREGSTATUS offsetof(power_regs_t, USBREGSTATUS)
+#define P0_IN offsetof(gpio_regs_t, IN)
+#define GPIOTE_EV_IN(n) (offsetof(gpiote_regs_t, EVENTS_IN) + (n) * 4)
+#define GPIOTE_CONFIG(n) (offsetof(gpiote_regs_t, CONFIG) + (n) * 4)
+#define TIMER_TASKS_START offsetof(timer_regs_t, TASKS_START)
+#define TIMER_TASKS_STOP offsetof(timer_regs_t, TASKS_STOP)
+#define TIMER_TASKS_CLEAR offsetof(timer_regs_t, TASKS_CLEAR)
+#define TIMER_TASKS_CAPTURE(n) (offsetof(timer_regs_t, TASKS_CAPTURE) + (n) * 4)
+#define TIMER_EV_COMPARE(n) (offsetof(timer_regs_t, EVENTS_COMPARE) + (n) * 4)
+#define TIMER_BITMODE offsetof(timer_regs_t, BITMODE)
+#define TIMER_PRESCALER offsetof(timer_regs_t, PRESCALER)
+#define TIMER_CC(n) (offsetof(timer_regs_t, CC) + (n) * 4)
+#define PPI_CHEN offsetof(ppi_regs_t, CHEN)
+#define PPI_CHENSET offsetof(ppi_regs_t, CHENSET)
+#define PPI_CHENCLR offsetof(ppi_regs_t, CHENCLR)
+#define PPI_EEP(n) (offsetof(ppi_regs_t, CH) + (n) * sizeof(ppi_ch_regs_t) + offsetof(ppi_ch_regs_t, EEP))
+#define PPI_TEP(n) (offsetof(ppi_regs_t, CH) + (n) * sizeof(ppi_ch_regs_t) + offsetof(ppi_ch_regs_t, TEP))
+#define NVIC_ISER0 0x100
+#define NVIC_ISER1 0x104
+#define NVIC_ISPR0 0x200
+#define NVIC_ISPR1 0x204
+#define NVIC_ICPR0 0x280
+#define NVIC_ICPR1 0x284
+#define SCS_DEMCR 0xDFC
+#define DWT_CTRL 0x000
+#define DWT_CYCCNT 0x004
+
+/** @brief EVENTCAUSE bits */
+#define EVENTCAUSE_SUSPEND (1 << 8)
+#define EVENTCAUSE_RESUME (1 << 9)
+#define EVENTCAUSE_USBWUALLOWED (1 << 10)
+#define EVENTCAUSE_READY (1 << 11)
+/** @brief DPDMVALUE.STATE Resume */
+#define DPDMVALUE_RESUME 0x1
+/** @brief POWER_CLOCK is IRQ 0, USBD is IRQ 39 */
+#define IRQ_POWER_CLOCK_BIT (1 << 0)
+#define IRQ_USBD_BIT (1 << 7)
+/** @brief GPIOTE is IRQ 6, TIMER3 is IRQ 26 */
+#define IRQ_GPIOTE_BIT (1 << 6)
+#define IRQ_TIMER3_BIT (1 << 26)
+/** @brief SWI0_EGU0 is IRQ 20, at the lowest priority (the deferred log) */
+#define IRQ_SWI0_BIT (1 << 20)
+/** @brief give up when the handlers keep being re-entered (an event is never cleared) */
+#define SIM_IRQ_STORM_LIMIT 100000
+
+/** @brief EasyDMA handles: upper bits tag the handle, lower bits index dma_ptrs */
+#define SIM_DMA_TAG 0x20000000
+#define SIM_DMA_HANDLES 256
+static const volatile void* dma_ptrs[SIM_DMA_HANDLES];
+static uint32_t dma_count = 0;
+
+/** @brief pending timers */
+#define SIM_TIMERS 16
+typedef struct{
+    int used;
+    uint64_t due;
+    void (*fire)();
+}sim_timer_t;
+static sim_timer_t timers[SIM_TIMERS];
+
+/** @brief GPIOTE channels, TIMER3 CC registers and PPI channels */
+#define SIM_GPIOTE_CHANNELS 8
+#define SIM_TIMER_CC 6
+#define SIM_PPI_CHANNELS 20
+
+/** @brief model state derived from the registers */
+static uint32_t usbd_inten = 0;
+static uint32_t power_inten = 0;
+static uint32_t gpiote_inten = 0;
+static uint32_t timer3_inten = 0;
+/** @brief TIMER3: running, counter value at timer3_base_ns, and counter at the last compare check */
+static int timer3_running = 0;
+static uint64_t timer3_base_ns = 0;
+static uint32_t timer3_held = 0;
+static uint32_t timer3_checked = 0;
+static uint32_t nvic_pending0 = 0;
+static uint32_t nvic_pending1 = 0;
+static int usbd_enabled = 0;
+static int usbd_is_ready = 0;
+static int pullup_on = 0;
+static int vbus = 0;
+static int in_irq = 0;
+/** @brief bus suspended by the host, USBD in low power, and when those started */
+static int bus_suspended = 0;
+static int usbd_lowpower = 0;
+static uint64_t suspended_at = 0;
+static uint64_t hfclk_stopped_at = 0;
+
+/** @name sim_error
+ * @brief Reports a model error and counts it
+*/
+void sim_error(const char* fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "[sim %10.3f ms] error: ", sim_time_ns / 1e6);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    sim_stats.errors++;
+}
+
+/** @name write_only
+ * @brief Whether a register only takes writes: TASKS_* and INTENSET / INTENCLR of USBD, POWER, CLOCK, GPIOTE, TIMER3 and PPI
+*/
+static int write_only(const volatile uint32_t* reg){
+    const volatile uint32_t* pages[5] = {sim_usbd_regs, sim_power_regs, sim_gpiote_regs, sim_timer3_regs, sim_ppi_regs};
+    for(uint32_t i = 0; i < 5; i++){
+        if(reg >= pages[i] && reg < pages[i] + SIM_PAGE_WORDS){
+            uint32_t offset = (uint32_t)(reg - pages[i]) * 4;
+            return offset < 0x100 || offset == offsetof(usbd_regs_t, INTENSET) || offset == offsetof(usbd_regs_t, INTENCLR);
+        }
+    }
+    return 0;
+}
+
+/** @name sim_reg_read
+ * @brief REG_READ backend: counts the access and rejects reads of write-only registers
+*/
+uint32_t sim_reg_read(const volatile uint32_t* reg){
+    sim_stats.reg_reads++;
+    if(write_only(reg)){
+        sim_error("firmware read a write-only register (TASKS_*, INTENSET or INTENCLR)");
+    }
+    return *reg;
+}
+
+/** @name write_inten
+ * @brief Applies a write to INTENSET / INTENCLR of a page right away
+ * @return 1 if reg is one of them
+*/
+static int write_inten(volatile uint32_t* page, uint32_t* inten, volatile uint32_t* reg, uint32_t value){
+    if(reg == &SIM_REG(page, USBD_INTENSET)){
+        *inten |= value;
+    }else if(reg == &SIM_REG(page, USBD_INTENCLR)){
+        *inten &= ~value;
+    }else{
+        return 0;
+    }
+    SIM_REG(page, USBD_INTEN) = *inten;
+    SIM_REG(page, USBD_INTENSET) = *inten;
+    return 1;
+}
+
+/** @name timer3_count
+ * @brief TIMER3 counter now (16 MHz / 2^PRESCALER, cut to BITMODE)
+*/
+static uint32_t timer3_count(){
+    static const uint32_t masks[4] = {0xFFFF, 0xFF, 0xFFFFFF, 0xFFFFFFFF};
+    uint64_t ticks = 0;
+    if(timer3_running){
+        ticks = ((sim_time_ns - timer3_base_ns) * 16 / 1000) >> (SIM_REG(sim_timer3_regs, TIMER_PRESCALER) & 0xF);
+    }
+    return (uint32_t)(timer3_held + ticks) & masks[SIM_REG(sim_timer3_regs, TIMER_BITMODE) & 0x3];
+}
+
+/** @name timer3_task
+ * @brief Starts a TIMER3 task (written by the firmware or through PPI)
+*/
+static void timer3_task(uint32_t offset){
+    if(offset == TIMER_TASKS_START && !timer3_running){
+        timer3_running = 1;
+        timer3_base_ns = sim_time_ns;
+    }else if(offset == TIMER_TASKS_STOP && timer3_running){
+        timer3_held = timer3_count();
+        timer3_running = 0;
+    }else if(offset == TIMER_TASKS_CLEAR){
+        timer3_held = 0;
+        timer3_base_ns = sim_time_ns;
+        timer3_checked = 0;
+    }else if(offset >= TIMER_TASKS_CAPTURE(0) && offset < TIMER_TASKS_CAPTURE(SIM_TIMER_CC)){
+        SIM_REG(sim_timer3_regs, TIMER_CC((offset - TIMER_TASKS_CAPTURE(0)) / 4)) = timer3_count();
+    }else if(offset != TIMER_TASKS_START && offset != TIMER_TASKS_STOP){
+        sim_error("TIMER3 task 0x%03x is not modelled", offset);
+    }
+}
+
+/** @name sim_reg_write
+ * @brief REG_WRITE backend: counts the access
+ * @note  INTENSET / INTENCLR act on every write, not on the value left in
+ *        the page: POWER and CLOCK share theirs and are written back to back.
+ *        TIMER3 tasks and PPI CHENSET / CHENCLR act right away as well (the
+ *        firmware reads a captured CC straight after triggering the capture),
+ *        and NVIC ISER bits accumulate.
+*/
+void sim_reg_write(volatile uint32_t* reg, uint32_t value){
+    sim_stats.reg_writes++;
+    if(write_inten(sim_usbd_regs, &usbd_inten, reg, value) || write_inten(sim_power_regs, &power_inten, reg, value) ||
+       write_inten(sim_gpiote_regs, &gpiote_inten, reg, value) || write_inten(sim_timer3_regs, &timer3_inten, reg, value)){
+        return;
+    }
+    if(reg >= sim_timer3_regs && reg < &SIM_REG(sim_timer3_regs, 0x100)){
+        if(value != 0){
+            timer3_task((uint32_t)(reg - sim_timer3_regs) * 4);
+        }
+        return;
+    }
+    if(reg == &SIM_REG(sim_nvic_regs, NVIC_ISER0) || reg == &SIM_REG(sim_nvic_regs, NVIC_ISER1)){
+        // write 1 to enable: usbd.c, usbd_log.c and gpio_buttons.c each enable their own IRQs
+        *reg |= value;
+        return;
+    }
+    if(reg == &SIM_REG(sim_ppi_regs, PPI_CHENSET)){
+        SIM_REG(sim_ppi_regs, PPI_CHEN) |= value;
+        return;
+    }
+    if(reg == &SIM_REG(sim_ppi_regs, PPI_CHENCLR)){
+        SIM_REG(sim_ppi_regs, PPI_CHEN) &= ~value;
+        return;
+    }
+    *reg = value;
+}
+
+/** @name printk
+ * @brief Kernel printk, only printed with sim_verbose
+*/
+int printk(const char* fmt, ...){
+    if(!sim_verbose){
+        return 0;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vprintf(fmt, args);
+    va_end(args);
+    return n;
+}
+
+/** @name breakpoint
+ * @brief The firmware reached code it does not expect to run
+*/
+void breakpoint(){
+    sim_error("firmware hit breakpoint()");
+}
+
+/** @name sim_dma_addr
+ * @brief Turns a host pointer into a 32-bit EasyDMA address
+*/
+uint32_t sim_dma_addr(const volatile void* ptr){
+    for(uint32_t i = 0; i < dma_count; i++){
+        if(dma_ptrs[i] == ptr){
+            return SIM_DMA_TAG | i;
+        }
+    }
+    if(dma_count == SIM_DMA_HANDLES){
+        sim_error("out of DMA handles");
+        return 0;
+    }
+    dma_ptrs[dma_count] = ptr;
+    return SIM_DMA_TAG | dma_count++;
+}
+
+/** @name sim_dma_ptr
+ * @brief Resolves an EasyDMA address back into the host pointer
+*/
+void* sim_dma_ptr(uint32_t addr){
+    uint32_t i = addr & ~SIM_DMA_TAG;
+    if((addr & SIM_DMA_TAG) == 0 || i >= dma_count){
+        sim_error("EasyDMA PTR 0x%08x does not point to RAM", addr);
+        return 0;
+    }
+    return (void*)dma_ptrs[i];
+}
+
+/** @name sim_schedule
+ * @brief Calls fire() after delay_ns of simulated time
+*/
+void sim_schedule(uint64_t delay_ns, void (*fire)()){
+    for(int i = 0; i < SIM_TIMERS; i++){
+        if(!timers[i].used){
+            timers[i].used = 1;
+            timers[i].due = sim_time_ns + delay_ns;
+            timers[i].fire = fire;
+            return;
+        }
+    }
+    sim_error("out of timers");
+}
+
+/** @name sim_usbd_event
+ * @brief Raises a USBD event
+*/
+void sim_usbd_event(uint32_t offset){
+    SIM_REG(sim_usbd_regs, offset) = 1;
+}
+
+/** @name sim_power_event
+ * @brief Raises a POWER / CLOCK event
+*/
+void sim_power_event(uint32_t offset){
+    SIM_REG(sim_power_regs, offset) = 1;
+}
+
+/** @name ppi_event
+ * @brief Starts the tasks of the enabled PPI channels whose event end point is event
+*/
+static void ppi_event(volatile uint32_t* event){
+    uint32_t enabled = SIM_REG(sim_ppi_regs, PPI_CHEN);
+    for(uint32_t ch = 0; ch < SIM_PPI_CHANNELS; ch++){
+        if((enabled & (1u << ch)) == 0 || SIM_REG(sim_ppi_regs, PPI_EEP(ch)) == 0 ||
+           sim_dma_ptr(SIM_REG(sim_ppi_regs, PPI_EEP(ch))) != event){
+            continue;
+        }
+        volatile uint32_t* task = sim_dma_ptr(SIM_REG(sim_ppi_regs, PPI_TEP(ch)));
+        if(task >= sim_timer3_regs && task < &SIM_REG(sim_timer3_regs, 0x100)){
+            timer3_task((uint32_t)(task - sim_timer3_regs) * 4);
+        }else{
+            sim_error("PPI channel %u: task end point is not modelled", ch);
+        }
+    }
+}
+
+/** @name sim_gpio_set
+ * @brief Drives a P0 input pin, raising the GPIOTE events configured for its edge
+*/
+void sim_gpio_set(uint32_t pin, int level){
+    uint32_t bit = 1u << pin;
+    uint32_t in = SIM_REG(sim_p0_regs, P0_IN);
+    if(((in & bit) != 0) == (level != 0)){
+        return;
+    }
+    SIM_REG(sim_p0_regs, P0_IN) = level ? (in | bit) : (in & ~bit);
+    for(uint32_t n = 0; n < SIM_GPIOTE_CHANNELS; n++){
+        uint32_t config = SIM_REG(sim_gpiote_regs, GPIOTE_CONFIG(n));
+        // MODE Event on this pin of P0; POLARITY 1 LoToHi, 2 HiToLo, 3 Toggle
+        uint32_t polarity = (config >> 16) & 0x3;
+        if((config & 0x3) != 0x1 || ((config >> 8) & 0x3F) != pin ||
+           !(polarity == 3 || (polarity == 1 && level) || (polarity == 2 && !level))){
+            continue;
+        }
+        SIM_REG(sim_gpiote_regs, GPIOTE_EV_IN(n)) = 1;
+        ppi_event(&SIM_REG(sim_gpiote_regs, GPIOTE_EV_IN(n)));
+    }
+}
+
+/** @name timer3_compare
+ * @brief Raises COMPARE[n] for every CC the counter reached since the last check
+*/
+static void timer3_compare(){
+    uint32_t now = timer3_count();
+    for(uint32_t n = 0; n < SIM_TIMER_CC; n++){
+        uint32_t cc = SIM_REG(sim_timer3_regs, TIMER_CC(n));
+        if(cc - timer3_checked - 1 < now - timer3_checked){
+            SIM_REG(sim_timer3_regs, TIMER_EV_COMPARE(n)) = 1;
+        }
+    }
+    timer3_checked = now;
+}
+
+/** @name timer3_next_ns
+ * @brief Simulated time at which the next enabled compare is due, UINT64_MAX if none
+*/
+static uint64_t timer3_next_ns(){
+    uint64_t next = UINT64_MAX;
+    if(!timer3_running){
+        return next;
+    }
+    uint32_t now = timer3_count();
+    for(uint32_t n = 0; n < SIM_TIMER_CC; n++){
+        if((timer3_inten & (1u << (16 + n))) == 0){
+            continue;
+        }
+        uint64_t ticks = SIM_REG(sim_timer3_regs, TIMER_CC(n)) - now;
+        uint64_t tick_ns16 = 1000ull << (SIM_REG(sim_timer3_regs, TIMER_PRESCALER) & 0xF);
+        uint64_t due = sim_time_ns + (ticks * tick_ns16 + 15) / 16;
+        if(ticks != 0 && due < next){
+            next = due;
+        }
+    }
+    return next;
+}
+
+/** @name sim_hfclk_running
+ * @brief 1 while the HFCLK is running
+*/
+int sim_hfclk_running(){
+    return (SIM_REG(sim_power_regs, CLOCK_HFCLKSTAT) & (1 << 16)) != 0;
+}
+
+/** @name hfclk_off_time
+ * @brief Adds the time since the HFCLK stopped to hfclk_off_ns (only counted while suspended)
+*/
+static void hfclk_off_time(){
+    if(bus_suspended && !sim_hfclk_running()){
+        uint64_t from = hfclk_stopped_at > suspended_at ? hfclk_stopped_at : suspended_at;
+        sim_stats.hfclk_off_ns += sim_time_ns - from;
+    }
+    hfclk_stopped_at = sim_time_ns;
+}
+
+/** @brief timer callbacks */
+static void hfclk_started(){
+    hfclk_off_time();
+    SIM_REG(sim_power_regs, CLOCK_HFCLKSTAT) = (1 << 16) | 1;
+    sim_power_event(CLOCK_EV_HFCLKSTARTED);
+}
+
+static void wakeup_allowed(){
+    if(!bus_suspended || usbd_lowpower){
+        return;
+    }
+    SIM_REG(sim_usbd_regs, USBD_EVENTCAUSE) |= EVENTCAUSE_USBWUALLOWED;
+    sim_usbd_event(USBD_EV_USBEVENT);
+}
+
+static void usbd_ready(){
+    if(!usbd_enabled){
+        return;
+    }
+    usbd_is_ready = 1;
+    SIM_REG(sim_usbd_regs, USBD_EVENTCAUSE) |= EVENTCAUSE_READY;
+    sim_usbd_event(USBD_EV_USBEVENT);
+}
+
+static void usb_power_ready(){
+    if(!vbus){
+        return;
+    }
+    SIM_REG(sim_power_regs, POWER_USBREGSTATUS) |= 0x2;
+    sim_power_event(POWER_EV_USBPWRRDY);
+}
+
+/** @name sim_reset
+ * @brief Clears every register, buffer, timer and counter
+*/
+void sim_reset(){
+    memset((void*)sim_usbd_regs, 0, sizeof(sim_usbd_regs));
+    memset((void*)sim_power_regs, 0, sizeof(sim_power_regs));
+    memset((void*)sim_nvic_regs, 0, sizeof(sim_nvic_regs));
+    memset((void*)sim_errata_regs, 0, sizeof(sim_errata_regs));
+    memset((void*)sim_dwt_regs, 0, sizeof(sim_dwt_regs));
+    memset((void*)sim_p0_regs, 0, sizeof(sim_p0_regs));
+    memset((void*)sim_gpiote_regs, 0, sizeof(sim_gpiote_regs));
+    memset((void*)sim_timer3_regs, 0, sizeof(sim_timer3_regs));
+    memset((void*)sim_ppi_regs, 0, sizeof(sim_ppi_regs));
+    // nothing drives the pins: the pull-ups keep them high (buttons released)
+    SIM_REG(sim_p0_regs, P0_IN) = 0xFFFFFFFF;
+    memset(sim_ep_in, 0, sizeof(sim_ep_in));
+    memset(sim_ep_out, 0, sizeof(sim_ep_out));
+    memset(timers, 0, sizeof(timers));
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim_ep0_status = 0;
+    sim_ep0_rcvout = 0;
+    sim_ep0_stall = 0;
+    sim_remote_wakeup = 0;
+    bus_suspended = 0;
+    usbd_lowpower = 0;
+    suspended_at = 0;
+    hfclk_stopped_at = 0;
+    usbd_inten = 0;
+    power_inten = 0;
+    gpiote_inten = 0;
+    timer3_inten = 0;
+    timer3_running = 0;
+    timer3_base_ns = 0;
+    timer3_held = 0;
+    timer3_checked = 0;
+    nvic_pending0 = 0;
+    nvic_pending1 = 0;
+    usbd_enabled = 0;
+    usbd_is_ready = 0;
+    pullup_on = 0;
+    vbus = 0;
+    sim_time_ns = 0;
+}
+
+/** @name sim_vbus_detect
+ * @brief Cable plugged in: USBDETECTED now, USBPWRRDY once the regulator is up
+*/
+void sim_vbus_detect(){
+    vbus = 1;
+    SIM_REG(sim_power_regs, POWER_USBREGSTATUS) = 0x1;
+    sim_power_event(POWER_EV_USBDETECTED);
+    sim_schedule(SIM_USBPWRRDY_NS, usb_power_ready);
+}
+
+/** @name sim_vbus_remove
+ * @brief Cable removed
+*/
+void sim_vbus_remove(){
+    vbus = 0;
+    SIM_REG(sim_power_regs, POWER_USBREGSTATUS) = 0;
+    sim_power_event(POWER_EV_USBREMOVED);
+}
+
+/** @name sim_bus_suspend
+ * @brief No SOF for 3 ms: the USBD reports SUSPEND
+*/
+void sim_bus_suspend(){
+    bus_suspended = 1;
+    suspended_at = sim_time_ns;
+    hfclk_stopped_at = sim_time_ns;
+    SIM_REG(sim_usbd_regs, USBD_EVENTCAUSE) |= EVENTCAUSE_SUSPEND;
+    sim_usbd_event(USBD_EV_USBEVENT);
+}
+
+/** @name sim_bus_resume
+ * @brief The host has driven resume signalling: the USBD reports RESUME
+*/
+void sim_bus_resume(){
+    hfclk_off_time();
+    sim_stats.suspended_ns += sim_time_ns - suspended_at;
+    bus_suspended = 0;
+    sim_remote_wakeup = 0;
+    SIM_REG(sim_usbd_regs, USBD_EVENTCAUSE) |= EVENTCAUSE_RESUME;
+    sim_usbd_event(USBD_EV_USBEVENT);
+}
+
+/** @name sim_pullup
+ * @brief 1 while the device is visible on the bus
+*/
+int sim_pullup(){
+    return vbus && usbd_enabled && SIM_REG(sim_usbd_regs, USBD_USBPULLUP) == 1;
+}
+
+/** @name update_inten
+ * @brief Applies INTENSET / INTENCLR writes (set bits accumulate, clear bits win)
+*/
+static void update_inten(volatile uint32_t* page, uint32_t* inten, uint32_t set_offset, uint32_t clr_offset){
+    uint32_t set = SIM_REG(page, set_offset);
+    uint32_t clr = SIM_REG(page, clr_offset);
+    *inten |= set;
+    if(clr != 0){
+        *inten &= ~clr;
+        SIM_REG(page, clr_offset) = 0;
+    }
+    SIM_REG(page, set_offset) = *inten;
+    SIM_REG(page, set_offset - 4) = *inten;
+}
+
+/** @name ep_in_dma
+ * @brief TASKS_STARTEPIN[n]: copy MAXCNT bytes from RAM into the endpoint buffer
+*/
+static void ep_in_dma(uint32_t n){
+    uint32_t size = SIM_REG(sim_usbd_regs, USBD_EPIN_MAXCNT(n));
+    if(!sim_hfclk_running() || usbd_lowpower){
+        sim_error("STARTEPIN%u without HFCLK or in low power", n);
+    }
+    if(n != 0 && (SIM_REG(sim_usbd_regs, USBD_EPINEN) & (1 << n)) == 0){
+        sim_error("STARTEPIN%u on a disabled endpoint", n);
+    }
+    if(size > sizeof(sim_ep_in[n].data)){
+        sim_error("EPIN%u MAXCNT %u is larger than the endpoint buffer", n, size);
+        size = sizeof(sim_ep_in[n].data);
+    }
+    if(sim_ep_in[n].full){
+        sim_error("STARTEPIN%u while the host has not read the previous packet", n);
+    }
+    uint8_t* src = sim_dma_ptr(SIM_REG(sim_usbd_regs, USBD_EPIN_PTR(n)));
+    if(src != 0){
+        memcpy(sim_ep_in[n].data, src, size);
+    }
+    sim_ep_in[n].len = size;
+    sim_ep_in[n].full = 1;
+    SIM_REG(sim_usbd_regs, USBD_EPIN_AMOUNT(n)) = size;
+    sim_usbd_event(USBD_EV_ENDEPIN(n));
+}
+
+/** @name ep_out_dma
+ * @brief TASKS_STARTEPOUT[n]: copy what the host sent into RAM
+*/
+static void ep_out_dma(uint32_t n){
+    uint32_t size = SIM_REG(sim_usbd_regs, USBD_EPOUT_MAXCNT(n));
+    if(!sim_hfclk_running() || usbd_lowpower){
+        sim_error("STARTEPOUT%u without HFCLK or in low power", n);
+    }
+    if(size > sim_ep_out[n].len){
+        size = sim_ep_out[n].len;
+    }
+    uint8_t* dst = sim_dma_ptr(SIM_REG(sim_usbd_regs, USBD_EPOUT_PTR(n)));
+    if(dst != 0){
+        memcpy(dst, sim_ep_out[n].data, size);
+    }
+    sim_ep_out[n].full = 0;
+    SIM_REG(sim_usbd_regs, USBD_EPOUT_AMOUNT(n)) = size;
+    sim_usbd_event(USBD_EV_ENDEPOUT(n));
+}
+
+/** @name sim_step
+ * @brief Processes register writes done by the firmware and fires due timers
+*/
+void sim_step(){
+    // cycle counter
+    if((SIM_REG(sim_nvic_regs, SCS_DEMCR) & (1 << 24)) && (SIM_REG(sim_dwt_regs, DWT_CTRL) & 1)){
+        SIM_REG(sim_dwt_regs, DWT_CYCCNT) = (uint32_t)SIM_NS_TO_CYCLES(sim_time_ns);
+    }
+
+    // timers
+    for(int i = 0; i < SIM_TIMERS; i++){
+        if(timers[i].used && timers[i].due <= sim_time_ns){
+            timers[i].used = 0;
+            timers[i].fire();
+        }
+    }
+
+    // USBD
+    int enable = (SIM_REG(sim_usbd_regs, USBD_ENABLE) & 1);
+    if(enable && !usbd_enabled){
+        usbd_enabled = 1;
+        sim_schedule(SIM_USBD_READY_NS, usbd_ready);
+    }else if(!enable && usbd_enabled){
+        usbd_enabled = 0;
+        usbd_is_ready = 0;
+    }
+    // the pull-up may only be enabled once the USBD is READY, the regulator is up and the HFCLK runs
+    int pullup = (SIM_REG(sim_usbd_regs, USBD_USBPULLUP) & 1);
+    if(pullup && !pullup_on && (!usbd_is_ready || !sim_hfclk_running() ||
+       (SIM_REG(sim_power_regs, POWER_USBREGSTATUS) & 0x2) == 0)){
+        sim_error("pull-up enabled before READY, USBPWRRDY and HFCLKSTARTED");
+    }
+    pullup_on = pullup;
+    update_inten(sim_usbd_regs, &usbd_inten, USBD_INTENSET, USBD_INTENCLR);
+    // EasyDMA runs one transfer at a time: the firmware must wait for END before the next START
+    uint32_t dma_starts = 0;
+    for(uint32_t n = 0; n < SIM_NUM_EP; n++){
+        dma_starts += (SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPIN(n)) != 0);
+        dma_starts += (SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPOUT(n)) != 0);
+    }
+    if(dma_starts > 1){
+        sim_error("%u EasyDMA transfers started at once", dma_starts);
+    }
+    for(uint32_t n = 0; n < SIM_NUM_EP; n++){
+        if(SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPIN(n))){
+            SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPIN(n)) = 0;
+            ep_in_dma(n);
+        }
+        if(SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPOUT(n))){
+            SIM_REG(sim_usbd_regs, USBD_TASKS_STARTEPOUT(n)) = 0;
+            ep_out_dma(n);
+        }
+    }
+    if(SIM_REG(sim_usbd_regs, USBD_TASKS_EP0RCVOUT)){
+        SIM_REG(sim_usbd_regs, USBD_TASKS_EP0RCVOUT) = 0;
+        sim_ep0_rcvout = 1;
+    }
+    if(SIM_REG(sim_usbd_regs, USBD_TASKS_EP0STATUS)){
+        SIM_REG(sim_usbd_regs, USBD_TASKS_EP0STATUS) = 0;
+        sim_ep0_status = 1;
+    }
+    if(SIM_REG(sim_usbd_regs, USBD_TASKS_EP0STALL)){
+        SIM_REG(sim_usbd_regs, USBD_TASKS_EP0STALL) = 0;
+        sim_ep0_stall = 1;
+    }
+    // low power: only allowed on a suspended bus; leaving it there allows a remote wakeup
+    int lowpower = (SIM_REG(sim_usbd_regs, USBD_LOWPOWER) & 1);
+    if(lowpower && !usbd_lowpower){
+        usbd_lowpower = 1;
+        if(!bus_suspended){
+            sim_error("USBD put in low power while the bus is not suspended");
+        }
+    }else if(!lowpower && usbd_lowpower){
+        usbd_lowpower = 0;
+        if(bus_suspended){
+            sim_schedule(SIM_WUALLOWED_NS, wakeup_allowed);
+        }
+    }
+    if(SIM_REG(sim_usbd_regs, USBD_TASKS_DPDMDRIVE)){
+        SIM_REG(sim_usbd_regs, USBD_TASKS_DPDMDRIVE) = 0;
+        if(SIM_REG(sim_usbd_regs, USBD_DPDMVALUE) != DPDMVALUE_RESUME || !bus_suspended || usbd_lowpower){
+            sim_error("DPDMDRIVE is only a remote wakeup on a suspended bus, out of low power, with DPDMVALUE Resume");
+        }else{
+            sim_remote_wakeup = 1;
+        }
+    }
+    // write-1-to-clear registers: consumed together with the event that reported them
+    if(SIM_REG(sim_usbd_regs, USBD_EV_USBEVENT) == 0){
+        SIM_REG(sim_usbd_regs, USBD_EVENTCAUSE) = 0;
+    }
+    if(SIM_REG(sim_usbd_regs, USBD_EV_EPDATA) == 0){
+        SIM_REG(sim_usbd_regs, USBD_EPDATASTATUS) = 0;
+    }
+
+    // POWER and CLOCK
+    update_inten(sim_power_regs, &power_inten, POWER_INTENSET, POWER_INTENCLR);
+    if(SIM_REG(sim_power_regs, CLOCK_TASKS_HFCLKSTART)){
+        SIM_REG(sim_power_regs, CLOCK_TASKS_HFCLKSTART) = 0;
+        if((SIM_REG(sim_power_regs, CLOCK_HFCLKSTAT) & (1 << 16)) == 0){
+            sim_schedule(SIM_HFCLK_STARTUP_NS, hfclk_started);
+        }else{
+            sim_power_event(CLOCK_EV_HFCLKSTARTED);
+        }
+    }
+    if(SIM_REG(sim_power_regs, CLOCK_TASKS_HFCLKSTOP)){
+        SIM_REG(sim_power_regs, CLOCK_TASKS_HFCLKSTOP) = 0;
+        if(sim_hfclk_running()){
+            hfclk_stopped_at = sim_time_ns;
+        }
+        SIM_REG(sim_power_regs, CLOCK_HFCLKSTAT) = 0;
+    }
+
+    // TIMER3
+    timer3_compare();
+
+    // NVIC
+    nvic_pending0 |= SIM_REG(sim_nvic_regs, NVIC_ISPR0);
+    nvic_pending1 |= SIM_REG(sim_nvic_regs, NVIC_ISPR1);
+    nvic_pending0 &= ~SIM_REG(sim_nvic_regs, NVIC_ICPR0);
+    nvic_pending1 &= ~SIM_REG(sim_nvic_regs, NVIC_ICPR1);
+    SIM_REG(sim_nvic_regs, NVIC_ISPR0) = 0;
+    SIM_REG(sim_nvic_regs, NVIC_ISPR1) = 0;
+    SIM_REG(sim_nvic_regs, NVIC_ICPR0) = 0;
+    SIM_REG(sim_nvic_regs, NVIC_ICPR1) = 0;
+}
+
+/** @name event_line
+ * @brief 1 if any enabled event of the page is set (EVENTS at 0x100 + 4 * bit)
+*/
+static int event_line(volatile uint32_t* page, uint32_t inten){
+    for(uint32_t bit = 0; bit < 32; bit++){
+        if((inten & (1u << bit)) && SIM_REG(page, 0x100 + bit * 4)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** @name host_ns
+ * @brief host monotonic clock, used to measure time spent in the handlers
+*/
+static uint64_t host_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** @name sim_run_irqs
+ * @brief Calls the interrupt handlers until no enabled interrupt is pending
+*/
+void sim_run_irqs(){
+    if(in_irq){
+        return;
+    }
+    for(uint32_t i = 0; i < SIM_IRQ_STORM_LIMIT; i++){
+        sim_step();
+        int power = event_line(sim_power_regs, power_inten) || (nvic_pending0 & IRQ_POWER_CLOCK_BIT);
+        int gpiote = event_line(sim_gpiote_regs, gpiote_inten) || (nvic_pending0 & IRQ_GPIOTE_BIT);
+        int timer3 = event_line(sim_timer3_regs, timer3_inten) || (nvic_pending0 & IRQ_TIMER3_BIT);
+        int usbd = event_line(sim_usbd_regs, usbd_inten) || (nvic_pending1 & IRQ_USBD_BIT);
+        if(power && (SIM_REG(sim_nvic_regs, NVIC_ISER0) & IRQ_POWER_CLOCK_BIT)){
+            // POWER_CLOCK (IRQ 0) wins over USBD (IRQ 39) at equal priority
+            nvic_pending0 &= ~IRQ_POWER_CLOCK_BIT;
+            in_irq = 1;
+            uint64_t start = host_ns();
+            POWER_CLOCK_IRQHandler();
+            sim_stats.irq_host_ns += host_ns() - start;
+            in_irq = 0;
+            sim_stats.power_irqs++;
+        }else if(gpiote && (SIM_REG(sim_nvic_regs, NVIC_ISER0) & IRQ_GPIOTE_BIT)){
+            // equal priority: the lower IRQ number goes first
+            nvic_pending0 &= ~IRQ_GPIOTE_BIT;
+            in_irq = 1;
+            GPIOTE_IRQHandler();
+            in_irq = 0;
+            sim_stats.button_irqs++;
+        }else if(timer3 && (SIM_REG(sim_nvic_regs, NVIC_ISER0) & IRQ_TIMER3_BIT)){
+            nvic_pending0 &= ~IRQ_TIMER3_BIT;
+            in_irq = 1;
+            TIMER3_IRQHandler();
+            in_irq = 0;
+            sim_stats.button_irqs++;
+        }else if(usbd && (SIM_REG(sim_nvic_regs, NVIC_ISER1) & IRQ_USBD_BIT)){
+            nvic_pending1 &= ~IRQ_USBD_BIT;
+            in_irq = 1;
+            uint64_t start = host_ns();
+            uint64_t regs = sim_stats.reg_reads + sim_stats.reg_writes;
+            USBD_IRQHandler();
+            sim_stats.irq_host_ns += host_ns() - start;
+            sim_stats.usbd_irq_regs += sim_stats.reg_reads + sim_stats.reg_writes - regs;
+            in_irq = 0;
+            sim_stats.usbd_irqs++;
+        }else if((nvic_pending0 & IRQ_SWI0_BIT) && (SIM_REG(sim_nvic_regs, NVIC_ISER0) & IRQ_SWI0_BIT)){
+            // lowest priority: only runs once nothing else is pending
+            nvic_pending0 &= ~IRQ_SWI0_BIT;
+            in_irq = 1;
+            SWI0_EGU0_IRQHandler();
+            in_irq = 0;
+            sim_stats.swi_irqs++;
+        }else{
+            return;
+        }
+    }
+    sim_error("interrupt storm: an enabled event is never cleared");
+}
+
+/** @name sim_spin
+ * @brief One iteration of a firmware busy-wait loop
+*/
+void sim_spin(){
+    sim_time_ns += SIM_SPIN_NS;
+    sim_stats.spins++;
+    sim_stats.spin_ns += SIM_SPIN_NS;
+    sim_step();
+}
+
+/** @name sim_advance
+ * @brief Lets ns of simulated time pass, firing timers and interrupts on the way
+*/
+void sim_advance(uint64_t ns){
+    uint64_t end = sim_time_ns + ns;
+    sim_run_irqs();
+    while(1){
+        uint64_t next = end;
+        for(int i = 0; i < SIM_TIMERS; i++){
+            if(timers[i].used && timers[i].due < next){
+                next = timers[i].due;
+            }
+        }
+        uint64_t compare = timer3_next_ns();
+        if(compare < next){
+            next = compare;
+        }
+        if(next > sim_time_ns){
+            sim_time_ns = next;
+        }
+        sim_run_irqs();
+        if(sim_time_ns >= end){
+            return;
+        }
+    }
+}
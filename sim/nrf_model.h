@@ -0,0 +1,113 @@
+/** @file   nrf_model.h
+ *  @brief  host-side model of the nRF52840 USBD, POWER, CLOCK, GPIO, GPIOTE, TIMER3, PPI and NVIC blocks
+ *  @note   Only used by the simulator. The firmware sees the same registers
+ *          through usbd.h / usbd_sim.h.
+**/
+
+#ifndef _NRF_MODEL_H_
+#define _NRF_MODEL_H_
+
+#include <usbd_sim.h>
+#include <nrf_regs.h>
+
+/** @brief access a register of a simulated page by its offset from the peripheral base */
+#define SIM_REG(page, offset) ((page)[(offset) / 4])
+
+/** @brief CPU clock; the DWT cycle counter follows simulated time at this rate */
+#define SIM_CPU_HZ 64000000ull
+
+/** @brief peripheral timing used by the model (ns) */
+#define SIM_HFCLK_STARTUP_NS 360000    // HFXO start-up after TASKS_HFCLKSTART
+#define SIM_USBD_READY_NS 100000       // USBD READY after ENABLE
+#define SIM_USBPWRRDY_NS 1000000       // USB regulator ready after VBUS was detected
+#define SIM_SPIN_NS 50                 // one iteration of a firmware busy-wait loop
+#define SIM_WUALLOWED_NS 10000         // USBWUALLOWED after LOWPOWER is cleared on a suspended bus
+
+/** @brief number of IN / OUT endpoints of the USBD (bulk/interrupt + control) */
+#define SIM_NUM_EP 8
+
+/** @brief bus side of a USBD endpoint buffer */
+typedef struct{
+    uint8_t data[64];
+    uint32_t len;
+    int full;       // IN: data waiting for the host, OUT: data waiting for the firmware
+}sim_ep_buf_t;
+
+/** @brief counters collected while the simulation runs */
+typedef struct{
+    uint64_t usbd_irqs;       // USBD_IRQHandler invocations
+    uint64_t power_irqs;      // POWER_CLOCK_IRQHandler invocations
+    uint64_t swi_irqs;        // SWI0_EGU0_IRQHandler invocations (log formatting)
+    uint64_t button_irqs;     // GPIOTE_IRQHandler and TIMER3_IRQHandler invocations (not timed)
+    uint64_t irq_host_ns;     // host CPU time spent inside both handlers
+    uint64_t spins;           // iterations of firmware busy-wait loops
+    uint64_t spin_ns;         // simulated time spent busy-waiting
+    uint32_t errors;          // model errors (bad DMA address, IRQ storm, breakpoint, ...)
+    uint64_t suspended_ns;    // time the bus was suspended
+    uint64_t hfclk_off_ns;    // ... of which the HFCLK was stopped
+    uint64_t reg_reads;       // firmware register reads (REG_READ)
+    uint64_t reg_writes;      // firmware register writes (REG_WRITE, REG_TRIGGER, REG_CLEAR)
+    uint64_t usbd_irq_regs;   // ... of which made inside USBD_IRQHandler
+}sim_stats_t;
+
+/** @brief simulated time since sim_reset() */
+extern uint64_t sim_time_ns;
+/** @brief print the firmware's printk output when non-zero */
+extern int sim_verbose;
+extern sim_stats_t sim_stats;
+
+/** @brief USBD endpoint buffers as seen from the bus */
+extern sim_ep_buf_t sim_ep_in[SIM_NUM_EP];
+extern sim_ep_buf_t sim_ep_out[SIM_NUM_EP];
+/** @brief EP0 tasks the firmware has triggered and the host has not consumed yet */
+extern int sim_ep0_status;
+extern int sim_ep0_rcvout;
+extern int sim_ep0_stall;
+/** @brief the device has driven a resume (remote wakeup) that the host has not answered yet */
+extern int sim_remote_wakeup;
+
+/** @brief firmware entry points driven by the simulator */
+void usbd_init();
+void POWER_CLOCK_IRQHandler();
+void USBD_IRQHandler();
+void SWI0_EGU0_IRQHandler();
+void GPIOTE_IRQHandler();
+void TIMER3_IRQHandler();
+
+/** @brief clear every register, buffer, timer and counter */
+void sim_reset();
+/** @brief process register writes done by the firmware and fire due timers */
+void sim_step();
+/** @brief call the interrupt handlers until no enabled interrupt is pending */
+void sim_run_irqs();
+/** @brief let simulated time pass, firing timers and interrupts on the way */
+void sim_advance(uint64_t ns);
+/** @brief call fire() once delay_ns of simulated time have passed */
+void sim_schedule(uint64_t delay_ns, void (*fire)());
+/** @brief simulated time in CPU cycles (scaled by the clock in MHz, so hour-long runs do not overflow) */
+#define SIM_NS_TO_CYCLES(ns) ((ns) * (SIM_CPU_HZ / 1000000) / 1000ull)
+#define SIM_CYCLES_TO_NS(cycles) ((uint64_t)(cycles) * 1000ull / (SIM_CPU_HZ / 1000000))
+
+/** @brief host pointer for an address written to an EasyDMA PTR register */
+void* sim_dma_ptr(uint32_t addr);
+/** @brief report a model error */
+void sim_error(const char* fmt, ...);
+
+/** @brief raise a USBD / POWER event (offset of its EVENTS register) */
+void sim_usbd_event(uint32_t offset);
+void sim_power_event(uint32_t offset);
+
+/** @brief VBUS connected / disconnected */
+void sim_vbus_detect();
+void sim_vbus_remove();
+/** @brief 1 while the firmware has the D+ pull-up enabled (device visible on the bus) */
+int sim_pullup();
+/** @brief the host stopped sending SOFs for 3 ms (SUSPEND) / drove a resume (RESUME) */
+void sim_bus_suspend();
+void sim_bus_resume();
+/** @brief drive a P0 input pin (1 high, 0 low); the pins start high, like released buttons on their pull-ups */
+void sim_gpio_set(uint32_t pin, int level);
+/** @brief 1 while the HFCLK is running */
+int sim_hfclk_running();
+
+#endif /* _NRF_MODEL_H_ */
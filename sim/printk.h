@@ -0,0 +1,10 @@
+/** @file   printk.h
+ *  @brief  kernel printk for the host simulator (silent unless sim_verbose is set)
+**/
+
+#ifndef _PRINTK_H_
+#define _PRINTK_H_
+
+int printk(const char* fmt, ...);
+
+#endif /* _PRINTK_H_ */
@@ -0,0 +1,509 @@
+/**
+ * @file replay.c
+ * @name Records a mouse session into a capture and replays captures against the simulated host.
+ *
+ * With -r the program enumerates, attaches a recorder to the syscall layer
+ * (sys_mouse_record) and drives a seeded, made-up session through the
+ * mouse syscalls: strokes at 1-8 ms report rates, clicks, scroll bursts
+ * and idle gaps. Captures taken on the board replay the same way.
+ *
+ * Without -r the capture is streamed (never loaded whole) and every report
+ * is queued with send_data on EP1 at its recorded time, preceded by
+ * trace_syscall_entry like a real syscall. Two errors are reported:
+ *   schedule  how late the report was queued against its recorded time
+ *   delivery  recorded time -> the host receiving the report carrying it
+ * Delivery is matched on the host by the running sums of X / Y / Wheel and
+ * the number of button changes, which survive the firmware merging queued
+ * reports. The spread of the delivery error (p99 - p50) is the jitter;
+ * -o stores the summary and -c prints it next to one stored by another
+ * build.
+ *
+ * usage: usbd_replay -r capture [-d duration_s] [-s seed] [-p poll_profile]
+ *        usbd_replay [-p poll_profile] [-o summary] [-c summary] capture
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usbd.h>
+#include <syscall_mouse.h>
+#include <usbd_trace.h>
+#include <report_rec.h>
+#include <nrf_model.h>
+#include <usb_host.h>
+
+_Static_assert(TRACE_CPU_HZ == SIM_CPU_HZ, "the firmware and the model must agree on the core clock");
+
+/** @brief delivery error histogram: 1 us bins up to 1 s, the last one collects everything above */
+#define ERROR_BINS 1000000
+/** @brief reports queued but not yet seen by the host */
+#define PENDING_SIZE 4096
+/** @brief longest wait for the host to fetch the last replayed reports */
+#define DRAIN_FRAMES 5000
+
+/** @brief recorded session: idle gaps and activity lengths */
+#define IDLE_MIN_MS 50
+#define IDLE_MAX_MS 3000
+#define LONG_IDLE_MS 30000
+#define STROKE_MIN 20
+#define STROKE_MAX 400
+#define STROKE_SPEED 12
+#define CLICK_MIN_MS 60
+#define CLICK_MAX_MS 200
+#define SCROLL_MAX 10
+
+/** @brief a replayed report waiting for the host */
+typedef struct{
+    uint64_t target_ns;     // recorded time
+    int64_t x;              // running sums after this report
+    int64_t y;
+    int64_t wheel;
+    uint32_t changes;       // button changes up to and including this report
+}pending_t;
+
+/** @brief replay state shared with the host callback */
+typedef struct{
+    pending_t pending[PENDING_SIZE];
+    uint32_t head;          // oldest pending report
+    uint32_t tail;
+    // what the host has received so far
+    int64_t x;
+    int64_t y;
+    int64_t wheel;
+    uint32_t changes;
+    uint8_t buttons;
+    // delivery error of every matched report
+    uint32_t* bins;
+    uint64_t delivered;
+    double sum_us;
+    double sum_sq_us;
+    uint64_t max_ns;
+}replay_t;
+
+/** @brief one line of a summary file */
+typedef struct{
+    const char* name;
+    double value;
+}metric_t;
+
+enum REPLAY_METRIC{
+    M_REPORTS = 0, M_DURATION_S, M_SCHEDULE_MAX_US, M_DELIVERY_AVG_US, M_DELIVERY_P50_US, M_DELIVERY_P90_US,
+    M_DELIVERY_P99_US, M_DELIVERY_MAX_US, M_JITTER_US, M_STDDEV_US, M_COALESCED, NUM_METRICS
+};
+
+/** @name next_random
+ * @brief xorshift64, seeded from -s
+*/
+static uint64_t next_random(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/** @name between
+ * @brief uniform value in [lo, hi]
+*/
+static int64_t between(uint64_t* rnd, int64_t lo, int64_t hi){
+    return lo + (int64_t)(next_random(rnd) % (uint64_t)(hi - lo + 1));
+}
+
+/** @name file_write
+ * @brief rec_write_fn on a stdio stream
+*/
+static int file_write(const uint8_t* data, uint32_t len, void* ctx){
+    return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+/** @name file_read
+ * @brief rec_read_fn on a stdio stream
+*/
+static int32_t file_read(uint8_t* data, uint32_t len, void* ctx){
+    size_t got = fread(data, 1, len, ctx);
+    return ferror((FILE*)ctx) ? -1 : (int32_t)got;
+}
+
+/** @name wait_until
+ * @brief lets the host poll until the given time, then runs what the syscalls raised
+*/
+static void wait_until(usb_host_t* host, uint64_t time_ns){
+    host_run_until(host, time_ns);
+    sim_run_irqs();
+}
+
+/** @name record_session
+ * @brief Drives a made-up session through the mouse syscalls while they are being recorded
+*/
+static void record_session(usb_host_t* host, uint64_t duration_ns, uint64_t* rnd){
+    uint64_t end = sim_time_ns + duration_ns;
+    while(sim_time_ns < end){
+        uint64_t kind = next_random(rnd) % 10;
+        if(kind < 7){
+            // a stroke: the velocity wanders, reports at the rate of a 125 Hz - 1 kHz mouse
+            uint64_t period_ns = (1ull << (next_random(rnd) % 4)) * 1000000ull;
+            int64_t steps = between(rnd, STROKE_MIN, STROKE_MAX);
+            int32_t vx = 0, vy = 0;
+            for(int64_t i = 0; i < steps; i++){
+                vx += between(rnd, -3, 3);
+                vy += between(rnd, -3, 3);
+                vx = vx > STROKE_SPEED ? STROKE_SPEED : vx < -STROKE_SPEED ? -STROKE_SPEED : vx;
+                vy = vy > STROKE_SPEED ? STROKE_SPEED : vy < -STROKE_SPEED ? -STROKE_SPEED : vy;
+                if(vx != 0 || vy != 0){
+                    sys_mouse_move(vx, vy);
+                }
+                wait_until(host, sim_time_ns + period_ns);
+            }
+        }else if(kind < 9){
+            sys_mouse_click(1 + next_random(rnd) % 2);
+            wait_until(host, sim_time_ns + between(rnd, CLICK_MIN_MS, CLICK_MAX_MS) * 1000000ull);
+            sys_mouse_click(0);
+        }else{
+            int8_t direction = next_random(rnd) % 2 ? 1 : -1;
+            for(int64_t i = between(rnd, 1, SCROLL_MAX); i > 0; i--){
+                sys_mouse_scroll(direction);
+                wait_until(host, sim_time_ns + between(rnd, 20, 60) * 1000000ull);
+            }
+        }
+        // mostly short pauses, sometimes the hand leaves the mouse
+        int64_t idle_ms = next_random(rnd) % 20 ? between(rnd, IDLE_MIN_MS, IDLE_MAX_MS) : LONG_IDLE_MS;
+        wait_until(host, sim_time_ns + idle_ms * 1000000ull);
+    }
+}
+
+/** @name on_report
+ * @brief EP1 report callback: delivers the newest pending report the host's running sums match, and all before it
+*/
+static void on_report(const uint8_t* report, uint32_t len, uint64_t time_ns, void* ctx){
+    replay_t* replay = ctx;
+    input_report_t r = {0, 0, 0, 0};
+    memcpy(&r, report, len < sizeof(r) ? len : sizeof(r));
+    replay->x += r.X;
+    replay->y += r.Y;
+    replay->wheel += r.Wheel;
+    if(r.buttons != replay->buttons){
+        replay->changes++;
+        replay->buttons = r.buttons;
+    }
+    uint32_t match = replay->head;
+    for(uint32_t i = replay->tail; i != replay->head; i--){
+        pending_t* p = &replay->pending[(i - 1) % PENDING_SIZE];
+        if(p->x == replay->x && p->y == replay->y && p->wheel == replay->wheel && p->changes == replay->changes){
+            match = i;
+            break;
+        }
+    }
+    // no match: part of the motion is still carried over in the firmware
+    for(; replay->head != match; replay->head++){
+        pending_t* p = &replay->pending[replay->head % PENDING_SIZE];
+        uint64_t error_ns = time_ns - p->target_ns;
+        uint64_t bin = error_ns / 1000;
+        replay->bins[bin < ERROR_BINS ? bin : ERROR_BINS - 1]++;
+        replay->delivered++;
+        replay->sum_us += error_ns / 1e3;
+        replay->sum_sq_us += (error_ns / 1e3) * (error_ns / 1e3);
+        if(error_ns > replay->max_ns){
+            replay->max_ns = error_ns;
+        }
+    }
+}
+
+/** @name error_percentile
+ * @brief nearest-rank percentile of the delivery error (us, rounded down)
+*/
+static double error_percentile(const replay_t* replay, uint32_t pct){
+    uint64_t rank = (replay->delivered * pct + 99) / 100;
+    uint64_t seen = 0;
+    for(uint32_t bin = 0; bin < ERROR_BINS; bin++){
+        seen += replay->bins[bin];
+        if(seen >= rank && seen > 0){
+            return bin;
+        }
+    }
+    return ERROR_BINS;
+}
+
+/** @name write_summary
+ * @brief Stores "metric value" lines
+ * @return 0 on success
+*/
+static int write_summary(const char* path, const char* capture, uint32_t profile, const metric_t* metrics){
+    FILE* file = fopen(path, "w");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "# usbd_replay summary: %s, poll profile %u\n", capture, profile);
+    for(uint32_t m = 0; m < NUM_METRICS; m++){
+        fprintf(file, "%s %.3f\n", metrics[m].name, metrics[m].value);
+    }
+    fclose(file);
+    return 0;
+}
+
+/** @name compare_summary
+ * @brief Prints this run next to a summary stored by another run or build ('#' starts a comment)
+ * @return 0 on success
+*/
+static int compare_summary(const char* path, const metric_t* metrics){
+    FILE* file = fopen(path, "r");
+    if(file == 0){
+        perror(path);
+        return -1;
+    }
+    double other[NUM_METRICS];
+    int found[NUM_METRICS] = {0};
+    char line[256];
+    while(fgets(line, sizeof(line), file) != 0){
+        char name[64];
+        double value;
+        if(line[0] == '#' || sscanf(line, "%63s %lf", name, &value) != 2){
+            continue;
+        }
+        for(uint32_t m = 0; m < NUM_METRICS; m++){
+            if(strcmp(name, metrics[m].name) == 0){
+                other[m] = value;
+                found[m] = 1;
+            }
+        }
+    }
+    fclose(file);
+    printf("compared with %s:\n", path);
+    printf("                 %-18s %12s %12s %12s\n", "", "this", "other", "delta");
+    for(uint32_t m = 0; m < NUM_METRICS; m++){
+        if(found[m]){
+            printf("                 %-18s %12.3f %12.3f %+12.3f\n", metrics[m].name, metrics[m].value, other[m],
+                   metrics[m].value - other[m]);
+        }else{
+            printf("                 %-18s %12.3f %12s\n", metrics[m].name, metrics[m].value, "-");
+        }
+    }
+    return 0;
+}
+
+/** @name record
+ * @brief -r: records a session of duration_s seconds into path
+ * @return 0 on success
+*/
+static int record(usb_host_t* host, const char* path, uint64_t duration_s, uint64_t seed){
+    FILE* file = fopen(path, "wb");
+    if(file == 0){
+        perror(path);
+        return 1;
+    }
+    rec_writer_t writer;
+    if(rec_writer_init(&writer, file_write, file) != REC_OK){
+        fprintf(stderr, "%s: write failed\n", path);
+        fclose(file);
+        return 1;
+    }
+    uint64_t rnd = seed;
+    sys_mouse_record(&writer);
+    record_session(host, duration_s * 1000000000ull, &rnd);
+    sys_mouse_record(0);
+    fclose(file);
+    if(writer.error != 0){
+        fprintf(stderr, "%s: write failed\n", path);
+        return 1;
+    }
+    printf("recorded:        %u reports in %.1f s, %llu bytes (%.2f per report), seed %llu\n", writer.records,
+           writer.last_us / 1e6, (unsigned long long)writer.bytes,
+           writer.records ? (double)(writer.bytes - REC_HEADER_SIZE) / writer.records : 0.0, (unsigned long long)seed);
+    return sim_stats.errors != 0;
+}
+
+/** @name replay
+ * @brief Replays the capture at path on EP1 at its recorded timing
+ * @return 0 on success
+*/
+static int replay(usb_host_t* host, const char* path, uint32_t profile, const char* summary, const char* check){
+    FILE* file = fopen(path, "rb");
+    if(file == 0){
+        perror(path);
+        return 1;
+    }
+    rec_reader_t reader;
+    if(rec_reader_init(&reader, file_read, file) != REC_OK){
+        fprintf(stderr, "%s: not a capture (or not version %u)\n", path, REC_VERSION);
+        fclose(file);
+        return 1;
+    }
+    replay_t* state = calloc(1, sizeof(replay_t));
+    state->bins = calloc(ERROR_BINS, sizeof(uint32_t));
+    host->on_report = on_report;
+    host->ctx = state;
+
+    report_queue_stats_t before;
+    usbd_get_queue_stats(&before);
+    int64_t x = 0, y = 0, wheel = 0;
+    uint32_t changes = 0;
+    uint8_t buttons = 0;
+    uint64_t schedule_max_ns = 0;
+    uint64_t late = 0;
+    uint64_t time_us = 0;
+    input_report_t report;
+    uint64_t start = sim_time_ns;
+    int status;
+    int failed = 0;
+    while((status = rec_read(&reader, &time_us, &report)) == REC_OK){
+        uint64_t target = start + time_us * 1000;
+        host_run_until(host, target);
+        // a poll in progress can run past the target
+        uint64_t schedule_ns = sim_time_ns - target;
+        if(schedule_ns > 0){
+            late++;
+        }
+        if(schedule_ns > schedule_max_ns){
+            schedule_max_ns = schedule_ns;
+        }
+        x += report.X;
+        y += report.Y;
+        wheel += report.Wheel;
+        changes += report.buttons != buttons;
+        buttons = report.buttons;
+        if(state->tail - state->head >= PENDING_SIZE){
+            sim_error("more than %u replayed reports waiting for the host", PENDING_SIZE);
+            break;
+        }
+        state->pending[state->tail % PENDING_SIZE] = (pending_t){target, x, y, wheel, changes};
+        state->tail++;
+        trace_syscall_entry();
+        send_data(1, (uint8_t*)&report, sizeof(input_report_t), sizeof(input_report_t));
+        sim_run_irqs();
+    }
+    fclose(file);
+    if(status != REC_END){
+        printf("FAIL: %s: %s after %u reports\n", path, status == REC_ERR_RANGE ?
+               "value too large for this build's report" : "truncated or unreadable", reader.records);
+        failed = 1;
+    }
+    // let the last reports out, including motion carried over because it did not fit into one report
+    for(uint32_t frame = 0; frame < DRAIN_FRAMES && state->head != state->tail; frame++){
+        host_advance(host, HOST_FRAME_NS);
+    }
+
+    report_queue_stats_t after;
+    usbd_get_queue_stats(&after);
+    uint64_t duration_ns = sim_time_ns - start;
+    double avg = state->delivered ? state->sum_us / state->delivered : 0;
+    double variance = state->delivered ? state->sum_sq_us / state->delivered - avg * avg : 0;
+    metric_t metrics[NUM_METRICS] = {
+        {"reports", reader.records},
+        {"duration_s", duration_ns / 1e9},
+        {"schedule_max_us", schedule_max_ns / 1e3},
+        {"delivery_avg_us", avg},
+        {"delivery_p50_us", error_percentile(state, 50)},
+        {"delivery_p90_us", error_percentile(state, 90)},
+        {"delivery_p99_us", error_percentile(state, 99)},
+        {"delivery_max_us", state->max_ns / 1e3},
+        {"jitter_us", error_percentile(state, 99) - error_percentile(state, 50)},
+        {"stddev_us", variance > 0 ? sqrt(variance) : 0},
+        {"coalesced", after.coalesced - before.coalesced}
+    };
+    printf("replayed:        %u reports over %.1f s (%s, poll %u ms)\n", reader.records, duration_ns / 1e9, path,
+           after.poll_interval_ms);
+    printf("schedule (us):   %llu late, max %.1f\n", (unsigned long long)late, schedule_max_ns / 1e3);
+    printf("delivery (us):   avg %.1f, p50 %.0f, p90 %.0f, p99 %.0f, max %.1f, jitter (p99 - p50) %.0f, stddev %.1f\n",
+           avg, metrics[M_DELIVERY_P50_US].value, metrics[M_DELIVERY_P90_US].value, metrics[M_DELIVERY_P99_US].value,
+           metrics[M_DELIVERY_MAX_US].value, metrics[M_JITTER_US].value, metrics[M_STDDEV_US].value);
+    printf("reports:         %llu delivered, %llu coalesced, %llu dropped\n", (unsigned long long)state->delivered,
+           (unsigned long long)(after.coalesced - before.coalesced), (unsigned long long)(after.dropped - before.dropped));
+
+    if(state->x != x || state->y != y || state->wheel != wheel || state->changes != changes){
+        printf("FAIL: the host did not receive the replayed motion and clicks\n");
+        failed = 1;
+    }
+    if(state->delivered != reader.records){
+        // only reports without motion or button change may be left: the firmware sends nothing for them
+        uint64_t empty = 0;
+        for(uint32_t i = state->head; i != state->tail; i++){
+            pending_t* p = &state->pending[i % PENDING_SIZE];
+            pending_t prev = {0, 0, 0, 0, 0};
+            if(i != 0){
+                prev = state->pending[(i - 1) % PENDING_SIZE];
+            }
+            empty += p->x == prev.x && p->y == prev.y && p->wheel == prev.wheel && p->changes == prev.changes;
+        }
+        if(state->delivered + empty != reader.records){
+            printf("FAIL: %llu of %u replayed reports never reached the host\n",
+                   (unsigned long long)(reader.records - state->delivered), reader.records);
+            failed = 1;
+        }
+    }
+    if(summary != 0 && write_summary(summary, path, profile, metrics) != 0){
+        failed = 1;
+    }
+    if(check != 0 && compare_summary(check, metrics) != 0){
+        failed = 1;
+    }
+    free(state->bins);
+    free(state);
+    return failed;
+}
+
+int main(int argc, char* argv[]){
+    const char* capture_out = 0;
+    const char* summary = 0;
+    const char* check = 0;
+    uint64_t duration_s = 60;
+    uint64_t seed = 642;
+    uint32_t profile = USBD_POLL_PROFILE;
+    int opt;
+    while((opt = getopt(argc, argv, "r:d:s:p:o:c:")) != -1){
+        switch(opt){
+            case 'r':
+                capture_out = optarg;
+                break;
+            case 'd':
+                duration_s = strtoull(optarg, 0, 0);
+                break;
+            case 's':
+                seed = strtoull(optarg, 0, 0);
+                break;
+            case 'p':
+                profile = atoi(optarg);
+                break;
+            case 'o':
+                summary = optarg;
+                break;
+            case 'c':
+                check = optarg;
+                break;
+            default:
+                optind = -1;
+                break;
+        }
+        if(optind < 0){
+            break;
+        }
+    }
+    if(optind < 0 || (capture_out == 0) == (optind != argc - 1) || seed == 0){
+        fprintf(stderr, "usage: %s -r capture [-d duration_s] [-s seed] [-p poll_profile]\n"
+                        "       %s [-p poll_profile] [-o summary] [-c summary] capture\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    sim_reset();
+    usbd_init();
+    if(usbd_set_poll_profile(profile) != 0){
+        fprintf(stderr, "unknown poll profile %u\n", profile);
+        return 2;
+    }
+    usb_host_t host;
+    host_init(&host);
+    sim_vbus_detect();
+    sim_run_irqs();
+    if(host_enumerate(&host) != HOST_OK || MOUSE_READY != 1){
+        fprintf(stderr, "enumeration failed\n");
+        return 1;
+    }
+
+    int failed = capture_out != 0 ? record(&host, capture_out, duration_s, seed)
+                                  : replay(&host, argv[optind], profile, summary, check);
+    if(sim_stats.errors != 0){
+        printf("FAIL: %u simulator errors\n", sim_stats.errors);
+        failed = 1;
+    }
+    return failed;
+}
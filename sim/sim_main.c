@@ -0,0 +1,562 @@
+/**
+ * @file sim_main.c
+ * @name Runs the USBD firmware against the simulated nRF52840 and USB host.
+ *
+ * Plugs the cable, enumerates, then drives sys_mouse_move / sys_mouse_scroll
+ * / sys_mouse_click at a fixed rate while the host polls EP1. At the end
+ * it checks that everything sent arrived (in order, nothing lost) and
+ * prints enumeration time, report counts and syscall-to-host latency.
+ * A drag (press, two moves, release) must reach the host as one press
+ * and one release, with the moves in between carrying the button; the
+ * first move follows the press before the host polls, so it shares the
+ * priority lane's report with it and must not release the button.
+ * Then the physical buttons are pressed and released with bouncing
+ * contacts, some as taps shorter than the debounce lockout; every press and
+ * release must reach the host exactly once. Before the checks the host
+ * suspends the bus twice: once the mouse must wake it up itself (remote
+ * wakeup), once the host resumes it. Last, the host re-enumerates while a
+ * button is held; the next report must press it again.
+ *
+ * usage: usbd_sim [-v] [-b] [-i idle_rate] [-p poll_profile] [-m move_period_us] [-d duration_ms]
+ *   -b  switch the mouse to the boot protocol (SET_PROTOCOL) after enumeration
+ *   -i  SET_IDLE duration in 4 ms units (0: reports only on change)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usbd.h>
+#include <syscall_mouse.h>
+#include <usbd_trace.h>
+#include <gpio_buttons.h>
+#include <nrf_model.h>
+#include <usb_host.h>
+
+/** @brief workload */
+#define MOVE_DX 7
+#define MOVE_DY -3
+/** @brief a fast flick, as large as one report can carry (boot protocol reports carry 8 bits) */
+#define FLICK MOUSE_DELTA_MAX
+#define BOOT_FLICK 127
+/** @brief fine scroll steps (1/USBD_WHEEL_MULTIPLIER detent) sent with each scroll */
+#define FINE_SCROLL 3
+#define CLICK_PERIOD_US 250000
+#define SCROLL_PERIOD_US 500000
+#define MAX_MOVES 1000000
+/** @brief stationary time at the end of the run, in frames */
+#define STATIONARY_FRAMES 200
+/** @brief time spent suspended before the mouse moves, and the longest acceptable wake-up (ms) */
+#define SUSPEND_FRAMES 50
+#define WAKEUP_TIMEOUT_FRAMES 100
+/** @brief frames between the steps of the drag (more than any bInterval, so each step is its own report) */
+#define DRAG_GAP_FRAMES 20
+/** @brief physical clicks, alternating left and right; every fourth is a tap shorter than the lockout */
+#define BUTTON_CLICKS 20
+#define BUTTON_HOLD_US 30000
+#define BUTTON_TAP_US 2000
+/** @brief contact bounce: the pin toggles at these times (us) after the first edge, and ends at the new level */
+static const uint32_t bounce_us[] = {0, 80, 200, 260, 450};
+
+/** @brief what the host has received */
+typedef struct{
+    int64_t x;
+    int64_t y;
+    int64_t wheel;
+    uint32_t presses;
+    uint32_t releases;
+    uint8_t buttons;
+    uint32_t unchanged;     // reports without motion or button change (idle repeats)
+    uint32_t held_motion;   // reports with motion while a button is held
+    // syscall -> host latency of each move
+    uint64_t* move_time;
+    int64_t* move_target_x;
+    uint32_t moves;
+    uint32_t moves_seen;
+    uint64_t latency_min;
+    uint64_t latency_max;
+    uint64_t latency_sum;
+    // first edge -> host latency of each physical press
+    uint64_t press_edge_ns;     // first edge of the press in flight, 0 if none
+    uint8_t press_buttons;      // buttons of the report that carries it
+    uint32_t presses_timed;
+    uint64_t press_latency_max;
+    uint64_t press_latency_sum;
+}received_t;
+
+/** @name move_after_suspend
+ * @brief Moves the mouse and waits for the report
+ * @return time from the syscall to the report on the host (ns), 0 if it never came
+*/
+static uint64_t move_after_suspend(usb_host_t* host){
+    uint64_t reports = host->reports;
+    uint64_t start = sim_time_ns;
+    sys_mouse_move(MOVE_DX, MOVE_DY);
+    sim_run_irqs();
+    for(uint32_t frame = 0; frame < WAKEUP_TIMEOUT_FRAMES && host->reports == reports; frame++){
+        host_advance(host, HOST_FRAME_NS);
+    }
+    return host->reports == reports ? 0 : sim_time_ns - start;
+}
+
+/** @name bounce
+ * @brief Moves a button's pin to level the way a switch contact does (see bounce_us)
+*/
+static void bounce(usb_host_t* host, uint32_t pin, int level){
+    uint64_t start = sim_time_ns;
+    for(uint32_t i = 0; i < sizeof(bounce_us) / sizeof(bounce_us[0]); i++){
+        host_run_until(host, start + bounce_us[i] * 1000ull);
+        sim_gpio_set(pin, (i % 2 == 0) ? level : !level);
+        sim_run_irqs();
+    }
+}
+
+/** @name check_request
+ * @brief Runs one control request and compares the result (and the first data byte if expected_byte >= 0)
+ * @return 1 if it did not behave as expected
+*/
+static int check_request(usb_host_t* host, const char* name, host_setup_t setup, int expected, int expected_byte){
+    uint8_t data[64] = {0};
+    int status = host_control(host, &setup, data);
+    if(status != expected || (expected_byte >= 0 && data[0] != expected_byte)){
+        printf("FAIL: %s returned %d (data 0x%02x), expected %d\n", name, status, data[0], expected);
+        return 1;
+    }
+    return 0;
+}
+
+/** @name check_chapter9
+ * @brief Standard requests beyond enumeration: status, configuration, halt, and STALL for what is not supported
+ * @return number of requests that did not behave as expected
+*/
+static int check_chapter9(usb_host_t* host){
+    int failed = 0;
+    failed += check_request(host, "GET_CONFIGURATION", (host_setup_t){0x80, USB_GET_CONFIGURATION, 0, 0, 1}, 1, 1);
+    failed += check_request(host, "GET_STATUS(device)", (host_setup_t){0x80, USB_GET_STATUS, 0, 0, 2}, 2, 0x1);
+    failed += check_request(host, "GET_STATUS(interface)", (host_setup_t){0x81, USB_GET_STATUS, 0, 0, 2}, 2, 0);
+    failed += check_request(host, "GET_INTERFACE", (host_setup_t){0x81, USB_GET_INTERFACE, 0, 0, 1}, 1, 0);
+    failed += check_request(host, "GET_DESCRIPTOR(HID)", (host_setup_t){0x81, USB_GET_DESCRIPTOR, HID_DESC_HID << 8, 0, 9}, 9, 9);
+    failed += check_request(host, "SET_FEATURE(ENDPOINT_HALT)",
+                            (host_setup_t){0x02, USB_SET_FEATURE, USB_FEATURE_ENDPOINT_HALT, 0x81, 0}, 0, -1);
+    failed += check_request(host, "GET_STATUS(EP1, halted)", (host_setup_t){0x82, USB_GET_STATUS, 0, 0x81, 2}, 2, 1);
+    failed += check_request(host, "CLEAR_FEATURE(ENDPOINT_HALT)",
+                            (host_setup_t){0x02, USB_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, 0x81, 0}, 0, -1);
+    failed += check_request(host, "GET_STATUS(EP1)", (host_setup_t){0x82, USB_GET_STATUS, 0, 0x81, 2}, 2, 0);
+    // not supported: must STALL instead of completing
+    failed += check_request(host, "GET_DESCRIPTOR(DEVICE_QUALIFIER)",
+                            (host_setup_t){0x80, USB_GET_DESCRIPTOR, USB_DESC_DEVICE_QUALIFIER << 8, 0, 10}, HOST_ERR_STALL, -1);
+    failed += check_request(host, "GET_DESCRIPTOR(STRING)", (host_setup_t){0x80, USB_GET_DESCRIPTOR, STRING << 8, 0, 255},
+                            HOST_ERR_STALL, -1);
+    failed += check_request(host, "SET_CONFIGURATION(2)", (host_setup_t){0x00, USB_SET_CONFIGURATION, 2, 0, 0}, HOST_ERR_STALL, -1);
+    failed += check_request(host, "SET_INTERFACE(alt 1)", (host_setup_t){0x01, USB_SET_INTERFACE, 1, 0, 0}, HOST_ERR_STALL, -1);
+    failed += check_request(host, "SYNCH_FRAME", (host_setup_t){0x82, 0x0C, 0, 0x81, 2}, HOST_ERR_STALL, -1);
+    return failed;
+}
+
+/** @name on_report
+ * @brief EP1 report callback of the host
+*/
+static void on_report(const uint8_t* report, uint32_t len, uint64_t time_ns, void* ctx){
+    received_t* rx = ctx;
+    if(len < HID_BOOT_REPORT_SIZE){
+        sim_error("short report (%u bytes)", len);
+        return;
+    }
+    input_report_t r_full = {0, 0, 0, 0};
+    if(len == HID_BOOT_REPORT_SIZE){
+        // boot protocol: 8-bit X/Y, no wheel
+        const boot_report_t* boot = (const boot_report_t*)report;
+        r_full.buttons = boot->buttons;
+        r_full.X = boot->X;
+        r_full.Y = boot->Y;
+    }else{
+        memcpy(&r_full, report, len < sizeof(r_full) ? len : sizeof(r_full));
+    }
+    const input_report_t* r = &r_full;
+    rx->x += r->X;
+    rx->y += r->Y;
+    rx->wheel += r->Wheel;
+    if(r->X == 0 && r->Y == 0 && r->Wheel == 0 && r->buttons == rx->buttons){
+        rx->unchanged++;
+    }
+    if((r->X != 0 || r->Y != 0 || r->Wheel != 0) && r->buttons != 0){
+        rx->held_motion++;
+    }
+    if(r->buttons != rx->buttons){
+        if(r->buttons != 0){
+            rx->presses++;
+        }else{
+            rx->releases++;
+        }
+        rx->buttons = r->buttons;
+    }
+    if(rx->press_edge_ns != 0 && r->buttons == rx->press_buttons){
+        uint64_t latency = time_ns - rx->press_edge_ns;
+        if(latency > rx->press_latency_max){
+            rx->press_latency_max = latency;
+        }
+        rx->press_latency_sum += latency;
+        rx->presses_timed++;
+        rx->press_edge_ns = 0;
+    }
+    while(rx->moves_seen < rx->moves && rx->move_target_x[rx->moves_seen] <= rx->x){
+        uint64_t latency = time_ns - rx->move_time[rx->moves_seen];
+        if(latency < rx->latency_min){
+            rx->latency_min = latency;
+        }
+        if(latency > rx->latency_max){
+            rx->latency_max = latency;
+        }
+        rx->latency_sum += latency;
+        rx->moves_seen++;
+    }
+}
+
+int main(int argc, char* argv[]){
+    uint32_t profile = USBD_POLL_PROFILE;
+    uint64_t move_period_us = 2000;
+    uint64_t duration_ms = 2000;
+    uint32_t boot = 0;
+    uint32_t idle_rate = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "vbi:p:m:d:")) != -1){
+        switch(opt){
+            case 'v':
+                sim_verbose = 1;
+                break;
+            case 'b':
+                boot = 1;
+                break;
+            case 'i':
+                idle_rate = atoi(optarg);
+                break;
+            case 'p':
+                profile = atoi(optarg);
+                break;
+            case 'm':
+                move_period_us = strtoull(optarg, 0, 0);
+                break;
+            case 'd':
+                duration_ms = strtoull(optarg, 0, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v] [-b] [-i idle_rate] [-p poll_profile] [-m move_period_us] [-d duration_ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(move_period_us == 0 || duration_ms * 1000 / move_period_us > MAX_MOVES || idle_rate > 0xFF){
+        fprintf(stderr, "too many moves\n");
+        return 2;
+    }
+
+    received_t rx;
+    memset(&rx, 0, sizeof(rx));
+    rx.latency_min = UINT64_MAX;
+    rx.move_time = calloc(MAX_MOVES, sizeof(uint64_t));
+    rx.move_target_x = calloc(MAX_MOVES, sizeof(int64_t));
+
+    sim_reset();
+    usbd_init();
+    if(usbd_set_poll_profile(profile) != 0){
+        fprintf(stderr, "unknown poll profile %u\n", profile);
+        return 2;
+    }
+    usb_host_t host;
+    host_init(&host);
+    host.on_report = on_report;
+    host.ctx = &rx;
+
+    sim_vbus_detect();
+    sim_run_irqs();
+    if(host_enumerate(&host) != HOST_OK || MOUSE_READY != 1){
+        fprintf(stderr, "enumeration failed\n");
+        return 1;
+    }
+    uint64_t enumerated_ns = sim_time_ns;
+
+    // HID class requests, the way a boot-mode BIOS or a driver honouring the idle rate would
+    uint8_t value = 0xFF;
+    int failed = 0;
+    if(boot){
+        host_setup_t set_protocol = {0x21, HID_SET_PROTOCOL, HID_PROTOCOL_BOOT, 0, 0};
+        host_setup_t get_protocol = {0xA1, HID_GET_PROTOCOL, 0, 0, 1};
+        if(host_control(&host, &set_protocol, 0) != 0 || host_control(&host, &get_protocol, &value) != 1 ||
+           value != HID_PROTOCOL_BOOT){
+            printf("FAIL: SET_PROTOCOL(boot)\n");
+            failed = 1;
+        }
+    }
+    if(idle_rate != 0){
+        host_setup_t set_idle = {0x21, HID_SET_IDLE, (uint16_t)(idle_rate << 8), 0, 0};
+        host_setup_t get_idle = {0xA1, HID_GET_IDLE, 0, 0, 1};
+        if(host_control(&host, &set_idle, 0) != 0 || host_control(&host, &get_idle, &value) != 1 || value != idle_rate){
+            printf("FAIL: SET_IDLE(%u)\n", idle_rate);
+            failed = 1;
+        }
+    }
+#if USBD_HIRES_REPORT
+    if(!boot){
+        // what a driver supporting high-resolution scrolling does: enable the Resolution Multiplier
+        uint8_t multiplier = 1;
+        host_setup_t set_feature = {0x21, HID_SET_REPORT, HID_REPORT_FEATURE << 8, 0, 1};
+        host_setup_t get_feature = {0xA1, HID_GET_REPORT, HID_REPORT_FEATURE << 8, 0, 1};
+        if(host_control(&host, &set_feature, &multiplier) != 1 || host_control(&host, &get_feature, &value) != 1 ||
+           value != 1 || usbd_wheel_resolution() != USBD_WHEEL_MULTIPLIER){
+            printf("FAIL: SET_REPORT(Resolution Multiplier)\n");
+            failed = 1;
+        }
+    }
+#endif
+    if(check_chapter9(&host) != 0){
+        failed = 1;
+    }
+    uint64_t irqs_at_start = sim_stats.usbd_irqs;
+    uint64_t irq_ns_at_start = sim_stats.irq_host_ns;
+    uint64_t irq_regs_at_start = sim_stats.usbd_irq_regs;
+
+    // workload
+    int64_t sent_x = 0, sent_y = 0, sent_wheel = 0;
+    uint32_t clicks = 0;
+    uint64_t start = sim_time_ns;
+    uint64_t end = start + duration_ms * 1000000ull;
+    for(uint64_t t = start; t < end; t += move_period_us * 1000){
+        host_run_until(&host, t);
+        uint64_t elapsed_us = (t - start) / 1000;
+        sys_mouse_move(MOVE_DX, MOVE_DY);
+        sent_x += MOVE_DX;
+        sent_y += MOVE_DY;
+        rx.move_time[rx.moves] = sim_time_ns;
+        rx.move_target_x[rx.moves] = sent_x;
+        rx.moves++;
+        if(elapsed_us % CLICK_PERIOD_US < move_period_us){
+            int32_t flick = boot ? BOOT_FLICK : FLICK;
+            sys_mouse_move(flick, -flick);
+            sent_x += flick;
+            sent_y -= flick;
+            sys_mouse_click(1);
+            sys_mouse_click(0);
+            clicks++;
+        }
+        if(elapsed_us % SCROLL_PERIOD_US < move_period_us){
+            sys_mouse_scroll(1);
+            sent_wheel += usbd_wheel_resolution();
+            if(usbd_wheel_resolution() == USBD_WHEEL_MULTIPLIER){
+                // the host reads fractions of a detent (always true for the 8-bit layout, where a step is a detent)
+                sys_mouse_scroll_fine(FINE_SCROLL);
+                sent_wheel += FINE_SCROLL;
+            }
+        }
+        sim_run_irqs();
+    }
+    // let the host pick up what is still queued
+    host_advance(&host, 10 * HOST_FRAME_NS);
+    // drag: the button stays held while the mouse moves, one press and one release in all
+    uint32_t drag_presses = rx.presses;
+    uint32_t drag_releases = rx.releases;
+    uint32_t drag_held = rx.held_motion;
+    sys_mouse_click(1);
+    uint32_t drag_held_buttons = 1;
+    for(uint32_t i = 0; i < 2; i++){
+        sys_mouse_move(MOVE_DX, MOVE_DY);
+        sent_x += MOVE_DX;
+        sent_y += MOVE_DY;
+        sim_run_irqs();
+        host_advance(&host, DRAG_GAP_FRAMES * HOST_FRAME_NS);
+        drag_held_buttons &= (rx.buttons == 1);
+    }
+    sys_mouse_click(0);
+    sim_run_irqs();
+    host_advance(&host, DRAG_GAP_FRAMES * HOST_FRAME_NS);
+    clicks++;
+    int drag_ok = (rx.presses - drag_presses == 1 && rx.releases - drag_releases == 1 &&
+                   rx.held_motion - drag_held == 2 && drag_held_buttons);
+    // stay still: moves that add up to nothing must not produce reports, only the idle rate may
+    uint32_t unchanged_before = rx.unchanged;
+    sys_mouse_move(0, 0);
+    sim_run_irqs();
+    host_advance(&host, STATIONARY_FRAMES * HOST_FRAME_NS);
+    uint32_t idle_reports = rx.unchanged - unchanged_before;
+    if(boot){
+        sent_wheel = 0;
+    }
+
+    // physical buttons: each change must reach the host once, however much the contact bounces
+    static const uint8_t pins[BUTTON_COUNT] = BUTTON_PINS;
+    uint32_t presses_before = rx.presses;
+    uint32_t releases_before = rx.releases;
+    uint32_t taps = 0;
+    for(uint32_t i = 0; i < BUTTON_CLICKS; i++){
+        uint32_t n = i % 2;
+        uint64_t hold_us = (i % 4 == 3) ? BUTTON_TAP_US : BUTTON_HOLD_US;
+        taps += (hold_us < BUTTON_DEBOUNCE_US);
+        rx.press_edge_ns = sim_time_ns;
+        rx.press_buttons = (uint8_t)(1 << n);
+        bounce(&host, pins[n], 0);
+        host_advance(&host, hold_us * 1000);
+        bounce(&host, pins[n], 1);
+        host_advance(&host, BUTTON_HOLD_US * 1000);
+    }
+    uint32_t pin_presses = rx.presses - presses_before;
+    uint32_t pin_releases = rx.releases - releases_before;
+    buttons_stats_t buttons;
+    buttons_get_stats(&buttons);
+
+    // suspend: the mouse stops its HFCLK, then a move wakes the host up (remote wakeup)
+    usbd_power_stats_t power;
+    uint64_t remote_wakeup_ns = 0;
+    uint64_t host_resume_ns = 0;
+    int hfclk_stopped = 0;
+    if(host_suspend(&host) == HOST_OK){
+        host_advance(&host, SUSPEND_FRAMES * HOST_FRAME_NS);
+        usbd_get_power_stats(&power);
+        hfclk_stopped = !sim_hfclk_running() && power.state == USBD_POWER_SUSPENDED && usbd_suspended();
+        remote_wakeup_ns = move_after_suspend(&host);
+        sent_x += MOVE_DX;
+        sent_y += MOVE_DY;
+        // suspend again; this time the host resumes the bus before the mouse moves
+        if(host_suspend(&host) == HOST_OK){
+            host_advance(&host, SUSPEND_FRAMES * HOST_FRAME_NS);
+            uint64_t resume_start = sim_time_ns;
+            host_resume(&host);
+            if(move_after_suspend(&host) != 0){
+                host_resume_ns = sim_time_ns - resume_start;
+            }
+            sent_x += MOVE_DX;
+            sent_y += MOVE_DY;
+        }
+    }
+    usbd_get_power_stats(&power);
+
+    // a button held across a bus reset: the host forgot it, so the first report after enumeration presses it again
+    int reset_ok = 0;
+    sys_mouse_click(1);
+    host_advance(&host, 10 * HOST_FRAME_NS);
+    uint32_t presses_before_reset = rx.presses;
+    if(rx.buttons == 1 && host_enumerate(&host) == HOST_OK){
+        rx.buttons = 0;
+        reset_ok = (move_after_suspend(&host) != 0 && rx.buttons == 1 && rx.presses == presses_before_reset + 1);
+        sent_x += MOVE_DX;
+        sent_y += MOVE_DY;
+    }
+    sys_mouse_click(0);
+    host_advance(&host, 10 * HOST_FRAME_NS);
+    clicks++;
+    uint32_t reset_presses = rx.presses - presses_before_reset;
+
+    report_queue_stats_t stats;
+    usbd_get_queue_stats(&stats);
+    uint64_t irqs = sim_stats.usbd_irqs - irqs_at_start;
+    uint64_t irq_ns = sim_stats.irq_host_ns - irq_ns_at_start;
+    uint64_t irq_regs = sim_stats.usbd_irq_regs - irq_regs_at_start;
+
+    printf("report format:   %s, %u wheel units per detent\n", USBD_HIRES_REPORT ? "16-bit X/Y/wheel" : "8-bit X/Y/wheel",
+           usbd_wheel_resolution());
+    printf("poll interval:   %u ms\n", stats.poll_interval_ms);
+    printf("enumeration:     %.3f ms (USBDETECTED -> MOUSE_READY)\n", enumerated_ns / 1e6);
+    usbd_bringup_stats_t bringup;
+    usbd_get_bringup_stats(&bringup);
+    const char* phases[NUM_BRINGUP_PHASES] = {"detected", "READY", "HFCLK", "USBPWRRDY", "pull-up", "reset", "MOUSE_READY"};
+    printf("power-up (ms):  ");
+    for(uint32_t phase = 0; phase < NUM_BRINGUP_PHASES; phase++){
+        if(bringup.reached & (1 << phase)){
+            printf(" %s %.3f", phases[phase], SIM_CYCLES_TO_NS(bringup.cycles[phase]) / 1e6);
+        }
+    }
+    printf("\n");
+    printf("busy-wait:       %llu iterations, %.3f ms\n", (unsigned long long)sim_stats.spins, sim_stats.spin_ns / 1e6);
+    printf("reports:         %u sent, %llu received, %u coalesced, %u dropped, %u priority, max depth %u\n",
+           stats.sent, (unsigned long long)host.reports, stats.coalesced, stats.dropped, stats.priority,
+           stats.max_depth);
+    printf("idle:            rate %u ms, %u unchanged reports suppressed, %u idle repeats (%u while stationary)\n",
+           idle_rate * 4, stats.suppressed, stats.idle_repeats, idle_reports);
+    printf("host polls:      %llu (%llu NAK)\n", (unsigned long long)host.polls, (unsigned long long)host.naks);
+    printf("motion:          x %lld/%lld, y %lld/%lld, wheel %lld/%lld (received/sent)\n",
+           (long long)rx.x, (long long)sent_x, (long long)rx.y, (long long)sent_y, (long long)rx.wheel, (long long)sent_wheel);
+    printf("clicks:          %u pressed, %u released, %u sent\n", rx.presses - pin_presses - reset_presses, rx.releases - pin_releases,
+           clicks);
+    printf("buttons:         %u pressed, %u released, %u clicked (%u taps); %u changes on the first edge, %u after the lockout\n",
+           pin_presses, pin_releases, BUTTON_CLICKS, taps, buttons.edges, buttons.settled);
+    if(rx.presses_timed > 0){
+        printf("press latency:   avg %.3f ms, max %.3f ms (first edge -> host), edge -> IRQ max %u us\n",
+               rx.press_latency_sum / 1e6 / rx.presses_timed, rx.press_latency_max / 1e6, buttons.max_irq_us);
+    }
+    if(rx.moves_seen > 0){
+        printf("move latency:    min %.3f ms, avg %.3f ms, max %.3f ms\n",
+               rx.latency_min / 1e6, rx.latency_sum / 1e6 / rx.moves_seen, rx.latency_max / 1e6);
+    }
+    printf("suspend:         %u suspends, %u resumes, %u remote wakeups, HFCLK off %.3f of %.3f ms suspended\n",
+           power.suspends, power.resumes, power.remote_wakeups, sim_stats.hfclk_off_ns / 1e6, sim_stats.suspended_ns / 1e6);
+    printf("wake-up:         move -> report %.3f ms (remote wakeup), host resume -> report %.3f ms\n",
+           remote_wakeup_ns / 1e6, host_resume_ns / 1e6);
+    usbd_setup_stats_t setup_stats;
+    usbd_get_setup_stats(&setup_stats);
+    // handler cycles are only meaningful on the target: simulated time does not pass inside a handler
+    printf("SETUP requests:  %u, %u stalled\n", setup_stats.requests, setup_stats.stalls);
+    printf("USBD IRQs:       %llu, %.0f ns host CPU each, %.1f register accesses each\n", (unsigned long long)irqs,
+           irqs ? (double)irq_ns / irqs : 0.0, irqs ? (double)irq_regs / irqs : 0.0);
+
+    // read the firmware's latency trace the way a host tool would: vendor request on EP0
+    trace_stage_stats_t trace[NUM_TRACE_STAGES];
+    host_setup_t get_trace = {0xC0, TRACE_REQ_GET_STATS, 0, 0, sizeof(trace)};
+    if(host_control(&host, &get_trace, (uint8_t*)trace) == sizeof(trace)){
+        const char* names[NUM_TRACE_STAGES] = {"queued", "dma", "host", "total", "resume"};
+        printf("trace (us):      stage      count      min      avg      p50      p90      p99      max\n");
+        for(uint32_t stage = 0; stage < NUM_TRACE_STAGES; stage++){
+            printf("                 %-6s %9u %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", names[stage], trace[stage].count,
+                   SIM_CYCLES_TO_NS(trace[stage].min) / 1e3, SIM_CYCLES_TO_NS(trace[stage].avg) / 1e3,
+                   SIM_CYCLES_TO_NS(trace[stage].p50) / 1e3, SIM_CYCLES_TO_NS(trace[stage].p90) / 1e3,
+                   SIM_CYCLES_TO_NS(trace[stage].p99) / 1e3, SIM_CYCLES_TO_NS(trace[stage].max) / 1e3);
+        }
+    }else{
+        sim_error("vendor request TRACE_REQ_GET_STATS failed");
+    }
+
+    if(sim_stats.errors != 0){
+        failed = 1;
+    }
+    if(stats.dropped == 0 && (rx.x != sent_x || rx.y != sent_y || rx.wheel != sent_wheel)){
+        printf("FAIL: motion lost or duplicated\n");
+        failed = 1;
+    }
+    if(idle_rate == 0 && (rx.unchanged != 0 || stats.suppressed == 0)){
+        printf("FAIL: unchanged reports were sent with idle rate 0\n");
+        failed = 1;
+    }
+    // the first repeat may fall into the frames before the stationary phase
+    uint32_t expected_repeats = idle_rate ? STATIONARY_FRAMES / (idle_rate * 4) : 0;
+    if(idle_rate != 0 && idle_reports + 1 < expected_repeats){
+        printf("FAIL: %u idle repeats while stationary, expected %u\n", idle_reports, expected_repeats);
+        failed = 1;
+    }
+    if(rx.presses - pin_presses - reset_presses != clicks || rx.releases - pin_releases != clicks){
+        printf("FAIL: clicks lost or merged\n");
+        failed = 1;
+    }
+    if(!drag_ok){
+        printf("FAIL: drag did not arrive as press, two held moves, release\n");
+        failed = 1;
+    }
+    if(!reset_ok){
+        printf("FAIL: a button held across a bus reset was not pressed again\n");
+        failed = 1;
+    }
+    if(pin_presses != BUTTON_CLICKS || pin_releases != BUTTON_CLICKS || rx.presses_timed != BUTTON_CLICKS ||
+       buttons.settled != taps || buttons.dropped != 0){
+        printf("FAIL: physical button changes lost, or bounces reported\n");
+        failed = 1;
+    }
+    if(!hfclk_stopped){
+        printf("FAIL: HFCLK still running while suspended\n");
+        failed = 1;
+    }
+    if(remote_wakeup_ns == 0 || host_resume_ns == 0 || power.remote_wakeups != 1 || host.remote_wakeups != 1){
+        printf("FAIL: no report within %u ms of a move after suspend\n", WAKEUP_TIMEOUT_FRAMES);
+        failed = 1;
+    }
+    if(sim_stats.errors != 0){
+        printf("FAIL: %u simulator errors\n", sim_stats.errors);
+    }
+    free(rx.move_time);
+    free(rx.move_target_x);
+    return failed;
+}
@@ -0,0 +1,403 @@
+/**
+ * @file usb_host.c
+ * @name Scripted full-speed USB host driving the simulated USBD.
+ *
+ * Control transfers are run transaction by transaction: the host raises
+ * EP0SETUP, then NAKs (retrying every xact_ns) until the firmware has
+ * armed the next data chunk or requested the status stage. EP1 is polled
+ * once every bInterval frames after SET_CONFIGURATION. While the bus is
+ * suspended no SOF is sent; a resume driven by the device (remote wakeup)
+ * is answered with resume_ns of resume signalling, like a root hub does.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <nrf_model.h>
+#include <usb_host.h>
+
+/** @brief register offsets the host writes */
+#define USBD_EV_USBRESET offsetof(usbd_regs_t, EVENTS_USBRESET)
+#define USBD_EV_EP0DATADONE offsetof(usbd_regs_t, EVENTS_EP0DATADONE)
+#define USBD_EV_SOF offsetof(usbd_regs_t, EVENTS_SOF)
+#define USBD_EV_EP0SETUP offsetof(usbd_regs_t, EVENTS_EP0SETUP)
+#define USBD_EV_EPDATA offsetof(usbd_regs_t, EVENTS_EPDATA)
+#define USBD_EPDATASTATUS offsetof(usbd_regs_t, EPDATASTATUS)
+#define USBD_USBADDR offsetof(usbd_regs_t, USBADDR)
+#define USBD_BMREQUESTTYPE offsetof(usbd_regs_t, BMREQUESTTYPE)
+#define USBD_BREQUEST offsetof(usbd_regs_t, BREQUEST)
+#define USBD_WVALUEL offsetof(usbd_regs_t, WVALUEL)
+#define USBD_WVALUEH offsetof(usbd_regs_t, WVALUEH)
+#define USBD_WINDEXL offsetof(usbd_regs_t, WINDEXL)
+#define USBD_WINDEXH offsetof(usbd_regs_t, WINDEXH)
+#define USBD_WLENGTHL offsetof(usbd_regs_t, WLENGTHL)
+#define USBD_WLENGTHH offsetof(usbd_regs_t, WLENGTHH)
+#define USBD_SIZE_EPOUT(n) (offsetof(usbd_regs_t, SIZE_EPOUT) + (n) * 4)
+#define USBD_FRAMECNTR offsetof(usbd_regs_t, FRAMECNTR)
+
+/** @brief standard requests used during enumeration */
+#define REQ_GET_DESCRIPTOR 0x06
+#define REQ_SET_ADDRESS 0x05
+#define REQ_SET_CONFIGURATION 0x09
+#define REQ_HID_SET_IDLE 0x0A
+#define REQ_SET_FEATURE 0x03
+#define FEATURE_DEVICE_REMOTE_WAKEUP 1
+
+/** @brief address the host assigns */
+#define HOST_DEVICE_ADDRESS 5
+
+/** @name host_init
+ * @brief Sets up the host with default timing
+*/
+void host_init(usb_host_t* host){
+    memset(host, 0, sizeof(*host));
+    host->timing.attach_debounce_ns = 100000000ull;
+    host->timing.reset_ns = 10000000ull;
+    host->timing.reset_recovery_ns = 10000000ull;
+    host->timing.set_address_recovery_ns = 2000000ull;
+    host->timing.xact_ns = 10000ull;
+    host->timing.stage_timeout_ns = 50000000ull;
+    host->timing.suspend_ns = 3000000ull;
+    host->timing.resume_ns = 20000000ull;
+    host->next_frame_ns = sim_time_ns + HOST_FRAME_NS;
+}
+
+/** @name poll_ep1
+ * @brief Interrupt IN token to EP1
+*/
+static void poll_ep1(usb_host_t* host){
+    host->polls++;
+    if(!sim_ep_in[1].full){
+        host->naks++;
+        return;
+    }
+    uint8_t report[64];
+    uint32_t len = sim_ep_in[1].len;
+    memcpy(report, sim_ep_in[1].data, len);
+    sim_ep_in[1].full = 0;
+    host->reports++;
+    SIM_REG(sim_usbd_regs, USBD_EPDATASTATUS) |= (1 << 1);
+    sim_usbd_event(USBD_EV_EPDATA);
+    if(host->on_report != 0){
+        host->on_report(report, len, sim_time_ns, host->ctx);
+    }
+    sim_run_irqs();
+}
+
+/** @name start_frame
+ * @brief SOF, then the periodic EP1 poll when it is due
+*/
+static void start_frame(usb_host_t* host){
+    host->frame++;
+    SIM_REG(sim_usbd_regs, USBD_FRAMECNTR) = host->frame & 0x7FF;
+    sim_usbd_event(USBD_EV_SOF);
+    sim_run_irqs();
+    if(host->configured && host->ep1_interval != 0 && (host->frame % host->ep1_interval) == 0){
+        poll_ep1(host);
+    }
+}
+
+/** @name host_run_until
+ * @brief Runs the bus until the given absolute simulated time
+*/
+void host_run_until(usb_host_t* host, uint64_t time_ns){
+    while(host->next_frame_ns <= time_ns){
+        if(host->next_frame_ns > sim_time_ns){
+            sim_advance(host->next_frame_ns - sim_time_ns);
+        }
+        host->next_frame_ns += HOST_FRAME_NS;
+        if(host->suspended){
+            // the device drove a resume: answer it, then the bus is back after resume_ns
+            if(sim_remote_wakeup && host->resume_due == 0){
+                host->resume_due = sim_time_ns + host->timing.resume_ns;
+                host->remote_wakeups++;
+            }
+            if(host->resume_due != 0 && sim_time_ns >= host->resume_due){
+                host->suspended = 0;
+                host->resume_due = 0;
+                sim_bus_resume();
+                sim_run_irqs();
+            }
+            continue;
+        }
+        if(sim_pullup()){
+            start_frame(host);
+        }
+    }
+    if(time_ns > sim_time_ns){
+        sim_advance(time_ns - sim_time_ns);
+    }
+}
+
+/** @name host_advance
+ * @brief Lets ns of simulated time pass on the bus
+*/
+void host_advance(usb_host_t* host, uint64_t ns){
+    host_run_until(host, sim_time_ns + ns);
+}
+
+/** @name host_wait_attach
+ * @brief Waits until the device has enabled its pull-up
+*/
+int host_wait_attach(usb_host_t* host, uint64_t timeout_ns){
+    uint64_t end = sim_time_ns + timeout_ns;
+    while(!sim_pullup()){
+        if(sim_time_ns >= end){
+            return HOST_ERR_TIMEOUT;
+        }
+        host_advance(host, host->timing.xact_ns);
+    }
+    return HOST_OK;
+}
+
+/** @name host_bus_reset
+ * @brief Drives a bus reset; the USBD forgets its address and endpoint buffers
+*/
+void host_bus_reset(usb_host_t* host){
+    host->address = 0;
+    host->configured = 0;
+    host->suspended = 0;
+    host->resume_due = 0;
+    SIM_REG(sim_usbd_regs, USBD_USBADDR) = 0;
+    memset(sim_ep_in, 0, sizeof(sim_ep_in));
+    memset(sim_ep_out, 0, sizeof(sim_ep_out));
+    sim_ep0_status = 0;
+    sim_ep0_rcvout = 0;
+    sim_ep0_stall = 0;
+    sim_usbd_event(USBD_EV_USBRESET);
+    sim_run_irqs();
+    host_advance(host, host->timing.reset_ns);
+}
+
+/** @name wait_ep0
+ * @brief NAKs until flag becomes set, the endpoint stalls or the stage times out
+*/
+static int wait_ep0(usb_host_t* host, int* flag){
+    uint64_t end = sim_time_ns + host->timing.stage_timeout_ns;
+    while(!*flag){
+        if(sim_ep0_stall){
+            sim_ep0_stall = 0;
+            return HOST_ERR_STALL;
+        }
+        if(sim_time_ns >= end){
+            return HOST_ERR_TIMEOUT;
+        }
+        host_advance(host, host->timing.xact_ns);
+    }
+    return HOST_OK;
+}
+
+/** @name host_control
+ * @brief Runs one control transfer (SETUP, optional DATA stage, STATUS)
+ * @return number of bytes transferred in the DATA stage, or HOST_ERR_*
+*/
+int host_control(usb_host_t* host, const host_setup_t* setup, uint8_t* data){
+    sim_ep0_status = 0;
+    sim_ep0_rcvout = 0;
+    sim_ep0_stall = 0;
+    sim_ep_in[0].full = 0;
+    SIM_REG(sim_usbd_regs, USBD_BMREQUESTTYPE) = setup->bmRequestType;
+    SIM_REG(sim_usbd_regs, USBD_BREQUEST) = setup->bRequest;
+    SIM_REG(sim_usbd_regs, USBD_WVALUEL) = setup->wValue & 0xFF;
+    SIM_REG(sim_usbd_regs, USBD_WVALUEH) = setup->wValue >> 8;
+    SIM_REG(sim_usbd_regs, USBD_WINDEXL) = setup->wIndex & 0xFF;
+    SIM_REG(sim_usbd_regs, USBD_WINDEXH) = setup->wIndex >> 8;
+    SIM_REG(sim_usbd_regs, USBD_WLENGTHL) = setup->wLength & 0xFF;
+    SIM_REG(sim_usbd_regs, USBD_WLENGTHH) = setup->wLength >> 8;
+    if(setup->bmRequestType == 0x00 && setup->bRequest == REQ_SET_ADDRESS){
+        // the USBD answers SET_ADDRESS in hardware, software only sees the SETUP
+        SIM_REG(sim_usbd_regs, USBD_USBADDR) = setup->wValue & 0x7F;
+        sim_usbd_event(USBD_EV_EP0SETUP);
+        host_advance(host, host->timing.xact_ns);
+        host->address = setup->wValue & 0x7F;
+        return 0;
+    }
+    sim_usbd_event(USBD_EV_EP0SETUP);
+    host_advance(host, host->timing.xact_ns);
+
+    uint32_t done = 0;
+    int status;
+    if((setup->bmRequestType & 0x80) != 0){
+        // DATA IN: read chunks until wLength bytes or a short packet
+        while(done < setup->wLength){
+            status = wait_ep0(host, &sim_ep_in[0].full);
+            if(status != HOST_OK){
+                return status;
+            }
+            uint32_t len = sim_ep_in[0].len;
+            if(done + len > setup->wLength){
+                return HOST_ERR_PROTOCOL;
+            }
+            memcpy(data + done, sim_ep_in[0].data, len);
+            done += len;
+            sim_ep_in[0].full = 0;
+            sim_usbd_event(USBD_EV_EP0DATADONE);
+            host_advance(host, host->timing.xact_ns);
+            if(len < 64){
+                break;
+            }
+        }
+    }else{
+        // DATA OUT: send a chunk each time the firmware is ready for one
+        while(done < setup->wLength){
+            status = wait_ep0(host, &sim_ep0_rcvout);
+            if(status != HOST_OK){
+                return status;
+            }
+            sim_ep0_rcvout = 0;
+            uint32_t len = setup->wLength - done;
+            if(len > 64){
+                len = 64;
+            }
+            memcpy(sim_ep_out[0].data, data + done, len);
+            sim_ep_out[0].len = len;
+            sim_ep_out[0].full = 1;
+            SIM_REG(sim_usbd_regs, USBD_SIZE_EPOUT(0)) = len;
+            done += len;
+            sim_usbd_event(USBD_EV_EP0DATADONE);
+            host_advance(host, host->timing.xact_ns);
+        }
+    }
+    status = wait_ep0(host, &sim_ep0_status);
+    if(status != HOST_OK){
+        return status;
+    }
+    sim_ep0_status = 0;
+    return (int)done;
+}
+
+/** @name host_suspend
+ * @brief Arms remote wakeup when the device supports it and stops the SOFs
+ * @note  The device sees SUSPEND after suspend_ns of idle bus
+*/
+int host_suspend(usb_host_t* host){
+    if(host->remote_wakeup){
+        host_setup_t set_feature = {0x00, REQ_SET_FEATURE, FEATURE_DEVICE_REMOTE_WAKEUP, 0, 0};
+        int status = host_control(host, &set_feature, 0);
+        if(status < 0){
+            fprintf(stderr, "host: SET_FEATURE(DEVICE_REMOTE_WAKEUP) failed: %d\n", status);
+            return status;
+        }
+    }
+    host->suspended = 1;
+    host->resume_due = 0;
+    host_advance(host, host->timing.suspend_ns);
+    sim_bus_suspend();
+    sim_run_irqs();
+    return HOST_OK;
+}
+
+/** @name host_resume
+ * @brief Drives resume signalling for resume_ns, then restarts the SOFs
+*/
+void host_resume(usb_host_t* host){
+    if(!host->suspended){
+        return;
+    }
+    if(host->resume_due == 0){
+        host->resume_due = sim_time_ns + host->timing.resume_ns;
+    }
+    while(host->suspended){
+        host_advance(host, HOST_FRAME_NS);
+    }
+}
+
+/** @name get_descriptor
+ * @brief GET_DESCRIPTOR helper (standard device, or HID interface when recipient is 0x81)
+*/
+static int get_descriptor(usb_host_t* host, uint8_t request_type, uint8_t type, uint16_t length, uint8_t* data){
+    host_setup_t setup = {request_type, REQ_GET_DESCRIPTOR, (uint16_t)(type << 8), 0, length};
+    return host_control(host, &setup, data);
+}
+
+/** @name host_enumerate
+ * @brief Enumerates the device the way Linux does for a HID mouse
+*/
+int host_enumerate(usb_host_t* host){
+    uint8_t buf[1024];
+    int status;
+
+    memset(host->phase_ns, 0, sizeof(host->phase_ns));
+    host->phase_ns[HOST_PHASE_START] = sim_time_ns;
+    status = host_wait_attach(host, 1000000000ull);
+    if(status != HOST_OK){
+        fprintf(stderr, "host: device never attached\n");
+        return status;
+    }
+    host->phase_ns[HOST_PHASE_ATTACH] = sim_time_ns;
+    host_advance(host, host->timing.attach_debounce_ns);
+    host_bus_reset(host);
+    host_advance(host, host->timing.reset_recovery_ns);
+    host->phase_ns[HOST_PHASE_RESET] = sim_time_ns;
+
+    // first 64 bytes of the device descriptor to learn bMaxPacketSize0
+    status = get_descriptor(host, 0x80, 1, 64, buf);
+    if(status < 8){
+        fprintf(stderr, "host: GET_DESCRIPTOR(device) failed: %d\n", status);
+        return status < 0 ? status : HOST_ERR_PROTOCOL;
+    }
+    host_bus_reset(host);
+    host_advance(host, host->timing.reset_recovery_ns);
+    host->phase_ns[HOST_PHASE_DEVICE64] = sim_time_ns;
+
+    host_setup_t set_address = {0x00, REQ_SET_ADDRESS, HOST_DEVICE_ADDRESS, 0, 0};
+    host_control(host, &set_address, 0);
+    host_advance(host, host->timing.set_address_recovery_ns);
+    host->phase_ns[HOST_PHASE_ADDRESS] = sim_time_ns;
+
+    status = get_descriptor(host, 0x80, 1, 18, buf);
+    if(status != 18){
+        fprintf(stderr, "host: GET_DESCRIPTOR(device, 18) failed: %d\n", status);
+        return status < 0 ? status : HOST_ERR_PROTOCOL;
+    }
+    status = get_descriptor(host, 0x80, 2, 9, buf);
+    if(status != 9){
+        fprintf(stderr, "host: GET_DESCRIPTOR(config, 9) failed: %d\n", status);
+        return status < 0 ? status : HOST_ERR_PROTOCOL;
+    }
+    uint16_t total = buf[2] | (buf[3] << 8);
+    host->remote_wakeup = (buf[7] & (1 << 5)) != 0;
+    if(total > sizeof(buf)){
+        return HOST_ERR_PROTOCOL;
+    }
+    status = get_descriptor(host, 0x80, 2, total, buf);
+    if(status != total){
+        fprintf(stderr, "host: GET_DESCRIPTOR(config, %u) failed: %d\n", total, status);
+        return status < 0 ? status : HOST_ERR_PROTOCOL;
+    }
+    // walk the descriptors for the HID descriptor and the interrupt IN endpoint
+    for(uint32_t i = 0; i + 1 < total && buf[i] != 0; i += buf[i]){
+        if(buf[i + 1] == 0x21 && i + 8 < total){
+            host->report_desc_len = buf[i + 7] | (buf[i + 8] << 8);
+        }else if(buf[i + 1] == 5 && buf[i + 2] == 0x81 && i + 6 < total){
+            host->ep1_max_packet = buf[i + 4] | (buf[i + 5] << 8);
+            host->ep1_interval = buf[i + 6];
+        }
+    }
+    if(host->ep1_interval == 0 || host->report_desc_len == 0){
+        fprintf(stderr, "host: no HID interrupt IN endpoint found\n");
+        return HOST_ERR_PROTOCOL;
+    }
+
+    host->phase_ns[HOST_PHASE_DESCRIPTORS] = sim_time_ns;
+
+    host_setup_t set_config = {0x00, REQ_SET_CONFIGURATION, 1, 0, 0};
+    status = host_control(host, &set_config, 0);
+    if(status < 0){
+        fprintf(stderr, "host: SET_CONFIGURATION failed: %d\n", status);
+        return status;
+    }
+    host->configured = 1;
+    host->phase_ns[HOST_PHASE_CONFIGURED] = sim_time_ns;
+
+    // HID class set-up: SET_IDLE(0) may be stalled by devices that do not support it
+    host_setup_t set_idle = {0x21, REQ_HID_SET_IDLE, 0, 0, 0};
+    host_control(host, &set_idle, 0);
+
+    status = get_descriptor(host, 0x81, 0x22, host->report_desc_len, buf);
+    if(status != host->report_desc_len){
+        fprintf(stderr, "host: GET_DESCRIPTOR(report) failed: %d\n", status);
+        return status < 0 ? status : HOST_ERR_PROTOCOL;
+    }
+    host->phase_ns[HOST_PHASE_REPORT] = sim_time_ns;
+    return HOST_OK;
+}
@@ -0,0 +1,95 @@
+/** @file   usb_host.h
+ *  @brief  scripted full-speed USB host for the simulator
+**/
+
+#ifndef _USB_HOST_H_
+#define _USB_HOST_H_
+
+#include <stdint.h>
+
+/** @brief errors returned by the host functions */
+#define HOST_OK 0
+#define HOST_ERR_TIMEOUT -1
+#define HOST_ERR_STALL -2
+#define HOST_ERR_PROTOCOL -3
+
+/** @brief length of one full-speed frame */
+#define HOST_FRAME_NS 1000000ull
+
+/** @brief a SETUP packet */
+typedef struct{
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+}host_setup_t;
+
+/** @brief steps of host_enumerate, in order; phase_ns holds the time each one finished */
+enum HOST_ENUM_PHASE{
+    HOST_PHASE_START = 0,   // host_enumerate called
+    HOST_PHASE_ATTACH,      // pull-up seen
+    HOST_PHASE_RESET,       // first bus reset and its recovery (after the attach debounce)
+    HOST_PHASE_DEVICE64,    // GET_DESCRIPTOR(device, 64) and the second reset
+    HOST_PHASE_ADDRESS,     // SET_ADDRESS and its recovery
+    HOST_PHASE_DESCRIPTORS, // GET_DESCRIPTOR(device) and GET_DESCRIPTOR(configuration)
+    HOST_PHASE_CONFIGURED,  // SET_CONFIGURATION
+    HOST_PHASE_REPORT,      // SET_IDLE and GET_DESCRIPTOR(report)
+    HOST_NUM_PHASES
+};
+
+/** @brief bus timing of the host (ns) */
+typedef struct{
+    uint64_t attach_debounce_ns;      // pull-up seen -> first reset
+    uint64_t reset_ns;                // length of a bus reset
+    uint64_t reset_recovery_ns;       // after a bus reset
+    uint64_t set_address_recovery_ns; // after SET_ADDRESS
+    uint64_t xact_ns;                 // one control transaction / NAK retry
+    uint64_t stage_timeout_ns;        // give up on a control stage after this long
+    uint64_t suspend_ns;              // idle bus (no SOF) -> the device sees SUSPEND
+    uint64_t resume_ns;               // length of the resume signalling driven by the host
+}host_timing_t;
+
+/** @brief the host and what it learned about the device */
+typedef struct{
+    host_timing_t timing;
+    uint8_t address;
+    int configured;
+    int remote_wakeup;           // the configuration supports remote wakeup (bmAttributes bit 5)
+    int suspended;               // no SOFs or polls are sent
+    uint64_t resume_due;         // end of the resume signalling in progress (0: none)
+    uint64_t remote_wakeups;     // remote wakeups answered by the host
+    uint64_t phase_ns[HOST_NUM_PHASES];    // simulated time at the end of each enumeration step
+    uint8_t ep1_interval;        // bInterval of EP1 IN (ms)
+    uint16_t ep1_max_packet;     // wMaxPacketSize of EP1 IN
+    uint16_t report_desc_len;    // wDescriptorLength of the HID report descriptor
+    uint64_t frame;              // current frame number
+    uint64_t next_frame_ns;      // start of the next frame
+    uint64_t polls;              // interrupt IN tokens sent to EP1
+    uint64_t naks;               // ... that found no data
+    uint64_t reports;            // ... that returned a report
+    /** @brief called for every report received on EP1 */
+    void (*on_report)(const uint8_t* report, uint32_t len, uint64_t time_ns, void* ctx);
+    void* ctx;
+}usb_host_t;
+
+/** @brief set up the host with default (Linux-like) timing */
+void host_init(usb_host_t* host);
+/** @brief let simulated time pass; SOFs and EP1 polling happen on frame boundaries */
+void host_advance(usb_host_t* host, uint64_t ns);
+/** @brief run until the given absolute simulated time */
+void host_run_until(usb_host_t* host, uint64_t time_ns);
+/** @brief wait until the device enables its pull-up */
+int host_wait_attach(usb_host_t* host, uint64_t timeout_ns);
+/** @brief drive a bus reset */
+void host_bus_reset(usb_host_t* host);
+/** @brief run a control transfer; returns the number of bytes of the data stage or an error */
+int host_control(usb_host_t* host, const host_setup_t* setup, uint8_t* data);
+/** @brief full enumeration: descriptors, address, configuration, HID set-up */
+int host_enumerate(usb_host_t* host);
+/** @brief arm remote wakeup (if supported) and suspend the bus */
+int host_suspend(usb_host_t* host);
+/** @brief drive a resume from the host side and wait for it to end */
+void host_resume(usb_host_t* host);
+
+#endif /* _USB_HOST_H_ */
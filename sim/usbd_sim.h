@@ -0,0 +1,55 @@
+/** @file   usbd_sim.h
+ *  @brief  register space and hooks the firmware sees in the host simulator
+ *  @note   Included by usbd.h when building with -DUSBD_SIM. The register
+ *          blocks of nrf_regs.h then lie over the arrays below instead of
+ *          the nRF52840 MMIO space, and their accesses go to the model.
+**/
+
+#ifndef _USBD_SIM_H_
+#define _USBD_SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** @brief each simulated peripheral occupies one 4 KB page of 32-bit registers */
+#define SIM_PAGE_WORDS 1024
+
+/** @brief simulated register pages */
+extern volatile uint32_t sim_usbd_regs[SIM_PAGE_WORDS];    // USBD      0x40027000
+extern volatile uint32_t sim_power_regs[SIM_PAGE_WORDS];   // POWER and CLOCK share 0x40000000
+extern volatile uint32_t sim_nvic_regs[SIM_PAGE_WORDS];    // System Control Space 0xE000E000
+extern volatile uint32_t sim_errata_regs[SIM_PAGE_WORDS];  // undocumented errata registers 0x4006E000
+extern volatile uint32_t sim_dwt_regs[SIM_PAGE_WORDS];     // Data Watchpoint and Trace 0xE0001000
+extern volatile uint32_t sim_p0_regs[SIM_PAGE_WORDS];      // GPIO P0   0x50000000
+extern volatile uint32_t sim_gpiote_regs[SIM_PAGE_WORDS];  // GPIOTE    0x40006000
+extern volatile uint32_t sim_timer3_regs[SIM_PAGE_WORDS];  // TIMER3    0x4001A000
+extern volatile uint32_t sim_ppi_regs[SIM_PAGE_WORDS];     // PPI       0x4001F000
+
+#define USBD_BASE ((uintptr_t)sim_usbd_regs)
+#define POWER_BASE ((uintptr_t)sim_power_regs)
+#define CLOCK_BASE ((uintptr_t)sim_power_regs)
+#define NVIC_BASE ((uintptr_t)sim_nvic_regs)
+#define ERRATA_BASE ((uintptr_t)sim_errata_regs)
+#define DWT_BASE ((uintptr_t)sim_dwt_regs)
+#define P0_BASE ((uintptr_t)sim_p0_regs)
+#define GPIOTE_BASE ((uintptr_t)sim_gpiote_regs)
+#define TIMER3_BASE ((uintptr_t)sim_timer3_regs)
+#define PPI_BASE ((uintptr_t)sim_ppi_regs)
+
+/** @brief register access backend of nrf_regs.h: every firmware access is counted and checked by the model */
+uint32_t sim_reg_read(const volatile uint32_t* reg);
+void sim_reg_write(volatile uint32_t* reg, uint32_t value);
+#define REG_READ(reg) sim_reg_read(&(reg))
+#define REG_WRITE(reg, value) sim_reg_write(&(reg), (value))
+
+/** @brief host pointers do not fit into the 32-bit EasyDMA PTR registers, hand out a handle instead */
+uint32_t sim_dma_addr(const volatile void* ptr);
+#define USBD_DMA_ADDR(ptr) sim_dma_addr(ptr)
+/** @brief ... and for the event / task registers a PPI channel connects */
+#define PPI_ADDR(reg) sim_dma_addr(&(reg))
+
+/** @brief called from firmware busy-wait loops; advances simulated time and the peripheral model */
+void sim_spin();
+#define USBD_SPIN_HOOK() sim_spin()
+
+#endif /* _USBD_SIM_H_ */
@@ -6,22 +6,79 @@
 #include <usbd.h>
 #include <syscall_mouse.h>
 #include <printk.h>
+#include <usbd_trace.h>
+
+/*
+ * The syscalls below only queue the report (see usbd_queue_report) and return
+ * immediately. The report is copied, so it may live on the caller's stack;
+ * EasyDMA only ever reads the USBD layer's static report slots. Reports are
+ * sent by USBD_IRQHandler whenever the host polls EP1 and the mouse is ready.
+ */
+
+/** @brief buttons held since the last sys_mouse_click; every report carries them */
+static uint8_t current_buttons = 0;
+
+/** @brief capture of every queued report, 0 while not recording */
+static rec_writer_t* report_recorder = 0;
+/** @brief cycle counter at the last timestamp, and the cycles since recording started */
+static uint32_t record_last_cycles = 0;
+static uint64_t record_cycles = 0;
+
+/** @name sys_mouse_record
+ * @brief Starts or stops recording the reports queued by the syscalls
+ * @param  writer  an initialized capture (timestamps start at 0 now), or 0 to stop
+ * @note   The 32-bit cycle counter is extended on every report, so gaps
+ *         between reports must stay below one wrap (~67 s); a longer idle
+ *         gap is recorded shortened by a multiple of the wrap.
+ */
+void sys_mouse_record(rec_writer_t* writer){
+    record_last_cycles = trace_now();
+    record_cycles = 0;
+    report_recorder = writer;
+}
+
+/** @name queue_report
+ * @brief Records the report if a capture is running, then queues it for EP1
+ */
+static void queue_report(const input_report_t* input_report){
+    if(report_recorder != 0){
+        uint32_t now = trace_now();
+        record_cycles += now - record_last_cycles;
+        record_last_cycles = now;
+        rec_write(report_recorder, record_cycles / (TRACE_CPU_HZ / 1000000), input_report);
+    }
+    send_data(1, (const uint8_t*)input_report, sizeof(input_report_t), sizeof(input_report_t));
+}
 
 /** @name sys_mouse_move
  * @brief syscall to move mouse by specified coordinates 
  * @param  x  coordinates to move mouse horizontally
  * @param  y  coordinates to move mouse vertically
  */
-void sys_mouse_move(int8_t x, int8_t y){
-    while(MOUSE_READY != 1){
-        // wait for the USB to initialize and mouse to get ready
-    }
+void sys_mouse_move(mouse_delta_t x, mouse_delta_t y){
+    trace_syscall_entry();
     input_report_t input_report;
-    input_report.buttons = (0x0);
+    input_report.buttons = current_buttons;
     input_report.X = x;
     input_report.Y = y;
     input_report.Wheel = 0;
-    send_data(1, (uint8_t*)&input_report, sizeof(input_report_t), sizeof(input_report_t));
+    queue_report(&input_report);
+}
+
+/** @brief fine scroll steps not sent yet because the host reads whole detents */
+static int32_t scroll_remainder = 0;
+
+/** @name queue_scroll
+ * @brief Queues a wheel-only report
+ * @param  wheel  wheel units, as the host currently expects them
+ */
+static void queue_scroll(int32_t wheel){
+    input_report_t input_report;
+    input_report.buttons = current_buttons;
+    input_report.X = 0;
+    input_report.Y = 0;
+    input_report.Wheel = (mouse_delta_t)wheel;
+    queue_report(&input_report);
 }
 
 /** @name sys_mouse_scroll
@@ -29,31 +86,45 @@ void sys_mouse_move(int8_t x, int8_t y){
  * @param  wheel  +ve value to scroll mouse up; -ve value to scroll down
  */
 void sys_mouse_scroll(int8_t wheel){
-    while(MOUSE_READY != 1){
-        // wait for the USB to initialize and mouse to get ready
+    trace_syscall_entry();
+    queue_scroll(wheel * (int32_t)usbd_wheel_resolution());
+}
+
+/** @name sys_mouse_scroll_fine
+ * @brief syscall to scroll by a fraction of a detent
+ * @param  units  1/USBD_WHEEL_MULTIPLIER detent steps (+ve up, -ve down)
+ * @note   If the host did not enable the Resolution Multiplier, steps are
+ *         collected until they add up to a whole detent.
+ */
+void sys_mouse_scroll_fine(mouse_delta_t units){
+    trace_syscall_entry();
+    uint32_t resolution = usbd_wheel_resolution();
+    if(resolution == USBD_WHEEL_MULTIPLIER){
+        queue_scroll(units);
+        return;
+    }
+    scroll_remainder += units;
+    int32_t detents = scroll_remainder / USBD_WHEEL_MULTIPLIER;
+    if(detents != 0){
+        scroll_remainder -= detents * USBD_WHEEL_MULTIPLIER;
+        queue_scroll(detents);
     }
-    input_report_t input_report;
-    input_report.buttons = (0x0);
-    input_report.X = 0;
-    input_report.Y = 0;
-    input_report.Wheel = wheel;
-    send_data(1, (uint8_t*)&input_report, sizeof(input_report_t), sizeof(input_report_t));
 }
 
 /** @name sys_mouse_click
- * @brief syscall to perform a mouse button click action 
- * @param  button  1 to left click; 2 to right click
- *          
+ * @brief syscall to press or release mouse buttons
+ * @param  button  buttons held from now on (bit 0 left, bit 1 right); 0 releases them
+ * @note   The buttons stay held, and moves and scrolls carry them, until the
+ *         next call changes them (a drag is click(1), moves, click(0)).
  */
 void sys_mouse_click(uint8_t button){
-    while(MOUSE_READY != 1){
-        // wait for the USB to initialize and mouse to get ready
-    }
+    trace_syscall_entry();
+    current_buttons = button;
     input_report_t input_report;
-    input_report.buttons = button; // | 0x8
+    input_report.buttons = button;
     input_report.X = 0;
     input_report.Y = 0;
     input_report.Wheel = 0;
-    send_data(1, (uint8_t*)&input_report, sizeof(input_report_t), sizeof(input_report_t));
+    queue_report(&input_report);
 }
 
@@ -5,17 +5,25 @@
  *
 **/
 #include <unistd.h>
+#include <usbd.h>
+#include <report_rec.h>
 
 #ifndef _SYSCALL_MOUSE_H_
 #define _SYSCALL_MOUSE_H_
 
 /** @brief syscall to move mouse by specified coordinates */
-void sys_mouse_move(int8_t x, int8_t y);
+void sys_mouse_move(mouse_delta_t x, mouse_delta_t y);
 
-/** @brief syscall to scroll mouse */
+/** @brief syscall to scroll mouse (in detents) */
 void sys_mouse_scroll(int8_t wheel);
 
-/** @brief syscall to emulate mouse left or right click */
+/** @brief syscall to scroll mouse in 1/USBD_WHEEL_MULTIPLIER detent steps */
+void sys_mouse_scroll_fine(mouse_delta_t units);
+
+/** @brief syscall to press / release mouse buttons; they stay held (and moves carry them) until the next call */
 void sys_mouse_click(uint8_t button);
 
+/** @brief record every report the syscalls queue into writer (0 stops recording) */
+void sys_mouse_record(rec_writer_t* writer);
+
 #endif /* _SYSCALL_MOUSE_H_ */
\ No newline at end of file
@@ -4,26 +4,416 @@
 */
 
 #include<usbd.h>
-#include<printk.h>
+#include<usbd_log.h>
 #include<arm.h>
+#include<usbd_trace.h>
+#include<usbd_ep.h>
+#include<gpio_buttons.h>
+
+/** @brief System Control Space and errata register block */
+#ifndef NVIC_BASE
+#define NVIC_BASE 0xE000E000
+#endif
+#ifndef ERRATA_BASE
+#define ERRATA_BASE 0x4006E000
+#endif
 
 /** @brief Enable USBD and POWERCLCK interrupts */
-#define NVIC_ISER0 (volatile uint32_t*) 0xE000E100
-#define NVIC_ISER1 (volatile uint32_t*) 0xE000E104
+#define NVIC_ISER0 (volatile uint32_t*) (NVIC_BASE + 0x100)
+#define NVIC_ISER1 (volatile uint32_t*) (NVIC_BASE + 0x104)
+/** @brief Set USBD interrupt pending (used to kick the EP1 queue from thread context) */
+#define NVIC_ISPR1 (volatile uint32_t*) (NVIC_BASE + 0x204)
+#define USBD_IRQ_BIT (1 << 7)
+
+/** @brief Errata #187: USBD cannot be enabled */
+#define USBD_ERRATA_187_KEY (volatile uint32_t*) (ERRATA_BASE + 0xC00)
+#define USBD_ERRATA_187_VAL (volatile uint32_t*) (ERRATA_BASE + 0xD14)
+
+/** @brief keeps the compiler from moving memory accesses across this point */
+#define COMPILER_BARRIER() __asm__ volatile("" ::: "memory")
 
-/** @brief mouse device descriptor */
-device_desc_t mouse_dev_desc;
-/** @brief mouse configuration descriptor */
-configuration_desc_t mouse_config_desc;
 /** @brief The "USB host" is ready to receive mouse reports (ie. actions) when this value becomes 0x1 */
 volatile uint32_t MOUSE_READY = 0x0;
 
+/**
+ * @brief EP1 input report queue
+ * Single producer (syscalls) / single consumer (USBD_IRQHandler) ring.
+ * Only the producer writes the tail and only the consumer writes the head,
+ * so no locking is needed on a single core.
+*/
+static input_report_t report_queue[REPORT_QUEUE_SIZE];
+/** @brief cycle counter at the syscall that queued each report (see usbd_trace.h) */
+static uint32_t report_queue_cycles[REPORT_QUEUE_SIZE];
+static volatile uint32_t report_queue_head = 0;
+static volatile uint32_t report_queue_tail = 0;
+static volatile uint32_t report_queue_max_depth = 0;
+static volatile uint32_t report_queue_dropped = 0;
+static volatile uint32_t report_queue_sent = 0;
+static volatile uint32_t report_queue_coalesced = 0;
+static volatile uint32_t report_queue_suppressed = 0;
+static volatile uint32_t report_queue_idle_repeats = 0;
+static volatile uint32_t report_queue_priority = 0;
+
+/**
+ * @brief EP1 priority lane: the button state of every queued report that changes it
+ * Same producer / consumer as the report queue. ep1_stage takes the next
+ * transition before any motion, so a click never waits behind a backlog.
+*/
+static uint8_t button_lane[BUTTON_LANE_SIZE];
+static uint32_t button_lane_cycles[BUTTON_LANE_SIZE];
+static volatile uint32_t button_lane_head = 0;
+static volatile uint32_t button_lane_tail = 0;
+/** @brief button state of the last transition queued (producer side) */
+static uint8_t button_lane_last = 0;
+
+/**
+ * @brief EP1 lane of the physical buttons (see gpio_buttons.h)
+ * Single producer (the button interrupts) / single consumer (USBD_IRQHandler).
+ * ep1_stage takes it ahead of the syscall lane; the report carries the
+ * buttons of both sources ORed together.
+*/
+static uint8_t pin_lane[BUTTON_LANE_SIZE];
+static uint32_t pin_lane_cycles[BUTTON_LANE_SIZE];
+static volatile uint32_t pin_lane_head = 0;
+static volatile uint32_t pin_lane_tail = 0;
+
+/** @brief measured report rate: SOF frames (1 ms each) and acknowledged reports in the current window */
+static volatile uint32_t rate_frames = 0;
+static volatile uint32_t rate_reports = 0;
+static volatile uint32_t reports_per_second = 0;
+static volatile uint32_t rate_measurement = 0;
+
+/** @brief HID class state negotiated with the host (back to the defaults on bus reset) */
+static volatile uint32_t hid_protocol = HID_PROTOCOL_REPORT;
+/** @brief idle rate in 4 ms units, 0 means unchanged reports are never re-sent */
+static volatile uint32_t hid_idle_rate = USBD_HID_IDLE_DEFAULT;
+/** @brief wheel Resolution Multiplier feature (0: one unit per detent, 1: USBD_WHEEL_MULTIPLIER units) */
+static volatile uint32_t hid_wheel_multiplier = 0;
+/** @brief reply of the HID GET_* requests (must outlive the EP0 transfer) */
+static uint8_t hid_reply[sizeof(input_report_t)];
+#if USBD_HIRES_REPORT
+/** @brief DATA OUT stage of SET_REPORT(feature) */
+static uint8_t hid_feature[1];
+#endif
+
+/**
+ * @brief bus power state (enum USBD_POWER_STATE)
+ * Written by USBD_IRQHandler (suspend, resume) and POWER_CLOCK_IRQHandler
+ * (HFCLK back), which run at the same priority.
+*/
+static volatile uint32_t usbd_power = USBD_POWER_ACTIVE;
+/** @brief the host allows remote wakeup (SET_FEATURE(DEVICE_REMOTE_WAKEUP), cleared by bus reset) */
+static volatile uint32_t remote_wakeup_enabled = 0;
+/** @brief a remote wakeup was signalled and the host has not resumed the bus yet */
+static volatile uint32_t remote_wakeup_pending = 0;
+static volatile uint32_t power_suspends = 0;
+static volatile uint32_t power_resumes = 0;
+static volatile uint32_t power_remote_wakeups = 0;
+/** @brief start of the resume being traced; the next acknowledged report closes STAGE_RESUME */
+static uint32_t resume_cycles = 0;
+static uint32_t resume_traced = 0;
+
+/**
+ * @brief power-up sequence after USBDETECTED
+ * The HFCLK start, the USBD READY and the USB regulator run in parallel,
+ * each one finishes in its own interrupt and clears its bit in
+ * bringup_waiting. The last one enables the pull-up.
+*/
+#define BRINGUP_WAIT_ALL ((1 << BRINGUP_HFCLK) | (1 << BRINGUP_USBD_READY) | (1 << BRINGUP_PWRRDY))
+static volatile uint32_t bringup_waiting = 0;
+static uint32_t bringup_start = 0;
+static volatile uint32_t bringup_reached = 0;
+static uint32_t bringup_cycles[NUM_BRINGUP_PHASES];
+
+/** @brief current configuration (SET_CONFIGURATION wValue, 0 while unconfigured) */
+static volatile uint32_t usb_configuration = 0;
+/** @brief 1 while the host has halted EP1 (SET_FEATURE(ENDPOINT_HALT)) */
+static volatile uint32_t ep1_halted = 0;
+
+/** @brief states of an EP0 control transfer */
+enum EP0_STATE{EP0_IDLE = 0, EP0_DATA_IN, EP0_DATA_OUT};
+
+/**
+ * @brief EP0 control transfer in progress
+ * The data stage is sent/received one MAX_PACKET_SIZE chunk at a time. Each
+ * chunk is started from USBD_IRQHandler when the previous one completes, so
+ * no code ever waits for the host inside the interrupt.
+*/
+static volatile uint32_t ep0_state = EP0_IDLE;
+static const uint8_t* ep0_in_buffer = 0;
+static uint8_t* ep0_out_buffer = 0;
+static uint32_t ep0_done = 0;
+static uint32_t ep0_remaining = 0;
+static void (*ep0_out_callback)(uint8_t* buffer_ptr, uint32_t size) = 0;
+/**
+ * @brief RAM bounce buffer for EP0 chunks
+ * EasyDMA can only access Data RAM, so every DATA IN chunk is copied here
+ * first (descriptors live in flash). DATA OUT stages nobody is interested
+ * in are dropped here as well.
+*/
+static uint8_t ep0_chunk[MAX_PACKET_SIZE];
+
+/**
+ * @brief EP1 report slots (ping-pong)
+ * One slot is handed to EasyDMA / waits in the EP1 buffer for the host while
+ * the next report is built in the other one, so the endpoint is re-armed
+ * with a pointer swap as soon as the host acknowledges. Both live in Data
+ * RAM for the whole program, unlike a report on the caller's stack.
+*/
+typedef union{
+    input_report_t report;
+    boot_report_t boot;     // layout used while the host selected the boot protocol
+}ep1_slot_t;
+static ep1_slot_t ep1_slots[2] __attribute__((aligned(4)));
+/** @brief slot in flight and slot being built (always the other one) */
+static uint32_t ep1_inflight = 0;
+static uint32_t ep1_fill = 1;
+/** @brief 1 when the fill slot holds a report that is ready to be armed */
+static uint32_t ep1_staged = 0;
+/** @brief motion merged into the fill slot so far, before clamping to the report's range */
+static int32_t ep1_acc_x = 0;
+static int32_t ep1_acc_y = 0;
+static int32_t ep1_acc_wheel = 0;
+/** @brief motion written to the fill slot (the accumulators clamped to the report's range) */
+static int32_t ep1_fill_x = 0;
+static int32_t ep1_fill_y = 0;
+static int32_t ep1_fill_wheel = 0;
+/** @brief button state of the fill slot and number of queued reports merged into it */
+static uint8_t ep1_fill_buttons = 0;
+static uint32_t ep1_fill_merged = 0;
+/** @brief buttons of each source in the fill slot (ep1_fill_buttons is both ORed) */
+static uint8_t ep1_sys_buttons = 0;
+static uint8_t ep1_pin_buttons = 0;
+/** @brief button state of the last report armed */
+static uint8_t ep1_buttons = 0;
+/** @brief syscall entry of the oldest report merged into the fill slot (see usbd_trace.h) */
+static uint32_t ep1_fill_syscall_cycles = 0;
+/** @brief frames since the last report was armed (counted on SOF while the idle rate is not 0) */
+static uint32_t ep1_idle_frames = 0;
+/**
+ * @brief the host's EP1 poll schedule, learnt from the acknowledged reports
+ * Once a report has been acknowledged, the host polls again every
+ * ep1_poll_interval frames from that frame on. SOF counts the frames, and
+ * EP1 is only armed during the SOF of a poll frame (ep1_poll_due), so the
+ * report the host reads holds everything that arrived until that poll.
+ * Until the schedule is known, or after a suspend, a report is armed at once.
+*/
+static uint32_t ep1_poll_known = 0;
+static uint32_t ep1_poll_interval = 1;
+static uint32_t ep1_poll_frame = 0;
+static uint32_t ep1_poll_due = 0;
+/** @brief trace timestamps of the report in flight (syscall entry of its oldest merged report, DMA start, ENDEPIN1) */
+static uint32_t ep1_syscall_cycles = 0;
+static uint32_t ep1_has_syscall = 0;
+static uint32_t ep1_dma_cycles = 0;
+static uint32_t ep1_endepin_cycles = 0;
+
+/** @brief endpoint engine handlers (see usbd_ep.h) */
+static void ep0_out_done(uint8_t ep_addr, uint32_t size);
+static void ep1_dma_done(uint8_t ep_addr, uint32_t size);
+static void ep1_acked(uint8_t ep_addr, uint32_t size);
+
+/** @name transfers_reset
+ * @brief Forgets everything in flight on EP0 and EP1 (bus reset or cable removed)
+*/
+static void transfers_reset(){
+    usbd_ep_reset();
+    ep0_state = EP0_IDLE;
+    ep1_staged = 0;
+    ep1_acc_x = 0;
+    ep1_acc_y = 0;
+    ep1_acc_wheel = 0;
+    ep1_fill_buttons = 0;
+    ep1_fill_merged = 0;
+    ep1_sys_buttons = 0;
+    ep1_pin_buttons = 0;
+    ep1_buttons = 0;
+    // the host forgets held buttons on reset: the next queued report presses them again
+    button_lane_last = 0;
+    // the SOF interrupt follows with hid_reset
+    ep1_poll_known = 0;
+    ep1_poll_due = 0;
+}
+
+/** @name sof_update
+ * @brief Enables the SOF interrupt while something needs the 1 ms frame tick
+ * (the report rate measurement, a non-zero HID idle rate or the EP1 poll schedule)
+*/
+static void sof_update(){
+    if(rate_measurement == 1 || hid_idle_rate != 0 || ep1_poll_known == 1){
+        REG_CLEAR(NRF_USBD->EVENTS_SOF);
+        REG_WRITE(NRF_USBD->INTENSET, USBD_INT_SOF);
+    }else{
+        REG_WRITE(NRF_USBD->INTENCLR, USBD_INT_SOF);
+    }
+}
+
+/** @name hid_reset
+ * @brief Puts the HID protocol and idle rate back to their defaults (bus reset or cable removed)
+*/
+static void hid_reset(){
+    hid_protocol = HID_PROTOCOL_REPORT;
+    hid_idle_rate = USBD_HID_IDLE_DEFAULT;
+    hid_wheel_multiplier = 0;
+    ep1_idle_frames = 0;
+    sof_update();
+}
+
+/** @name usb_unconfigure
+ * @brief Back to the address / default state (bus reset, cable removed, SET_CONFIGURATION(0))
+*/
+static void usb_unconfigure(){
+    usb_configuration = 0;
+    ep1_halted = 0;
+    MOUSE_READY = 0x0;
+}
+
+/** @name usbd_suspend
+ * @brief The bus has been idle for 3 ms: put the USBD in low power and stop the HFCLK
+ * @note  The USBD still detects resume and reset without a clock. Nothing is
+ *        armed while suspended (see usbd_ep1_service), so no EasyDMA is cut off.
+*/
+static void usbd_suspend(){
+    if(usbd_power == USBD_POWER_SUSPENDED){
+        return;
+    }
+    usbd_power = USBD_POWER_SUSPENDED;
+    power_suspends++;
+    // the host's frame numbers go on while the bus sleeps: learn the poll schedule again after the resume
+    ep1_poll_known = 0;
+    ep1_poll_due = 0;
+    sof_update();
+    REG_WRITE(NRF_USBD->LOWPOWER, USBD_LOWPOWER_LOWPOWER);
+    REG_WRITE(NRF_CLOCK->INTENCLR, CLOCK_INT_HFCLKSTARTED);
+    REG_TRIGGER(NRF_CLOCK->TASKS_HFCLKSTOP);
+    LOG_DEBUG("USB suspended\n");
+}
+
+/** @name usbd_wake
+ * @brief Leaves low power and restarts the HFCLK; POWER_CLOCK_IRQHandler finishes on HFCLKSTARTED
+*/
+static void usbd_wake(){
+    usbd_power = USBD_POWER_RESUMING;
+    REG_WRITE(NRF_USBD->LOWPOWER, USBD_LOWPOWER_FORCENORMAL);
+    REG_CLEAR(NRF_CLOCK->EVENTS_HFCLKSTARTED);
+    REG_WRITE(NRF_CLOCK->INTENSET, CLOCK_INT_HFCLKSTARTED);
+    REG_TRIGGER(NRF_CLOCK->TASKS_HFCLKSTART);
+}
+
+/** @name usbd_resume_trace
+ * @brief Starts timing a resume, unless one is already being timed
+*/
+static void usbd_resume_trace(){
+    if(resume_traced == 0){
+        resume_cycles = trace_point(TRACE_RESUME);
+        resume_traced = 1;
+    }
+}
+
+/** @name usbd_resumed
+ * @brief The host has resumed the bus (on its own or after our remote wakeup)
+*/
+static void usbd_resumed(){
+    power_resumes++;
+    remote_wakeup_pending = 0;
+    usbd_resume_trace();
+    if(usbd_power == USBD_POWER_SUSPENDED){
+        usbd_wake();
+    }
+    LOG_DEBUG("USB resumed\n");
+}
+
+/** @name usbd_remote_wakeup
+ * @brief Asks the host to resume the bus because a report is waiting
+ * @note  Leaving low power makes the USBD raise USBWUALLOWED, which drives
+ *        the resume signalling (see usbd_usb_event)
+*/
+static void usbd_remote_wakeup(){
+    if(usbd_power != USBD_POWER_SUSPENDED || remote_wakeup_enabled == 0 || remote_wakeup_pending == 1){
+        return;
+    }
+    remote_wakeup_pending = 1;
+    power_remote_wakeups++;
+    usbd_resume_trace();
+    usbd_wake();
+}
+
+/** @name usbd_power_reset
+ * @brief Bus reset or cable removed: the device is awake and remote wakeup is disabled again
+*/
+static void usbd_power_reset(){
+    remote_wakeup_enabled = 0;
+    remote_wakeup_pending = 0;
+    resume_traced = 0;
+    if(usbd_power == USBD_POWER_SUSPENDED){
+        usbd_wake();
+    }
+}
+
+/** @name bringup_phase
+ * @brief Records the time a power-up phase was reached (only the first time per cable plug)
+*/
+static void bringup_phase(uint32_t phase){
+    if((bringup_reached & (1 << phase)) != 0){
+        return;
+    }
+    bringup_cycles[phase] = trace_now() - bringup_start;
+    bringup_reached |= (1 << phase);
+}
+
+/** @name bringup_done
+ * @brief One of the parallel power-up steps has finished; the last one enables the pull-up
+*/
+static void bringup_done(uint32_t phase){
+    if((bringup_waiting & (1 << phase)) == 0){
+        return;
+    }
+    bringup_waiting &= ~(1 << phase);
+    bringup_phase(phase);
+    if(bringup_waiting != 0){
+        return;
+    }
+    REG_WRITE(NRF_USBD->USBPULLUP, 0x1);
+    bringup_phase(BRINGUP_PULLUP);
+
+    // Endpoint IN enable for endpoint 1 (mouse reports)
+    usbd_ep_enable(USBD_EP_IN(1), ep1_dma_done, ep1_acked);
+
+    LOG_INFO("USBD initialized!\n");
+}
+
+/** @name usbd_usb_event
+ * @brief Handles the causes of USBEVENT (suspend, resume, remote wakeup allowed)
+*/
+static void usbd_usb_event(){
+    uint32_t cause = REG_READ(NRF_USBD->EVENTCAUSE);
+    REG_WRITE(NRF_USBD->EVENTCAUSE, cause);
+    LOG_DEBUG("USB EVENT received! EVENTCAUSE: 0x%x\n", cause);
+    if((cause & USBD_EVENTCAUSE_READY) != 0 && (bringup_waiting & (1 << BRINGUP_USBD_READY)) != 0){
+        // second half of Errata [187], once the USBD is ready
+        REG_WRITE(*USBD_ERRATA_187_KEY, 0x00009375);
+        REG_WRITE(*USBD_ERRATA_187_VAL, 0x00000000);
+        REG_WRITE(*USBD_ERRATA_187_KEY, 0x00009375);
+        bringup_done(BRINGUP_USBD_READY);
+    }
+    if((cause & USBD_EVENTCAUSE_RESUME) != 0){
+        usbd_resumed();
+    }else if((cause & USBD_EVENTCAUSE_SUSPEND) != 0){
+        usbd_suspend();
+    }
+    if((cause & USBD_EVENTCAUSE_USBWUALLOWED) != 0 && remote_wakeup_pending == 1){
+        // the USBD is out of low power: drive the resume (K state) on D+/D-
+        REG_WRITE(NRF_USBD->DPDMVALUE, USBD_DPDMVALUE_RESUME);
+        REG_TRIGGER(NRF_USBD->TASKS_DPDMDRIVE);
+    }
+}
+
 /**
  * @brief HID report descriptor of our mouse 
  * Reference: https://www.usbmadesimple.co.uk/ums_5.htm
  * 
 */
-uint8_t hidReportDescriptor [] = 
+const uint8_t hidReportDescriptor [] = 
 {
     0x05, 0x01,    // UsagePage(Generic Desktop Controls)
     0x09, 0x02,    // Usage (Mouse)
@@ -42,6 +432,36 @@ uint8_t hidReportDescriptor [] =
     0x75, 0x03,    //         Report Size (3)
     0x81, 0x01,    //         Input (Constant, Array, Absolute, Bit Field)
     0x05, 0x01,    //         Usage Page (Generic Desktop Controls)
+#if USBD_HIRES_REPORT
+    0x09, 0x30,    //         Usage (X)
+    0x09, 0x31,    //         Usage (Y)
+    0x16, 0x01, 0x80,  //     Logical Minimum (-32767)
+    0x26, 0xFF, 0x7F,  //     Logical Maximum (32767)
+    0x75, 0x10,    //         Report Size (16)
+    0x95, 0x02,    //         Report Count (2)
+    0x81, 0x06,    //         Input (Data, Variable, Relative, Bit Field)
+    0xA1, 0x02,    //         Collection(Logical)
+    0x09, 0x48,    //           Usage (Resolution Multiplier)
+    0x15, 0x00,    //           Logical Minimum (0)
+    0x25, 0x01,    //           Logical Maximum (1)
+    0x35, 0x01,    //           Physical Minimum (1)
+    0x45, USBD_WHEEL_MULTIPLIER, // Physical Maximum (wheel units per detent)
+    0x75, 0x02,    //           Report Size (2)
+    0x95, 0x01,    //           Report Count (1)
+    0xB1, 0x02,    //           Feature (Data, Variable, Absolute)
+    0x35, 0x00,    //           Physical Minimum (0)
+    0x45, 0x00,    //           Physical Maximum (0)
+    0x09, 0x38,    //           Usage (Wheel)
+    0x16, 0x01, 0x80,  //       Logical Minimum (-32767)
+    0x26, 0xFF, 0x7F,  //       Logical Maximum (32767)
+    0x75, 0x10,    //           Report Size (16)
+    0x95, 0x01,    //           Report Count (1)
+    0x81, 0x06,    //           Input (Data, Variable, Relative, Bit Field)
+    0xC0,          //         EndCollection()
+    0x75, 0x06,    //         Report Size (6)
+    0x95, 0x01,    //         Report Count (1)
+    0xB1, 0x03,    //         Feature (Constant) pads the feature report to a byte
+#else
     0x09, 0x30,    //         Usage (X)
     0x09, 0x31,    //         Usage (Y)
     0x09, 0x38,    //         Usage (Wheel)
@@ -50,153 +470,727 @@ uint8_t hidReportDescriptor [] =
     0x75, 0x08,    //         Report Size (8)
     0x95, 0x03,    //         Report Count (3)
     0x81, 0x06,    //         Input (Data, Variable, Relative, Bit Field)
+#endif
     0xC0,          //       EndCollection()
     0xC0,          //    EndCollection()
 };
 
+/** @brief mouse device descriptor */
+const device_desc_t mouse_dev_desc = {
+    .bLength = sizeof(device_desc_t),
+    .bDescriptorType = DEVICE,
+    .bcdUSB = 0x0110,
+    .bDeviceClass = 0x00,
+    .bDeviceSubClass = 0x00,
+    .bDeviceProtocol = 0x00,
+    .bMaxPacketSize0 = MAX_PACKET_SIZE,
+    .idVendor = 0x0F62,
+    .idProduct = 0x1001,
+    .bcdDevice = 0x0001,
+    .iManufacturer = 0,
+    .iProduct = 0,
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1,
+};
+
+/** @brief mouse configuration descriptor (CONFIG, INTERFACE, HID and ENDPOINT descriptors) with the given bInterval */
+#define MOUSE_CONFIG_DESC(interval_ms) {                                   \
+    .config = {                                                            \
+        .bLength = sizeof(_config_desc_t),                                 \
+        .bDescriptorType = CONFIG,                                         \
+        .wTotalLength = sizeof(configuration_desc_t),                      \
+        .bNumInterfaces = 1,                                               \
+        .bConfigurationValue = 1,                                          \
+        .iConfiguration = 0,                                               \
+        .bmAttributes = 0b11100000, /* self-powered, remote wakeup */      \
+        .bMaxPower = 0,                                                    \
+    },                                                                     \
+    .interface = {                                                         \
+        .bLength = sizeof(_interface_desc_t),                              \
+        .bDescriptorType = INTERFACE,                                      \
+        .bInterfaceNumber = 0,                                             \
+        .bAlternateSetting = 0,                                            \
+        .bNumEndpoints = 1,                                                \
+        .bInterfaceClass = 0x03, /* HID */                                 \
+        .bInterfaceSubClass = 0x01,                                        \
+        .bInterfaceProtocol = 0x02, /* Mouse */                            \
+        .iInterface = 0,                                                   \
+    },                                                                     \
+    .hid = {                                                               \
+        .bLength = sizeof(_hid_desc_t),                                    \
+        .bDescriptorType = 0x21,                                           \
+        .bcdHID = 0x0110,                                                  \
+        .bCountryCode = 0,                                                 \
+        .bNumDescriptors = 1,                                              \
+        .bDescriptorType2 = 34,                                            \
+        .wDescriptorLength = sizeof(hidReportDescriptor),                  \
+    },                                                                     \
+    .endpoint = {                                                          \
+        .bLength = sizeof(_endpoint_desc_t),                               \
+        .bDescriptorType = ENDPOINT,                                       \
+        .bEndpointAddress = 0x81,                                          \
+        .bmAttributes = 0x03,                                              \
+        .wMaxPacketSize = sizeof(input_report_t), /* size of mouse REPORT packet */ \
+        .bInterval = (interval_ms),                                        \
+    },                                                                     \
+}
+
+/** @brief one configuration descriptor per polling profile (indexed by enum POLL_PROFILE) */
+const configuration_desc_t mouse_config_desc[NUM_POLL_PROFILES] = {
+    [POLL_1MS] = MOUSE_CONFIG_DESC(1),
+    [POLL_2MS] = MOUSE_CONFIG_DESC(2),
+    [POLL_4MS] = MOUSE_CONFIG_DESC(4),
+    [POLL_8MS] = MOUSE_CONFIG_DESC(8),
+    [POLL_10MS] = MOUSE_CONFIG_DESC(10),
+};
+
+/** @brief polling profile used for the next GET_CONFIG_DESCRIPTOR */
+static volatile uint32_t poll_profile = USBD_POLL_PROFILE;
+
+/** @brief descriptor sizes are fixed by the USB 2.0 / HID 1.11 specs; catch padding or typos at build time */
+_Static_assert(sizeof(device_desc_t) == 18, "device descriptor must be 18 bytes");
+_Static_assert(sizeof(_config_desc_t) == 9, "configuration descriptor must be 9 bytes");
+_Static_assert(sizeof(_interface_desc_t) == 9, "interface descriptor must be 9 bytes");
+_Static_assert(sizeof(_hid_desc_t) == 9, "HID descriptor must be 9 bytes");
+_Static_assert(sizeof(_endpoint_desc_t) == 7, "endpoint descriptor must be 7 bytes");
+_Static_assert(sizeof(configuration_desc_t) == sizeof(_config_desc_t) + sizeof(_interface_desc_t) + sizeof(_hid_desc_t) + sizeof(_endpoint_desc_t),
+               "wTotalLength must cover every descriptor that follows the configuration descriptor");
+_Static_assert(sizeof(configuration_desc_t) <= 0xFFFF, "wTotalLength does not fit into 16 bits");
+_Static_assert(sizeof(hidReportDescriptor) <= 0xFFFF, "wDescriptorLength does not fit into 16 bits");
+_Static_assert(sizeof(input_report_t) <= MAX_PACKET_SIZE, "input report does not fit into one EP1 packet");
+_Static_assert(sizeof(input_report_t) == 1 + 3 * sizeof(mouse_delta_t), "input report must match hidReportDescriptor");
+_Static_assert(sizeof(boot_report_t) == HID_BOOT_REPORT_SIZE, "boot protocol reports are 3 bytes");
+_Static_assert(USBD_POLL_PROFILE >= 0 && USBD_POLL_PROFILE < NUM_POLL_PROFILES, "USBD_POLL_PROFILE is not a valid POLL_PROFILE");
+
 /** @name usbd_init
  * @brief initialize USBD 
  * 
 */
 void usbd_init(){
+    trace_init();
+    log_init();
     // enable Power and Clock interrupt handler
-    *NVIC_ISER0 |= (0x1);
+    REG_WRITE(*NVIC_ISER0, (0x1));
     // enable USBD interrupt handler
-    *NVIC_ISER1 |= (1 << 7);
+    REG_WRITE(*NVIC_ISER1, (1 << 7));
     // enable interrupts for USBDETECTED and USBREMOVED events
-    *POWER_INTENSET |= (0x3 << 7);
+    REG_WRITE(NRF_POWER->INTENSET, (POWER_INT_USBDETECTED | POWER_INT_USBREMOVED));
 
-    // enable interrupts for USBRESET, EP0SETUP, USBEVENT //and EPDATA events
-    *USBD_INTENSET |= (0x1 | (0x1 << 23) | (0x1 << 22)); //| (0x1 << 24)
+    // enable interrupts for USBRESET, EP0SETUP and USBEVENT events
+    REG_WRITE(NRF_USBD->INTENSET, (USBD_INT_USBRESET | USBD_INT_EP0SETUP | USBD_INT_USBEVENT));
+    // EP0 data stage: EP0DATADONE here, ENDEPIN0 and ENDEPOUT0 through the endpoint engine
+    REG_WRITE(NRF_USBD->INTENSET, USBD_INT_EP0DATADONE);
+    usbd_ep_enable(USBD_EP_IN(0), 0, 0);
+    usbd_ep_enable(USBD_EP_OUT(0), 0, ep0_out_done);
+    // the physical buttons feed the EP1 report path, so they start with it
+    buttons_init();
 }
 
 /** @name POWER_CLOCK_IRQHandler
  * @brief Handles POWER or CLOCK related interrupts
- * @note  This is the starting point of our USBD
+ * @note  This is the starting point of our USBD. USBDETECTED only starts the
+ *        power-up steps; HFCLKSTARTED, USBPWRRDY (here) and USBEVENT READY
+ *        (USBD_IRQHandler) finish them, and the last one enables the pull-up.
 */
 void POWER_CLOCK_IRQHandler(){
-    if(*POWER_EVENTS_USBDETECTED == 1){
+    if(REG_READ(NRF_POWER->EVENTS_USBDETECTED) == 1){
+        REG_CLEAR(NRF_POWER->EVENTS_USBDETECTED);
+        bringup_start = trace_now();
+        bringup_reached = 0;
+        bringup_phase(BRINGUP_DETECTED);
+        bringup_waiting = BRINGUP_WAIT_ALL;
+        MOUSE_READY = 0x0;
+
         /**
          * Refer: https://infocenter.nordicsemi.com/pdf/nRF52840_Rev_2_Errata_v1.5.pdf
          * Errata [187] USBD: USB cannot be enabled
-         * 
+         * (undone in usbd_usb_event once the USBD is READY)
         */
-        *(volatile uint32_t *)0x4006EC00 = 0x00009375;
-        *(volatile uint32_t *)0x4006ED14 = 0x00000003;
-        *(volatile uint32_t *)0x4006EC00 = 0x00009375;
-
-        *USBD_ENABLE = 0x1;
-        *CLOCK_TASKS_HFCLKSTART = 0x1;
-        
-        while(*USBD_EVENTS_USBEVENT != 1 && ((*USBD_EVENTCAUSE & (1 << 11)) >> 11) != 1){
-            // wait for USBEVENT and EVENTCAUSE=READY event
-        }
-        // clear the previous events
-        *USBD_EVENTS_USBEVENT = 0x0;
-        *USBD_EVENTCAUSE = (0x0 << 11);
-
-        *(volatile uint32_t *)0x4006EC00 = 0x00009375;
-        *(volatile uint32_t *)0x4006ED14 = 0x00000000;
-        *(volatile uint32_t *)0x4006EC00 = 0x00009375;
+        REG_WRITE(*USBD_ERRATA_187_KEY, 0x00009375);
+        REG_WRITE(*USBD_ERRATA_187_VAL, 0x00000003);
+        REG_WRITE(*USBD_ERRATA_187_KEY, 0x00009375);
 
-        while(*POWER_EVENTS_USBPWRRDY != 1){
-            // wait for USBPWRRDY event
+        REG_WRITE(NRF_USBD->ENABLE, 0x1);
+        // the regulator may already be up, in which case the event is pending right away
+        REG_WRITE(NRF_POWER->INTENSET, POWER_INT_USBPWRRDY);
+        REG_CLEAR(NRF_CLOCK->EVENTS_HFCLKSTARTED);
+        REG_WRITE(NRF_CLOCK->INTENSET, CLOCK_INT_HFCLKSTARTED);
+        REG_TRIGGER(NRF_CLOCK->TASKS_HFCLKSTART);
+    }else if(REG_READ(NRF_POWER->EVENTS_USBREMOVED) == 1){
+        REG_CLEAR(NRF_POWER->EVENTS_USBREMOVED);
+        usb_unconfigure();
+        if(bringup_waiting != 0){
+            // unplugged half-way through the power-up
+            bringup_waiting = 0;
+            REG_WRITE(NRF_POWER->INTENCLR, POWER_INT_USBPWRRDY);
+            REG_WRITE(NRF_CLOCK->INTENCLR, CLOCK_INT_HFCLKSTARTED);
         }
-        *POWER_EVENTS_USBPWRRDY = 0x0;
-
-        while(*CLOCK_EVENTS_HFCLKSTARTED != 1){
-            // wait for HFCLKSTARTED event
+        // the next USBDETECTED enables the USBD again and waits for a new READY
+        REG_WRITE(NRF_USBD->USBPULLUP, 0x0);
+        REG_WRITE(NRF_USBD->ENABLE, 0x0);
+        transfers_reset();
+        hid_reset();
+        usbd_power_reset();
+        LOG_INFO("USBD removed!\n");
+    }
+    if(REG_READ(NRF_POWER->EVENTS_USBPWRRDY) == 1){
+        REG_CLEAR(NRF_POWER->EVENTS_USBPWRRDY);
+        REG_WRITE(NRF_POWER->INTENCLR, POWER_INT_USBPWRRDY);
+        bringup_done(BRINGUP_PWRRDY);
+    }
+    if(REG_READ(NRF_CLOCK->EVENTS_HFCLKSTARTED) == 1){
+        // only enabled during the power-up and while resuming (see usbd_wake)
+        REG_CLEAR(NRF_CLOCK->EVENTS_HFCLKSTARTED);
+        REG_WRITE(NRF_CLOCK->INTENCLR, CLOCK_INT_HFCLKSTARTED);
+        bringup_done(BRINGUP_HFCLK);
+        if(usbd_power == USBD_POWER_RESUMING){
+            // back from suspend: EasyDMA works again, let USBD_IRQHandler arm EP1
+            usbd_power = USBD_POWER_ACTIVE;
+            REG_WRITE(*NVIC_ISPR1, USBD_IRQ_BIT);
         }
-        *CLOCK_EVENTS_HFCLKSTARTED = 0x0;
-
-        *USBD_USBPULLUP = 0x1; 
-
-        // Endpoint IN enable for endpoint 1
-        *USBD_EPINEN |= (0x1 << 1);
-
-        *POWER_EVENTS_USBDETECTED = 0x0;
-
-        MOUSE_READY = 0x0;
+    }
+}
 
-        printk("USBD initialized!\n");
-    }else if(*POWER_EVENTS_USBREMOVED == 1){
-        MOUSE_READY = 0x0;
-        printk("USBD removed!\n");
+/** @name ep0_next_in_chunk
+ * @brief Starts EasyDMA for the next chunk of the EP0 DATA IN stage
+*/
+static void ep0_next_in_chunk(){
+    uint32_t size = ep0_remaining;
+    if(size > MAX_PACKET_SIZE){
+        size = MAX_PACKET_SIZE;
+    }
+    for(uint32_t i = 0; i < size; i++){
+        ep0_chunk[i] = ep0_in_buffer[ep0_done + i];
     }
+    usbd_ep_write(USBD_EP_IN(0), ep0_chunk, size); // start 'data stage'
+}
+
+/** @name ep0_status
+ * @brief Ends the control transfer by entering the 'status' stage
+*/
+static void ep0_status(){
+    ep0_state = EP0_IDLE;
+    REG_TRIGGER(NRF_USBD->TASKS_EP0STATUS);
 }
 
 /** @name send_data
  * @brief Transfers data from USB "device" to "host"
+ * 
+ * EP0: only the first chunk is started here. The remaining chunks and the
+ * 'status' stage are driven by USBD_IRQHandler (see usbd_ep0_event).
+ * EP1: the report is queued (see usbd_queue_report).
+ * Other endpoints: one packet is handed to the endpoint engine (see usbd_ep.h).
+ * None of them waits for the host.
  * @param endpoint     the endpoint to use for data transfer
- * @param buffer_ptr   pointer to your transfer buffer
+ * @param buffer_ptr   pointer to your transfer buffer (EP0: must stay valid until the transfer ends, may be in flash)
  * @param total_size   total size of the buffer being sent  
  * @param data_size    size specified by the host (available in usbd_wlength register)
 */
-void send_data(uint8_t endpoint, uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size){
-    // Errata #199: USBD cannot receive tasks during DMA
-    *(volatile uint32_t *)0x40027C1C = 0x00000082;
+void send_data(uint8_t endpoint, const uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size){
+    switch(endpoint){
+        case 0:
+            ep0_in_buffer = buffer_ptr;
+            ep0_done = 0;
+            if(total_size < data_size){
+                ep0_remaining = total_size;
+            }else{
+                ep0_remaining = data_size;
+            }
+            if(ep0_remaining == 0){
+                ep0_status();
+                return;
+            }
+            ep0_state = EP0_DATA_IN;
+            ep0_next_in_chunk();
+            break;
+        case 1:
+            // EP1 reports go through the queue; USBD_IRQHandler sends them when the host polls
+            if(total_size >= sizeof(input_report_t) && data_size >= sizeof(input_report_t)){
+                usbd_queue_report((const input_report_t*)buffer_ptr);
+            }
+            break;
+        default:
+            // any other IN endpoint: one packet straight from buffer_ptr (must be in RAM)
+            if(usbd_ep_write(USBD_EP_IN(endpoint), buffer_ptr, (total_size < data_size) ? total_size : data_size) != 0){
+                LOG_ERROR("Enpoint %d not supported\n", endpoint);
+            }
+            break;
+    }
+}
+
+/** @name receive_data
+ * @brief Receives the DATA OUT stage of a control transfer from the "host"
+ * 
+ * Returns immediately. Each chunk is fetched from USBD_IRQHandler as it
+ * arrives; done() is called from the interrupt once all data is in
+ * buffer_ptr, right before the 'status' stage.
+ * @param endpoint     the endpoint to receive on (only 0 is supported)
+ * @param buffer_ptr   where to store the data (NULL to discard it)
+ * @param data_size    size specified by the host (available in usbd_wlength register)
+ * @param done         called when the data has arrived (may be NULL)
+*/
+void receive_data(uint8_t endpoint, uint8_t* buffer_ptr, uint16_t data_size, void (*done)(uint8_t* buffer_ptr, uint32_t size)){
+    if(endpoint != 0){
+        LOG_ERROR("Enpoint %d not supported\n", endpoint);
+        return;
+    }
+    ep0_out_buffer = buffer_ptr;
+    ep0_done = 0;
+    ep0_remaining = data_size;
+    ep0_out_callback = done;
+    if(data_size == 0){
+        if(done != 0){
+            done(buffer_ptr, 0);
+        }
+        ep0_status();
+        return;
+    }
+    ep0_state = EP0_DATA_OUT;
+    REG_TRIGGER(NRF_USBD->TASKS_EP0RCVOUT); // allow the host to send the first chunk
+}
 
-    uint32_t data_sent = 0;
-    uint32_t data_remaining = 0;
-    if(total_size < data_size){
-        data_remaining = total_size;
+/** @name ep0_out_done
+ * @brief A DATA OUT chunk is in RAM: ask for the next one or end the transfer
+ * @note  Endpoint engine handler of EP0 OUT (ENDEPOUT0)
+*/
+static void ep0_out_done(uint8_t ep_addr, uint32_t size){
+    (void)ep_addr;
+    if(ep0_state != EP0_DATA_OUT){
+        return;
+    }
+    ep0_done = ep0_done + size;
+    ep0_remaining = ep0_remaining - size;
+    if(ep0_remaining > 0){
+        REG_TRIGGER(NRF_USBD->TASKS_EP0RCVOUT);
     }else{
-        data_remaining = data_size;
-    }
-    while(data_remaining > 0){ 
-        switch(endpoint){
-            case 0:{
-                *USBD_EPIN0_PTR = (uint8_t*)((uint32_t)buffer_ptr + data_sent);
-                if(data_remaining < MAX_PACKET_SIZE){
-                    *USBD_EPIN0_MAXCNT = data_remaining;
-                }else{
-                    *USBD_EPIN0_MAXCNT = MAX_PACKET_SIZE;
-                }
-                *USBD_TASKS_STARTEPIN0 = 0x1; // start 'data stage'
-                while(*USBD_EVENTS_ENDEPIN0 != 1){
-                    //wait for ENDEPIN event
-                }
-                *USBD_EVENTS_ENDEPIN0 = 0x0;
-                while(*USBD_EVENTS_EP0DATADONE != 1){
-
-                }
-                *USBD_EVENTS_EP0DATADONE = 0x0;
-                data_sent = data_sent + *USBD_EPIN0_AMOUNT;
-                data_remaining = data_remaining - *USBD_EPIN0_AMOUNT;
-                break;
+        if(ep0_out_callback != 0){
+            ep0_out_callback(ep0_out_buffer, ep0_done);
+        }
+        ep0_status();
+    }
+}
+
+/** @name usbd_ep0_event
+ * @brief Advances the EP0 control transfer on EP0DATADONE
+ * @note  Only called from USBD_IRQHandler
+*/
+static void usbd_ep0_event(){
+    if(REG_READ(NRF_USBD->EVENTS_EP0DATADONE) == 1){
+        REG_CLEAR(NRF_USBD->EVENTS_EP0DATADONE);
+        if(ep0_state == EP0_DATA_IN){
+            // host has read the chunk
+            uint32_t amount = REG_READ(NRF_USBD->EPIN[0].AMOUNT);
+            ep0_done = ep0_done + amount;
+            ep0_remaining = ep0_remaining - amount;
+            if(ep0_remaining > 0){
+                ep0_next_in_chunk();
+            }else{
+                ep0_status();
             }
-            case 1:{
-                *USBD_EPIN1_PTR = (uint8_t*)((uint32_t)buffer_ptr + data_sent);
-                if(data_remaining < MAX_PACKET_SIZE){
-                    *USBD_EPIN1_MAXCNT = data_remaining;
-                }else{
-                    *USBD_EPIN1_MAXCNT = MAX_PACKET_SIZE;
-                }
-                *USBD_TASKS_STARTEPIN1 = 0x1; // start 'data stage'
-                while(*USBD_EVENTS_ENDEPIN1 != 1){
-                    //wait for ENDEPIN event
-                }
-                *USBD_EVENTS_ENDEPIN1 = 0x0;
-                while((((*USBD_EVENTS_EPDATASTATUS) & 0x2) >> 1) != 1){
-                
-                }
-                *USBD_EVENTS_EPDATASTATUS |= (0x0 << 1);
-                data_sent = data_sent + *USBD_EPIN1_AMOUNT;
-                data_remaining = data_remaining - *USBD_EPIN1_AMOUNT;
-                break;
+        }else if(ep0_state == EP0_DATA_OUT){
+            // host has sent a chunk, move it into RAM (ENDEPOUT0 calls ep0_out_done)
+            uint32_t size = REG_READ(NRF_USBD->SIZE_EPOUT[0]);
+            if(size > ep0_remaining){
+                size = ep0_remaining;
             }
-            default:
-                printk("[Error] Enpoint %d not supported\n", endpoint);
-                return;
+            usbd_ep_read(USBD_EP_OUT(0), (ep0_out_buffer != 0) ? ep0_out_buffer + ep0_done : ep0_chunk, size);
+        }
+    }
+}
+
+/** @name usbd_queue_report
+ * @brief Adds an input report to the EP1 queue and returns immediately
+ *
+ * A change of the button state goes into the priority lane, the motion
+ * into the report queue. A transition without motion needs no room in the
+ * report queue, so a backlog of motion never drops a click.
+ * @param report   the report to send (copied into the queue)
+ * @return 0 on success, -1 if the lane was full and the report was dropped,
+ *         or the queue was full and its motion was dropped
+*/
+int usbd_queue_report(const input_report_t* report){
+    uint32_t tail = report_queue_tail;
+    uint32_t depth = tail - report_queue_head;
+    uint32_t lane_tail = button_lane_tail;
+    int transition = (report->buttons != button_lane_last);
+    // a transition alone needs no room in the report queue
+    int motion = (report->X != 0 || report->Y != 0 || report->Wheel != 0 || !transition);
+    if(transition && lane_tail - button_lane_head >= BUTTON_LANE_SIZE){
+        report_queue_dropped++;
+        return -1;
+    }
+    int status = 0;
+    if(motion && depth >= REPORT_QUEUE_SIZE){
+        // a full queue only costs the motion, the transition still goes out
+        report_queue_dropped++;
+        status = -1;
+        motion = 0;
+        if(!transition){
+            return -1;
+        }
+    }
+    uint32_t cycles = trace_take_syscall();
+    if(transition){
+        button_lane[lane_tail & (BUTTON_LANE_SIZE - 1)] = report->buttons;
+        button_lane_cycles[lane_tail & (BUTTON_LANE_SIZE - 1)] = cycles;
+        COMPILER_BARRIER();
+        button_lane_tail = lane_tail + 1;
+        button_lane_last = report->buttons;
+    }
+    if(motion){
+        report_queue[tail & (REPORT_QUEUE_SIZE - 1)] = *report;
+        report_queue_cycles[tail & (REPORT_QUEUE_SIZE - 1)] = cycles;
+        COMPILER_BARRIER();
+        report_queue_tail = tail + 1;
+        if(depth + 1 > report_queue_max_depth){
+            report_queue_max_depth = depth + 1;
+        }
+    }
+    if(usbd_ep_busy(USBD_EP_IN(1)) == 0 && ep1_poll_known == 0){
+        // EP1 is idle, so no completion event will drain the queue. Let USBD_IRQHandler arm it.
+        // Once the poll schedule is known, the SOF of the next poll frame does.
+        REG_WRITE(*NVIC_ISPR1, USBD_IRQ_BIT);
+    }
+    return status;
+}
+
+/** @name usbd_queue_buttons
+ * @brief Queues a change of the physical buttons for EP1 and returns immediately
+ * @param buttons  state of the physical buttons (HID button bits)
+ * @param cycles   cycle counter at the change, used as its syscall entry (see usbd_trace.h)
+ * @note  Called from the button interrupts only (the producer of the pin lane)
+ * @return 0 on success, -1 if the lane is full and the change was dropped
+*/
+int usbd_queue_buttons(uint8_t buttons, uint32_t cycles){
+    uint32_t tail = pin_lane_tail;
+    if(tail - pin_lane_head >= BUTTON_LANE_SIZE){
+        return -1;
+    }
+    pin_lane[tail & (BUTTON_LANE_SIZE - 1)] = buttons;
+    pin_lane_cycles[tail & (BUTTON_LANE_SIZE - 1)] = cycles;
+    COMPILER_BARRIER();
+    pin_lane_tail = tail + 1;
+    if(usbd_ep_busy(USBD_EP_IN(1)) == 0 && ep1_poll_known == 0){
+        REG_WRITE(*NVIC_ISPR1, USBD_IRQ_BIT);
+    }
+    return 0;
+}
+
+/** @name usbd_get_queue_stats
+ * @brief Reads the EP1 input report queue statistics
+ * @param stats   filled with the current statistics
+*/
+void usbd_get_queue_stats(report_queue_stats_t* stats){
+    stats->depth = report_queue_tail - report_queue_head;
+    stats->max_depth = report_queue_max_depth;
+    stats->dropped = report_queue_dropped;
+    stats->sent = report_queue_sent;
+    stats->coalesced = report_queue_coalesced;
+    stats->suppressed = report_queue_suppressed;
+    stats->idle_repeats = report_queue_idle_repeats;
+    stats->priority = report_queue_priority;
+    stats->transitions = button_lane_tail - button_lane_head;
+    stats->poll_interval_ms = mouse_config_desc[poll_profile].endpoint.bInterval;
+    stats->reports_per_second = reports_per_second;
+}
+
+/** @name usbd_set_poll_profile
+ * @brief Selects the EP1 polling interval advertised to the host
+ * @note  The host only reads bInterval while enumerating, so the new profile
+ *        takes effect after the next reset / re-plug.
+ * @param profile   one of enum POLL_PROFILE
+ * @return 0 on success, -1 if the profile does not exist
+*/
+int usbd_set_poll_profile(uint32_t profile){
+    if(profile >= NUM_POLL_PROFILES){
+        return -1;
+    }
+    poll_profile = profile;
+    return 0;
+}
+
+/** @name usbd_set_rate_measurement
+ * @brief Turns the reports-per-second counter on or off
+ * @note  The counter uses the SOF interrupt (once per 1 ms frame), so it is
+ *        off by default.
+ * @param enable   1 to measure, 0 to stop
+*/
+void usbd_set_rate_measurement(uint32_t enable){
+    rate_frames = 0;
+    rate_reports = 0;
+    reports_per_second = 0;
+    rate_measurement = enable;
+    sof_update();
+}
+
+/** @name usbd_suspended
+ * @brief 1 while the bus is suspended
+ * @note  The HFCLK is stopped and nothing happens until a resume, reset or
+ *        queued report, so the idle loop may put the core to sleep (WFI).
+*/
+uint32_t usbd_suspended(){
+    return usbd_power == USBD_POWER_SUSPENDED;
+}
+
+/** @name usbd_get_power_stats
+ * @brief Reads the suspend / resume statistics
+ * @param stats   filled with the current statistics
+*/
+void usbd_get_power_stats(usbd_power_stats_t* stats){
+    stats->state = usbd_power;
+    stats->suspends = power_suspends;
+    stats->resumes = power_resumes;
+    stats->remote_wakeups = power_remote_wakeups;
+    stats->remote_wakeup_enabled = remote_wakeup_enabled;
+}
+
+/** @name usbd_get_bringup_stats
+ * @brief Copies the timestamps of the last power-up sequence (cycles since USBDETECTED)
+*/
+void usbd_get_bringup_stats(usbd_bringup_stats_t* stats){
+    stats->reached = bringup_reached;
+    for(uint32_t phase = 0; phase < NUM_BRINGUP_PHASES; phase++){
+        stats->cycles[phase] = bringup_cycles[phase];
+    }
+}
+
+/** @name ep1_clamp
+ * @brief Clamps an accumulated delta to a report field's logical range
+ * @param value    accumulated delta
+ * @param limit    largest magnitude the field holds
+ * @return the part of value that fits into one report
+*/
+static int32_t ep1_clamp(int32_t value, int32_t limit){
+    if(value > limit){
+        return limit;
+    }else if(value < -limit){
+        return -limit;
+    }
+    return value;
+}
+
+/** @name ep1_write_fill
+ * @brief Writes the accumulators into the fill slot, in the layout of the current protocol
+*/
+static void ep1_write_fill(){
+    ep1_slot_t* slot = &ep1_slots[ep1_fill];
+    if(hid_protocol == HID_PROTOCOL_BOOT){
+        ep1_fill_x = ep1_clamp(ep1_acc_x, 127);
+        ep1_fill_y = ep1_clamp(ep1_acc_y, 127);
+        ep1_fill_wheel = 0;
+        slot->boot.buttons = ep1_fill_buttons;
+        slot->boot.X = (int8_t)ep1_fill_x;
+        slot->boot.Y = (int8_t)ep1_fill_y;
+    }else{
+        ep1_fill_x = ep1_clamp(ep1_acc_x, MOUSE_DELTA_MAX);
+        ep1_fill_y = ep1_clamp(ep1_acc_y, MOUSE_DELTA_MAX);
+        ep1_fill_wheel = ep1_clamp(ep1_acc_wheel, MOUSE_DELTA_MAX);
+        slot->report.buttons = ep1_fill_buttons;
+        slot->report.X = (mouse_delta_t)ep1_fill_x;
+        slot->report.Y = (mouse_delta_t)ep1_fill_y;
+        slot->report.Wheel = (mouse_delta_t)ep1_fill_wheel;
+    }
+}
+
+/** @name ep1_stage
+ * @brief Merges queued reports into the fill slot
+ *
+ * The next button transition is taken first, even if motion is still
+ * queued or carried over: from the physical buttons' lane if it has one,
+ * otherwise from the syscalls' priority lane. Every report carries at most
+ * one transition, so a press and its release always go out as two
+ * reports; a transition the report does not show (a button the other
+ * source holds as well) is merged with the next one. A slot holding only
+ * motion takes the transition as well. The slot is only armed at the SOF
+ * of a poll frame (see ep1_arm), so a transition reaches the host with the
+ * next poll, one poll interval at most, unless another transition is
+ * ahead of it. All queued motion is then merged into the same report, so a
+ * single report goes out per host poll no matter how many moves arrived in
+ * between. Deltas that do not fit into the report stay in the accumulators
+ * and are carried into the next report.
+ * @note  Only called from USBD_IRQHandler (the queue consumer)
+*/
+static void ep1_stage(){
+    uint32_t head = report_queue_head;
+    uint32_t tail = report_queue_tail;
+    uint32_t lane_head = button_lane_head;
+    uint32_t lane_tail = button_lane_tail;
+    uint32_t pin_head = pin_lane_head;
+    uint32_t pin_tail = pin_lane_tail;
+    if(head == tail && lane_head == lane_tail && pin_head == pin_tail){
+        return;
+    }
+    uint32_t merged = ep1_fill_merged;
+    while(ep1_fill_buttons == ep1_buttons && (pin_head != pin_tail || lane_head != lane_tail)){
+        uint32_t cycles;
+        if(pin_head != pin_tail){
+            ep1_pin_buttons = pin_lane[pin_head & (BUTTON_LANE_SIZE - 1)];
+            cycles = pin_lane_cycles[pin_head & (BUTTON_LANE_SIZE - 1)];
+            pin_head++;
+        }else{
+            ep1_sys_buttons = button_lane[lane_head & (BUTTON_LANE_SIZE - 1)];
+            cycles = button_lane_cycles[lane_head & (BUTTON_LANE_SIZE - 1)];
+            lane_head++;
+        }
+        if(merged == 0){
+            ep1_fill_syscall_cycles = cycles;
+        }
+        if(head != tail || ep1_acc_x != 0 || ep1_acc_y != 0 || ep1_acc_wheel != 0){
+            report_queue_priority++;
+        }
+        ep1_fill_buttons = ep1_sys_buttons | ep1_pin_buttons;
+        merged++;
+    }
+    if(merged == 0 && head != tail){
+        ep1_fill_syscall_cycles = report_queue_cycles[head & (REPORT_QUEUE_SIZE - 1)];
+    }
+    while(head != tail){
+        input_report_t* report = &report_queue[head & (REPORT_QUEUE_SIZE - 1)];
+        ep1_acc_x += report->X;
+        ep1_acc_y += report->Y;
+        if(hid_protocol == HID_PROTOCOL_REPORT){
+            // boot protocol reports have no wheel
+            ep1_acc_wheel += report->Wheel;
+        }
+        head++;
+        merged++;
+    }
+    if(merged == ep1_fill_merged){
+        return;
+    }
+    COMPILER_BARRIER();
+    report_queue_head = head;
+    button_lane_head = lane_head;
+    pin_lane_head = pin_head;
+    if(ep1_acc_x == 0 && ep1_acc_y == 0 && ep1_acc_wheel == 0 && ep1_fill_buttons == ep1_buttons){
+        // nothing changed (no motion, same buttons): send nothing and let the host NAK
+        report_queue_suppressed += merged - ep1_fill_merged;
+        ep1_fill_merged = 0;
+        ep1_staged = 0;
+        return;
+    }
+    // the first report of a slot is not counted as coalesced
+    report_queue_coalesced += merged - ep1_fill_merged - (ep1_fill_merged == 0);
+    ep1_fill_merged = merged;
+
+    ep1_write_fill();
+    ep1_staged = 1;
+}
+
+/** @name ep1_arm
+ * @brief Hands the fill slot to EasyDMA if EP1 is idle, then starts the next slot with the carry
+ * @note  Only called from USBD_IRQHandler. Once the poll schedule is known
+ *        the slot waits for the SOF of the next poll frame: a report armed
+ *        earlier could not take a transition that arrives before that poll.
+*/
+static void ep1_arm(){
+    if(usbd_ep_busy(USBD_EP_IN(1)) == 1 || ep1_staged == 0 || MOUSE_READY != 1 ||
+       (ep1_poll_known == 1 && ep1_poll_due == 0)){
+        return;
+    }
+    ep1_slot_t* slot = &ep1_slots[ep1_fill];
+    ep1_inflight = ep1_fill;
+    ep1_fill ^= 1;
+    ep1_buttons = ep1_fill_buttons;
+    ep1_idle_frames = 0;
+    // a report made only of carried-over motion has no syscall of its own
+    ep1_has_syscall = (ep1_fill_merged > 0);
+    ep1_syscall_cycles = ep1_fill_syscall_cycles;
+
+    ep1_dma_cycles = trace_point(TRACE_DMA_START);
+    usbd_ep_write(USBD_EP_IN(1), (const uint8_t*)slot,
+                  (hid_protocol == HID_PROTOCOL_BOOT) ? sizeof(boot_report_t) : sizeof(input_report_t));
+    if(ep1_has_syscall){
+        trace_stage(STAGE_QUEUED, ep1_dma_cycles - ep1_syscall_cycles);
+    }
+
+    // whatever did not fit becomes the start of the next report
+    ep1_acc_x -= ep1_fill_x;
+    ep1_acc_y -= ep1_fill_y;
+    ep1_acc_wheel -= ep1_fill_wheel;
+    ep1_fill_merged = 0;
+    ep1_staged = 0;
+    if(ep1_acc_x != 0 || ep1_acc_y != 0 || ep1_acc_wheel != 0){
+        ep1_write_fill();
+        ep1_staged = 1;
+    }
+}
+
+/** @name ep1_dma_done
+ * @brief EasyDMA has copied the report into the EP1 buffer
+ * @note  Endpoint engine handler of EP1 IN (ENDEPIN1)
+*/
+static void ep1_dma_done(uint8_t ep_addr, uint32_t size){
+    (void)ep_addr;
+    (void)size;
+    ep1_endepin_cycles = trace_point(TRACE_ENDEPIN1);
+    trace_stage(STAGE_DMA, ep1_endepin_cycles - ep1_dma_cycles);
+}
+
+/** @name ep1_acked
+ * @brief The host has acknowledged the report on EP1
+ * @note  Endpoint engine handler of EP1 IN (EPDATA)
+*/
+static void ep1_acked(uint8_t ep_addr, uint32_t size){
+    (void)ep_addr;
+    (void)size;
+    uint32_t acked = trace_point(TRACE_EPDATA);
+    trace_stage(STAGE_HOST, acked - ep1_endepin_cycles);
+    if(ep1_has_syscall){
+        trace_stage(STAGE_TOTAL, acked - ep1_syscall_cycles);
+    }
+    if(resume_traced == 1){
+        trace_stage(STAGE_RESUME, acked - resume_cycles);
+        resume_traced = 0;
+    }
+    report_queue_sent++;
+    rate_reports++;
+    // the host polls in this frame: the next poll is ep1_poll_interval frames away
+    ep1_poll_frame = 0;
+    if(ep1_poll_known == 0){
+        ep1_poll_known = 1;
+        sof_update();
+    }
+}
+
+/** @name ep1_idle_tick
+ * @brief Counts one frame; re-sends the button state once the HID idle period has expired
+ * @note  Called on SOF while the idle rate is not 0. Motion is relative, so the
+ *        repeated report carries the current buttons and no motion.
+*/
+static void ep1_idle_tick(){
+    ep1_idle_frames++;
+    if(ep1_idle_frames < hid_idle_rate * 4 || usbd_ep_busy(USBD_EP_IN(1)) == 1 || ep1_staged == 1){
+        return;
+    }
+    // nothing is staged, so the accumulators are empty
+    ep1_fill_buttons = ep1_buttons;
+    ep1_write_fill();
+    ep1_fill_merged = 0;
+    ep1_staged = 1;
+    report_queue_idle_repeats++;
+}
+
+/** @name usbd_ep1_service
+ * @brief Arms EP1 with the next report if the endpoint is idle, and builds the one after it
+ * @note  Only called from USBD_IRQHandler (the queue consumer)
+*/
+static void usbd_ep1_service(){
+    ep1_stage();
+    if(usbd_power != USBD_POWER_ACTIVE){
+        // no HFCLK, so no EasyDMA: wake the host up if there is something to send
+        if(ep1_staged == 1){
+            usbd_remote_wakeup();
         }
+        return;
     }
-    if(endpoint == 0){
-        // enter 'status' stage for endpoint 0
-        *USBD_TASKS_EP0STATUS = 0x1;
+    if(ep1_halted == 1){
+        // the host answers STALL until it clears the halt; keep the report staged
+        return;
     }
-    //printk("Data of size %d successfully sent to host on Endpoint %d\n", data_sent, endpoint);
-    // Errata #199: USBD cannot receive tasks during DMA
-    *(volatile uint32_t *)0x40027C1C = 0x00000000;
+    ep1_arm();
+    // build the next report while this one is in flight
+    ep1_stage();
 }
 
 /** @name get_device_desc
@@ -204,25 +1198,7 @@ void send_data(uint8_t endpoint, uint8_t* buffer_ptr, uint32_t total_size, uint1
  * @param data_size    size specified by the host (available in usbd_wlength register)
 */
 void get_device_desc(uint16_t data_size){
-    printk("Inside get_device_desc\n");
-    mouse_dev_desc.bLength = sizeof(device_desc_t);
-    mouse_dev_desc.bDescriptorType = 1;
-    mouse_dev_desc.bcdUSB = 0x0110;
-    mouse_dev_desc.bDeviceClass = 0x00;
-    mouse_dev_desc.bDeviceSubClass = 0x00;
-    mouse_dev_desc.bDeviceProtocol = 0x00;
-    mouse_dev_desc.bMaxPacketSize0 = MAX_PACKET_SIZE;
-    mouse_dev_desc.idVendor = 0x0F62;
-    mouse_dev_desc.idProduct = 0x1001;
-    mouse_dev_desc.bcdDevice = 0x0001;
-    mouse_dev_desc.iManufacturer = 0;
-    mouse_dev_desc.iProduct = 0;
-    mouse_dev_desc.iSerialNumber = 0;
-    mouse_dev_desc.bNumConfigurations = 1;
-
-    send_data(0, (uint8_t*)&mouse_dev_desc, sizeof(device_desc_t), data_size);
-
-    printk("Finished get_device_desc\n");
+    send_data(0, (const uint8_t*)&mouse_dev_desc, sizeof(device_desc_t), data_size);
 }
 
 /** @name get_config_desc
@@ -230,153 +1206,476 @@ void get_device_desc(uint16_t data_size){
  * @param data_size    size specified by the host (available in usbd_wlength register)
 */
 void get_config_desc(uint16_t data_size){
-    printk("Inside get_config_desc\n");
-    // config descriptor
-    mouse_config_desc.config.bLength = sizeof(_config_desc_t);
-    mouse_config_desc.config.bDescriptorType = 2;
-    mouse_config_desc.config.wTotalLength = (uint16_t) sizeof(configuration_desc_t);
-    mouse_config_desc.config.bNumInterfaces = 1;
-    mouse_config_desc.config.bConfigurationValue = 1;
-    mouse_config_desc.config.iConfiguration = 0;
-    mouse_config_desc.config.bmAttributes = 0b11000000;
-    mouse_config_desc.config.bMaxPower = 0;
-
-    // interface descriptor
-    mouse_config_desc.interface.bLength = sizeof(_interface_desc_t);
-    mouse_config_desc.interface.bDescriptorType = 4;
-    mouse_config_desc.interface.bInterfaceNumber = 0;
-    mouse_config_desc.interface.bAlternateSetting = 0;
-    mouse_config_desc.interface.bNumEndpoints = 1;
-    mouse_config_desc.interface.bInterfaceClass = 0x03; //HID
-    mouse_config_desc.interface.bInterfaceSubClass = 0x01;
-    mouse_config_desc.interface.bInterfaceProtocol = 0x02; //Mouse
-    mouse_config_desc.interface.iInterface = 0;
-
-    // HID descriptor
-    mouse_config_desc.hid.bLength = sizeof(_hid_desc_t);
-    mouse_config_desc.hid.bDescriptorType = 0x21;
-    mouse_config_desc.hid.bcdHID = 0x0110;
-    mouse_config_desc.hid.bCountryCode = 0;
-    mouse_config_desc.hid.bNumDescriptors = 1;
-    mouse_config_desc.hid.bDescriptorType2 = 34;
-    mouse_config_desc.hid.wDescriptorLength = sizeof(hidReportDescriptor);
-
-    // endpoint descriptor
-    mouse_config_desc.endpoint.bLength = sizeof(_endpoint_desc_t);
-    mouse_config_desc.endpoint.bDescriptorType = 5;
-    mouse_config_desc.endpoint.bEndpointAddress = 0x81;
-    mouse_config_desc.endpoint.bmAttributes = 0x03;
-    mouse_config_desc.endpoint.wMaxPacketSize = sizeof(input_report_t); // size of mouse REPORT packet
-    mouse_config_desc.endpoint.bInterval = 0x0A; //10ms
-
-    send_data(0, (uint8_t*)&mouse_config_desc, sizeof(configuration_desc_t), data_size);
-
-    printk("Finished get_config_desc\n");
+    send_data(0, (const uint8_t*)&mouse_config_desc[poll_profile], sizeof(configuration_desc_t), data_size);
+}
+
+#if USBD_HIRES_REPORT
+/** @name hid_feature_received
+ * @brief DATA OUT stage of SET_REPORT(feature) has arrived: the host (en/dis)ables the Resolution Multiplier
+*/
+static void hid_feature_received(uint8_t* buffer_ptr, uint32_t size){
+    if(size >= 1){
+        hid_wheel_multiplier = buffer_ptr[0] & 0x3;
+    }
+}
+#endif
+
+/** @name usbd_wheel_resolution
+ * @brief Wheel units per detent the host currently expects
+ * @return USBD_WHEEL_MULTIPLIER once the host enabled the Resolution Multiplier, 1 otherwise
+*/
+uint32_t usbd_wheel_resolution(){
+    return (hid_wheel_multiplier != 0) ? USBD_WHEEL_MULTIPLIER : 1;
 }
 
+/**
+ * @brief cycle budgets of the SETUP handlers (64 MHz core clock)
+ * STATUS: reads/writes a few registers and starts the status stage.
+ * DATA:   also copies at most one MAX_PACKET_SIZE chunk into ep0_chunk and
+ *         starts EasyDMA; the rest of the data stage runs from EP0DATADONE.
+ * VENDOR: the trace requests summarize (one pass each) or clear
+ *         NUM_TRACE_STAGES histograms of TRACE_BUCKETS buckets each before
+ *         the first chunk.
+ * The dispatcher itself reads the SETUP registers and compares against at
+ * most NUM_SETUP_HANDLERS table entries.
+*/
+#define SETUP_BUDGET_STATUS 200
+#define SETUP_BUDGET_DATA 600
+#define SETUP_BUDGET_VENDOR 8000
+
+/** @brief reply of GET_STATUS / GET_CONFIGURATION / GET_INTERFACE (must outlive the EP0 transfer) */
+static uint8_t ep0_reply[2];
+
+/** @brief SETUP dispatcher counters */
+static volatile uint32_t setup_requests = 0;
+static volatile uint32_t setup_stalls = 0;
+static volatile uint32_t setup_overruns = 0;
+static volatile uint32_t setup_max_cycles = 0;
+static volatile uint32_t setup_max_request = 0;
+
 /** @name get_descriptor
- * @brief When GET_DESCRIPTOR request is received, calls the specific descriptor being requested
- * @param desc_type    type of descriptor requested by host
- * @param data_size    descriptor size specified by the host (available in usbd_wlength register)
+ * @brief GET_DESCRIPTOR(device): device and configuration descriptors
+ * @note  budget DATA. There are no strings (all string indexes are 0) and a
+ *        full-speed only device has no DEVICE_QUALIFIER, so those stall.
 */
-void get_descriptor(uint16_t desc_type, uint16_t data_size){
-    printk("Desc_Type: %d, Data Size: %d\n", desc_type, data_size);
-    switch(desc_type){
+static int get_descriptor(const usb_setup_t* setup){
+    LOG_DEBUG("Desc_Type: %d, Data Size: %d\n", setup->wValue >> 8, setup->wLength);
+    switch(setup->wValue >> 8){
         case DEVICE:
-            get_device_desc(data_size);
-            break;
+            get_device_desc(setup->wLength);
+            return 0;
         case CONFIG:
-            //breakpoint();
-            get_config_desc(data_size);
-            break;
-        case STRING:
-            //breakpoint();
-            // no strings to send. Proceed to STATUS stage
-            *USBD_TASKS_EP0STATUS = 0x1;
-            break;
-        case INTERFACE:
-            breakpoint();
+            get_config_desc(setup->wLength);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/** @name get_interface_descriptor
+ * @brief GET_DESCRIPTOR(interface): HID report descriptor and HID descriptor
+ * @note  budget DATA
+*/
+static int get_interface_descriptor(const usb_setup_t* setup){
+    if(setup->wIndex != 0){
+        return -1;
+    }
+    switch(setup->wValue >> 8){
+        case HID_DESC_REPORT:
+            send_data(0, hidReportDescriptor, sizeof(hidReportDescriptor), setup->wLength);
+            return 0;
+        case HID_DESC_HID:
+            send_data(0, (const uint8_t*)&mouse_config_desc[poll_profile].hid, sizeof(_hid_desc_t), setup->wLength);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/** @name set_address
+ * @brief SET_ADDRESS request is received from host
+ * @note  budget STATUS. The USBD answers SET_ADDRESS in hardware (status
+ *        stage included) and takes the address from the SETUP packet.
+*/
+static int set_address(const usb_setup_t* setup){
+    LOG_DEBUG("Set Address: %d, Device Addr: %d\n", setup->wValue, REG_READ(NRF_USBD->USBADDR));
+    return (setup->wValue > 127) ? -1 : 0;
+}
+
+/** @name get_status
+ * @brief GET_STATUS(device / interface / endpoint)
+ * @note  budget DATA. Device: self-powered and remote wakeup enabled bits,
+ *        interface: always 0, endpoint: halt bit (EP0 and EP1 IN only).
+*/
+static int get_status(const usb_setup_t* setup){
+    ep0_reply[0] = 0x0;
+    ep0_reply[1] = 0x0;
+    switch(setup->bmRequestType){
+        case USB_REQ_DEVICE_IN:
+            ep0_reply[0] = 0x1 | (remote_wakeup_enabled << 1);
             break;
-        case ENDPOINT:
-            breakpoint();
+        case USB_REQ_INTERFACE_IN:
+            if(usb_configuration == 0 || setup->wIndex != 0){
+                return -1;
+            }
             break;
         default:
+            if((setup->wIndex & 0x7F) == 0){
+                break;
+            }
+            if(usb_configuration == 0 || setup->wIndex != USBD_EP_IN(1)){
+                return -1;
+            }
+            ep0_reply[0] = (uint8_t)ep1_halted;
             break;
     }
+    send_data(0, ep0_reply, sizeof(ep0_reply), setup->wLength);
+    return 0;
+}
 
+/** @name device_feature
+ * @brief SET_FEATURE / CLEAR_FEATURE(DEVICE_REMOTE_WAKEUP)
+ * @note  budget STATUS
+*/
+static int device_feature(const usb_setup_t* setup){
+    if(setup->wValue != USB_FEATURE_DEVICE_REMOTE_WAKEUP){
+        return -1;
+    }
+    remote_wakeup_enabled = (setup->bRequest == USB_SET_FEATURE);
+    REG_TRIGGER(NRF_USBD->TASKS_EP0STATUS);
+    return 0;
 }
 
-/** @name set_address
- * @brief SET_ADDRESS request is received from host
- * @param address    the new address assigned to the USB device
+/** @name endpoint_feature
+ * @brief SET_FEATURE / CLEAR_FEATURE(ENDPOINT_HALT) on EP1 IN
+ * @note  budget STATUS. Clearing the halt also resets the data toggle to DATA0;
+ *        EP1 is armed again at the end of USBD_IRQHandler.
+*/
+static int endpoint_feature(const usb_setup_t* setup){
+    if(setup->wValue != USB_FEATURE_ENDPOINT_HALT || usb_configuration == 0 || setup->wIndex != USBD_EP_IN(1)){
+        return -1;
+    }
+    if(setup->bRequest == USB_SET_FEATURE){
+        ep1_halted = 1;
+        REG_WRITE(NRF_USBD->EPSTALL, USBD_EPSTALL_STALL | USBD_EP_IN(1));
+    }else{
+        ep1_halted = 0;
+        REG_WRITE(NRF_USBD->EPSTALL, USBD_EP_IN(1));
+        REG_WRITE(NRF_USBD->DTOGGLE, USBD_DTOGGLE_DATA0 | USBD_EP_IN(1));
+    }
+    REG_TRIGGER(NRF_USBD->TASKS_EP0STATUS);
+    return 0;
+}
+
+/** @name get_configuration
+ * @brief GET_CONFIGURATION
+ * @note  budget DATA
+*/
+static int get_configuration(const usb_setup_t* setup){
+    ep0_reply[0] = (uint8_t)usb_configuration;
+    send_data(0, ep0_reply, 1, setup->wLength);
+    return 0;
+}
+
+/** @name set_configuration
+ * @brief SET_CONFIGURATION: the only configuration is 1; reports may be sent from now on
+ * @note  budget STATUS. The HID driver still fetches the report descriptor
+ *        afterwards, but the host polls EP1 as soon as the device is configured.
+*/
+static int set_configuration(const usb_setup_t* setup){
+    if(setup->wValue > mouse_dev_desc.bNumConfigurations){
+        return -1;
+    }
+    if(setup->wValue == 0){
+        usb_unconfigure();
+    }else{
+        usb_configuration = setup->wValue;
+        ep1_halted = 0;
+        ep1_poll_interval = mouse_config_desc[poll_profile].endpoint.bInterval;
+        REG_WRITE(NRF_USBD->EPSTALL, USBD_EP_IN(1));
+        REG_WRITE(NRF_USBD->DTOGGLE, USBD_DTOGGLE_DATA0 | USBD_EP_IN(1));
+        MOUSE_READY = 0x1;
+        bringup_phase(BRINGUP_MOUSE_READY);
+    }
+    REG_TRIGGER(NRF_USBD->TASKS_EP0STATUS);
+    return 0;
+}
+
+/** @name get_interface
+ * @brief GET_INTERFACE: interface 0 only has alternate setting 0
+ * @note  budget DATA
+*/
+static int get_interface(const usb_setup_t* setup){
+    if(usb_configuration == 0 || setup->wIndex != 0){
+        return -1;
+    }
+    ep0_reply[0] = 0;
+    send_data(0, ep0_reply, 1, setup->wLength);
+    return 0;
+}
+
+/** @name set_interface
+ * @brief SET_INTERFACE: only alternate setting 0 of interface 0 exists
+ * @note  budget STATUS
+*/
+static int set_interface(const usb_setup_t* setup){
+    if(usb_configuration == 0 || setup->wIndex != 0 || setup->wValue != 0){
+        return -1;
+    }
+    REG_TRIGGER(NRF_USBD->TASKS_EP0STATUS);
+    return 0;
+}
+
+/** @name hid_get_report
+ * @brief GET_REPORT(input): the current buttons; GET_REPORT(feature): the Resolution Multiplier
+ * @note  budget DATA
+*/
+static int hid_get_report(const usb_setup_t* setup){
+    if(setup->wIndex != 0){
+        return -1;
+    }
+#if USBD_HIRES_REPORT
+    if((setup->wValue >> 8) == HID_REPORT_FEATURE){
+        hid_reply[0] = (uint8_t)hid_wheel_multiplier;
+        send_data(0, hid_reply, sizeof(hid_feature), setup->wLength);
+        return 0;
+    }
+#endif
+    if((setup->wValue >> 8) != HID_REPORT_INPUT){
+        return -1;
+    }
+    // relative motion has no current value, only the buttons do
+    for(uint32_t i = 0; i < sizeof(hid_reply); i++){
+        hid_reply[i] = 0;
+    }
+    hid_reply[0] = ep1_buttons;
+    send_data(0, hid_reply, (hid_protocol == HID_PROTOCOL_BOOT) ? sizeof(boot_report_t) : sizeof(input_report_t), setup->wLength);
+    return 0;
+}
+
+/** @name hid_get_idle
+ * @brief GET_IDLE
+ * @note  budget DATA
+*/
+static int hid_get_idle(const usb_setup_t* setup){
+    if(setup->wIndex != 0){
+        return -1;
+    }
+    hid_reply[0] = (uint8_t)hid_idle_rate;
+    send_data(0, hid_reply, 1, setup->wLength);
+    return 0;
+}
+
+/** @name hid_get_protocol
+ * @brief GET_PROTOCOL
+ * @note  budget DATA
+*/
+static int hid_get_protocol(const usb_setup_t* setup){
+    if(setup->wIndex != 0){
+        return -1;
+    }
+    hid_reply[0] = (uint8_t)hid_protocol;
+    send_data(0, hid_reply, 1, setup->wLength);
+    return 0;
+}
+
+#if USBD_HIRES_REPORT
+/** @name hid_set_report
+ * @brief SET_REPORT(feature): the Resolution Multiplier arrives in the DATA OUT stage
+ * @note  budget DATA
+*/
+static int hid_set_report(const usb_setup_t* setup){
+    if(setup->wIndex != 0 || (setup->wValue >> 8) != HID_REPORT_FEATURE || setup->wLength != sizeof(hid_feature)){
+        return -1;
+    }
+    receive_data(0, hid_feature, sizeof(hid_feature), hid_feature_received);
+    return 0;
+}
+#endif
+
+/** @name hid_set_idle
+ * @brief SET_IDLE: upper byte is the duration, lower byte the report ID (there is only one report)
+ * @note  budget STATUS
 */
-void set_address(uint16_t address){
-    printk("Set Address: %d\n", address);
-    printk("Device Addr: %d\n", *USBD_USBADDR);
-    *USBD_EVENTCAUSE |= *USBD_EVENTCAUSE;
-    *USBD_EVENTS_USBEVENT = 0x0;
+static int hid_set_idle(const usb_setup_t* setup){
+    if(setup->wIndex != 0){
+        return -1;
+    }
+    hid_idle_rate = setup->wValue >> 8;
+    ep1_idle_frames = 0;
+    sof_update();
+    send_data(0, 0, 0, 0);
+    return 0;
+}
+
+/** @name hid_set_protocol
+ * @brief SET_PROTOCOL: boot or report protocol
+ * @note  budget STATUS
+*/
+static int hid_set_protocol(const usb_setup_t* setup){
+    if(setup->wIndex != 0 || setup->wValue > HID_PROTOCOL_REPORT){
+        return -1;
+    }
+    hid_protocol = setup->wValue;
+    if(hid_protocol == HID_PROTOCOL_BOOT){
+        ep1_acc_wheel = 0;
+    }
+    send_data(0, 0, 0, 0);
+    return 0;
 }
 
+/** @name vendor_request
+ * @brief Latency trace requests (see usbd_trace.h)
+ * @note  budget VENDOR
+*/
+static int vendor_request(const usb_setup_t* setup){
+    return trace_vendor_request(setup->bmRequestType, setup->bRequest, setup->wLength);
+}
+
+/** @brief one entry of the SETUP dispatch table */
+typedef struct{
+    uint8_t request_type;   // bmRequestType
+    uint8_t request;        // bRequest
+    uint16_t budget;        // documented worst case of the handler, in cycles
+    int (*handler)(const usb_setup_t* setup);   // returns 0 if handled, -1 to STALL
+}setup_entry_t;
+
+/** @brief every request the device answers; anything else is stalled */
+static const setup_entry_t setup_table[] = {
+    {USB_REQ_DEVICE_IN, USB_GET_STATUS, SETUP_BUDGET_DATA, get_status},
+    {USB_REQ_INTERFACE_IN, USB_GET_STATUS, SETUP_BUDGET_DATA, get_status},
+    {USB_REQ_ENDPOINT_IN, USB_GET_STATUS, SETUP_BUDGET_DATA, get_status},
+    {USB_REQ_DEVICE_OUT, USB_CLEAR_FEATURE, SETUP_BUDGET_STATUS, device_feature},
+    {USB_REQ_DEVICE_OUT, USB_SET_FEATURE, SETUP_BUDGET_STATUS, device_feature},
+    {USB_REQ_ENDPOINT_OUT, USB_CLEAR_FEATURE, SETUP_BUDGET_STATUS, endpoint_feature},
+    {USB_REQ_ENDPOINT_OUT, USB_SET_FEATURE, SETUP_BUDGET_STATUS, endpoint_feature},
+    {USB_REQ_DEVICE_OUT, USB_SET_ADDRESS, SETUP_BUDGET_STATUS, set_address},
+    {USB_REQ_DEVICE_IN, USB_GET_DESCRIPTOR, SETUP_BUDGET_DATA, get_descriptor},
+    {USB_REQ_INTERFACE_IN, USB_GET_DESCRIPTOR, SETUP_BUDGET_DATA, get_interface_descriptor},
+    {USB_REQ_DEVICE_IN, USB_GET_CONFIGURATION, SETUP_BUDGET_DATA, get_configuration},
+    {USB_REQ_DEVICE_OUT, USB_SET_CONFIGURATION, SETUP_BUDGET_STATUS, set_configuration},
+    {USB_REQ_INTERFACE_IN, USB_GET_INTERFACE, SETUP_BUDGET_DATA, get_interface},
+    {USB_REQ_INTERFACE_OUT, USB_SET_INTERFACE, SETUP_BUDGET_STATUS, set_interface},
+    {USB_REQ_CLASS_INTERFACE_IN, HID_GET_REPORT, SETUP_BUDGET_DATA, hid_get_report},
+    {USB_REQ_CLASS_INTERFACE_IN, HID_GET_IDLE, SETUP_BUDGET_DATA, hid_get_idle},
+    {USB_REQ_CLASS_INTERFACE_IN, HID_GET_PROTOCOL, SETUP_BUDGET_DATA, hid_get_protocol},
+#if USBD_HIRES_REPORT
+    {USB_REQ_CLASS_INTERFACE_OUT, HID_SET_REPORT, SETUP_BUDGET_DATA, hid_set_report},
+#endif
+    {USB_REQ_CLASS_INTERFACE_OUT, HID_SET_IDLE, SETUP_BUDGET_STATUS, hid_set_idle},
+    {USB_REQ_CLASS_INTERFACE_OUT, HID_SET_PROTOCOL, SETUP_BUDGET_STATUS, hid_set_protocol},
+    {USB_REQ_VENDOR_DEVICE_IN, TRACE_REQ_GET_STATS, SETUP_BUDGET_VENDOR, vendor_request},
+    {USB_REQ_VENDOR_DEVICE_IN, TRACE_REQ_GET_RING, SETUP_BUDGET_VENDOR, vendor_request},
+    {USB_REQ_VENDOR_DEVICE_OUT, TRACE_REQ_RESET, SETUP_BUDGET_VENDOR, vendor_request},
+};
+#define NUM_SETUP_HANDLERS (sizeof(setup_table) / sizeof(setup_table[0]))
+
 /** @name  usbd_enumeration
- * @brief Initialize USBD stack (USB enumeration) 
+ * @brief Dispatches a SETUP packet to its handler in setup_table, or STALLs it
+ * @note  Called from USBD_IRQHandler on EP0SETUP
 */
 void usbd_enumeration(){
-    uint8_t request_type = (*USBD_BMREQUESTTYPE & 0xFF);
-    uint8_t request = (*USBD_BREQUEST & 0xFF);
-    uint16_t w_value = 0;
-    uint16_t w_length = (*USBD_WLENGTHL & 0xFF)  | ((*USBD_WLENGTHH & 0xFF) << 8);
-    printk("device_addr: %d, request_type: 0x%x, request: 0x%x, w_valueh (descriptor_type): 0x%x, w_valuel (descriptor_index): %d, w_length (descriptor_length): %d, w_index (interface_number): %d\n",*USBD_USBADDR, request_type, request, (*USBD_WVALUEH & 0xFF), ((*USBD_WVALUEL & 0xFF)), w_length, (*USBD_WINDEXL & 0xFF)  | ((*USBD_WINDEXH & 0xFF) << 8));
-    if(request_type == 0x80){
-        // respond to GET_DESCRIPTOR
-        if(request == 0x6){
-            w_value = (*USBD_WVALUEH & 0xFF);
-            get_descriptor(w_value, w_length);
-        }else{
-            printk("REQUEST (Device to Host): %d\n", request);
-        }
-    }else if(request_type == 0x0){
-        if(request == 0x5){
-            // SET_ADDRESS
-            w_value = (*USBD_WVALUEL & 0xFF)  | ((*USBD_WVALUEH & 0xFF) << 8);
-            set_address(w_value);
-        }else{
-            printk("REQUEST (Host to Device): %d\n", request);
-            // No data to send. Proceed to STATUS stage
-            *USBD_TASKS_EP0STATUS = 0x1;
+    usb_setup_t setup;
+    setup.bmRequestType = (REG_READ(NRF_USBD->BMREQUESTTYPE) & 0xFF);
+    setup.bRequest = (REG_READ(NRF_USBD->BREQUEST) & 0xFF);
+    setup.wValue = (REG_READ(NRF_USBD->WVALUEL) & 0xFF) | ((REG_READ(NRF_USBD->WVALUEH) & 0xFF) << 8);
+    setup.wIndex = (REG_READ(NRF_USBD->WINDEXL) & 0xFF) | ((REG_READ(NRF_USBD->WINDEXH) & 0xFF) << 8);
+    setup.wLength = (REG_READ(NRF_USBD->WLENGTHL) & 0xFF) | ((REG_READ(NRF_USBD->WLENGTHH) & 0xFF) << 8);
+    LOG_DEBUG("SETUP request_type: 0x%x, request: 0x%x, w_value: 0x%x, w_index: %d, w_length: %d, device_addr: %d\n",
+              setup.bmRequestType, setup.bRequest, setup.wValue, setup.wIndex, setup.wLength, REG_READ(NRF_USBD->USBADDR));
+    setup_requests++;
+
+    uint32_t start = trace_now();
+    const setup_entry_t* entry = 0;
+    for(uint32_t i = 0; i < NUM_SETUP_HANDLERS; i++){
+        if(setup_table[i].request_type == setup.bmRequestType && setup_table[i].request == setup.bRequest){
+            entry = &setup_table[i];
+            break;
         }
-    }else if(request_type == 0x81 && request == 0x6){
-        printk("Request received for HID Report Descriptor\n");
-        send_data(0, (uint8_t*)hidReportDescriptor, sizeof(hidReportDescriptor), w_length);
-        MOUSE_READY = 0x1;
-    }else{
-        printk("[ERROR] Unrecognized request_type: %d\n", request_type);
-        // Unrecognized request type, proceed to STATUS stage and see what happens
-        *USBD_TASKS_EP0STATUS = 0x1;
+    }
+    if(entry == 0 || entry->handler(&setup) != 0){
+        // unsupported request or invalid parameters: the host sees STALL in the data / status stage
+        LOG_WARN("STALL request_type: 0x%x, request: 0x%x\n", setup.bmRequestType, setup.bRequest);
+        REG_TRIGGER(NRF_USBD->TASKS_EP0STALL);
+        setup_stalls++;
+    }
+    uint32_t cycles = trace_now() - start;
+    if(cycles > setup_max_cycles){
+        setup_max_cycles = cycles;
+        setup_max_request = (setup.bmRequestType << 8) | setup.bRequest;
+    }
+    if(entry != 0 && cycles > entry->budget){
+        setup_overruns++;
     }
 }
 
+/** @name usbd_get_setup_stats
+ * @brief Copies the SETUP dispatcher counters
+*/
+void usbd_get_setup_stats(usbd_setup_stats_t* stats){
+    stats->requests = setup_requests;
+    stats->stalls = setup_stalls;
+    stats->overruns = setup_overruns;
+    stats->max_cycles = setup_max_cycles;
+    stats->max_request = (uint16_t)setup_max_request;
+}
+
 /** @name  USBD_IRQHandler
  * @brief USDB interrupt handler
 */
 void USBD_IRQHandler(){
-    if(*USBD_EVENTS_USBRESET == 1){
-        *USBD_EVENTS_USBRESET = 0x0;
+    usbd_ep_event();
+    usbd_ep0_event();
+
+    if(REG_READ(NRF_USBD->EVENTS_USBRESET) == 1){
+        REG_CLEAR(NRF_USBD->EVENTS_USBRESET);
+        // the device is unconfigured until the host enumerates it again
+        usb_unconfigure();
+        // the endpoint buffers are reset, anything in flight is lost
+        transfers_reset();
+        hid_reset();
+        usbd_power_reset();
+        bringup_phase(BRINGUP_RESET);
         //usbd_enumeration();
-        printk("\nUSB_RESET received!\n");
-    }else if(*USBD_EVENTS_EP0SETUP == 1){
-        printk("\nEP0SETUP received!\n");
-        *USBD_EVENTS_EP0SETUP = 0x0;
+        LOG_DEBUG("USB_RESET received!\n");
+    }else if(REG_READ(NRF_USBD->EVENTS_EP0SETUP) == 1){
+        LOG_DEBUG("EP0SETUP received!\n");
+        REG_CLEAR(NRF_USBD->EVENTS_EP0SETUP);
+        // a new SETUP aborts whatever control transfer was still in progress
+        ep0_state = EP0_IDLE;
+        usbd_ep_abort(USBD_EP_IN(0));
+        usbd_ep_abort(USBD_EP_OUT(0));
         usbd_enumeration();
-    }else if(*USBD_EVENTS_USBEVENT == 1){
-        *USBD_EVENTS_USBEVENT = 0x0;
-        printk("\nUSB EVENT received! EVENTCAUSE: 0x%x\n", *USBD_EVENTCAUSE);
-    }else if(*USBD_EVENTS_EPDATA == 1){
-        *USBD_EVENTS_EPDATA = 0x0;
-        printk("\nEPDATA received! EPDATASTATUS: %d\n", *USBD_EVENTS_EPDATASTATUS);
+    }
+    if(REG_READ(NRF_USBD->EVENTS_USBEVENT) == 1){
+        REG_CLEAR(NRF_USBD->EVENTS_USBEVENT);
+        usbd_usb_event();
     }
 
-    // clear the events after they're consumed
-    *USBD_EVENTCAUSE |= *USBD_EVENTCAUSE;
-    *USBD_EVENTS_USBEVENT = 0x0;
+    if((rate_measurement == 1 || hid_idle_rate != 0 || ep1_poll_known == 1) && REG_READ(NRF_USBD->EVENTS_SOF) == 1){
+        // SOF is raised every frame, but only counted while something needs the frame tick (see sof_update)
+        REG_CLEAR(NRF_USBD->EVENTS_SOF);
+        if(ep1_poll_known == 1){
+            ep1_poll_frame++;
+            if(ep1_poll_frame >= ep1_poll_interval){
+                ep1_poll_frame = 0;
+                ep1_poll_due = 1;
+            }
+        }
+        if(rate_measurement == 1){
+            rate_frames++;
+            if(rate_frames >= 1000){
+                reports_per_second = rate_reports;
+                rate_frames = 0;
+                rate_reports = 0;
+            }
+        }
+        if(hid_idle_rate != 0){
+            ep1_idle_tick();
+        }
+    }
+    usbd_ep1_service();
+    // the host polls right after the SOF; later events wait for the next poll frame
+    ep1_poll_due = 0;
 }
 
@@ -7,6 +7,35 @@
 #ifndef _USBD_H_
 #define _USBD_H_
 
+#ifdef USBD_SIM
+/* host build: registers live in the simulator's register file (see sim/usbd_sim.h) */
+#include <usbd_sim.h>
+#endif
+
+/** @brief peripheral base addresses */
+#ifndef USBD_BASE
+#define USBD_BASE 0x40027000
+#endif
+#ifndef POWER_BASE
+#define POWER_BASE 0x40000000
+#endif
+#ifndef CLOCK_BASE
+#define CLOCK_BASE 0x40000000
+#endif
+
+/** @brief the register blocks: NRF_USBD, NRF_POWER, NRF_CLOCK */
+#include <nrf_regs.h>
+
+/** @brief address EasyDMA uses for a buffer (written to the EPIN/EPOUT PTR registers) */
+#ifndef USBD_DMA_ADDR
+#define USBD_DMA_ADDR(ptr) ((uint32_t)(ptr))
+#endif
+
+/** @brief body of register busy-wait loops (lets the simulator advance its peripheral model) */
+#ifndef USBD_SPIN_HOOK
+#define USBD_SPIN_HOOK()
+#endif
+
 /** @brief types of USB device descriptors */
 enum DESC_TYPE{DEVICE = 1, CONFIG, STRING, INTERFACE, ENDPOINT};
 
@@ -90,94 +119,248 @@ typedef struct __attribute__((__packed__)){
     _endpoint_desc_t endpoint;
 }configuration_desc_t;
 
+/**
+ * @brief report layout, chosen at build time
+ * 0: 8-bit X/Y/Wheel (-127..127), the classic mouse report
+ * 1: 16-bit X/Y/Wheel (-32767..32767) and a wheel Resolution Multiplier
+ *    feature, so one report carries a whole fast flick and scrolling can be
+ *    finer than one detent
+*/
+#ifndef USBD_HIRES_REPORT
+#define USBD_HIRES_REPORT 0
+#endif
+
+/** @brief type of one relative axis in the input report */
+#if USBD_HIRES_REPORT
+typedef int16_t mouse_delta_t;
+#define MOUSE_DELTA_MAX 32767
+/** @brief wheel units per detent once the host enables the Resolution Multiplier */
+#define USBD_WHEEL_MULTIPLIER 8
+#else
+typedef int8_t mouse_delta_t;
+#define MOUSE_DELTA_MAX 127
+#define USBD_WHEEL_MULTIPLIER 1
+#endif
+
 /** @brief struct for each HID input report (ie. the mouse actions) */
+typedef struct __attribute__((__packed__)){
+    uint8_t buttons;
+    mouse_delta_t X;
+    mouse_delta_t Y;
+    mouse_delta_t Wheel;
+}input_report_t;
+
+/** @brief HID boot protocol report (same for both layouts) */
 typedef struct __attribute__((__packed__)){
     uint8_t buttons;
     int8_t X;
     int8_t Y;
-    int8_t Wheel;
-}input_report_t;
+}boot_report_t;
 
 /** @brief maximum packet size for the USB communication */
 #define MAX_PACKET_SIZE 64
 
+/** @brief number of input reports the EP1 queue can hold (must be a power of 2) */
+#define REPORT_QUEUE_SIZE 32
+
+/** @brief number of button transitions each EP1 button lane (syscalls, physical buttons) can hold (must be a power of 2) */
+#define BUTTON_LANE_SIZE 16
+
+/** @brief EP1 polling interval profiles (bInterval in ms, full-speed) */
+enum POLL_PROFILE{POLL_1MS = 0, POLL_2MS, POLL_4MS, POLL_8MS, POLL_10MS, NUM_POLL_PROFILES};
+
+/** @brief polling profile advertised at enumeration unless changed with usbd_set_poll_profile() */
+#ifndef USBD_POLL_PROFILE
+#define USBD_POLL_PROFILE POLL_10MS
+#endif
+
+/** @brief HID class requests (bmRequestType 0xA1 for GET_*, 0x21 for SET_*) */
+enum HID_REQUEST{HID_GET_REPORT = 0x01, HID_GET_IDLE = 0x02, HID_GET_PROTOCOL = 0x03,
+                 HID_SET_REPORT = 0x09, HID_SET_IDLE = 0x0A, HID_SET_PROTOCOL = 0x0B};
+
+/** @brief HID protocols (SET_PROTOCOL wValue); boot protocol reports are buttons, X, Y only */
+enum HID_PROTOCOL{HID_PROTOCOL_BOOT = 0, HID_PROTOCOL_REPORT};
+#define HID_BOOT_REPORT_SIZE 3
+
+/** @brief HID report types (GET_REPORT / SET_REPORT wValue high byte) */
+enum HID_REPORT_TYPE{HID_REPORT_INPUT = 1, HID_REPORT_OUTPUT, HID_REPORT_FEATURE};
+
+/** @brief idle rate after reset, in 4 ms units (0: only report when something changes) */
+#ifndef USBD_HID_IDLE_DEFAULT
+#define USBD_HID_IDLE_DEFAULT 0
+#endif
+
+/** @brief standard requests (USB 2.0 chapter 9, bRequest) */
+enum USB_REQUEST{USB_GET_STATUS = 0x00, USB_CLEAR_FEATURE = 0x01, USB_SET_FEATURE = 0x03, USB_SET_ADDRESS = 0x05,
+                 USB_GET_DESCRIPTOR = 0x06, USB_GET_CONFIGURATION = 0x08, USB_SET_CONFIGURATION = 0x09,
+                 USB_GET_INTERFACE = 0x0A, USB_SET_INTERFACE = 0x0B};
+
+/** @brief bmRequestType values: direction | type | recipient */
+#define USB_REQ_DEVICE_OUT 0x00
+#define USB_REQ_INTERFACE_OUT 0x01
+#define USB_REQ_ENDPOINT_OUT 0x02
+#define USB_REQ_DEVICE_IN 0x80
+#define USB_REQ_INTERFACE_IN 0x81
+#define USB_REQ_ENDPOINT_IN 0x82
+#define USB_REQ_CLASS_INTERFACE_OUT 0x21
+#define USB_REQ_CLASS_INTERFACE_IN 0xA1
+#define USB_REQ_VENDOR_DEVICE_OUT 0x40
+#define USB_REQ_VENDOR_DEVICE_IN 0xC0
+
+/** @brief descriptor types beyond enum DESC_TYPE that hosts ask for */
+#define USB_DESC_DEVICE_QUALIFIER 6
+#define HID_DESC_HID 0x21
+#define HID_DESC_REPORT 0x22
+
+/** @brief standard feature selectors of SET_FEATURE / CLEAR_FEATURE (recipient endpoint / device) */
+#define USB_FEATURE_ENDPOINT_HALT 0
+#define USB_FEATURE_DEVICE_REMOTE_WAKEUP 1
+
+/** @brief the SETUP packet of a control transfer */
+typedef struct{
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+}usb_setup_t;
+
+/** @brief SETUP dispatcher statistics (cycles measured with the DWT cycle counter) */
+typedef struct{
+    uint32_t requests;      // SETUP packets handled
+    uint32_t stalls;        // requests answered with STALL (unsupported or invalid)
+    uint32_t overruns;      // handlers that took longer than their documented budget
+    uint32_t max_cycles;    // longest handler run
+    uint16_t max_request;   // bmRequestType << 8 | bRequest of that run
+}usbd_setup_stats_t;
+
+/** @brief bus power state of the device */
+enum USBD_POWER_STATE{
+    USBD_POWER_ACTIVE = 0,  // HFCLK running, reports are sent
+    USBD_POWER_SUSPENDED,   // bus suspended: USBD in low power, HFCLK stopped
+    USBD_POWER_RESUMING     // leaving suspend, waiting for HFCLKSTARTED
+};
+
+/**
+ * @brief steps of the power-up sequence, in the order they usually complete
+ * HFCLK, USBD_READY and PWRRDY run in parallel; the pull-up is enabled once all three are done.
+*/
+enum USBD_BRINGUP_PHASE{
+    BRINGUP_DETECTED = 0,   // USBDETECTED: USBD enabled, HFCLK started
+    BRINGUP_USBD_READY,     // USBEVENT with EVENTCAUSE READY
+    BRINGUP_HFCLK,          // HFCLKSTARTED
+    BRINGUP_PWRRDY,         // USBPWRRDY: USB regulator up
+    BRINGUP_PULLUP,         // D+ pull-up enabled, the host can see the device
+    BRINGUP_RESET,          // first bus reset from the host
+    BRINGUP_MOUSE_READY,    // MOUSE_READY set
+    NUM_BRINGUP_PHASES
+};
+
+/** @brief timestamps of the last power-up sequence */
+typedef struct{
+    uint32_t reached;                       // bit n set once phase n was reached
+    uint32_t cycles[NUM_BRINGUP_PHASES];    // CPU cycles from USBDETECTED to each phase
+}usbd_bringup_stats_t;
+
+/** @brief statistics of the EP1 input report queue */
+typedef struct{
+    uint32_t depth;      // reports waiting to be sent to the host
+    uint32_t max_depth;  // highest depth seen so far
+    uint32_t dropped;    // reports dropped because the queue was full
+    uint32_t sent;       // reports acknowledged by the host
+    uint32_t coalesced;  // reports merged into another report before sending
+    uint32_t suppressed;    // reports dropped because they changed nothing
+    uint32_t idle_repeats;  // reports re-sent because the idle period expired
+    uint32_t priority;      // button transitions sent ahead of motion that was waiting
+    uint32_t transitions;   // button transitions waiting in the priority lane
+    uint32_t poll_interval_ms;    // bInterval advertised to the host
+    uint32_t reports_per_second;  // reports acknowledged during the last second (rate measurement only)
+}report_queue_stats_t;
+
+/** @brief suspend / resume statistics */
+typedef struct{
+    uint32_t state;                 // enum USBD_POWER_STATE
+    uint32_t suspends;              // bus suspends seen
+    uint32_t resumes;               // bus resumes seen (host resume or after a remote wakeup)
+    uint32_t remote_wakeups;        // remote wakeups signalled by the device
+    uint32_t remote_wakeup_enabled; // 1 while the host allows remote wakeup
+}usbd_power_stats_t;
+
 /********************************** USBD Global **********************************/
 
-/** @brief USBD registers */
-#define USBD (volatile uint32_t*) 0x40027000
-#define USBD_ENABLE (volatile uint32_t*) (0x40027000 + 0x500)
-#define USBD_USBPULLUP (volatile uint32_t*) (0x40027000 + 0x504)
-#define USBD_EPINEN (volatile uint32_t*) (0x40027000 + 0x510)
-#define USBD_EPOUTEN (volatile uint32_t*) (0x40027000 + 0x514)
-#define USBD_INTENSET (volatile uint32_t*) (0x40027000 + 0x304)
-#define USBD_INTENCLR (volatile uint32_t*) (0x40027000 + 0x308)
-#define USBD_USBADDR (volatile uint32_t*) (0x40027000 + 0x470)
-
-/** @brief USBD Generic Events (ie. for all endpoints) */
-#define USBD_EVENTS_USBEVENT (volatile uint32_t*) (0x40027000 + 0x158)
-#define USBD_EVENTCAUSE (volatile uint32_t*) (0x40027000 + 0x400)
-#define USBD_EVENTS_STARTED (volatile uint32_t*) (0x40027000 + 0x104)
-#define USBD_EVENTS_EPDATASTATUS (volatile uint32_t*) (0x40027000 + 0x46C)
-#define USBD_EVENTS_EPDATA (volatile uint32_t*) (0x40027000 + 0x160)
-
-
-/********************************** CONTROL TRANSFER **********************************/
-
-/** @brief ENDPOINT-0 registers */
-#define USBD_EPIN0_PTR (volatile uint8_t**) (0x40027000 + 0x600 + (0 * 0x14))
-#define USBD_EPIN0_MAXCNT (volatile uint32_t*) (0x40027000 + 0x604 + (0 * 0x14))
-#define USBD_EPIN0_AMOUNT (volatile uint32_t*) (0x40027000 + 0x608 + (0 * 0x14))
-
-/** @brief ENDPOINT-0 Tasks & Events */
-#define USBD_TASKS_STARTEPIN0 (volatile uint32_t*) (0x40027000 + 0x004 + (0 * 0x4))
-#define USBD_TASKS_EP0STATUS (volatile uint32_t*) (0x40027000 + 0x050)
-#define USBD_EVENTS_USBRESET (volatile uint32_t*) (0x40027000 + 0x100)
-#define USBD_EVENTS_ENDEPIN0 (volatile uint32_t*) (0x40027000 + 0x108 + (0 * 0x4))
-#define USBD_EVENTS_EP0SETUP (volatile uint32_t*) (0x40027000 + 0x15C)
-#define USBD_EVENTS_EP0DATADONE (volatile uint32_t*) (0x40027000 + 0x128)
-
-/** @brief ENDPOINT-0 registers that store SETUP data */
-#define USBD_BMREQUESTTYPE (volatile uint32_t*) (0x40027000 + 0x480)
-#define USBD_BREQUEST (volatile uint32_t*) (0x40027000 + 0x484)
-#define USBD_WVALUEL (volatile uint32_t*) (0x40027000 + 0x488)
-#define USBD_WVALUEH (volatile uint32_t*) (0x40027000 + 0x48C)
-#define USBD_WLENGTHL (volatile uint32_t*) (0x40027000 + 0x498)
-#define USBD_WLENGTHH (volatile uint32_t*) (0x40027000 + 0x49C)
-#define USBD_WINDEXL (volatile uint32_t*) (0x40027000 + 0x494)
-#define USBD_WINDEXH (volatile uint32_t*) (0x40027000 + 0x49C)
-
-/********************************** INTERRUPT TRANSFER **********************************/
-
-/** @brief ENDPOINT-1 Tasks & Events */
-#define USBD_TASKS_STARTEPIN1 (volatile uint32_t*) (0x40027000 + 0x004 + (1 * 0x4))
-#define USBD_EVENTS_ENDEPIN1 (volatile uint32_t*) (0x40027000 + 0x108 + (1 * 0x4))
-
-/** @brief ENDPOINT-1 registers */
-#define USBD_EPIN1_PTR (volatile uint8_t**) (0x40027000 + 0x600 + (1 * 0x14))
-#define USBD_EPIN1_MAXCNT (volatile uint32_t*) (0x40027000 + 0x604 + (1 * 0x14))
-#define USBD_EPIN1_AMOUNT (volatile uint32_t*) (0x40027000 + 0x608 + (1 * 0x14))
+/** @brief LOWPOWER values and the DPDMVALUE state driven for a remote wakeup */
+#define USBD_LOWPOWER_FORCENORMAL 0x0
+#define USBD_LOWPOWER_LOWPOWER 0x1
+#define USBD_DPDMVALUE_RESUME 0x1
+
+/** @brief EVENTCAUSE bits (write 1 to clear) */
+#define USBD_EVENTCAUSE_SUSPEND (0x1 << 8)
+#define USBD_EVENTCAUSE_RESUME (0x1 << 9)
+#define USBD_EVENTCAUSE_USBWUALLOWED (0x1 << 10)
+#define USBD_EVENTCAUSE_READY (0x1 << 11)
+
+/** @brief USBD interrupt enable bits */
+#define USBD_INT_USBRESET (0x1 << 0)
+#define USBD_INT_ENDEPIN0 (0x1 << 2)
+#define USBD_INT_ENDEPIN1 (0x1 << 3)
+#define USBD_INT_EP0DATADONE (0x1 << 10)
+#define USBD_INT_ENDEPOUT0 (0x1 << 12)
+#define USBD_INT_SOF (0x1 << 21)
+#define USBD_INT_USBEVENT (0x1 << 22)
+#define USBD_INT_EP0SETUP (0x1 << 23)
+#define USBD_INT_EPDATA (0x1 << 24)
+
+/** @brief endpoint halt and data toggle (EPSTALL / DTOGGLE): EP number in bits 0-2, bit 7 set for IN */
+#define USBD_EPSTALL_STALL (0x1 << 8)
+#define USBD_DTOGGLE_DATA0 (0x1 << 8)
 
 /********************************** POWER & CLOCK **********************************/
 
-/** @brief POWER registers */
-#define POWER (volatile uint32_t*) 0x40000000
-#define POWER_EVENTS_USBDETECTED (volatile uint32_t*) (0x40000000 + 0x11C)
-#define POWER_EVENTS_USBREMOVED (volatile uint32_t*) (0x40000000 + 0x120)
-#define POWER_EVENTS_USBPWRRDY (volatile uint32_t*) (0x40000000 + 0x124)
-#define POWER_INTENSET (volatile uint32_t*) (0x40000000 + 0x304)
-#define POWER_INTENCLR (volatile uint32_t*) (0x40000000 + 0x308)
-
-/** @brief CLOCK registers */
-#define CLOCK (volatile uint32_t*) 0x40000000
-#define CLOCK_TASKS_HFCLKSTART (volatile uint32_t*) (0x40000000 + 0x000)
-#define CLOCK_TASKS_HFCLKSTOP (volatile uint32_t*) (0x40000000 + 0x004)
-#define CLOCK_EVENTS_HFCLKSTARTED (volatile uint32_t*) (0x40000000 + 0x100)
-#define CLOCK_HFCLKSTAT (volatile uint32_t*) (0x40000000 + 0x40C)
+/** @brief POWER interrupt enable bits */
+#define POWER_INT_USBDETECTED (0x1 << 7)
+#define POWER_INT_USBREMOVED (0x1 << 8)
+#define POWER_INT_USBPWRRDY (0x1 << 9)
+
+/** @brief CLOCK interrupt enable bits */
+#define CLOCK_INT_HFCLKSTARTED (0x1 << 0)
 
 /** @brief initialize USBD */
 void usbd_init();
 
 /** @brief send data from USB device to USB */
-void send_data(uint8_t endpoint, uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size);
+void send_data(uint8_t endpoint, const uint8_t* buffer_ptr, uint32_t total_size, uint16_t data_size);
+
+/** @brief receive the DATA OUT stage of a control transfer, done() is called once it has arrived */
+void receive_data(uint8_t endpoint, uint8_t* buffer_ptr, uint16_t data_size, void (*done)(uint8_t* buffer_ptr, uint32_t size));
+
+/** @brief queue an input report for EP1 without waiting for the host */
+int usbd_queue_report(const input_report_t* report);
+
+/** @brief queue a change of the physical buttons for EP1 (button interrupts only, see gpio_buttons.h) */
+int usbd_queue_buttons(uint8_t buttons, uint32_t cycles);
+
+/** @brief read the EP1 input report queue statistics */
+void usbd_get_queue_stats(report_queue_stats_t* stats);
+
+/** @brief wheel units per detent the host currently expects (1 unless it enabled the Resolution Multiplier) */
+uint32_t usbd_wheel_resolution();
+
+/** @brief select the EP1 polling interval advertised at the next enumeration */
+int usbd_set_poll_profile(uint32_t profile);
+
+/** @brief turn the measured reports-per-second counter on (1) or off (0) */
+void usbd_set_rate_measurement(uint32_t enable);
+
+/** @brief 1 while the bus is suspended (HFCLK stopped, the core may sleep until an interrupt) */
+uint32_t usbd_suspended();
+
+/** @brief read the suspend / resume statistics */
+void usbd_get_power_stats(usbd_power_stats_t* stats);
+
+/** @brief read the timestamps of the last power-up sequence */
+void usbd_get_bringup_stats(usbd_bringup_stats_t* stats);
+
+/** @brief read the SETUP dispatcher statistics */
+void usbd_get_setup_stats(usbd_setup_stats_t* stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,273 @@
+/**
+ * @file usbd_ep.c
+ * @name Table-driven USBD endpoint engine.
+ *
+ * Every endpoint (EP0 to EP7, IN and OUT) has one table index, used for
+ * its entry of the state table and to pick its registers out of the
+ * register block, so an endpoint address or an EPDATASTATUS bit leads to
+ * its registers and its transfer in O(1).
+ *
+ * Transfers on different endpoints are independent: each one waits for its
+ * host token on its own. Only EasyDMA is shared. The USBD can run one
+ * EasyDMA transfer at a time, so DMA requests are collected in a bitmask
+ * and started one after the other, lowest endpoint first. As a result, the
+ * interrupt only has to check the END event of the transfer in progress.
+*/
+
+#include <usbd.h>
+#include <usbd_ep.h>
+
+/** @brief table index: IN endpoints first, then OUT endpoints */
+#define EP_INDEX(ep_addr) (((ep_addr) & 0x80) ? ((ep_addr) & 0x7) : USBD_NUM_EP + ((ep_addr) & 0x7))
+#define EP_IS_IN(index) ((index) < USBD_NUM_EP)
+#define EP_NUMBER(index) ((index) & 0x7)
+#define EP_ADDR(index) (EP_IS_IN(index) ? USBD_EP_IN(EP_NUMBER(index)) : USBD_EP_OUT(EP_NUMBER(index)))
+
+/** @brief registers of an endpoint: EasyDMA channel, START task, END event, SIZE.EPOUT and INTEN bit of the END event */
+#define EP_DMA(index) (EP_IS_IN(index) ? &NRF_USBD->EPIN[EP_NUMBER(index)] : &NRF_USBD->EPOUT[EP_NUMBER(index)])
+#define EP_TASK(index) (*(EP_IS_IN(index) ? &NRF_USBD->TASKS_STARTEPIN[EP_NUMBER(index)] \
+                                          : &NRF_USBD->TASKS_STARTEPOUT[EP_NUMBER(index)]))
+#define EP_END_EVENT(index) (*(EP_IS_IN(index) ? &NRF_USBD->EVENTS_ENDEPIN[EP_NUMBER(index)] \
+                                               : &NRF_USBD->EVENTS_ENDEPOUT[EP_NUMBER(index)]))
+#define EP_SIZE(index) (NRF_USBD->SIZE_EPOUT[EP_NUMBER(index)])
+#define EP_INTEN(index) (EP_IS_IN(index) ? (1u << (2 + EP_NUMBER(index))) : (1u << (12 + EP_NUMBER(index))))
+
+/** @brief state of one endpoint */
+typedef struct{
+    const uint8_t* buffer;      // RAM buffer of the transfer (EasyDMA cannot read flash)
+    uint32_t size;              // bytes to send / room in the buffer
+    volatile uint32_t busy;     // IN: until the host acknowledged (EP0: until DMA done), OUT: until the data is in RAM
+    uint32_t enabled;
+    uint32_t pending;           // OUT: the host has sent a packet that is not in RAM yet
+    usbd_ep_handler_t dma_done; // EasyDMA has finished (IN: the packet is in the endpoint buffer)
+    usbd_ep_handler_t complete; // IN: the host has read the packet, OUT: the packet is in RAM
+}usbd_ep_t;
+
+static usbd_ep_t ep_state[2 * USBD_NUM_EP];
+
+/** @brief endpoints waiting for EasyDMA (bit = table index) */
+static uint32_t dma_requests = 0;
+/** @brief table index + 1 of the endpoint using EasyDMA, 0 when EasyDMA is idle */
+static uint32_t dma_owner = 0;
+
+/** @name dma_kick
+ * @brief Starts the next requested EasyDMA transfer if EasyDMA is idle
+*/
+static void dma_kick(){
+    if(dma_owner != 0 || dma_requests == 0){
+        return;
+    }
+    uint32_t index = __builtin_ctz(dma_requests);
+    dma_requests &= ~(1u << index);
+    usbd_dma_regs_t* dma = EP_DMA(index);
+    usbd_ep_t* ep = &ep_state[index];
+
+    uint32_t size = ep->size;
+    if(!EP_IS_IN(index) && EP_NUMBER(index) != 0){
+        // only move what the host has sent
+        uint32_t received = REG_READ(EP_SIZE(index));
+        if(received < size){
+            size = received;
+        }
+    }
+    dma_owner = index + 1;
+    REG_WRITE(dma->PTR, USBD_DMA_ADDR(ep->buffer));
+    REG_WRITE(dma->MAXCNT, size);
+    // Errata #199 workaround, removed again when the transfer ends
+    REG_WRITE(NRF_USBD->ERRATA_199, 0x00000082);
+    REG_TRIGGER(EP_TASK(index));
+}
+
+/** @name dma_request
+ * @brief Queues an endpoint for EasyDMA
+*/
+static void dma_request(uint32_t index){
+    dma_requests |= (1u << index);
+    dma_kick();
+}
+
+/** @name usbd_ep_enable
+ * @brief Enables an endpoint and sets its handlers
+ * @param ep_addr    USBD_EP_IN(n) or USBD_EP_OUT(n)
+ * @param dma_done   called when EasyDMA has finished (may be NULL)
+ * @param complete   IN: called when the host has read the packet (not for EP0)
+ *                   OUT: called when the packet is in RAM (may be NULL)
+ * @return 0 on success, -1 for an invalid endpoint
+*/
+int usbd_ep_enable(uint8_t ep_addr, usbd_ep_handler_t dma_done, usbd_ep_handler_t complete){
+    if((ep_addr & 0x7F) >= USBD_NUM_EP){
+        return -1;
+    }
+    uint32_t index = EP_INDEX(ep_addr);
+    usbd_ep_t* ep = &ep_state[index];
+    ep->dma_done = dma_done;
+    ep->complete = complete;
+    ep->enabled = 1;
+    if(EP_NUMBER(index) != 0){
+        // EP0 is always enabled
+        if(EP_IS_IN(index)){
+            REG_WRITE(NRF_USBD->EPINEN, REG_READ(NRF_USBD->EPINEN) | (1u << EP_NUMBER(index)));
+        }else{
+            REG_WRITE(NRF_USBD->EPOUTEN, REG_READ(NRF_USBD->EPOUTEN) | (1u << EP_NUMBER(index)));
+        }
+        REG_WRITE(NRF_USBD->INTENSET, USBD_INT_EPDATA | EP_INTEN(index));
+    }else{
+        REG_WRITE(NRF_USBD->INTENSET, EP_INTEN(index));
+    }
+    return 0;
+}
+
+/** @name usbd_ep_write
+ * @brief Sends one packet on an IN endpoint
+ * @param ep_addr      USBD_EP_IN(n)
+ * @param buffer_ptr   packet in RAM, must stay valid until dma_done
+ * @param size         at most MAX_PACKET_SIZE bytes
+ * @return 0 if the transfer was started, -1 if the endpoint is busy, disabled or not IN
+*/
+int usbd_ep_write(uint8_t ep_addr, const uint8_t* buffer_ptr, uint32_t size){
+    if((ep_addr & 0x80) == 0 || (ep_addr & 0x7F) >= USBD_NUM_EP || size > MAX_PACKET_SIZE){
+        return -1;
+    }
+    uint32_t index = EP_INDEX(ep_addr);
+    usbd_ep_t* ep = &ep_state[index];
+    if(ep->enabled == 0 || ep->busy == 1){
+        return -1;
+    }
+    ep->buffer = buffer_ptr;
+    ep->size = size;
+    ep->busy = 1;
+    dma_request(index);
+    return 0;
+}
+
+/** @name usbd_ep_read
+ * @brief Provides the buffer for the next packet of an OUT endpoint
+ *
+ * EP0: the packet must already be in the endpoint buffer (EP0DATADONE).
+ * Other endpoints: the packet is moved into RAM as soon as the host sends
+ * it, or right away if it has already arrived.
+ * @param ep_addr      USBD_EP_OUT(n)
+ * @param buffer_ptr   RAM buffer
+ * @param size         room in the buffer
+ * @return 0 on success, -1 if the endpoint is busy, disabled or not OUT
+*/
+int usbd_ep_read(uint8_t ep_addr, uint8_t* buffer_ptr, uint32_t size){
+    if((ep_addr & 0x80) != 0 || ep_addr >= USBD_NUM_EP){
+        return -1;
+    }
+    uint32_t index = EP_INDEX(ep_addr);
+    usbd_ep_t* ep = &ep_state[index];
+    if(ep->enabled == 0 || ep->busy == 1){
+        return -1;
+    }
+    ep->buffer = buffer_ptr;
+    ep->size = size;
+    ep->busy = 1;
+    if(EP_NUMBER(index) == 0 || ep->pending == 1){
+        dma_request(index);
+    }
+    return 0;
+}
+
+/** @name usbd_ep_busy
+ * @brief 1 while a transfer is in progress on the endpoint
+*/
+uint32_t usbd_ep_busy(uint8_t ep_addr){
+    return ep_state[EP_INDEX(ep_addr)].busy;
+}
+
+/** @name usbd_ep_abort
+ * @brief Drops a transfer that has not reached EasyDMA yet
+ * @note  A transfer whose EasyDMA is already running finishes normally
+*/
+void usbd_ep_abort(uint8_t ep_addr){
+    uint32_t index = EP_INDEX(ep_addr);
+    if(dma_requests & (1u << index)){
+        dma_requests &= ~(1u << index);
+        ep_state[index].busy = 0;
+    }
+}
+
+/** @name usbd_ep_reset
+ * @brief Forgets every transfer; the handlers and enabled endpoints are kept
+*/
+void usbd_ep_reset(){
+    for(uint32_t index = 0; index < 2 * USBD_NUM_EP; index++){
+        ep_state[index].busy = 0;
+        ep_state[index].pending = 0;
+    }
+    dma_requests = 0;
+    dma_owner = 0;
+    REG_WRITE(NRF_USBD->ERRATA_199, 0x00000000);
+}
+
+/** @name dma_finished
+ * @brief END event of the EasyDMA transfer in progress
+*/
+static void dma_finished(){
+    uint32_t index = dma_owner - 1;
+    usbd_ep_t* ep = &ep_state[index];
+    REG_CLEAR(EP_END_EVENT(index));
+    REG_WRITE(NRF_USBD->ERRATA_199, 0x00000000);
+    dma_owner = 0;
+
+    uint32_t amount = REG_READ(EP_DMA(index)->AMOUNT);
+    if(EP_IS_IN(index)){
+        if(EP_NUMBER(index) == 0){
+            // EP0 is driven by the control transfer (EP0DATADONE), the buffer is free now
+            ep->busy = 0;
+        }
+        if(ep->dma_done != 0){
+            ep->dma_done(EP_ADDR(index), amount);
+        }
+    }else{
+        ep->busy = 0;
+        ep->pending = 0;
+        if(ep->dma_done != 0){
+            ep->dma_done(EP_ADDR(index), amount);
+        }
+        if(ep->complete != 0){
+            ep->complete(EP_ADDR(index), amount);
+        }
+    }
+}
+
+/** @name usbd_ep_event
+ * @brief Dispatches the endpoint events
+ * @note  Only called from USBD_IRQHandler
+*/
+void usbd_ep_event(){
+    // only the transfer that owns EasyDMA can have raised an END event
+    if(dma_owner != 0 && REG_READ(EP_END_EVENT(dma_owner - 1)) == 1){
+        dma_finished();
+    }
+    if(REG_READ(NRF_USBD->EVENTS_EPDATA) == 1){
+        REG_CLEAR(NRF_USBD->EVENTS_EPDATA);
+        uint32_t status = REG_READ(NRF_USBD->EPDATASTATUS);
+        REG_WRITE(NRF_USBD->EPDATASTATUS, status);
+        while(status != 0){
+            // EPIN[n] is bit n, EPOUT[n] is bit 16 + n
+            uint32_t bit = __builtin_ctz(status);
+            status &= status - 1;
+            if(bit % 16 >= USBD_NUM_EP){
+                continue;
+            }
+            uint32_t index = (bit < 16) ? bit : USBD_NUM_EP + (bit - 16);
+            usbd_ep_t* ep = &ep_state[index];
+            if(EP_IS_IN(index)){
+                // the host has read the packet
+                ep->busy = 0;
+                if(ep->complete != 0){
+                    ep->complete(EP_ADDR(index), ep->size);
+                }
+            }else{
+                // the host has sent a packet; it is moved into RAM once a buffer is there
+                ep->pending = 1;
+                if(ep->busy == 1 && (dma_requests & (1u << index)) == 0 && dma_owner != index + 1){
+                    dma_request(index);
+                }
+            }
+        }
+    }
+    dma_kick();
+}
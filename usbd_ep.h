@@ -0,0 +1,41 @@
+/** @file   usbd_ep.h
+ *  @brief  table-driven endpoint engine of the USBD (EP0 to EP7, IN and OUT)
+**/
+
+#include <unistd.h>
+
+#ifndef _USBD_EP_H_
+#define _USBD_EP_H_
+
+/** @brief endpoints per direction */
+#define USBD_NUM_EP 8
+
+/** @brief endpoint addresses, as in bEndpointAddress (bit 7 set for IN) */
+#define USBD_EP_IN(n) (0x80 | (n))
+#define USBD_EP_OUT(n) (n)
+
+/** @brief called from USBD_IRQHandler with the endpoint address and the number of bytes moved */
+typedef void (*usbd_ep_handler_t)(uint8_t ep_addr, uint32_t size);
+
+/** @brief enable an endpoint and set its completion handlers */
+int usbd_ep_enable(uint8_t ep_addr, usbd_ep_handler_t dma_done, usbd_ep_handler_t complete);
+
+/** @brief send one packet on an IN endpoint */
+int usbd_ep_write(uint8_t ep_addr, const uint8_t* buffer_ptr, uint32_t size);
+
+/** @brief provide the buffer for the next packet of an OUT endpoint */
+int usbd_ep_read(uint8_t ep_addr, uint8_t* buffer_ptr, uint32_t size);
+
+/** @brief 1 while a transfer is in progress on the endpoint */
+uint32_t usbd_ep_busy(uint8_t ep_addr);
+
+/** @brief drop a transfer that has not started yet */
+void usbd_ep_abort(uint8_t ep_addr);
+
+/** @brief forget every transfer (bus reset or cable removed) */
+void usbd_ep_reset();
+
+/** @brief dispatch ENDEPIN[n], ENDEPOUT[n] and EPDATA (called from USBD_IRQHandler) */
+void usbd_ep_event();
+
+#endif /* _USBD_EP_H_ */
@@ -0,0 +1,135 @@
+/**
+ * @file usbd_log.c
+ * @name Deferred binary log ring.
+ *
+ * Writers (any context, including interrupts) claim a slot with a
+ * compare-and-swap on the head, copy the format address and the raw
+ * arguments, then publish the slot by storing its sequence number. The
+ * only reader is the formatting side: SWI0_EGU0_IRQHandler, which runs
+ * at the lowest interrupt priority so it never delays the USBD or
+ * POWER_CLOCK handlers.
+*/
+
+#include <usbd.h>
+#include <usbd_log.h>
+#include <printk.h>
+
+#ifndef NVIC_BASE
+#define NVIC_BASE 0xE000E000
+#endif
+
+/** @brief SWI0_EGU0 (IRQ 20) formats the log */
+#define NVIC_ISER0 (volatile uint32_t*) (NVIC_BASE + 0x100)
+#define NVIC_ISPR0 (volatile uint32_t*) (NVIC_BASE + 0x200)
+#define NVIC_IPR_SWI0 (volatile uint8_t*) (NVIC_BASE + 0x400 + 20)
+#define SWI0_IRQ_BIT (1 << 20)
+/** @brief lowest priority (the nRF52840 implements 3 priority bits) */
+#define SWI0_PRIORITY 0xE0
+
+/** @brief one stored message */
+typedef struct{
+    volatile uint32_t seq;      // index + 1 once the slot is published
+    const char* fmt;
+    uint8_t level;
+    uint8_t nargs;
+    uint32_t args[LOG_MAX_ARGS];
+}log_record_t;
+
+static log_record_t log_ring[LOG_RING_SIZE];
+/** @brief next slot to claim (writers) and next slot to format (reader) */
+static volatile uint32_t log_head = 0;
+static volatile uint32_t log_tail = 0;
+static volatile uint32_t log_lost = 0;
+/** @brief lost count already reported by log_flush */
+static uint32_t log_lost_reported = 0;
+
+/** @brief printed in front of each message */
+static const char* const log_level_prefix[] = {"", "[ERROR] ", "[WARN] ", "", ""};
+
+/** @name log_init
+ * @brief Sets up the ring and the low-priority formatting interrupt
+*/
+void log_init(){
+    for(uint32_t i = 0; i < LOG_RING_SIZE; i++){
+        log_ring[i].seq = 0;
+    }
+    log_head = 0;
+    log_tail = 0;
+    *NVIC_IPR_SWI0 = SWI0_PRIORITY; // byte-wide, outside the 32-bit REG_* backend
+    REG_WRITE(*NVIC_ISER0, SWI0_IRQ_BIT);
+}
+
+/** @name log_write
+ * @brief Stores one message without formatting it
+ * @param level    LOG_LEVEL_*
+ * @param fmt      printk format string (must stay valid, i.e. a literal)
+ * @param args     raw arguments
+ * @param nargs    number of arguments (at most LOG_MAX_ARGS)
+*/
+void log_write(uint32_t level, const char* fmt, const uint32_t* args, uint32_t nargs){
+    uint32_t head = log_head;
+    do{
+        if(head - log_tail >= LOG_RING_SIZE){
+            log_lost++;
+            return;
+        }
+    }while(!__atomic_compare_exchange_n(&log_head, &head, head + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    log_record_t* record = &log_ring[head & (LOG_RING_SIZE - 1)];
+    record->fmt = fmt;
+    record->level = (uint8_t)level;
+    record->nargs = (uint8_t)nargs;
+    for(uint32_t i = 0; i < nargs; i++){
+        record->args[i] = args[i];
+    }
+    __atomic_store_n(&record->seq, head + 1, __ATOMIC_RELEASE);
+
+    REG_WRITE(*NVIC_ISPR0, SWI0_IRQ_BIT);
+}
+
+/** @name log_flush
+ * @brief Formats and prints every published message
+ * @note  Single reader: call it from one context only (SWI0_EGU0_IRQHandler by default)
+*/
+void log_flush(){
+    uint32_t tail = log_tail;
+    while(1){
+        log_record_t* record = &log_ring[tail & (LOG_RING_SIZE - 1)];
+        if(__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != tail + 1){
+            // empty, or the writer of this slot has not finished yet (it pends us again)
+            break;
+        }
+        const char* fmt = record->fmt;
+        uint32_t level = record->level;
+        uint32_t a[LOG_MAX_ARGS] = {0};
+        for(uint32_t i = 0; i < record->nargs && i < LOG_MAX_ARGS; i++){
+            a[i] = record->args[i];
+        }
+        tail++;
+        log_tail = tail;
+
+        if(level < sizeof(log_level_prefix) / sizeof(log_level_prefix[0])){
+            printk("%s", log_level_prefix[level]);
+        }
+        printk(fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    uint32_t lost = log_lost;
+    if(lost != log_lost_reported){
+        printk("[log] %d messages dropped\n", lost - log_lost_reported);
+        log_lost_reported = lost;
+    }
+}
+
+/** @name log_dropped
+ * @brief Number of messages lost because the ring was full
+*/
+uint32_t log_dropped(){
+    return log_lost;
+}
+
+/** @name SWI0_EGU0_IRQHandler
+ * @brief Lowest-priority interrupt that does the printk work for the log
+*/
+void SWI0_EGU0_IRQHandler(){
+    log_flush();
+}
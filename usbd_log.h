@@ -0,0 +1,80 @@
+/** @file   usbd_log.h
+ *  @brief  deferred binary logging for interrupt context
+ *
+ *  LOG_*(fmt, ...) only stores the format string's address and up to
+ *  LOG_MAX_ARGS raw 32-bit arguments in a ring. The printk formatting
+ *  happens later, in the lowest-priority interrupt (SWI0_EGU0_IRQHandler)
+ *  or wherever log_flush() is called. Levels above USBD_LOG_LEVEL compile
+ *  to nothing, including their arguments.
+**/
+
+#include <unistd.h>
+
+#ifndef _USBD_LOG_H_
+#define _USBD_LOG_H_
+
+/** @brief log levels */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+/** @brief most verbose level compiled in (e.g. -DUSBD_LOG_LEVEL=LOG_LEVEL_DEBUG while bringing up the stack) */
+#ifndef USBD_LOG_LEVEL
+#define USBD_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/** @brief number of messages the ring holds (must be a power of 2) */
+#define LOG_RING_SIZE 64
+/** @brief maximum number of arguments of one message */
+#define LOG_MAX_ARGS 6
+
+/** @brief store a message; arguments are converted to uint32_t, so only integer conversions (%d, %x, %u, ...) work */
+#define USBD_LOG(level, fmt, ...) do{                                                     \
+        const uint32_t _log_args[] = {0, ##__VA_ARGS__};                                  \
+        _Static_assert(sizeof(_log_args) <= (LOG_MAX_ARGS + 1) * sizeof(uint32_t),        \
+                       "too many log arguments");                                         \
+        log_write((level), (fmt), _log_args + 1, sizeof(_log_args) / sizeof(uint32_t) - 1); \
+    }while(0)
+
+/** @brief compiled out: never evaluated, but the arguments are still type checked and count as used */
+#define USBD_LOG_DISABLED(level, fmt, ...) do{ if(0){ USBD_LOG(level, fmt, ##__VA_ARGS__); } }while(0)
+
+#if USBD_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) USBD_LOG(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) USBD_LOG_DISABLED(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#endif
+
+#if USBD_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) USBD_LOG(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) USBD_LOG_DISABLED(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#endif
+
+#if USBD_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) USBD_LOG(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) USBD_LOG_DISABLED(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#endif
+
+#if USBD_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) USBD_LOG(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) USBD_LOG_DISABLED(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#endif
+
+/** @brief set up the ring and the low-priority formatting interrupt */
+void log_init();
+
+/** @brief store one message (use the LOG_* macros instead) */
+void log_write(uint32_t level, const char* fmt, const uint32_t* args, uint32_t nargs);
+
+/** @brief format and print everything in the ring */
+void log_flush();
+
+/** @brief number of messages lost because the ring was full */
+uint32_t log_dropped();
+
+#endif /* _USBD_LOG_H_ */
@@ -0,0 +1,235 @@
+/**
+ * @file usbd_trace.c
+ * @name Always-on latency tracing of the EP1 report path.
+ *
+ * Timestamps come from the Cortex-M4 DWT cycle counter (CYCCNT). Each
+ * trace point costs one counter read, one ring store and, for the end of
+ * a stage, one histogram increment, so it can stay enabled in production
+ * builds. The host reads the results with vendor requests on EP0.
+*/
+
+#include <usbd.h>
+#include <usbd_trace.h>
+
+/** @brief System Control Space and Data Watchpoint and Trace unit */
+#ifndef NVIC_BASE
+#define NVIC_BASE 0xE000E000
+#endif
+#ifndef DWT_BASE
+#define DWT_BASE 0xE0001000
+#endif
+
+/** @brief DWT registers */
+#define DWT_CTRL (volatile uint32_t*) (DWT_BASE + 0x000)
+#define DWT_CYCCNT (volatile uint32_t*) (DWT_BASE + 0x004)
+/** @brief Debug Exception and Monitor Control (TRCENA gates the DWT) */
+#define DEMCR (volatile uint32_t*) (NVIC_BASE + 0xDFC)
+#define DEMCR_TRCENA (1 << 24)
+#define DWT_CTRL_CYCCNTENA (0x1)
+
+/** @brief trace ring, written from both thread (syscalls) and interrupt context */
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_head = 0;
+
+/** @brief per-stage histograms and running statistics */
+static uint32_t trace_histogram[NUM_TRACE_STAGES][TRACE_BUCKETS];
+static uint32_t trace_count[NUM_TRACE_STAGES];
+static uint32_t trace_min[NUM_TRACE_STAGES];
+static uint32_t trace_max[NUM_TRACE_STAGES];
+static uint64_t trace_sum[NUM_TRACE_STAGES];
+
+/** @brief timestamp of the syscall whose report has not been queued yet */
+static volatile uint32_t trace_syscall_cycles = 0;
+static volatile uint32_t trace_syscall_valid = 0;
+
+/** @brief buffers handed to send_data (must outlive the EP0 transfer) */
+static trace_stage_stats_t trace_stats_snapshot[NUM_TRACE_STAGES];
+
+/** @name trace_clear
+ * @brief Empties the ring and the histograms
+*/
+static void trace_clear(){
+    for(uint32_t stage = 0; stage < NUM_TRACE_STAGES; stage++){
+        for(uint32_t b = 0; b < TRACE_BUCKETS; b++){
+            trace_histogram[stage][b] = 0;
+        }
+        trace_count[stage] = 0;
+        trace_min[stage] = 0xFFFFFFFF;
+        trace_max[stage] = 0;
+        trace_sum[stage] = 0;
+    }
+    for(uint32_t i = 0; i < TRACE_RING_SIZE; i++){
+        trace_ring[i].cycles = 0;
+        trace_ring[i].seq = 0;
+        trace_ring[i].point = 0xFF;
+        trace_ring[i].reserved = 0;
+    }
+    trace_head = 0;
+}
+
+/** @name trace_init
+ * @brief Enables the cycle counter and clears the trace
+*/
+void trace_init(){
+    REG_WRITE(*DEMCR, REG_READ(*DEMCR) | DEMCR_TRCENA);
+    REG_WRITE(*DWT_CYCCNT, 0);
+    REG_WRITE(*DWT_CTRL, REG_READ(*DWT_CTRL) | DWT_CTRL_CYCCNTENA);
+    trace_clear();
+}
+
+/** @name trace_now
+ * @brief Current value of the cycle counter (wraps every 2^32 cycles, ~67 s at 64 MHz)
+*/
+uint32_t trace_now(){
+    return REG_READ(*DWT_CYCCNT);
+}
+
+/** @name trace_point
+ * @brief Records a point in the ring
+ * @param point    enum TRACE_POINT
+ * @return the timestamp that was recorded
+*/
+uint32_t trace_point(uint32_t point){
+    uint32_t now = REG_READ(*DWT_CYCCNT);
+    // the ring is shared between thread and interrupt context, claim the slot atomically
+    uint32_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_record_t* record = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+    record->cycles = now;
+    record->seq = (uint16_t)seq;
+    record->point = (uint8_t)point;
+    return now;
+}
+
+/** @name trace_bucket
+ * @brief Histogram bucket of a value: 2 bits of resolution below the leading one
+*/
+static uint32_t trace_bucket(uint32_t cycles){
+    if(cycles < 4){
+        return cycles;
+    }
+    uint32_t msb = 31 - __builtin_clz(cycles);
+    return ((msb - 1) << 2) | ((cycles >> (msb - 2)) & 0x3);
+}
+
+/** @name trace_bucket_max
+ * @brief Largest value that falls into a bucket
+*/
+static uint32_t trace_bucket_max(uint32_t bucket){
+    if(bucket < 4){
+        return bucket;
+    }
+    uint32_t msb = (bucket >> 2) + 1;
+    uint32_t low = (0x4 | (bucket & 0x3)) << (msb - 2);
+    return low + ((1u << (msb - 2)) - 1);
+}
+
+/** @name trace_stage
+ * @brief Adds one measurement to a stage
+ * @param stage    enum TRACE_STAGE
+ * @param cycles   length of the stage
+ * @note  Only called from USBD_IRQHandler
+*/
+void trace_stage(uint32_t stage, uint32_t cycles){
+    trace_histogram[stage][trace_bucket(cycles)]++;
+    trace_count[stage]++;
+    trace_sum[stage] += cycles;
+    if(cycles < trace_min[stage]){
+        trace_min[stage] = cycles;
+    }
+    if(cycles > trace_max[stage]){
+        trace_max[stage] = cycles;
+    }
+}
+
+/** @name trace_syscall_entry
+ * @brief Records a mouse syscall entry; the next queued report is timed from here
+*/
+void trace_syscall_entry(){
+    trace_syscall_cycles = trace_point(TRACE_SYSCALL);
+    trace_syscall_valid = 1;
+}
+
+/** @name trace_take_syscall
+ * @brief Timestamp of the pending syscall entry (or now if there is none)
+*/
+uint32_t trace_take_syscall(){
+    if(trace_syscall_valid == 0){
+        return trace_now();
+    }
+    trace_syscall_valid = 0;
+    return trace_syscall_cycles;
+}
+
+/** @name trace_percentiles
+ * @brief Upper bounds of the buckets holding p50, p90 and p99, in one pass over the histogram
+ * @note  Runs in the vendor SETUP handler: one pass per stage keeps it within SETUP_BUDGET_VENDOR.
+*/
+static void trace_percentiles(uint32_t stage, trace_stage_stats_t* stats){
+    static const uint32_t percents[3] = {50, 90, 99};
+    uint32_t bounds[3] = {trace_max[stage], trace_max[stage], trace_max[stage]};
+    uint32_t next = 0;
+    uint32_t target = (uint32_t)(((uint64_t)trace_count[stage] * percents[0] + 99) / 100);
+    uint32_t seen = 0;
+    for(uint32_t b = 0; b < TRACE_BUCKETS && next < 3; b++){
+        seen += trace_histogram[stage][b];
+        while(next < 3 && seen >= target && seen > 0){
+            uint32_t bound = trace_bucket_max(b);
+            bounds[next] = bound < trace_max[stage] ? bound : trace_max[stage];
+            next++;
+            if(next < 3){
+                target = (uint32_t)(((uint64_t)trace_count[stage] * percents[next] + 99) / 100);
+            }
+        }
+    }
+    // stats is packed: no pointers into it
+    stats->p50 = bounds[0];
+    stats->p90 = bounds[1];
+    stats->p99 = bounds[2];
+}
+
+/** @name trace_get_stats
+ * @brief Summarises one stage
+ * @param stage    enum TRACE_STAGE
+ * @param stats    filled with count, min/avg/max and p50/p90/p99 in cycles
+*/
+void trace_get_stats(uint32_t stage, trace_stage_stats_t* stats){
+    stats->count = trace_count[stage];
+    if(trace_count[stage] == 0){
+        stats->min = stats->avg = stats->max = 0;
+        stats->p50 = stats->p90 = stats->p99 = 0;
+        return;
+    }
+    stats->min = trace_min[stage];
+    stats->avg = (uint32_t)(trace_sum[stage] / trace_count[stage]);
+    stats->max = trace_max[stage];
+    trace_percentiles(stage, stats);
+}
+
+/** @name trace_vendor_request
+ * @brief Serves the trace over EP0
+ * @param request_type   bmRequestType (USB_REQ_VENDOR_DEVICE_IN or USB_REQ_VENDOR_DEVICE_OUT)
+ * @param request        TRACE_REQ_*
+ * @param w_length       size specified by the host
+ * @return 0 if handled, -1 if this is not a trace request
+ * @note  Called from USBD_IRQHandler
+*/
+int trace_vendor_request(uint8_t request_type, uint8_t request, uint16_t w_length){
+    if(request_type == USB_REQ_VENDOR_DEVICE_IN && request == TRACE_REQ_GET_STATS){
+        for(uint32_t stage = 0; stage < NUM_TRACE_STAGES; stage++){
+            trace_get_stats(stage, &trace_stats_snapshot[stage]);
+        }
+        send_data(0, (const uint8_t*)trace_stats_snapshot, sizeof(trace_stats_snapshot), w_length);
+        return 0;
+    }
+    if(request_type == USB_REQ_VENDOR_DEVICE_IN && request == TRACE_REQ_GET_RING){
+        // the ring keeps running while it is sent; the host sorts the records by seq
+        send_data(0, (const uint8_t*)trace_ring, sizeof(trace_ring), w_length);
+        return 0;
+    }
+    if(request_type == USB_REQ_VENDOR_DEVICE_OUT && request == TRACE_REQ_RESET){
+        trace_clear();
+        send_data(0, 0, 0, 0);
+        return 0;
+    }
+    return -1;
+}
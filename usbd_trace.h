@@ -0,0 +1,80 @@
+/** @file   usbd_trace.h
+ *  @brief  cycle-counter latency tracing of the EP1 report path
+**/
+
+#include <unistd.h>
+
+#ifndef _USBD_TRACE_H_
+#define _USBD_TRACE_H_
+
+/** @brief points on the report path that get a timestamp */
+enum TRACE_POINT{TRACE_SYSCALL = 0, TRACE_DMA_START, TRACE_ENDEPIN1, TRACE_EPDATA, TRACE_RESUME, NUM_TRACE_POINTS};
+
+/** @brief stages between those points that get a histogram */
+enum TRACE_STAGE{
+    STAGE_QUEUED = 0,   // syscall entry -> USBD_TASKS_STARTEPIN1
+    STAGE_DMA,          // USBD_TASKS_STARTEPIN1 -> ENDEPIN1
+    STAGE_HOST,         // ENDEPIN1 -> EPDATA (waiting for the host to poll)
+    STAGE_TOTAL,        // syscall entry -> EPDATA
+    STAGE_RESUME,       // remote wakeup request or bus resume -> EPDATA of the first report after it
+    NUM_TRACE_STAGES
+};
+
+/** @brief core clock the cycle counter runs at */
+#define TRACE_CPU_HZ 64000000
+
+/** @brief number of records in the trace ring (must be a power of 2) */
+#define TRACE_RING_SIZE 256
+
+/** @brief histogram buckets: 4 per power of two, covering the whole 32-bit cycle range */
+#define TRACE_BUCKETS 124
+
+/** @brief vendor requests (USB_REQ_VENDOR_DEVICE_IN / _OUT) to read the trace from the host */
+#define TRACE_REQ_GET_STATS 0x01   // IN: trace_stage_stats_t[NUM_TRACE_STAGES]
+#define TRACE_REQ_GET_RING 0x02    // IN: trace_record_t[TRACE_RING_SIZE]
+#define TRACE_REQ_RESET 0x03       // OUT, no data: clear ring and histograms
+
+/** @brief one trace ring entry */
+typedef struct __attribute__((__packed__)){
+    uint32_t cycles;    // DWT cycle counter
+    uint16_t seq;       // increments with every record, to put the ring in order
+    uint8_t point;      // enum TRACE_POINT
+    uint8_t reserved;
+}trace_record_t;
+
+/** @brief summary of one stage, in CPU cycles (percentiles are histogram bucket upper bounds) */
+typedef struct __attribute__((__packed__)){
+    uint32_t count;
+    uint32_t min;
+    uint32_t avg;
+    uint32_t max;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+}trace_stage_stats_t;
+
+/** @brief enable the cycle counter and clear the trace */
+void trace_init();
+
+/** @brief current value of the cycle counter */
+uint32_t trace_now();
+
+/** @brief record a point in the ring, returns its timestamp */
+uint32_t trace_point(uint32_t point);
+
+/** @brief add one measurement to a stage's histogram */
+void trace_stage(uint32_t stage, uint32_t cycles);
+
+/** @brief record a syscall entry; the next queued report takes this timestamp */
+void trace_syscall_entry();
+
+/** @brief timestamp of the last syscall entry (or now if there was none) */
+uint32_t trace_take_syscall();
+
+/** @brief summary of one stage */
+void trace_get_stats(uint32_t stage, trace_stage_stats_t* stats);
+
+/** @brief handle a vendor request on EP0; returns -1 if it is not a trace request */
+int trace_vendor_request(uint8_t request_type, uint8_t request, uint16_t w_length);
+
+#endif /* _USBD_TRACE_H_ */